@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+#
+# This file is part of the libusbhost library
+# hosted at http://github.com/libusbhost/libusbhost
+#
+# Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+#
+#
+# libusbhost is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this library.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""Decode binary trace of libusbhost built with USBH_TRACE.
+
+Input is the USART debug output (text with the trace as hex between
+STX and ETX), or raw trace data with --raw (e.g. ring dumped by debugger).
+Event formats are read from src/usbh_trace.h, so the header has to match
+the firmware.
+"""
+
+import argparse
+import ast
+import os
+import re
+import struct
+import sys
+
+SYNC = 0xA5
+HEADER = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'src', 'usbh_trace.h')
+
+EVENT_RE = re.compile(r'EVENT\((\w+),\s*("(?:[^"\\]|\\.)*")\)')
+SPEC_RE = re.compile(r'%([-+ #0]*\d*(?:\.\d+)?)(?:hh|h|ll|l|z)?([diouxXc%])')
+
+
+def load_formats(header):
+    """Generate the format table in the order of USBH_TRACE_EVENTS."""
+    with open(header) as f:
+        text = f.read()
+    start = text.index('#define USBH_TRACE_EVENTS')
+    return [(name, ast.literal_eval(fmt)) for name, fmt in EVENT_RE.findall(text[start:])]
+
+
+def format_event(fmt, args):
+    args = list(args)
+    out = []
+    pos = 0
+    for m in SPEC_RE.finditer(fmt):
+        out.append(fmt[pos:m.start()])
+        pos = m.end()
+        flags, conv = m.groups()
+        if conv == '%':
+            out.append('%')
+            continue
+        value = args.pop(0) if args else 0
+        if conv in 'di' and value & 0x80000000:
+            value -= 1 << 32
+        if conv == 'c':
+            value &= 0xff
+        out.append(('%' + flags + conv) % value)
+    out.append(fmt[pos:])
+    return ''.join(out)
+
+
+class Decoder:
+    def __init__(self, formats, out):
+        self.formats = formats
+        self.out = out
+        self.data = bytearray()
+
+    def feed(self, data):
+        self.data += data
+        while len(self.data) >= 8:
+            header, time_us = struct.unpack_from('<II', self.data)
+            count = header & 0xff
+            event = (header >> 8) & 0xffff
+            if header >> 24 != SYNC or count > 16:
+                # lost synchronization, try the next byte
+                del self.data[0]
+                continue
+            length = 8 + 4 * count
+            if len(self.data) < length:
+                break
+            args = struct.unpack_from('<%dI' % count, self.data, 8)
+            del self.data[:length]
+            if event < len(self.formats):
+                name, fmt = self.formats[event]
+                message = format_event(fmt, args)
+            else:
+                name, message = 'EVENT_%d' % event, ' '.join('%08X' % a for a in args)
+            self.out.write('[%10u] %-10s %s\n' % (time_us, name, message.strip()))
+
+
+def decode_text(stream, decoder, out):
+    """Split USART output into text and hex encoded trace."""
+    in_trace = False
+    hex_digits = bytearray()
+    while True:
+        chunk = stream.read(4096)
+        if not chunk:
+            break
+        text = bytearray()
+        for c in chunk:
+            if c == 0x02:
+                out.write(text.decode('ascii', 'replace'))
+                text = bytearray()
+                in_trace = True
+                hex_digits = bytearray()
+            elif c == 0x03 and in_trace:
+                in_trace = False
+                decoder.feed(bytes.fromhex(hex_digits.decode('ascii', 'replace')))
+            elif in_trace:
+                hex_digits.append(c)
+            else:
+                text.append(c)
+        out.write(text.decode('ascii', 'replace'))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('input', nargs='?', help='captured output (default stdin)')
+    parser.add_argument('--raw', action='store_true', help='input is raw trace data')
+    parser.add_argument('--header', default=HEADER, help='usbh_trace.h with the event table')
+    args = parser.parse_args()
+
+    formats = load_formats(args.header)
+    stream = open(args.input, 'rb') if args.input else sys.stdin.buffer
+    decoder = Decoder(formats, sys.stdout)
+    if args.raw:
+        decoder.feed(stream.read())
+    else:
+        decode_text(stream, decoder, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()
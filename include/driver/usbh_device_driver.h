@@ -53,7 +53,21 @@ enum USBH_PACKET_CALLBACK_STATUS {
 enum USBH_POLL_STATUS {
 	USBH_POLL_STATUS_NONE,
 	USBH_POLL_STATUS_DEVICE_CONNECTED,
-	USBH_POLL_STATUS_DEVICE_DISCONNECTED
+	USBH_POLL_STATUS_DEVICE_DISCONNECTED,
+	/// resume of the suspended root port is complete
+	USBH_POLL_STATUS_DEVICE_RESUMED
+};
+
+enum USBH_SUSPEND_STATE {
+	USBH_SUSPEND_STATE_ACTIVE,
+	/// enabling remote wakeup before the port is suspended
+	USBH_SUSPEND_STATE_WAKEUP_SETUP,
+	USBH_SUSPEND_STATE_WAKEUP_STATUS,
+	USBH_SUSPEND_STATE_SUSPENDED,
+	/// resume signaling is driven by the port
+	USBH_SUSPEND_STATE_RESUMING,
+	/// waiting for the resume recovery time
+	USBH_SUSPEND_STATE_RECOVERY
 };
 
 enum USBH_CONTROL_TYPE {
@@ -61,6 +75,42 @@ enum USBH_CONTROL_TYPE {
 	USBH_CONTROL_TYPE_DATA
 };
 
+/**
+ * @brief The _usbh_periodic_endpoint struct
+ *
+ * Interrupt or isochronous endpoint of the device together with its
+ * reservation in the periodic schedule of the bus.
+ */
+struct _usbh_periodic_endpoint {
+	/// bus time of one transaction in nanoseconds
+	uint32_t cost_ns;
+
+	/// Max packet size of the endpoint
+	uint16_t maxpacketsize;
+
+	/// frame number of the last transfer started on this endpoint
+	uint16_t frame_last;
+
+	/// bEndpointAddress (including direction bit)
+	uint8_t address;
+
+	/// @see USBH_ENDPOINT_TYPE
+	uint8_t type;
+
+	/// period in frames (power of two)
+	uint8_t period;
+
+	/// offset of the endpoint's frames in the period
+	uint8_t phase;
+
+	/// period in frames used by the driver (power of two multiple of period)
+	uint16_t interval;
+
+	/// true when the bandwidth is reserved
+	bool admitted;
+};
+typedef struct _usbh_periodic_endpoint usbh_periodic_endpoint_t;
+
 /**
  * @brief The _usbh_device struct
  *
@@ -96,6 +146,49 @@ struct _usbh_device {
 	 * @brief lld - pointer to a low-level driver's instance
 	 */
 	const void *lld;
+
+	/// periodic endpoints found in configuration descriptor
+	usbh_periodic_endpoint_t periodic[USBH_PERIODIC_MAX_ENDPOINTS];
+	uint8_t periodic_num;
+
+	/// hub the device is connected to, 0 for the device on the root port
+	struct _usbh_device *parent;
+
+	/// port of the parent hub, 0 for the device on the root port
+	uint8_t port;
+
+	/// 1 for the device on the root port, 0 when the device is not attached
+	uint8_t tier;
+
+	/**
+	 * @brief route ports of the hubs from the root port to the device
+	 *
+	 * 4 bits per hub, port of the first hub in the lowest bits.
+	 * Ports above 15 are stored as 15.
+	 */
+	uint32_t route;
+
+	/// next attached device @see usbh_generic_data_t
+	struct _usbh_device *active_next;
+
+	/**
+	 * @brief tt_hub high speed hub, which translates transactions of this full/low speed device
+	 *
+	 * 0, when transactions are not split
+	 */
+	struct _usbh_device *tt_hub;
+
+	/// port of the tt_hub leading to the device
+	uint8_t tt_port;
+
+	/// @see USBH_SUSPEND_STATE
+	enum USBH_SUSPEND_STATE suspend_state;
+
+	/// time of the last meaningful data, or of the end of the resume
+	uint32_t activity_us;
+
+	/// device supports remote wakeup (configuration descriptor)
+	bool remote_wakeup;
 };
 typedef struct _usbh_device usbh_device_t;
 
@@ -143,6 +236,24 @@ struct _usbh_packet {
 	 */
 	usbh_packet_callback_t callback;
 
+	/**
+	 * @brief nak_eagain finish IN transfer with EAGAIN on NAK instead of retrying it
+	 *
+	 * Set by usbh_read() and usbh_read_once()
+	 */
+	bool nak_eagain;
+
+	/**
+	 * @brief split_hub_address address of the high speed hub with transaction translator
+	 *
+	 * 0, when transactions are not split. Set by usbh_read() and usbh_read_once(),
+	 * usbh_write() sets it in its own copy of the packet
+	 */
+	uint8_t split_hub_address;
+
+	/// port of the hub leading to the full/low speed device
+	uint8_t split_port;
+
 	/**
 	 * @brief callback_arg argument passed into callback
 	 *
@@ -185,6 +296,21 @@ struct _usbh_low_level_driver {
 	 */
 	enum USBH_SPEED (*root_speed)(void *drvdata);
 
+	/**
+	 * @brief current frame number of the bus
+	 *
+	 * Only the lower bits masked by @ref USBH_FRAME_NUMBER_MASK are used
+	 */
+	uint16_t (*frame_number)(void *drvdata);
+
+	/**
+	 * @brief optional, suspend (true) or resume (false) the root port
+	 *
+	 * End of the resume, also of the resume started by remote wakeup,
+	 * is reported by @ref USBH_POLL_STATUS_DEVICE_RESUMED
+	 */
+	void (*root_suspend)(void *drvdata, bool suspend);
+
 	/**
 	 * @brief Pointer to Low-level driver data
 	 *
@@ -197,23 +323,56 @@ typedef struct _usbh_low_level_driver usbh_low_level_driver_t;
 struct _usbh_generic_data {
 	usbh_device_t usbh_device[USBH_MAX_DEVICES];
 	uint8_t usbh_buffer[BUFFER_ONE_BYTES];
+
+	/// reserved periodic bus time of each frame in the schedule (nanoseconds)
+	uint32_t periodic_load_ns[USBH_PERIODIC_FRAMES];
+
+	/**
+	 * @brief list of attached devices
+	 *
+	 * Device is appended when it is attached, so every hub precedes
+	 * devices connected to it
+	 */
+	usbh_device_t *active_first;
+	usbh_device_t *active_last;
 };
 typedef struct _usbh_generic_data usbh_generic_data_t;
 
+/// Max tier of the device: up to five hubs between the root port and the device
+#define USBH_TIER_MAX	(6)
+
+
+/// Frame numbers are compared modulo this mask + 1
+#define USBH_FRAME_NUMBER_MASK	(0x3fff)
 
-#define ERROR(arg) LOG_PRINTF("UNHANDLED_ERROR %d: file: %s, line: %d",\
+#define ERROR(arg) LOG_ERROR("UNHANDLED_ERROR %d: file: %s, line: %d",\
 							arg, __FILE__, __LINE__)
 
 
 /* Hub related functions */
 
-usbh_device_t *usbh_get_free_device(const usbh_device_t *dev);
+usbh_device_t *usbh_get_free_device(usbh_device_t *parent, uint8_t port);
+void usbh_device_detach(usbh_device_t *dev);
+void usbh_device_resumed(usbh_device_t *dev);
 bool usbh_enum_available(void);
 void device_enumeration_start(usbh_device_t *dev);
 
 /* All devices functions */
 void usbh_read(usbh_device_t *dev, usbh_packet_t *packet);
+void usbh_read_once(usbh_device_t *dev, usbh_packet_t *packet);
+void usbh_device_activity(usbh_device_t *dev);
 void usbh_write(usbh_device_t *dev, const usbh_packet_t *packet);
+uint32_t usbh_time_us(void);
+const usbh_timing_t *usbh_timing(void);
+
+/* Periodic bandwidth management */
+void usbh_periodic_register(usbh_device_t *dev, const void *endpoint_descriptor);
+bool usbh_periodic_open(usbh_device_t *dev, uint8_t endpoint_address);
+bool usbh_periodic_due(usbh_device_t *dev, uint8_t endpoint_address);
+void usbh_periodic_interval(usbh_device_t *dev, uint8_t endpoint_address, uint16_t frames);
+void usbh_periodic_release(usbh_device_t *dev);
+void usbh_periodic_reset(const void *lld);
+uint16_t usbh_frame_number(const usbh_device_t *dev);
 
 /* Helper functions used by device drivers */
 void device_xfer_control_read(void *data, uint16_t datalen, usbh_packet_callback_t callback, usbh_device_t *dev);
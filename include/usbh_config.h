@@ -25,40 +25,198 @@
 
 
 
-// Max devices per hub
+// Max devices per hub (ports above are not used, up to 255)
 #define USBH_HUB_MAX_DEVICES	(8)
 
 // Max number of hub instancies
 #define USBH_MAX_HUBS		(2)
 
-// Max devices
+// Polling period of the hub status change endpoint in ms (0 = bInterval)
+// Port reset in progress is polled faster
+#define USBH_HUB_POLL_INTERVAL_MS	(0)
+
+// Max devices (up to 127, hubs can be nested up to 5 levels)
 #define USBH_MAX_DEVICES		(15)
 
 // Min: 128
 // Set this wisely
 #define BUFFER_ONE_BYTES	(2048)
 
+// Periodic (interrupt and isochronous) bandwidth management
+// Length of the periodic schedule in frames, must be power of two, up to 128
+#define USBH_PERIODIC_FRAMES	(32)
+
+// Max periodic endpoints tracked per device
+#define USBH_PERIODIC_MAX_ENDPOINTS	(4)
+
+// Bus time reserved for periodic transfers in each frame (nanoseconds)
+// USB 2.0 allows at most 90% of the full speed frame
+#define USBH_PERIODIC_FRAME_BUDGET_NS	(900000)
+
+// ... and 80% of each high speed microframe. The schedule is kept per frame,
+// high speed bus is given the budget of its 8 microframes.
+#define USBH_PERIODIC_MICROFRAME_BUDGET_NS	(100000)
+
+// HID report descriptor
+// Max size of report descriptor read from the device
+#define USBH_HID_REPORT_DESCRIPTOR_SIZE	(256)
+
+// Max count of fields in compiled report layout of each device
+#define USBH_HID_REPORT_FIELDS	(24)
+
+// Max count of report IDs of each device
+#define USBH_HID_REPORT_IDS	(4)
+
+// Max count of usages before one main item
+#define USBH_HID_REPORT_USAGES	(16)
+
+// Max count of HID class requests in progress (one per device)
+#define USBH_HID_REQUESTS	(4)
+
 // MOUSE
 #define USBH_HID_MOUSE_MAX_DEVICES	(2)
 
 #define USBH_HID_MOUSE_BUFFER		(32)
 
+// KEYBOARD
+#define USBH_HID_KEYBOARD_MAX_DEVICES	(1)
+
+// NKRO reports are usually up to 32 bytes
+#define USBH_HID_KEYBOARD_BUFFER	(64)
+
 // MIDI
 // Maximal number of midi devices connected to whatever hub
 #define USBH_AC_MIDI_MAX_DEVICES	(4)
 
 #define USBH_AC_MIDI_BUFFER 	(64)
 
+// Output queue of each midi device in bytes (4 bytes per event), must be power of two
+#define USBH_AC_MIDI_OUT_RING	(256)
+
+// Input ring of each midi device in bytes (8 bytes per timestamped event),
+// must be power of two, 0 disables the ring
+#define USBH_AC_MIDI_IN_RING	(512)
+
+// Count of cables per direction with SysEx reassembly and jack mapping (up to 16)
+#define USBH_AC_MIDI_CABLES	(4)
+
+// Max count of MIDI jack descriptors remembered for each device
+#define USBH_AC_MIDI_JACKS	(16)
+
+// AUDIO streaming (USB Audio Class 1.0)
+// Maximal number of audio devices connected to whatever hub
+#define USBH_AC_AUDIO_MAX_DEVICES	(1)
+
+// Max isochronous packet size, must fit into periodic transmit FIFO
+#define USBH_AC_AUDIO_BUFFER	(256)
+
+// Size of sample ring for each stream direction, must be power of two
+#define USBH_AC_AUDIO_RING	(2048)
+
+// MASS STORAGE (Bulk-Only Transport, SCSI transparent command set)
+// Maximal number of mass storage devices connected to whatever hub
+#define USBH_MSC_MAX_DEVICES	(1)
+
+// Buffer for command status and small command data (inquiry, sense, capacity)
+#define USBH_MSC_BUFFER		(64)
+
+// Count of 512 byte sectors in one cache line (1, 2, 4 or 8)
+#define USBH_MSC_CACHE_LINE_SECTORS	(4)
+
+// Count of cache lines per device
+#define USBH_MSC_CACHE_LINES	(4)
+
+// Dirty sectors are written to the device after this idle time (microseconds)
+#define USBH_MSC_WRITEBACK_DELAY_US	(500000)
+
+// CDC-ACM (serial)
+// Maximal number of serial devices connected to whatever hub
+#define USBH_CDC_ACM_MAX_DEVICES	(1)
+
+// Bulk transfer buffer, must hold at least one max packet of the data endpoints
+#define USBH_CDC_ACM_BUFFER	(256)
+
+// Size of receive and transmit ring of each device, must be power of two
+#define USBH_CDC_ACM_RX_RING	(1024)
+#define USBH_CDC_ACM_TX_RING	(1024)
+
+// CDC-NCM (ethernet)
+// Maximal number of network devices connected to whatever hub
+#define USBH_CDC_NCM_MAX_DEVICES	(1)
+
+// Size of one NTB (transfer block carrying several ethernet frames), at least 2048
+#define USBH_CDC_NCM_NTB_SIZE	(2048)
+
+// Count of NTB buffers of each device, shared by receive and transmit
+#define USBH_CDC_NCM_NTB_COUNT	(4)
+
+// Max ethernet frames aggregated into one transmitted NTB
+#define USBH_CDC_NCM_TX_DATAGRAMS	(8)
+
 // Gamepad XBOX
 #define USBH_GP_XBOX_MAX_DEVICES	(2)
 
 #define USBH_GP_XBOX_BUFFER		(32)
 
+// Logging (built with USART_DEBUG)
+// Log level of each module: 0 = none, 1 = errors, 2 = warnings, 3 = info, 4 = debug
+#define USBH_LOG_LEVEL_CORE	(4)
+#define USBH_LOG_LEVEL_LLD	(3)
+#define USBH_LOG_LEVEL_HUB	(4)
+#define USBH_LOG_LEVEL_HID	(4)
+#define USBH_LOG_LEVEL_MIDI	(4)
+#define USBH_LOG_LEVEL_AUDIO	(4)
+#define USBH_LOG_LEVEL_MSC	(4)
+#define USBH_LOG_LEVEL_CDC_ACM	(4)
+#define USBH_LOG_LEVEL_CDC_NCM	(4)
+#define USBH_LOG_LEVEL_XBOX	(4)
+#define USBH_LOG_LEVEL_APP	(4)
+
+// Max count of messages of one log site in the window, 0 = unlimited
+#define USBH_LOG_RATE_LIMIT	(20)
+#define USBH_LOG_RATE_WINDOW_MS	(1000)
+
+// Binary trace (built with USBH_TRACE)
+// Size of the trace ring in bytes, must be power of two
+#define USBH_TRACE_BUFFER	(2048)
+
 /* Sanity checks */
+#if (USBH_HUB_MAX_DEVICES > 255)
+#error USBH_HUB_MAX_DEVICES > 255
+#endif
+
 #if (USBH_MAX_DEVICES > 127)
 #error USBH_MAX_DEVICES > 127
 #endif
 
+#if (USBH_PERIODIC_FRAMES & (USBH_PERIODIC_FRAMES - 1)) || (USBH_PERIODIC_FRAMES > 128)
+#error USBH_PERIODIC_FRAMES must be power of two, up to 128
+#endif
+
+#if (USBH_AC_MIDI_OUT_RING & (USBH_AC_MIDI_OUT_RING - 1)) || (USBH_AC_MIDI_OUT_RING < 4)
+#error USBH_AC_MIDI_OUT_RING must be power of two, at least 4
+#endif
+
+#if (USBH_AC_MIDI_IN_RING & (USBH_AC_MIDI_IN_RING - 1))
+#error USBH_AC_MIDI_IN_RING must be power of two or 0
+#endif
+
+#if (USBH_AC_MIDI_CABLES > 16)
+#error USBH_AC_MIDI_CABLES > 16
+#endif
+
+#if (USBH_CDC_NCM_NTB_SIZE < 2048) || (USBH_CDC_NCM_NTB_SIZE > 65535)
+#error USBH_CDC_NCM_NTB_SIZE must be in range 2048..65535
+#endif
+
+#if (USBH_MSC_CACHE_LINE_SECTORS & (USBH_MSC_CACHE_LINE_SECTORS - 1)) || (USBH_MSC_CACHE_LINE_SECTORS > 8)
+#error USBH_MSC_CACHE_LINE_SECTORS must be power of two, up to 8
+#endif
+
+#if (USBH_TRACE_BUFFER & (USBH_TRACE_BUFFER - 1)) || (USBH_TRACE_BUFFER < 64)
+#error USBH_TRACE_BUFFER must be power of two, at least 64
+#endif
+
 // Uncomment to enable OTG_HS support - low level driver
 // #define USE_STM32F4_USBH_DRIVER_HS
 
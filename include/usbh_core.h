@@ -92,6 +92,26 @@ struct _usbh_dev_driver {
 	 */
 	void (*remove)(void *drvdata);
 
+	/**
+	 * @brief suspend optional, asks whether the idle device can be suspended
+	 * @param[in/out] drvdata is the device driver's private data
+	 * @retval true no transfer is in progress, the driver is not polled until the device is resumed
+	 * @retval false device has to stay active
+	 * @see usbh_suspend_timeout_set()
+	 */
+	bool (*suspend)(void *drvdata);
+
+	/**
+	 * @brief port_suspend optional, implemented by hubs: suspend or resume the downstream port
+	 * @param[in/out] drvdata is the device driver's private data
+	 * @param[in] port port number of the hub
+	 * @param[in] suspend true to suspend, false to resume
+	 * @retval false port cannot be suspended
+	 *
+	 * End of the resume is reported by usbh_device_resumed()
+	 */
+	bool (*port_suspend)(void *drvdata, uint8_t port, bool suspend);
+
 	/**
 	 * @brief info - compatibility information about the driver. It is used by the core during device enumeration
 	 * @see find_driver()
@@ -100,6 +120,39 @@ struct _usbh_dev_driver {
 };
 typedef struct _usbh_dev_driver usbh_dev_driver_t;
 
+/**
+ * @brief delays used while a device is connected and enumerated
+ *
+ * Used by the root port low-level driver and by the hub driver.
+ * @see usbh_timing_set()
+ */
+struct _usbh_timing {
+	/// time the connection has to be stable before the port is reset (TATTDB)
+	uint32_t debounce_us;
+
+	/// duration of the reset driven by the root port (TDRSTR)
+	uint32_t reset_us;
+
+	/// time after the end of reset before the first request (TRSTRCY)
+	uint32_t reset_recovery_us;
+
+	/// time after SET_ADDRESS before the new address is used (TDSETADDR)
+	uint32_t set_address_recovery_us;
+
+	/// lower bound of the hub's power on to power good time (bPwrOn2PwrGood)
+	uint32_t power_good_min_us;
+
+	/// time after the end of resume before the first request (TRSMRCY)
+	uint32_t resume_recovery_us;
+};
+typedef struct _usbh_timing usbh_timing_t;
+
+/// minimal delays allowed by the USB 2.0 specification
+extern const usbh_timing_t usbh_timing_spec;
+
+/// longer delays for devices that are slow to start
+extern const usbh_timing_t usbh_timing_conservative;
+
 /**
  * @brief usbh_init
  * @param low_level_drivers list of the low level drivers to be used by this library
@@ -117,6 +170,22 @@ void usbh_init(const void *low_level_drivers[], const usbh_dev_driver_t * const
  */
 void usbh_poll(uint32_t time_curr_us);
 
+/**
+ * @brief usbh_timing_set select delays used during enumeration
+ * @param timing has to stay valid, @ref usbh_timing_spec is used by default
+ */
+void usbh_timing_set(const usbh_timing_t *timing);
+
+/**
+ * @brief usbh_suspend_timeout_set suspend devices without activity
+ * @param timeout_ms time without meaningful data, after which the device is suspended,
+ * 0 disables suspend (default). Has to be shorter than the wrap period of the time passed to usbh_poll()
+ *
+ * Only devices, whose driver supports suspend, are suspended. Device is resumed
+ * on remote wakeup, or when the driver has data to send.
+ */
+void usbh_suspend_timeout_set(uint32_t timeout_ms);
+
 END_DECLS
 
 #endif // USBH_CORE_
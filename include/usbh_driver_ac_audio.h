@@ -0,0 +1,115 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_DRIVER_AC_AUDIO_
+#define USBH_DRIVER_AC_AUDIO_
+
+#include "usbh_core.h"
+
+#include <stdint.h>
+
+BEGIN_DECLS
+
+enum USBH_AUDIO_STREAM {
+	USBH_AUDIO_STREAM_PLAYBACK = 0,
+	USBH_AUDIO_STREAM_CAPTURE = 1,
+	USBH_AUDIO_STREAM_COUNT
+};
+
+/**
+ * PCM format requested from the device.
+ * Alternate setting matching this format is selected during enumeration.
+ */
+struct _audio_format {
+	/// sampling frequency in Hz
+	uint32_t sample_rate;
+	/// count of channels in one sample frame
+	uint8_t channels;
+	/// bytes per one channel sample
+	uint8_t subframe_size;
+	/// valid bits in subframe
+	uint8_t bit_resolution;
+};
+typedef struct _audio_format audio_format_t;
+
+struct _audio_stats {
+	/// playback frames, that were padded with silence since the ring was empty
+	uint32_t underruns;
+	/// capture frames, that were (partially) dropped since the ring was full
+	uint32_t overruns;
+	/// transfers that missed their frame
+	uint32_t missed_frames;
+	/// transferred packets
+	uint32_t packets;
+	/// current rate in samples per frame, fixed point 16.16
+	uint32_t rate;
+};
+typedef struct _audio_stats audio_stats_t;
+
+struct _audio_config {
+	audio_format_t format;
+	/**
+	 * @param device_id
+	 * @param streams bitmask of the available streams (1 << USBH_AUDIO_STREAM)
+	 */
+	void (*notify_connected)(uint8_t device_id, uint8_t streams);
+	void (*notify_disconnected)(uint8_t device_id);
+};
+typedef struct _audio_config audio_config_t;
+
+/**
+ * @brief audio_driver_init initialization routine - this will initialize internal structures of this device driver
+ * @param config
+ *
+ * @see audio_config_t
+ */
+void audio_driver_init(const audio_config_t *config);
+
+/**
+ * @brief usbh_audio_write queue samples for playback
+ * @param device_id
+ * @param data interleaved samples in the format of the stream
+ * @param length length of data in bytes
+ * @returns count of bytes actually queued
+ */
+uint32_t usbh_audio_write(uint8_t device_id, const void *data, uint32_t length);
+
+/**
+ * @brief usbh_audio_read get captured samples
+ * @param device_id
+ * @param data buffer for interleaved samples
+ * @param length size of the buffer in bytes
+ * @returns count of bytes actually read
+ */
+uint32_t usbh_audio_read(uint8_t device_id, void *data, uint32_t length);
+
+/**
+ * @brief usbh_audio_get_stats get underrun/overrun counters of the stream
+ * @returns false when the stream is not active
+ */
+bool usbh_audio_get_stats(uint8_t device_id, enum USBH_AUDIO_STREAM stream, audio_stats_t *stats);
+
+extern const usbh_dev_driver_t usbh_audio_driver;
+
+END_DECLS
+
+#endif
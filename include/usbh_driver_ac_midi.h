@@ -29,17 +29,73 @@
 
 BEGIN_DECLS
 
+/**
+ * @brief received USB-MIDI event packet with time of its arrival
+ */
+struct _midi_event {
+	/// time of the transfer completion, same time base as usbh_poll()
+	uint32_t time_us;
+	uint8_t packet[4];
+};
+typedef struct _midi_event midi_event_t;
+
+enum MIDI_SYSEX_FLAGS {
+	/// first chunk of the message, starts with 0xF0
+	MIDI_SYSEX_START = (1 << 0),
+	/// last chunk of the message
+	MIDI_SYSEX_END = (1 << 1),
+	/// message was interrupted by start of a new one, no 0xF7 at the end
+	MIDI_SYSEX_ABORTED = (1 << 2)
+};
+
+/**
+ * @brief mapping of the virtual cable to jacks of the device
+ */
+struct _midi_cable {
+	/// embedded jack associated with the endpoint
+	uint8_t jack_id;
+	/// external jack (physical port) connected to the embedded jack, 0 if none
+	uint8_t external_jack_id;
+	/// string descriptor index with name of the jack, 0 if none
+	uint8_t string_index;
+};
+typedef struct _midi_cable midi_cable_t;
+
 struct _midi_config {
 	void (*read_callback)(int device_id, uint8_t *data);
 	void (*notify_connected)(int device_id);
 	void (*notify_disconnected)(int device_id);
+
+	/**
+	 * @brief optional, called once for all events received in one bulk packet
+	 * @param device_id
+	 * @param packets count * 4 bytes of USB-MIDI event packets
+	 * @param count count of event packets
+	 * @param time_us time of the transfer completion, same time base as usbh_poll()
+	 */
+	void (*read_events)(int device_id, const uint8_t *packets, uint8_t count, uint32_t time_us);
+
+	/**
+	 * @brief optional, called with reassembled System Exclusive data
+	 *
+	 * SysEx packets of cables with a buffer assigned by @ref usbh_midi_sysex_buffer()
+	 * are collected into the buffer and delivered in chunks of up to buffer size,
+	 * they are not passed to the other read callbacks.
+	 *
+	 * @param device_id
+	 * @param cable virtual cable number 0..15
+	 * @param data raw bytes including leading 0xF0 and trailing 0xF7
+	 * @param length
+	 * @param flags @see MIDI_SYSEX_FLAGS
+	 */
+	void (*sysex)(int device_id, uint8_t cable, const uint8_t *data, uint16_t length, uint8_t flags);
 };
 typedef struct _midi_config midi_config_t;
 
 /**
  * @param bytes_written count of bytes that were actually written
  */
-typedef void (*midi_write_callback_t)(uint8_t bytes_written);
+typedef void (*midi_write_callback_t)(uint32_t bytes_written);
 
 /**
  * @brief midi_driver_init initialization routine - this will initialize internal structures of this device driver
@@ -50,14 +106,80 @@ typedef void (*midi_write_callback_t)(uint8_t bytes_written);
 void midi_driver_init(const midi_config_t *config);
 
 /**
- * @brief usbh_midi_write
+ * @brief usbh_midi_write queue event packets and get notified when they are sent
+ *
+ * Only whole 4 byte event packets are queued. Only one callback can be
+ * pending, when a new write with callback is issued earlier, the previous
+ * callback is called right away (its data are queued in order already).
+ *
  * @param device_id
  * @param data
  * @param length
- * @param callback this is called when the write call finishes
+ * @param callback this is called when the written data left in a transfer,
+ * or with 0 when they could not be queued
  */
 void usbh_midi_write(uint8_t device_id, const void *data, uint32_t length, midi_write_callback_t callback);
 
+/**
+ * @brief usbh_midi_enqueue queue event packets for transmission, non-blocking
+ *
+ * Queued events are coalesced into bulk transfers of up to max packet size.
+ * Can be called from other context (e.g. interrupt) than usbh_poll(),
+ * but only from one at a time.
+ *
+ * @param device_id
+ * @param events 4 byte USB-MIDI event packets
+ * @param count count of event packets
+ * @returns count of event packets actually queued, less than count when the queue is full
+ */
+uint32_t usbh_midi_enqueue(uint8_t device_id, const void *events, uint32_t count);
+
+/**
+ * @brief usbh_midi_out_free count of event packets that can be queued
+ */
+uint32_t usbh_midi_out_free(uint8_t device_id);
+
+/**
+ * @brief usbh_midi_sysex_buffer assign buffer for SysEx reassembly on the input cable
+ *
+ * Buffer size limits only the chunk size, messages of any length
+ * stream through it. Pass 0 as buffer to stop the reassembly.
+ *
+ * @param device_id
+ * @param cable virtual cable number, less than USBH_AC_MIDI_CABLES
+ * @param buffer has to stay valid until the device is disconnected
+ * @param size
+ * @returns false on bad parameters or when sysex callback is not configured
+ */
+bool usbh_midi_sysex_buffer(uint8_t device_id, uint8_t cable, uint8_t *buffer, uint16_t size);
+
+/**
+ * @brief usbh_midi_cables get jacks connected to the virtual cables
+ * @param device_id
+ * @param input true for cables of IN endpoint (from device), false for OUT endpoint
+ * @param cables filled with up to count entries, indexed by cable number
+ * @param count size of cables array
+ * @returns count of cables of the endpoint
+ */
+uint8_t usbh_midi_cables(uint8_t device_id, bool input, midi_cable_t *cables, uint8_t count);
+
+#if USBH_AC_MIDI_IN_RING
+/**
+ * @brief usbh_midi_read_events take received events out of the input ring
+ *
+ * Every received event is stored into the input ring with its timestamp.
+ * Can be called from other context (e.g. interrupt) than usbh_poll(),
+ * but only from one at a time. Events, that do not fit into the full ring,
+ * are dropped.
+ *
+ * @param device_id
+ * @param events
+ * @param count size of events array
+ * @returns count of events actually read
+ */
+uint32_t usbh_midi_read_events(uint8_t device_id, midi_event_t *events, uint32_t count);
+#endif
+
 extern const usbh_dev_driver_t usbh_midi_driver;
 
 END_DECLS
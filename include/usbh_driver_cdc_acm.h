@@ -0,0 +1,123 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_DRIVER_CDC_ACM_
+#define USBH_DRIVER_CDC_ACM_
+
+#include "usbh_core.h"
+
+#include <stdint.h>
+
+BEGIN_DECLS
+
+enum CDC_ACM_STOP_BITS {
+	CDC_ACM_STOP_BITS_1 = 0,
+	CDC_ACM_STOP_BITS_1_5 = 1,
+	CDC_ACM_STOP_BITS_2 = 2
+};
+
+enum CDC_ACM_PARITY {
+	CDC_ACM_PARITY_NONE = 0,
+	CDC_ACM_PARITY_ODD = 1,
+	CDC_ACM_PARITY_EVEN = 2,
+	CDC_ACM_PARITY_MARK = 3,
+	CDC_ACM_PARITY_SPACE = 4
+};
+
+struct _cdc_acm_line_coding {
+	uint32_t baudrate;
+	/// @see CDC_ACM_STOP_BITS
+	uint8_t stop_bits;
+	/// @see CDC_ACM_PARITY
+	uint8_t parity;
+	/// 5, 6, 7, 8 or 16
+	uint8_t data_bits;
+};
+typedef struct _cdc_acm_line_coding cdc_acm_line_coding_t;
+
+struct _cdc_acm_config {
+	/// line coding set up after the device is configured
+	cdc_acm_line_coding_t line_coding;
+
+	void (*notify_connected)(uint8_t device_id);
+	void (*notify_disconnected)(uint8_t device_id);
+
+	/**
+	 * @brief optional, this is called when new data are in receive ring
+	 * @param device_id
+	 * @param available count of bytes that can be read
+	 */
+	void (*notify_rx)(uint8_t device_id, uint32_t available);
+};
+typedef struct _cdc_acm_config cdc_acm_config_t;
+
+/**
+ * @brief cdc_acm_driver_init initialization routine - this will initialize internal structures of this device driver
+ * @param config
+ *
+ * @see cdc_acm_config_t
+ */
+void cdc_acm_driver_init(const cdc_acm_config_t *config);
+
+/**
+ * @brief usbh_cdc_acm_write queue data for transmission
+ *
+ * Can be called from other context (e.g. interrupt) than usbh_poll(),
+ * but only from one at a time.
+ *
+ * @param device_id
+ * @param data
+ * @param length
+ * @returns count of bytes actually queued
+ */
+uint32_t usbh_cdc_acm_write(uint8_t device_id, const void *data, uint32_t length);
+
+/**
+ * @brief usbh_cdc_acm_read get received data
+ *
+ * Can be called from other context (e.g. interrupt) than usbh_poll(),
+ * but only from one at a time.
+ *
+ * @param device_id
+ * @param data
+ * @param length size of data buffer
+ * @returns count of bytes actually read
+ */
+uint32_t usbh_cdc_acm_read(uint8_t device_id, void *data, uint32_t length);
+
+/**
+ * @brief usbh_cdc_acm_set_line_coding change baudrate and character format
+ * @returns false when the device is not connected
+ */
+bool usbh_cdc_acm_set_line_coding(uint8_t device_id, const cdc_acm_line_coding_t *line_coding);
+
+/**
+ * @brief usbh_cdc_acm_set_control_line_state set DTR and RTS signals
+ * @returns false when the device is not connected
+ */
+bool usbh_cdc_acm_set_control_line_state(uint8_t device_id, bool dtr, bool rts);
+
+extern const usbh_dev_driver_t usbh_cdc_acm_driver;
+
+END_DECLS
+
+#endif
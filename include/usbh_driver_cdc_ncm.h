@@ -0,0 +1,93 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_DRIVER_CDC_NCM_
+#define USBH_DRIVER_CDC_NCM_
+
+#include "usbh_core.h"
+
+#include <stdint.h>
+
+BEGIN_DECLS
+
+struct _cdc_ncm_config {
+	/**
+	 * @param device_id
+	 * @param mac ethernet address of the device (6 bytes), zeros if not available
+	 */
+	void (*notify_connected)(uint8_t device_id, const uint8_t *mac);
+	void (*notify_disconnected)(uint8_t device_id);
+
+	/**
+	 * @brief this is called for every received ethernet frame
+	 *
+	 * Frame points directly into the receive buffer. It stays valid until
+	 * it is returned by @ref usbh_cdc_ncm_rx_release(), which can be done
+	 * also inside this callback.
+	 *
+	 * @param device_id
+	 * @param frame ethernet frame without FCS
+	 * @param length length of the frame
+	 */
+	void (*rx_frame)(uint8_t device_id, const uint8_t *frame, uint16_t length);
+};
+typedef struct _cdc_ncm_config cdc_ncm_config_t;
+
+/**
+ * @brief cdc_ncm_driver_init initialization routine - this will initialize internal structures of this device driver
+ * @param config
+ *
+ * @see cdc_ncm_config_t
+ */
+void cdc_ncm_driver_init(const cdc_ncm_config_t *config);
+
+/**
+ * @brief usbh_cdc_ncm_rx_release give the received frame back to the driver
+ * @param device_id
+ * @param frame pointer passed to rx_frame callback
+ */
+void usbh_cdc_ncm_rx_release(uint8_t device_id, const uint8_t *frame);
+
+/**
+ * @brief usbh_cdc_ncm_tx_frame reserve space for ethernet frame in transmit buffer
+ *
+ * Frame has to be written to the returned pointer before the next call
+ * of usbh_poll(). Frames reserved in the same poll period are sent together.
+ *
+ * @param device_id
+ * @param length length of the frame
+ * @returns pointer where to write the frame, 0 when no buffer is available
+ */
+uint8_t *usbh_cdc_ncm_tx_frame(uint8_t device_id, uint16_t length);
+
+/**
+ * @brief usbh_cdc_ncm_send copy ethernet frame into transmit buffer
+ * @returns false when no buffer is available
+ * @see usbh_cdc_ncm_tx_frame()
+ */
+bool usbh_cdc_ncm_send(uint8_t device_id, const void *frame, uint16_t length);
+
+extern const usbh_dev_driver_t usbh_cdc_ncm_driver;
+
+END_DECLS
+
+#endif
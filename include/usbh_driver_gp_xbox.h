@@ -57,10 +57,49 @@ struct _gp_xbox_packet {
 typedef struct _gp_xbox_packet gp_xbox_packet_t;
 
 
+enum GP_XBOX_AXIS {
+	GP_XBOX_AXIS_LEFT_X,
+	GP_XBOX_AXIS_LEFT_Y,
+	GP_XBOX_AXIS_RIGHT_X,
+	GP_XBOX_AXIS_RIGHT_Y,
+	GP_XBOX_AXIS_REAR_LEFT,
+	GP_XBOX_AXIS_REAR_RIGHT,
+	GP_XBOX_AXES
+};
+
+struct _gp_xbox_axis_filter {
+	/// values with magnitude up to deadzone are reported as 0
+	uint16_t deadzone;
+	/// reported value is updated only when the axis moves by more than hysteresis
+	uint16_t hysteresis;
+};
+typedef struct _gp_xbox_axis_filter gp_xbox_axis_filter_t;
+
 struct _gp_xbox_config {
-	void (*update)(uint8_t device_id, gp_xbox_packet_t data);
+	/**
+	 * @brief called when the reported state changes
+	 *
+	 * Repeated reports and axis movements filtered out by
+	 * deadzone and hysteresis do not produce a call
+	 */
+	void (*update)(uint8_t device_id, const gp_xbox_packet_t *data);
 	void (*notify_connected)(uint8_t device_id);
 	void (*notify_disconnected)(uint8_t device_id);
+
+	/**
+	 * @brief optional, called together with update with the list of changes
+	 * @param device_id
+	 * @param data new state
+	 * @param buttons_changed mask of buttons that were pressed or released
+	 * @param axes_changed mask of axes that moved, bit positions @see GP_XBOX_AXIS
+	 */
+	void (*diff)(uint8_t device_id, const gp_xbox_packet_t *data, uint32_t buttons_changed, uint8_t axes_changed);
+
+	/// per-axis filtering, zeros disable it
+	gp_xbox_axis_filter_t axis_filter[GP_XBOX_AXES];
+
+	/// optional, poll the controller less often than its bInterval (0 = bInterval)
+	uint16_t poll_interval_ms;
 };
 typedef struct _gp_xbox_config gp_xbox_config_t;
 
@@ -71,6 +110,19 @@ typedef struct _gp_xbox_config gp_xbox_config_t;
  */
 void gp_xbox_driver_init(const gp_xbox_config_t *config);
 
+/**
+ * @brief usbh_gp_xbox_read_state get the latest reported state of the controller
+ *
+ * Can be called from any context at any time, no locking is needed.
+ *
+ * @param device_id
+ * @param packet filled with the same state as passed to the last update callback
+ * @param generation optional, count of state updates, changes with every update
+ * @returns false when the controller is not connected, or when called from
+ * context that interrupted the update of the state
+ */
+bool usbh_gp_xbox_read_state(uint8_t device_id, gp_xbox_packet_t *packet, uint32_t *generation);
+
 extern const usbh_dev_driver_t usbh_gp_xbox_driver;
 
 END_DECLS
@@ -0,0 +1,91 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_DRIVER_HID_KEYBOARD_
+#define USBH_DRIVER_HID_KEYBOARD_
+
+#include "usbh_core.h"
+
+#include <stdint.h>
+
+BEGIN_DECLS
+
+enum HID_KEYBOARD_EVENT {
+	HID_KEYBOARD_EVENT_RELEASED,
+	HID_KEYBOARD_EVENT_PRESSED,
+	/// generated by the driver while the last pressed key is held
+	HID_KEYBOARD_EVENT_REPEAT
+};
+
+/// modifier keys bits, as in the boot protocol report
+#define HID_KEYBOARD_MOD_LEFT_CTRL	(1 << 0)
+#define HID_KEYBOARD_MOD_LEFT_SHIFT	(1 << 1)
+#define HID_KEYBOARD_MOD_LEFT_ALT	(1 << 2)
+#define HID_KEYBOARD_MOD_LEFT_GUI	(1 << 3)
+#define HID_KEYBOARD_MOD_RIGHT_CTRL	(1 << 4)
+#define HID_KEYBOARD_MOD_RIGHT_SHIFT	(1 << 5)
+#define HID_KEYBOARD_MOD_RIGHT_ALT	(1 << 6)
+#define HID_KEYBOARD_MOD_RIGHT_GUI	(1 << 7)
+
+struct _hid_keyboard_config {
+	void (*notify_connected)(uint8_t device_id);
+	void (*notify_disconnected)(uint8_t device_id);
+
+	/**
+	 * @brief this is called for every key change and for every repeat
+	 * @param device_id
+	 * @param usage usage ID from keyboard usage page (0xE0 - 0xE7 are modifiers)
+	 * @param event @see HID_KEYBOARD_EVENT
+	 * @param modifiers state of modifier keys after the change @see HID_KEYBOARD_MOD_LEFT_CTRL
+	 */
+	void (*key)(uint8_t device_id, uint8_t usage, uint8_t event, uint8_t modifiers);
+
+	/// time from the key press to the first repeat, 0 disables the repeat
+	uint32_t repeat_delay_us;
+	/// time between repeats
+	uint32_t repeat_period_us;
+
+	/// optional, poll the keyboard less often than its bInterval (0 = bInterval)
+	uint16_t poll_interval_ms;
+};
+typedef struct _hid_keyboard_config hid_keyboard_config_t;
+
+/**
+ * @brief hid_keyboard_driver_init initialization routine - this will initialize internal structures of this device driver
+ * @param config
+ * @see hid_keyboard_config_t
+ */
+void hid_keyboard_driver_init(const hid_keyboard_config_t *config);
+
+/**
+ * @brief usbh_hid_keyboard_key_pressed check the state of the key
+ * @param device_id
+ * @param usage usage ID from keyboard usage page
+ * @returns false when the key is not pressed or keyboard is not connected
+ */
+bool usbh_hid_keyboard_key_pressed(uint8_t device_id, uint8_t usage);
+
+extern const usbh_dev_driver_t usbh_hid_keyboard_driver;
+
+END_DECLS
+
+#endif
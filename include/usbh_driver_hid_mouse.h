@@ -29,13 +29,49 @@
 
 BEGIN_DECLS
 
+struct _hid_mouse_state {
+	/// bit n set when button n + 1 is pressed
+	uint8_t buttons;
+	/// relative movement reported by the last report
+	int16_t x;
+	int16_t y;
+	int16_t wheel;
+};
+typedef struct _hid_mouse_state hid_mouse_state_t;
+
+/**
+ * @brief motion summed since the last @ref usbh_hid_mouse_read_motion()
+ */
+struct _hid_mouse_motion {
+	/// sums saturate at INT16_MIN/INT16_MAX
+	int16_t x;
+	int16_t y;
+	int16_t wheel;
+	/// buttons that were pressed at least once
+	uint8_t buttons_pressed;
+	/// buttons that were released at least once
+	uint8_t buttons_released;
+};
+typedef struct _hid_mouse_motion hid_mouse_motion_t;
+
 struct _hid_mouse_config {
 	/**
-	 * @brief this is called when some data is read when polling the device
+	 * @brief optional, this is called for every report read from the device
 	 * @param device_id
 	 * @param data pointer to the data (only 4 bytes are valid!)
 	 */
 	void (*mouse_in_message_handler)(uint8_t device_id, const uint8_t *data);
+
+	/**
+	 * @brief optional, this is called for every report with decoded state
+	 */
+	void (*report)(uint8_t device_id, const hid_mouse_state_t *state);
+
+	/// report is repeated after this time when nothing changes (rounded to 4 ms), 0 = only on change
+	uint16_t idle_ms;
+
+	/// optional, poll the mouse less often than its bInterval (0 = bInterval)
+	uint16_t poll_interval_ms;
 };
 typedef struct _hid_mouse_config hid_mouse_config_t;
 
@@ -46,6 +82,31 @@ typedef struct _hid_mouse_config hid_mouse_config_t;
  */
 void hid_mouse_driver_init(const hid_mouse_config_t *config);
 
+/**
+ * @brief usbh_hid_mouse_read_state get the state from the latest mouse report
+ *
+ * Can be called from any context at any time, no locking is needed.
+ *
+ * @param device_id
+ * @param state
+ * @param generation optional, count of received reports
+ * @returns false when the mouse is not connected, or when called from
+ * context that interrupted the update of the state
+ */
+bool usbh_hid_mouse_read_state(uint8_t device_id, hid_mouse_state_t *state, uint32_t *generation);
+
+/**
+ * @brief usbh_hid_mouse_read_motion get and clear motion summed over all reports
+ *
+ * Can be called from any context at any time, no movement is lost
+ * between the calls.
+ *
+ * @param device_id
+ * @param motion
+ * @returns false when the mouse is not connected
+ */
+bool usbh_hid_mouse_read_motion(uint8_t device_id, hid_mouse_motion_t *motion);
+
 extern const usbh_dev_driver_t usbh_hid_mouse_driver;
 
 END_DECLS
@@ -0,0 +1,99 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_DRIVER_MSC_
+#define USBH_DRIVER_MSC_
+
+#include "usbh_core.h"
+
+#include <stdint.h>
+
+BEGIN_DECLS
+
+/// Only devices with 512 byte logical blocks are supported
+#define USBH_MSC_SECTOR_SIZE	(512)
+
+/**
+ * @brief called when the request finishes
+ * @param device_id
+ * @param success false when the device reported an error or was removed
+ */
+typedef void (*msc_callback_t)(uint8_t device_id, bool success);
+
+struct _msc_config {
+	/**
+	 * @brief this is called when the medium is ready
+	 * @param device_id
+	 * @param sector_count capacity of the medium in sectors
+	 */
+	void (*notify_connected)(uint8_t device_id, uint32_t sector_count);
+	void (*notify_disconnected)(uint8_t device_id);
+};
+typedef struct _msc_config msc_config_t;
+
+/**
+ * @brief msc_driver_init initialization routine - this will initialize internal structures of this device driver
+ * @param config
+ *
+ * @see msc_config_t
+ */
+void msc_driver_init(const msc_config_t *config);
+
+/**
+ * @brief usbh_msc_read read sectors from the device
+ * @param device_id
+ * @param sector first sector
+ * @param count count of sectors
+ * @param data buffer for count * USBH_MSC_SECTOR_SIZE bytes, must be valid until callback is called
+ * @param callback this is called when the read finishes
+ * @returns false when the device is not ready or another request is in progress
+ */
+bool usbh_msc_read(uint8_t device_id, uint32_t sector, uint32_t count, void *data, msc_callback_t callback);
+
+/**
+ * @brief usbh_msc_write write sectors to the device
+ *
+ * Small writes are only stored in the cache, use @ref usbh_msc_flush()
+ * to make sure they reach the medium.
+ *
+ * @param device_id
+ * @param sector first sector
+ * @param count count of sectors
+ * @param data count * USBH_MSC_SECTOR_SIZE bytes, must be valid until callback is called
+ * @param callback this is called when the write finishes
+ * @returns false when the device is not ready or another request is in progress
+ */
+bool usbh_msc_write(uint8_t device_id, uint32_t sector, uint32_t count, const void *data, msc_callback_t callback);
+
+/**
+ * @brief usbh_msc_flush write all cached sectors to the device
+ * @param device_id
+ * @param callback this is called when the cache is clean
+ * @returns false when the device is not ready or another request is in progress
+ */
+bool usbh_msc_flush(uint8_t device_id, msc_callback_t callback);
+
+extern const usbh_dev_driver_t usbh_msc_driver;
+
+END_DECLS
+
+#endif
@@ -24,14 +24,20 @@
 #include "usbh_core.h"				/// provides usbh_init() and usbh_poll()
 #include "usbh_lld_stm32f4.h"		/// provides low level usb host driver for stm32f4 platform
 #include "usbh_driver_hid_mouse.h"	/// provides usb device driver Human Interface Device - type mouse
+#include "usbh_driver_hid_keyboard.h"	/// provides usb device driver Human Interface Device - type keyboard
 #include "usbh_driver_hub.h"		/// provides usb full speed hub driver (Low speed devices on hub are not supported)
 #include "usbh_driver_gp_xbox.h"	/// provides usb device driver for Gamepad: Microsoft XBOX compatible Controller
 #include "usbh_driver_ac_midi.h"	/// provides usb device driver for midi class devices
+#include "usbh_driver_ac_audio.h"	/// provides usb device driver for audio streaming (USB Audio Class 1.0)
+#include "usbh_driver_msc.h"		/// provides usb device driver for mass storage devices (Bulk-Only Transport)
+#include "usbh_driver_cdc_acm.h"	/// provides usb device driver for serial devices (CDC-ACM)
+#include "usbh_driver_cdc_ncm.h"	/// provides usb device driver for ethernet adapters (CDC-NCM)
 
  // STM32f407 compatible
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/dma.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/otg_hs.h>
 #include <libopencm3/stm32/otg_fs.h>
@@ -40,6 +46,8 @@
 #include <string.h>
 #include <stdlib.h>
 
+#define LOG_MODULE APP
+
 
 static inline void delay_ms_busy_loop(uint32_t ms)
 {
@@ -61,6 +69,7 @@ static void clock_setup(void)
 
 	// periphery
 	rcc_periph_clock_enable(RCC_USART6); // USART
+	rcc_periph_clock_enable(RCC_DMA2); // USART TX DMA
 	rcc_periph_clock_enable(RCC_OTGFS); // OTG_FS
 	rcc_periph_clock_enable(RCC_OTGHS); // OTG_HS
 	rcc_periph_clock_enable(RCC_TIM6); // TIM6
@@ -117,16 +126,21 @@ static void gpio_setup(void)
 static const usbh_dev_driver_t *device_drivers[] = {
 	&usbh_hub_driver,
 	&usbh_hid_mouse_driver,
+	&usbh_hid_keyboard_driver,
 	&usbh_gp_xbox_driver,
 	&usbh_midi_driver,
+	&usbh_audio_driver,
+	&usbh_msc_driver,
+	&usbh_cdc_acm_driver,
+	&usbh_cdc_ncm_driver,
 	0
 };
 
-static void gp_xbox_update(uint8_t device_id, gp_xbox_packet_t packet)
+static void gp_xbox_update(uint8_t device_id, const gp_xbox_packet_t *packet)
 {
 	(void)device_id;
 	(void)packet;
-	LOG_PRINTF("update %d: %d %d \n", device_id, packet.axis_left_x, packet.buttons & GP_XBOX_BUTTON_A);
+	LOG_PRINTF("update %d: %d %d \n", device_id, packet->axis_left_x, packet->buttons & GP_XBOX_BUTTON_A);
 }
 
 
@@ -145,20 +159,40 @@ static void gp_xbox_disconnected(uint8_t device_id)
 static const gp_xbox_config_t gp_xbox_config = {
 	.update = &gp_xbox_update,
 	.notify_connected = &gp_xbox_connected,
-	.notify_disconnected = &gp_xbox_disconnected
+	.notify_disconnected = &gp_xbox_disconnected,
+	.axis_filter = {
+		[GP_XBOX_AXIS_LEFT_X] = { .deadzone = 4000, .hysteresis = 256 },
+		[GP_XBOX_AXIS_LEFT_Y] = { .deadzone = 4000, .hysteresis = 256 },
+		[GP_XBOX_AXIS_RIGHT_X] = { .deadzone = 4000, .hysteresis = 256 },
+		[GP_XBOX_AXIS_RIGHT_Y] = { .deadzone = 4000, .hysteresis = 256 }
+	}
 };
 
-static void mouse_in_message_handler(uint8_t device_id, const uint8_t *data)
+static void mouse_report(uint8_t device_id, const hid_mouse_state_t *state)
 {
 	(void)device_id;
-	(void)data;
-	// print only first 4 bytes, since every mouse should have at least these four set.
-	// Report descriptors are not read by driver for now, so we do not know what each byte means
-	LOG_PRINTF("MOUSE EVENT %02X %02X %02X %02X \n", data[0], data[1], data[2], data[3]);
+	(void)state;
+	// fields are located by the report descriptor
+	LOG_PRINTF("MOUSE EVENT %02X %d %d %d \n", state->buttons, state->x, state->y, state->wheel);
 }
 
 static const hid_mouse_config_t mouse_config = {
-	.mouse_in_message_handler = &mouse_in_message_handler
+	.report = &mouse_report
+};
+
+static void keyboard_key(uint8_t device_id, uint8_t usage, uint8_t event, uint8_t modifiers)
+{
+	(void)device_id;
+	(void)usage;
+	(void)event;
+	(void)modifiers;
+	LOG_PRINTF("KEYBOARD %d: key %02X event %d modifiers %02X\n", device_id, usage, event, modifiers);
+}
+
+static const hid_keyboard_config_t keyboard_config = {
+	.key = &keyboard_key,
+	.repeat_delay_us = 500000,
+	.repeat_period_us = 33000
 };
 
 static void midi_in_message_handler(int device_id, uint8_t *data)
@@ -182,6 +216,90 @@ const midi_config_t midi_config = {
 	.read_callback = &midi_in_message_handler
 };
 
+static void audio_connected(uint8_t device_id, uint8_t streams)
+{
+	(void)device_id;
+	(void)streams;
+	LOG_PRINTF("audio connected %d, streams %d\n", device_id, streams);
+}
+
+static void audio_disconnected(uint8_t device_id)
+{
+	(void)device_id;
+	LOG_PRINTF("audio disconnected %d\n", device_id);
+}
+
+static const audio_config_t audio_config = {
+	.format = {
+		.sample_rate = 48000,
+		.channels = 2,
+		.subframe_size = 2,
+		.bit_resolution = 16
+	},
+	.notify_connected = &audio_connected,
+	.notify_disconnected = &audio_disconnected
+};
+
+static void msc_connected(uint8_t device_id, uint32_t sector_count)
+{
+	(void)device_id;
+	(void)sector_count;
+	LOG_PRINTF("mass storage connected %d, %d sectors\n", device_id, sector_count);
+}
+
+static void msc_disconnected(uint8_t device_id)
+{
+	(void)device_id;
+	LOG_PRINTF("mass storage disconnected %d\n", device_id);
+}
+
+static const msc_config_t msc_config = {
+	.notify_connected = &msc_connected,
+	.notify_disconnected = &msc_disconnected
+};
+
+static void cdc_acm_rx(uint8_t device_id, uint32_t available)
+{
+	uint8_t data[16];
+	(void)available;
+
+	// echo received data back
+	uint32_t length;
+	while ((length = usbh_cdc_acm_read(device_id, data, sizeof(data)))) {
+		usbh_cdc_acm_write(device_id, data, length);
+	}
+}
+
+static const cdc_acm_config_t cdc_acm_config = {
+	.line_coding = {
+		.baudrate = 115200,
+		.stop_bits = CDC_ACM_STOP_BITS_1,
+		.parity = CDC_ACM_PARITY_NONE,
+		.data_bits = 8
+	},
+	.notify_rx = &cdc_acm_rx
+};
+
+static void cdc_ncm_connected(uint8_t device_id, const uint8_t *mac)
+{
+	(void)device_id;
+	(void)mac;
+	LOG_PRINTF("ethernet connected %d, mac %02X:%02X:%02X:%02X:%02X:%02X\n", device_id,
+		mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+static void cdc_ncm_rx_frame(uint8_t device_id, const uint8_t *frame, uint16_t length)
+{
+	(void)length;
+	LOG_PRINTF("ethernet frame %d bytes\n", length);
+	usbh_cdc_ncm_rx_release(device_id, frame);
+}
+
+static const cdc_ncm_config_t cdc_ncm_config = {
+	.notify_connected = &cdc_ncm_connected,
+	.rx_frame = &cdc_ncm_rx_frame
+};
+
 int main(void)
 {
 	clock_setup();
@@ -192,6 +310,8 @@ int main(void)
 
 #ifdef USART_DEBUG
 	usart_init(USART6, 921600);
+	// USART6_TX
+	usart_dma_init(DMA2, DMA_STREAM6, DMA_SxCR_CHSEL_5);
 #endif
 	LOG_PRINTF("\n\n\n\n\n###################\nInit\n");
 
@@ -201,9 +321,14 @@ int main(void)
 	 * Pass configuration struct where the callbacks are defined
 	 */
 	hid_mouse_driver_init(&mouse_config);
+	hid_keyboard_driver_init(&keyboard_config);
 	hub_driver_init();
 	gp_xbox_driver_init(&gp_xbox_config);
 	midi_driver_init(&midi_config);
+	audio_driver_init(&audio_config);
+	msc_driver_init(&msc_config);
+	cdc_acm_driver_init(&cdc_acm_config);
+	cdc_ncm_driver_init(&cdc_ncm_config);
 
 	gpio_set(GPIOD,  GPIO13);
 
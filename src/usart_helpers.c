@@ -22,6 +22,8 @@
 
 
 #include "usart_helpers.h"
+#include "usbh_trace.h"
+#include "usbh_ring.h"
 
 #include <string.h>
 #include <stdarg.h>
@@ -29,89 +31,62 @@
 #include <stdio.h>
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/dma.h>
 
+#define LOG_MODULE APP
 
+
+// Output ring: written by log functions in the main loop context,
+// drained by LOG_FLUSH() (DMA or free space of the transmit register)
 #define USART_FIFO_OUT_SIZE (4096)
-uint8_t usart_fifo_out_data[USART_FIFO_OUT_SIZE];
-uint32_t usart_fifo_out_len = 0;
-uint32_t usart_fifo_out_index = 0;
+static uint8_t usart_fifo_out_data[USART_FIFO_OUT_SIZE];
+static usbh_ring_t usart_fifo_out = { usart_fifo_out_data, USART_FIFO_OUT_SIZE, 0, 0 };
+// bytes of messages not fitting into the output ring
+static uint32_t usart_fifo_out_dropped = 0;
 
+// Input ring: written by usart_interrupt(), read by usart_call_cmd()
 #define USART_FIFO_IN_SIZE (1024)
-uint8_t usart_fifo_in_data[USART_FIFO_IN_SIZE];
-uint32_t usart_fifo_in_len = 0;
-uint32_t usart_fifo_in_index = 0;
+static uint8_t usart_fifo_in_data[USART_FIFO_IN_SIZE];
+static usbh_ring_t usart_fifo_in = { usart_fifo_in_data, USART_FIFO_IN_SIZE, 0, 0 };
 
 static uint32_t usart = 0;
 
-static uint8_t usart_fifo_pop(void)
-{
-	uint8_t ret;
-	usart_fifo_out_len--;
-	ret = usart_fifo_out_data[usart_fifo_out_index];
-	usart_fifo_out_index++;
-	if (usart_fifo_out_index == USART_FIFO_OUT_SIZE ) {
-		usart_fifo_out_index = 0;
-	}
-	return ret;
-}
-
-static void usart_fifo_push(uint8_t aData)
-{
-	uint32_t i;
-	if( (usart_fifo_out_len + 1) == USART_FIFO_OUT_SIZE)//overflow
-	{
-		usart_fifo_out_len = 0;
-		LOG_PRINTF("OVERFLOW!");
-		return;
-	}
-
-	i = usart_fifo_out_index + usart_fifo_out_len;
-	if (i >= USART_FIFO_OUT_SIZE) {
-		i -= USART_FIFO_OUT_SIZE;
-	}
-	usart_fifo_out_data[i] = aData;
-	usart_fifo_out_len++;
-}
+static usart_log_sink_t log_sink = 0;
+static uint32_t log_time_us = 0;
 
+// Transmit DMA, optional
+static struct {
+	uint32_t dma;
+	uint8_t stream;
+	// length of the chunk in progress, 0 = idle
+	uint32_t length;
+} usart_dma = {0};
 
-static uint8_t usart_fifo_in_pop(void)
+/**
+ * Message is written whole or dropped, so the output does not
+ * contain pieces of messages
+ */
+static void usart_write(const char * data, uint32_t len)
 {
-	uint8_t ret;
-	usart_fifo_in_len--;
-	ret = usart_fifo_in_data[usart_fifo_in_index];
-	usart_fifo_in_index++;
-	if (usart_fifo_in_index == USART_FIFO_IN_SIZE ) {
-		usart_fifo_in_index = 0;
+	if (usart_fifo_out_dropped) {
+		char note[32];
+		int note_len = snprintf(note, sizeof(note), "\n[%u bytes dropped]\n",
+			(unsigned)usart_fifo_out_dropped);
+		if (usbh_ring_free(&usart_fifo_out) < note_len + len) {
+			usart_fifo_out_dropped += len;
+			return;
+		}
+		usbh_ring_write(&usart_fifo_out, note, note_len);
+		usart_fifo_out_dropped = 0;
 	}
-	return ret;
-}
 
-static void usart_fifo_in_push(uint8_t aData)
-{
-	uint32_t i;
-	if( (usart_fifo_in_len + 1) == USART_FIFO_IN_SIZE)//overflow
-	{
-		usart_fifo_in_len = 0;
+	if (usbh_ring_free(&usart_fifo_out) < len) {
+		usart_fifo_out_dropped += len;
 		return;
 	}
-
-	i = usart_fifo_in_index + usart_fifo_in_len;
-	if (i >= USART_FIFO_IN_SIZE) {
-		i -= USART_FIFO_IN_SIZE;
-	}
-	usart_fifo_in_data[i] = aData;
-	usart_fifo_in_len++;
+	usbh_ring_write(&usart_fifo_out, data, len);
 }
 
-
-static void usart_write(const char * data, uint32_t len)
-{
-    uint32_t i;
-    for(i = 0; i < len; i++)
-    {
-        usart_fifo_push(data[i]);
-    }
-}
 void usart_printf(const char *str, ...)
 {
 	va_list va;
@@ -126,10 +101,52 @@ void usart_vprintf(const char *str, va_list va)
 	char databuffer[128];
 	int i = vsnprintf(databuffer, 128, str, va);
 	if (i > 0) {
-		usart_write(databuffer, i);
+		if (i > 127) {
+			i = 127;
+		}
+		if (log_sink) {
+			log_sink(databuffer, i);
+		} else {
+			usart_write(databuffer, i);
+		}
 	}
 }
 
+void usart_log_sink_set(usart_log_sink_t sink)
+{
+	log_sink = sink;
+}
+
+void usart_log_timestamp(uint32_t time_us)
+{
+	log_time_us = time_us;
+}
+
+bool usart_log_allowed(usart_log_limit_t *limit, const char *module, uint16_t line)
+{
+	if (!USBH_LOG_RATE_LIMIT) {
+		return true;
+	}
+
+	if (log_time_us - limit->window_start_us >= USBH_LOG_RATE_WINDOW_MS * 1000UL) {
+		if (limit->suppressed) {
+			usart_printf("\n[%s:%d: %d suppressed]\n", module, line, limit->suppressed);
+		}
+		limit->window_start_us = log_time_us;
+		limit->count = 0;
+		limit->suppressed = 0;
+	}
+
+	if (limit->count < USBH_LOG_RATE_LIMIT) {
+		limit->count++;
+		return true;
+	}
+	if (limit->suppressed < UINT16_MAX) {
+		limit->suppressed++;
+	}
+	return false;
+}
+
 
 
 void usart_init(uint32_t arg_usart, uint32_t baudrate)
@@ -145,26 +162,107 @@ void usart_init(uint32_t arg_usart, uint32_t baudrate)
 	usart_enable(arg_usart);
 	usart = arg_usart;
 }
+
+void usart_dma_init(uint32_t dma, uint8_t stream, uint32_t channel)
+{
+	dma_stream_reset(dma, stream);
+	dma_channel_select(dma, stream, channel);
+	dma_set_priority(dma, stream, DMA_SxCR_PL_LOW);
+	dma_set_memory_size(dma, stream, DMA_SxCR_MSIZE_8BIT);
+	dma_set_peripheral_size(dma, stream, DMA_SxCR_PSIZE_8BIT);
+	dma_enable_memory_increment_mode(dma, stream);
+	dma_set_transfer_mode(dma, stream, DMA_SxCR_DIR_MEM_TO_PERIPHERAL);
+	dma_set_peripheral_address(dma, stream, (uint32_t)&USART_DR(usart));
+
+	usart_dma.dma = dma;
+	usart_dma.stream = stream;
+	usart_dma.length = 0;
+	usart_enable_tx_dma(usart);
+}
+
+/**
+ * Only receives, echo and output are done by usart_call_cmd()
+ * in the main loop, which is the only producer of the output ring
+ */
 void usart_interrupt(void)
 {
 	if (usart_get_interrupt_source(usart, USART_SR_RXNE)) {
 		uint8_t data = usart_recv(usart);
-		usart_fifo_in_push(data);
-		if ( data != 3 && data != '\r' && data != '\n') {
-			usart_fifo_push(data);
-		} else {
-			LOG_PRINTF("\n>>");
+		// dropped, when the ring is full
+		usbh_ring_write(&usart_fifo_in, &data, 1);
+	}
+}
+
+#ifdef USBH_TRACE
+/**
+ * Move the binary trace into the output as hex between STX and ETX,
+ * so the trace and text can share the line. Decoded by decodeTrace.py
+ */
+static void usart_trace_push(void)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	uint8_t data[32];
+	char line[2 + 2 * sizeof(data)];
+	uint32_t len;
+
+	while (usbh_ring_free(&usart_fifo_out) >= sizeof(line) &&
+		(len = usbh_trace_read(data, sizeof(data)))) {
+		uint32_t i;
+		line[0] = 0x02;
+		for (i = 0; i < len; i++) {
+			line[1 + 2 * i] = hex[data[i] >> 4];
+			line[2 + 2 * i] = hex[data[i] & 0xf];
 		}
+		line[1 + 2 * len] = 0x03;
+		usart_write(line, 2 + 2 * len);
 	}
 }
+#endif
 
+/**
+ * Start the transfer of the next contiguous chunk of the output ring,
+ * when the previous one is complete. Without DMA only the byte, that fits
+ * into the transmit register, is sent. Never waits for the USART.
+ */
 void usart_fifo_send(void)
 {
-	while(usart_fifo_out_len) {
-		uint8_t data = usart_fifo_pop();
-		usart_wait_send_ready(usart);
-		usart_send(usart, data);
+	const uint8_t *data;
+	uint32_t len;
+
+#ifdef USBH_TRACE
+	usart_trace_push();
+#endif
+
+	if (!usart_dma.dma) {
+		while (usart_get_flag(usart, USART_SR_TXE) &&
+			usbh_ring_peek(&usart_fifo_out, &data)) {
+			usart_send(usart, *data);
+			usbh_ring_consume(&usart_fifo_out, 1);
+		}
+		return;
 	}
+
+	if (usart_dma.length) {
+		if (!dma_get_interrupt_flag(usart_dma.dma, usart_dma.stream, DMA_TCIF)) {
+			return;
+		}
+		dma_clear_interrupt_flags(usart_dma.dma, usart_dma.stream,
+			DMA_TCIF | DMA_HTIF | DMA_TEIF | DMA_DMEIF | DMA_FEIF);
+		usbh_ring_consume(&usart_fifo_out, usart_dma.length);
+		usart_dma.length = 0;
+	}
+
+	len = usbh_ring_peek(&usart_fifo_out, &data);
+	if (!len) {
+		return;
+	}
+	if (len > 0xffff) {
+		len = 0xffff;
+	}
+	dma_set_memory_address(usart_dma.dma, usart_dma.stream, (uint32_t)data);
+	dma_set_number_of_data(usart_dma.dma, usart_dma.stream, len);
+	dma_enable_stream(usart_dma.dma, usart_dma.stream);
+	usart_dma.length = len;
 }
 static char command[128];
 static uint8_t command_len = 0;
@@ -172,9 +270,14 @@ static uint8_t command_argindex = 0;
 
 static uint8_t usart_read_command(void)
 {
-	uint32_t fifo_len = usart_fifo_in_len;
-	while (fifo_len) {
-		uint8_t data = usart_fifo_in_pop();
+	uint8_t data;
+	while (usbh_ring_read(&usart_fifo_in, &data, 1)) {
+		// echo
+		if (data != 3 && data != '\r' && data != '\n') {
+			usart_write((const char *)&data, 1);
+		} else {
+			usart_write("\n>>", 3);
+		}
 
 		if ((data >= 'A') && (data <= 'Z')) {
 			data += 'a'-'A';
@@ -215,8 +318,6 @@ static uint8_t usart_read_command(void)
 		} else {
 			LOG_PRINTF("%d ",data);
 		}
-
-		fifo_len--;
 	}
 	return 0;
 }
@@ -243,7 +344,7 @@ void usart_call_cmd(struct usart_commands * commands)
 					commands[i].callback(&command[command_argindex]);
 				}
 			}
-			usart_write("\n>>",4);
+			usart_write("\n>>", 3);
 			command_len = 0;
 			command_argindex = 0;
 			return;
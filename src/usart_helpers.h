@@ -24,6 +24,7 @@
 #define USBH_USART_HELPERS_H
 
 #include "usbh_core.h"
+#include "usbh_config.h"
 #include <stdint.h>
 #include <stdarg.h>
 
@@ -35,21 +36,108 @@ struct usart_commands{
 };
 
 
+/*
+ * Log levels
+ *
+ * Each source file defines LOG_MODULE (e.g. #define LOG_MODULE HUB) and logs by
+ * LOG_ERROR, LOG_WARN, LOG_INFO and LOG_DEBUG (LOG_PRINTF is LOG_DEBUG).
+ * Level of each module is set by USBH_LOG_LEVEL_<module> in usbh_config.h.
+ * Sites above the level of the module are compiled out together with
+ * their arguments. Each enabled site prints at most USBH_LOG_RATE_LIMIT
+ * messages per USBH_LOG_RATE_WINDOW_MS, count of suppressed messages
+ * is printed later.
+ */
+#define LOG_LEVEL_NONE	(0)
+#define LOG_LEVEL_ERROR	(1)
+#define LOG_LEVEL_WARN	(2)
+#define LOG_LEVEL_INFO	(3)
+#define LOG_LEVEL_DEBUG	(4)
+
+#define LOG_MODULE_LEVEL_(module) USBH_LOG_LEVEL_##module
+#define LOG_MODULE_LEVEL(module) LOG_MODULE_LEVEL_(module)
+#define LOG_MODULE_NAME_(module) #module
+#define LOG_MODULE_NAME(module) LOG_MODULE_NAME_(module)
+
 #ifdef USART_DEBUG
+
+/**
+ * @brief log output
+ * @param data formatted text, not terminated
+ */
+typedef void (*usart_log_sink_t)(const char *data, uint32_t length);
+
+/// state of one log site
+struct _usart_log_limit {
+	uint32_t window_start_us;
+	uint16_t count;
+	uint16_t suppressed;
+};
+typedef struct _usart_log_limit usart_log_limit_t;
+
 void usart_init(uint32_t usart, uint32_t baudrate);
+
+/**
+ * @brief usart_dma_init send the output by DMA, called after usart_init()
+ *
+ * Stream has to be connected to TX of the USART, its clock enabled.
+ * Without DMA, output is sent byte by byte from LOG_FLUSH().
+ * @param channel DMA_SxCR_CHSEL_x
+ */
+void usart_dma_init(uint32_t dma, uint8_t stream, uint32_t channel);
+
 void usart_printf(const char *str, ...);
 void usart_vprintf(const char *str, va_list va);
+/**
+ * @brief usart_fifo_send continue sending of the output, never waits
+ *
+ * Output is written only from the main loop context (not from interrupts),
+ * so the output ring has single producer and single consumer.
+ */
 void usart_fifo_send(void);
 
+/**
+ * @brief usart_log_sink_set redirect log output
+ * @param sink 0 restores the USART output
+ */
+void usart_log_sink_set(usart_log_sink_t sink);
+
+/**
+ * @brief usart_log_timestamp time used by rate limiting, updated by usbh_poll()
+ */
+void usart_log_timestamp(uint32_t time_us);
+
+/**
+ * @brief usart_log_allowed rate limit of the log site
+ * @returns false when the message has to be suppressed
+ */
+bool usart_log_allowed(usart_log_limit_t *limit, const char *module, uint16_t line);
+
 void usart_call_cmd(struct usart_commands * commands);
 void usart_interrupt(void);
-#define LOG_PRINTF(format, ...) usart_printf(format, ##__VA_ARGS__);
+
+#define LOG_AT(level, format, ...) \
+	do { \
+		if (LOG_MODULE_LEVEL(LOG_MODULE) >= (level)) { \
+			static usart_log_limit_t log_limit; \
+			if (usart_log_allowed(&log_limit, LOG_MODULE_NAME(LOG_MODULE), __LINE__)) { \
+				usart_printf(format, ##__VA_ARGS__); \
+			} \
+		} \
+	} while (0)
+#define LOG_TIMESTAMP(time_us) usart_log_timestamp(time_us)
 #define LOG_FLUSH() usart_fifo_send()
 #else
-#define LOG_PRINTF(dummy, ...) ((void)dummy)
+#define LOG_AT(level, format, ...) do {} while (0)
+#define LOG_TIMESTAMP(time_us) ((void)(time_us))
 #define LOG_FLUSH()
 #endif
 
+#define LOG_ERROR(format, ...) LOG_AT(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...) LOG_AT(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) LOG_AT(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#define LOG_PRINTF(format, ...) LOG_DEBUG(format, ##__VA_ARGS__)
+
 END_DECLS
 
 #endif
@@ -24,17 +24,46 @@
 #include "usbh_lld_stm32f4.h"
 #include "driver/usbh_device_driver.h"
 #include "usart_helpers.h"
+#include "usbh_trace.h"
 
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/usb/usbstd.h>
 
+#define LOG_MODULE CORE
+
 static struct {
 	bool enumeration_run;
 	const usbh_low_level_driver_t * const *lld_drivers;
 	const usbh_dev_driver_t * const *dev_drivers;
 	int8_t address_temporary;
+	// time passed to the running usbh_poll()
+	uint32_t time_curr_us;
+	const usbh_timing_t *timing;
+	// device waiting for SET_ADDRESS recovery
+	usbh_device_t *address_recovery_device;
+	uint32_t address_recovery_timestamp_us;
+	// devices idle for this time are suspended, 0 = never
+	uint32_t suspend_timeout_us;
 } usbh_data = {0};
 
+const usbh_timing_t usbh_timing_spec = {
+	.debounce_us = 100000,
+	.reset_us = 50000,
+	.reset_recovery_us = 10000,
+	.set_address_recovery_us = 2000,
+	.power_good_min_us = 0,
+	.resume_recovery_us = 10000
+};
+
+const usbh_timing_t usbh_timing_conservative = {
+	.debounce_us = 500000,
+	.reset_us = 50000,
+	.reset_recovery_us = 200000,
+	.set_address_recovery_us = 20000,
+	.power_good_min_us = 100000,
+	.resume_recovery_us = 50000
+};
+
 static void set_enumeration(void)
 {
 	usbh_data.enumeration_run = true;
@@ -92,6 +121,7 @@ static void device_register(void *descriptors, uint16_t descriptors_len, usbh_de
 
 	dev->drv = 0;
 	dev->drvdata = 0;
+	usbh_periodic_release(dev);
 
 	uint8_t desc_len = buf[i];
 	uint8_t desc_type = buf[i + 1];
@@ -106,7 +136,7 @@ static void device_register(void *descriptors, uint16_t descriptors_len, usbh_de
 		device_info.idVendor = device_desc->idVendor;
 		device_info.idProduct = device_desc->idProduct;
 	} else {
-		LOG_PRINTF("INVALID descriptors pointer - fatal error");
+		LOG_ERROR("INVALID descriptors pointer - fatal error");
 		return;
 	}
 
@@ -115,6 +145,12 @@ static void device_register(void *descriptors, uint16_t descriptors_len, usbh_de
 		desc_len = buf[i];
 		desc_type = buf[i + 1];
 		switch (desc_type) {
+		case USB_DT_CONFIGURATION:
+		{
+			struct usb_config_descriptor *cfg = (void*)&buf[i];
+			dev->remote_wakeup = cfg->bmAttributes & USB_CONFIG_ATTR_REMOTE_WAKEUP;
+		}
+			break;
 		case USB_DT_INTERFACE:
 		{
 			LOG_PRINTF("INTERFACE_DESCRIPTOR\n");
@@ -133,12 +169,15 @@ static void device_register(void *descriptors, uint16_t descriptors_len, usbh_de
 			}
 		}
 			break;
+		case USB_DT_ENDPOINT:
+			usbh_periodic_register(dev, &buf[i]);
+			break;
 		default:
 			break;
 		}
 
 		if (desc_len == 0) {
-			LOG_PRINTF("PROBLEM WITH PARSE %d\n",i);
+			LOG_WARN("PROBLEM WITH PARSE %d\n",i);
 			return;
 		}
 		i += desc_len;
@@ -154,13 +193,13 @@ static void device_register(void *descriptors, uint16_t descriptors_len, usbh_de
 			void *drvdata = dev->drvdata;
 			LOG_PRINTF("[%d]",buf[i+1]);
 			if (dev->drv->analyze_descriptor(drvdata, &buf[i])) {
-				LOG_PRINTF("Device Initialized\n");
+				LOG_INFO("Device Initialized\n");
 				return;
 			}
 			i += desc_len;
 		}
 	}
-	LOG_PRINTF("Device NOT Initialized\n");
+	LOG_INFO("Device NOT Initialized\n");
 }
 
 void usbh_init(const void *low_level_drivers[], const usbh_dev_driver_t * const device_drivers[])
@@ -177,15 +216,20 @@ void usbh_init(const void *low_level_drivers[], const usbh_dev_driver_t * const
 	while (usbh_data.lld_drivers[k]) {
 		LOG_PRINTF("DRIVER %d\n", k);
 
-		usbh_device_t * usbh_device =
-			((usbh_generic_data_t *)(usbh_data.lld_drivers[k])->driver_data)->usbh_device;
+		usbh_generic_data_t *lld_data = usbh_data.lld_drivers[k]->driver_data;
+		usbh_device_t *usbh_device = lld_data->usbh_device;
 		uint32_t i;
 		for (i = 0; i < USBH_MAX_DEVICES; i++) {
 			//~ LOG_PRINTF("%p ", &usbh_device[i]);
 			usbh_device[i].address = -1;
 			usbh_device[i].drv = 0;
 			usbh_device[i].drvdata = 0;
+			usbh_device[i].lld = usbh_data.lld_drivers[k];
+			usbh_device[i].tier = 0;
 		}
+		lld_data->active_first = 0;
+		lld_data->active_last = 0;
+		usbh_periodic_reset(usbh_data.lld_drivers[k]);
 		LOG_PRINTF("DRIVER %d", k);
 		usbh_data.lld_drivers[k]->init(usbh_data.lld_drivers[k]->driver_data);
 
@@ -265,24 +309,67 @@ bool usbh_enum_available(void)
 }
 
 /**
+ * @brief device_attach place the device into the topology
+ * @param parent hub, 0 for the device on the root port
+ * @param port port of the parent hub
+ */
+static void device_attach(usbh_device_t *dev, usbh_device_t *parent, uint8_t port)
+{
+	const usbh_low_level_driver_t *lld = dev->lld;
+	usbh_generic_data_t *lld_data = lld->driver_data;
+
+	dev->parent = parent;
+	dev->port = port;
+	if (parent) {
+		dev->tier = parent->tier + 1;
+		dev->route = parent->route | ((uint32_t)(port < 15 ? port : 15) << (4 * (parent->tier - 1)));
+	} else {
+		dev->tier = 1;
+		dev->route = 0;
+	}
+
+	dev->suspend_state = USBH_SUSPEND_STATE_ACTIVE;
+	dev->activity_us = usbh_data.time_curr_us;
+	dev->remote_wakeup = false;
+
+	dev->active_next = 0;
+	if (lld_data->active_last) {
+		lld_data->active_last->active_next = dev;
+	} else {
+		lld_data->active_first = dev;
+	}
+	lld_data->active_last = dev;
+	LOG_INFO("ATTACHED %d: tier %d, route %05X\n", dev->address, dev->tier, dev->route);
+}
+
+/**
+ * @brief usbh_get_free_device allocate and attach the device connected to the hub
+ * @param parent hub
+ * @param port port of the hub
  * Returns 0 on error
  * device otherwise
  */
-usbh_device_t *usbh_get_free_device(const usbh_device_t *dev)
+usbh_device_t *usbh_get_free_device(usbh_device_t *parent, uint8_t port)
 {
-	const usbh_low_level_driver_t *lld = dev->lld;
+	const usbh_low_level_driver_t *lld = parent->lld;
 	usbh_generic_data_t *lld_data = lld->driver_data;
 	usbh_device_t *usbh_device = lld_data->usbh_device;
 
 	uint8_t i;
-	LOG_PRINTF("DEV ADDRESS%d\n", dev->address);
+	LOG_PRINTF("DEV ADDRESS%d\n", parent->address);
+	if (parent->tier >= USBH_TIER_MAX) {
+		LOG_ERROR("TOO MANY TIERS\n");
+		return 0;
+	}
+
 	for (i = 0; i < USBH_MAX_DEVICES; i++) {
-		if (usbh_device[i].address < 0) {
+		// device with failed enumeration stays attached until disconnected
+		if (!usbh_device[i].tier) {
 			LOG_PRINTF("\t\t\t\t\tFOUND: %d", i);
 			usbh_device[i].address = i+1;
+			usbh_device[i].lld = parent->lld;
+			device_attach(&usbh_device[i], parent, port);
 			return &usbh_device[i];
-		} else {
-			LOG_PRINTF("address: %d\n\n\n", usbh_device[i].address);
 		}
 	}
 
@@ -292,10 +379,64 @@ usbh_device_t *usbh_get_free_device(const usbh_device_t *dev)
 static void device_enumeration_terminate(usbh_device_t *dev)
 {
 	reset_enumeration();
+	usbh_data.address_recovery_device = 0;
 	dev->state = 0;
 	dev->address = -1;
 }
 
+/**
+ * @brief usbh_device_detach remove the device and all devices connected to it
+ *
+ * Drivers are removed and their bus time is released.
+ * Called, when the device is disconnected from its port.
+ */
+void usbh_device_detach(usbh_device_t *dev)
+{
+	const usbh_low_level_driver_t *lld = dev->lld;
+	usbh_generic_data_t *lld_data = lld->driver_data;
+	usbh_device_t *prev = 0;
+	usbh_device_t *curr = lld_data->active_first;
+
+	if (!dev->tier) {
+		return;
+	}
+
+	// Hub precedes devices connected to it, so whole subtree
+	// is found in one pass: parent is already detached (tier == 0)
+	while (curr) {
+		usbh_device_t *next = curr->active_next;
+
+		if (curr == dev || (curr->parent && !curr->parent->tier)) {
+			LOG_INFO("DETACHED %d\n", curr->address);
+
+			// enumeration of this device is in progress
+			if (enumeration() && curr->state && curr->state < 9) {
+				device_enumeration_terminate(curr);
+			}
+			if (curr->drv && curr->drvdata) {
+				curr->drv->remove(curr->drvdata);
+			}
+			curr->drv = 0;
+			curr->drvdata = 0;
+			usbh_periodic_release(curr);
+			curr->address = -1;
+			curr->tier = 0;
+
+			if (prev) {
+				prev->active_next = next;
+			} else {
+				lld_data->active_first = next;
+			}
+			if (lld_data->active_last == curr) {
+				lld_data->active_last = prev;
+			}
+		} else {
+			prev = curr;
+		}
+		curr = next;
+	}
+}
+
 /* Do not call this function directly,
  *     only via callback passing into low-level function
  * If you must, call it carefully ;)
@@ -333,6 +474,13 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 			if (dev->address == 0) {
 				dev->address = usbh_data.address_temporary;
 				LOG_PRINTF("ADDR: %d\n", dev->address);
+
+				// let the device apply the address, enumeration continues from usbh_poll()
+				if (usbh_timing()->set_address_recovery_us) {
+					usbh_data.address_recovery_device = dev;
+					usbh_data.address_recovery_timestamp_us = usbh_data.time_curr_us;
+					break;
+				}
 			}
 
 			struct usb_setup_data setup_data;
@@ -543,12 +691,12 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 		break;
 
 	default:
-		LOG_PRINTF("Error: Unknown state "__FILE__"/%d\n", __LINE__);
+		LOG_ERROR("Error: Unknown state "__FILE__"/%d\n", __LINE__);
 		break;
 	}
 
 	if (state_start == dev->state) {
-		LOG_PRINTF("\n !HANG %d\n", state_start);
+		LOG_WARN("\n !HANG %d\n", state_start);
 	}
 }
 
@@ -557,6 +705,21 @@ void device_enumeration_start(usbh_device_t *dev)
 	set_enumeration();
 	dev->state = 1;
 
+	// Nearest high speed hub translates transactions of full/low speed device,
+	// hubs behind it are full speed
+	usbh_device_t *parent = dev->parent;
+	dev->tt_hub = 0;
+	dev->tt_port = 0;
+	if (parent && dev->speed != USBH_SPEED_HIGH) {
+		if (parent->speed == USBH_SPEED_HIGH) {
+			dev->tt_hub = parent;
+			dev->tt_port = dev->port;
+		} else {
+			dev->tt_hub = parent->tt_hub;
+			dev->tt_port = parent->tt_port;
+		}
+	}
+
 	// save address
 	uint8_t address = dev->address;
 	dev->address = 0;
@@ -569,7 +732,7 @@ void device_enumeration_start(usbh_device_t *dev)
 
 	usbh_data.address_temporary = address;
 
-	LOG_PRINTF("\n\n\n ENUMERATION OF DEVICE@%d STARTED \n\n", address);
+	LOG_INFO("\n\n\n ENUMERATION OF DEVICE@%d STARTED \n\n", address);
 
 	struct usb_setup_data setup_data;
 
@@ -583,6 +746,134 @@ void device_enumeration_start(usbh_device_t *dev)
 		device_enumerate, dev);
 }
 
+/**
+ * Suspend or resume the port, which the device is connected to
+ */
+static bool device_port_suspend(usbh_device_t *dev, bool suspend)
+{
+	const usbh_low_level_driver_t *lld = dev->lld;
+	usbh_device_t *hub = dev->parent;
+
+	if (hub) {
+		return hub->drv && hub->drvdata && hub->drv->port_suspend &&
+			hub->drv->port_suspend(hub->drvdata, dev->port, suspend);
+	}
+
+	if (lld->root_suspend) {
+		lld->root_suspend(lld->driver_data, suspend);
+		return true;
+	}
+	return false;
+}
+
+static void suspend_port(usbh_device_t *dev)
+{
+	if (device_port_suspend(dev, true)) {
+		LOG_INFO("SUSPENDED %d\n", dev->address);
+		dev->suspend_state = USBH_SUSPEND_STATE_SUSPENDED;
+	} else {
+		// try again after the timeout
+		dev->suspend_state = USBH_SUSPEND_STATE_ACTIVE;
+		dev->activity_us = usbh_data.time_curr_us;
+	}
+}
+
+static void suspend_event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	switch (dev->suspend_state) {
+	case USBH_SUSPEND_STATE_WAKEUP_SETUP:
+		if (cb_data.status == USBH_PACKET_CALLBACK_STATUS_OK) {
+			LOG_PRINTF("|empty packet read|");
+			dev->suspend_state = USBH_SUSPEND_STATE_WAKEUP_STATUS;
+			device_xfer_control_read(0, 0, suspend_event, dev);
+		} else {
+			// Device is still resumed, when it has data to send
+			ERROR(cb_data.status);
+			suspend_port(dev);
+		}
+		break;
+
+	case USBH_SUSPEND_STATE_WAKEUP_STATUS:
+		if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
+			ERROR(cb_data.status);
+		}
+		suspend_port(dev);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * Suspend the device, whose driver agreed, that it is idle
+ */
+static void device_suspend(usbh_device_t *dev)
+{
+	if (dev->remote_wakeup) {
+		struct usb_setup_data setup_data;
+
+		setup_data.bmRequestType = 0b00000000;
+		setup_data.bRequest = USB_REQ_SET_FEATURE;
+		setup_data.wValue = USB_FEAT_DEVICE_REMOTE_WAKEUP;
+		setup_data.wIndex = 0;
+		setup_data.wLength = 0;
+
+		dev->suspend_state = USBH_SUSPEND_STATE_WAKEUP_SETUP;
+		device_xfer_control_write_setup(&setup_data, sizeof(setup_data), suspend_event, dev);
+	} else {
+		suspend_port(dev);
+	}
+}
+
+static void suspend_check(usbh_device_t *dev)
+{
+	if (!usbh_data.suspend_timeout_us || !dev->drv || !dev->drv->suspend) {
+		return;
+	}
+
+	if (usbh_data.time_curr_us - dev->activity_us > usbh_data.suspend_timeout_us &&
+		dev->drv->suspend(dev->drvdata)) {
+		device_suspend(dev);
+	}
+}
+
+/**
+ * @brief usbh_device_activity mark meaningful data of the device
+ *
+ * Called by drivers, when data are received, or when the application
+ * has data for the device. Suspended device is resumed.
+ */
+void usbh_device_activity(usbh_device_t *dev)
+{
+	dev->activity_us = usbh_data.time_curr_us;
+	if (dev->suspend_state == USBH_SUSPEND_STATE_SUSPENDED) {
+		if (device_port_suspend(dev, false)) {
+			dev->suspend_state = USBH_SUSPEND_STATE_RESUMING;
+		}
+	}
+}
+
+/**
+ * @brief usbh_device_resumed resume signaling of the port has ended
+ *
+ * Called, when the resume requested by the host or by remote wakeup is complete.
+ * Driver is polled again after the resume recovery time.
+ */
+void usbh_device_resumed(usbh_device_t *dev)
+{
+	if (dev->suspend_state == USBH_SUSPEND_STATE_SUSPENDED ||
+		dev->suspend_state == USBH_SUSPEND_STATE_RESUMING) {
+		dev->suspend_state = USBH_SUSPEND_STATE_RECOVERY;
+		dev->activity_us = usbh_data.time_curr_us;
+	}
+}
+
+void usbh_suspend_timeout_set(uint32_t timeout_ms)
+{
+	usbh_data.suspend_timeout_us = timeout_ms * 1000;
+}
+
 /**
  * Should be called with at least 1kHz frequency
  *
@@ -590,6 +881,18 @@ void device_enumeration_start(usbh_device_t *dev)
 void usbh_poll(uint32_t time_curr_us)
 {
 	uint32_t k = 0;
+	usbh_data.time_curr_us = time_curr_us;
+	LOG_TIMESTAMP(time_curr_us);
+	LOG_TRACE_TIMESTAMP(time_curr_us);
+
+	if (usbh_data.address_recovery_device &&
+		time_curr_us - usbh_data.address_recovery_timestamp_us > usbh_timing()->set_address_recovery_us) {
+		usbh_device_t *dev = usbh_data.address_recovery_device;
+		const usbh_packet_callback_data_t cb_data = { USBH_PACKET_CALLBACK_STATUS_OK, 0 };
+
+		usbh_data.address_recovery_device = 0;
+		device_enumerate(dev, cb_data);
+	}
 	while (usbh_data.lld_drivers[k]) {
 		usbh_device_t * usbh_device =
 			((usbh_generic_data_t *)(usbh_data.lld_drivers[k]->driver_data))->usbh_device;
@@ -601,53 +904,196 @@ void usbh_poll(uint32_t time_curr_us)
 		switch (poll_status) {
 		case USBH_POLL_STATUS_DEVICE_CONNECTED:
 			// New device found
-			LOG_PRINTF("\nDEVICE FOUND\n");
+			LOG_INFO("\nDEVICE FOUND\n");
 			usbh_device[0].lld = usbh_data.lld_drivers[k];
 			usbh_device[0].speed = usbh_data.lld_drivers[k]->root_speed(lld_data);
 			usbh_device[0].address = 1;
+			device_attach(&usbh_device[0], 0, 0);
 
 			device_enumeration_start(&usbh_device[0]);
 			break;
 
 		case USBH_POLL_STATUS_DEVICE_DISCONNECTED:
 			{
-				// Device disconnected
-				if (usbh_device[0].drv && usbh_device[0].drvdata) {
-					usbh_device[0].drv->remove(usbh_device[0].drvdata);
-				}
-				usbh_device[0].drv = 0;
-				usbh_device[0].drvdata = 0;
-
-				uint32_t i;
-				for (i = 1; i < USBH_MAX_DEVICES; i++) {
-					usbh_device[i].address = -1;
-					usbh_device[i].drv = 0;
-					usbh_device[i].drvdata = 0;
-				}
+				// Device disconnected, together with devices connected to it
+				usbh_data.address_recovery_device = 0;
+				usbh_device_detach(&usbh_device[0]);
+				usbh_periodic_reset(usbh_data.lld_drivers[k]);
 			}
 			break;
 
+		case USBH_POLL_STATUS_DEVICE_RESUMED:
+			usbh_device_resumed(&usbh_device[0]);
+			break;
+
 		default:
 			break;
 		}
 
-		if (lld_data->usbh_device[0].drv && usbh_device[0].drvdata) {
-			usbh_device[0].drv->poll(usbh_device[0].drvdata, time_curr_us);
+		// Attached devices are polled directly, not through their hubs,
+		// suspended devices are not polled
+		usbh_device_t *dev = lld_data->active_first;
+		while (dev) {
+			if (dev->drv && dev->drvdata) {
+				switch (dev->suspend_state) {
+				case USBH_SUSPEND_STATE_ACTIVE:
+					// idle device is suspended before its driver starts next transfer
+					suspend_check(dev);
+					if (dev->suspend_state == USBH_SUSPEND_STATE_ACTIVE) {
+						dev->drv->poll(dev->drvdata, time_curr_us);
+					}
+					break;
+
+				case USBH_SUSPEND_STATE_RECOVERY:
+					if (time_curr_us - dev->activity_us > usbh_timing()->resume_recovery_us) {
+						LOG_INFO("RESUMED %d\n", dev->address);
+						dev->suspend_state = USBH_SUSPEND_STATE_ACTIVE;
+						dev->activity_us = time_curr_us;
+					}
+					break;
+
+				default:
+					break;
+				}
+			}
+			dev = dev->active_next;
 		}
 
 		k++;
 	}
 }
 
+/**
+ * @brief usbh_time_us time of the current usbh_poll() call
+ *
+ * Transfers are completed inside usbh_poll(), so this can be used
+ * as a timestamp of transfer completion in packet callbacks
+ */
+uint32_t usbh_time_us(void)
+{
+	return usbh_data.time_curr_us;
+}
+
+void usbh_timing_set(const usbh_timing_t *timing)
+{
+	usbh_data.timing = timing;
+}
+
+/**
+ * @brief usbh_timing delays selected by the application
+ */
+const usbh_timing_t *usbh_timing(void)
+{
+	if (!usbh_data.timing) {
+		return &usbh_timing_spec;
+	}
+	return usbh_data.timing;
+}
+
+/**
+ * Transactions of full/low speed device behind high speed hub are split
+ * by the hub's transaction translator. Only control and bulk transactions
+ * are split, periodic transfer is refused with USBH_PACKET_CALLBACK_STATUS_EFATAL
+ * @see usbh_periodic_open()
+ * @returns true when the transfer can be started
+ */
+static bool packet_split_setup(const usbh_device_t *dev, usbh_packet_t *packet)
+{
+	if (!dev->tt_hub) {
+		packet->split_hub_address = 0;
+		packet->split_port = 0;
+		return true;
+	}
+
+	if (packet->endpoint_type == USBH_ENDPOINT_TYPE_INTERRUPT ||
+		packet->endpoint_type == USBH_ENDPOINT_TYPE_ISOCHRONOUS) {
+		LOG_WARN("PERIODIC TRANSFER REFUSED, DEVICE %d BEHIND TT\n", dev->address);
+		usbh_packet_callback_data_t cb_data;
+		cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
+		cb_data.transferred_length = 0;
+		packet->callback(packet->callback_arg, cb_data);
+		return false;
+	}
+
+	packet->split_hub_address = dev->tt_hub->address;
+	packet->split_port = dev->tt_port;
+	return true;
+}
+
+/**
+ * Transfer cannot be sent to the device, that is suspended or resuming.
+ * Suspended device is resumed and the transfer is refused with
+ * USBH_PACKET_CALLBACK_STATUS_EAGAIN, driver retries it from its poll,
+ * which is called again when the resume is complete.
+ * @returns true when the transfer can be started
+ */
+static bool device_awake(usbh_device_t *dev, const usbh_packet_t *packet)
+{
+	switch (dev->suspend_state) {
+	case USBH_SUSPEND_STATE_SUSPENDED:
+		usbh_device_activity(dev);
+		break;
+
+	case USBH_SUSPEND_STATE_RESUMING:
+	case USBH_SUSPEND_STATE_RECOVERY:
+		break;
+
+	default:
+		return true;
+	}
+
+	LOG_PRINTF("TRANSFER REFUSED, DEVICE %d SUSPENDED\n", dev->address);
+	usbh_packet_callback_data_t cb_data;
+	cb_data.status = USBH_PACKET_CALLBACK_STATUS_EAGAIN;
+	cb_data.transferred_length = 0;
+	packet->callback(packet->callback_arg, cb_data);
+	return false;
+}
+
 void usbh_read(usbh_device_t *dev, usbh_packet_t *packet)
 {
 	const usbh_low_level_driver_t *lld = dev->lld;
+	if (!device_awake(dev, packet)) {
+		return;
+	}
+	packet->nak_eagain = false;
+	if (!packet_split_setup(dev, packet)) {
+		return;
+	}
+	lld->read(lld->driver_data, packet);
+}
+
+/**
+ * @brief usbh_read_once read with a single attempt
+ *
+ * When the device has no data (NAK), the callback is called with
+ * USBH_PACKET_CALLBACK_STATUS_EAGAIN and the channel is released,
+ * so endpoints with rare data do not occupy the bus between polls.
+ */
+void usbh_read_once(usbh_device_t *dev, usbh_packet_t *packet)
+{
+	const usbh_low_level_driver_t *lld = dev->lld;
+	if (!device_awake(dev, packet)) {
+		return;
+	}
+	packet->nak_eagain = true;
+	if (!packet_split_setup(dev, packet)) {
+		return;
+	}
 	lld->read(lld->driver_data, packet);
 }
 
 void usbh_write(usbh_device_t *dev, const usbh_packet_t *packet)
 {
 	const usbh_low_level_driver_t *lld = dev->lld;
-	lld->write(lld->driver_data, packet);
+	if (!device_awake(dev, packet)) {
+		return;
+	}
+	// packet of the caller is not modified, low-level driver copies the packet
+	usbh_packet_t split_packet = *packet;
+	if (!packet_split_setup(dev, &split_packet)) {
+		return;
+	}
+	lld->write(lld->driver_data, &split_packet);
 }
 
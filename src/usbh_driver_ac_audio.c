@@ -0,0 +1,791 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "driver/usbh_device_driver.h"
+#include "usbh_driver_ac_audio.h"
+#include "usbh_ring.h"
+#include "usart_helpers.h"
+
+#include <string.h>
+#include <libopencm3/usb/audio.h>
+#include <libopencm3/usb/usbstd.h>
+
+#define LOG_MODULE AUDIO
+
+// Class specific descriptor subtypes (Audio 1.0)
+#define AS_GENERAL		(0x01)
+#define FORMAT_TYPE		(0x02)
+#define EP_GENERAL		(0x01)
+
+#define FORMAT_TAG_PCM		(0x0001)
+#define FORMAT_TYPE_I		(0x01)
+
+#define AUDIO_REQ_SET_CUR	(0x01)
+#define SAMPLING_FREQ_CONTROL	(0x01)
+
+// bmAttributes of the standard isochronous endpoint
+#define ISO_SYNC_ASYNC		(0x04)
+#define ISO_USAGE_FEEDBACK	(0x10)
+
+enum STATES {
+	STATE_INACTIVE,
+	STATE_SET_CONFIGURATION_REQUEST,
+	STATE_SET_CONFIGURATION_EMPTY_READ,
+	STATE_SET_CONFIGURATION_COMPLETE,
+	STATE_SET_INTERFACE_REQUEST,
+	STATE_SET_INTERFACE_EMPTY_READ,
+	STATE_SET_INTERFACE_COMPLETE,
+	STATE_SET_SAMPLING_FREQ_DATA,
+	STATE_SET_SAMPLING_FREQ_EMPTY_READ,
+	STATE_SET_SAMPLING_FREQ_COMPLETE,
+	STATE_STREAMING,
+
+	// device failed, slot stays assigned to it until it is removed
+	STATE_ERROR
+};
+
+struct _audio_stream {
+	usbh_ring_t ring;
+	uint8_t ring_data[USBH_AC_AUDIO_RING];
+
+	// While one buffer is on the bus, the other one is prepared
+	uint8_t buffer[2][USBH_AC_AUDIO_BUFFER];
+	uint16_t buffer_len[2];
+	uint8_t buffer_index;
+
+	audio_stats_t stats;
+
+	// fractional part of samples per frame (16.16)
+	uint32_t rate_remainder;
+
+	uint16_t endpoint_maxpacketsize;
+	uint8_t endpoint_address;
+	uint8_t interface_number;
+	uint8_t alternate_setting;
+	uint8_t frame_bytes;
+	uint8_t toggle;
+	bool sampling_freq_control;
+	bool busy;
+	bool active;
+
+	// asynchronous playback endpoint only
+	uint8_t feedback_buffer[4];
+	uint16_t feedback_maxpacketsize;
+	uint8_t feedback_address;
+	uint8_t feedback_toggle;
+	bool feedback_busy;
+};
+typedef struct _audio_stream audio_stream_t;
+
+struct _audio_device {
+	usbh_device_t *usbh_device;
+	audio_stream_t stream[USBH_AUDIO_STREAM_COUNT];
+	uint8_t control_buffer[4];
+	enum STATES state_next;
+	uint8_t device_id;
+	uint8_t configuration_value;
+	uint8_t setup_stream;
+
+	// descriptor parsing
+	audio_stream_t *stream_last;
+	// bytes of the configuration descriptor not analyzed yet
+	uint16_t descriptors_left;
+	uint8_t interface_number;
+	uint8_t alternate_setting;
+	bool interface_streaming;
+	bool format_match;
+};
+typedef struct _audio_device audio_device_t;
+
+static audio_device_t audio_device[USBH_AC_AUDIO_MAX_DEVICES];
+static const audio_config_t *audio_config = 0;
+static bool initialized = false;
+
+void audio_driver_init(const audio_config_t *config)
+{
+	uint32_t i;
+	if (!config) {
+		return;
+	}
+	audio_config = config;
+	for (i = 0; i < USBH_AC_AUDIO_MAX_DEVICES; i++) {
+		audio_device[i].state_next = STATE_INACTIVE;
+	}
+	initialized = true;
+}
+
+/**
+ * Nominal count of samples per frame, 16.16
+ */
+static uint32_t nominal_rate(void)
+{
+	return audio_config->format.sample_rate * 8192 / 125;
+}
+
+static void *init(void *usbh_dev)
+{
+	if (!initialized) {
+		LOG_ERROR("\n%s/%d : driver not initialized\n", __FILE__, __LINE__);
+		return 0;
+	}
+
+	uint32_t i;
+	audio_device_t *drvdata = 0;
+
+	// find free data space for audio device
+	for (i = 0; i < USBH_AC_AUDIO_MAX_DEVICES; i++) {
+		if (audio_device[i].state_next == STATE_INACTIVE) {
+			uint32_t k;
+			drvdata = &audio_device[i];
+			drvdata->device_id = i;
+			drvdata->usbh_device = (usbh_device_t *)usbh_dev;
+			drvdata->stream_last = 0;
+			drvdata->descriptors_left = 0;
+			drvdata->interface_streaming = false;
+			drvdata->format_match = false;
+			for (k = 0; k < USBH_AUDIO_STREAM_COUNT; k++) {
+				audio_stream_t *stream = &drvdata->stream[k];
+				stream->active = false;
+				stream->busy = false;
+				stream->feedback_busy = false;
+				stream->feedback_address = 0;
+				stream->sampling_freq_control = false;
+			}
+			break;
+		}
+	}
+
+	return drvdata;
+}
+
+/**
+ * Check the Type I format descriptor against the requested format
+ */
+static bool format_matches(const uint8_t *desc)
+{
+	const audio_format_t *format = &audio_config->format;
+	const uint8_t length = desc[0];
+
+	if (desc[3] != FORMAT_TYPE_I ||
+		desc[4] != format->channels ||
+		desc[5] != format->subframe_size ||
+		desc[6] != format->bit_resolution) {
+		return false;
+	}
+
+	const uint8_t freq_type = desc[7];
+	uint8_t i;
+	if (freq_type == 0) {
+		// continuous range
+		if (length < 14) {
+			return false;
+		}
+		const uint32_t lower = desc[8] | (desc[9] << 8) | (desc[10] << 16);
+		const uint32_t upper = desc[11] | (desc[12] << 8) | (desc[13] << 16);
+		return (format->sample_rate >= lower) && (format->sample_rate <= upper);
+	}
+
+	for (i = 0; i < freq_type && (8 + 3*i + 2) < length; i++) {
+		const uint8_t *freq = &desc[8 + 3*i];
+		if ((uint32_t)(freq[0] | (freq[1] << 8) | (freq[2] << 16)) == format->sample_rate) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void analyze_endpoint(audio_device_t *audio, const struct usb_endpoint_descriptor *ep)
+{
+	const uint8_t *desc = (const uint8_t *)ep;
+	const uint8_t epaddr = ep->bEndpointAddress;
+
+	if ((ep->bmAttributes & 0x03) != USB_ENDPOINT_ATTR_ISOCHRONOUS) {
+		return;
+	}
+
+	// Feedback endpoint of the previously found playback stream
+	if ((ep->bmAttributes & 0x30) == ISO_USAGE_FEEDBACK) {
+		audio_stream_t *stream = audio->stream_last;
+		if (stream && stream->feedback_address == epaddr && !stream->feedback_maxpacketsize) {
+			if (usbh_periodic_open(audio->usbh_device, epaddr)) {
+				stream->feedback_maxpacketsize = ep->wMaxPacketSize;
+			} else {
+				stream->feedback_address = 0;
+			}
+		}
+		return;
+	}
+
+	if (!audio->format_match) {
+		return;
+	}
+
+	audio_stream_t *stream;
+	if (epaddr & 0x80) {
+		stream = &audio->stream[USBH_AUDIO_STREAM_CAPTURE];
+	} else {
+		stream = &audio->stream[USBH_AUDIO_STREAM_PLAYBACK];
+	}
+
+	// first matching alternate setting wins
+	if (stream->active) {
+		audio->stream_last = 0;
+		return;
+	}
+
+	if (ep->wMaxPacketSize > USBH_AC_AUDIO_BUFFER) {
+		LOG_WARN("AUDIO: INCREASE USBH_AC_AUDIO_BUFFER to %d\n", ep->wMaxPacketSize);
+		return;
+	}
+
+	if (!usbh_periodic_open(audio->usbh_device, epaddr)) {
+		return;
+	}
+
+	stream->endpoint_address = epaddr;
+	stream->endpoint_maxpacketsize = ep->wMaxPacketSize;
+	stream->interface_number = audio->interface_number;
+	stream->alternate_setting = audio->alternate_setting;
+	stream->frame_bytes = audio_config->format.channels * audio_config->format.subframe_size;
+	stream->feedback_maxpacketsize = 0;
+	stream->feedback_address = 0;
+	if (!(epaddr & 0x80) && ((ep->bmAttributes & 0x0c) == ISO_SYNC_ASYNC) && desc[0] >= 9) {
+		// bSynchAddress of the audio class endpoint descriptor
+		stream->feedback_address = desc[8] | 0x80;
+	}
+	stream->active = true;
+	audio->stream_last = stream;
+
+	LOG_PRINTF("AUDIO: stream %02X iface %d alt %d\n", epaddr, stream->interface_number, stream->alternate_setting);
+}
+
+/**
+ * Returns true if all needed data are parsed
+ */
+static bool analyze_descriptor(void *drvdata, void *descriptor)
+{
+	audio_device_t *audio = (audio_device_t *)drvdata;
+	const uint8_t *desc = (const uint8_t *)descriptor;
+	const uint8_t desc_type = desc[1];
+
+	if (audio->descriptors_left >= desc[0]) {
+		audio->descriptors_left -= desc[0];
+	} else {
+		audio->descriptors_left = 0;
+	}
+
+	switch (desc_type) {
+	case USB_DT_CONFIGURATION:
+		{
+			struct usb_config_descriptor *cfg = (struct usb_config_descriptor*)descriptor;
+			audio->configuration_value = cfg->bConfigurationValue;
+			audio->descriptors_left = cfg->wTotalLength;
+		}
+		break;
+
+	case USB_DT_INTERFACE:
+		{
+			struct usb_interface_descriptor *iface = (struct usb_interface_descriptor *)descriptor;
+			audio->interface_number = iface->bInterfaceNumber;
+			audio->alternate_setting = iface->bAlternateSetting;
+			audio->interface_streaming = (iface->bInterfaceClass == USB_CLASS_AUDIO) &&
+				(iface->bInterfaceSubClass == USB_AUDIO_SUBCLASS_AUDIOSTREAMING);
+			audio->format_match = false;
+			audio->stream_last = 0;
+		}
+		break;
+
+	case USB_AUDIO_DT_CS_INTERFACE:
+		if (audio->interface_streaming) {
+			if (desc[2] == AS_GENERAL) {
+				// wFormatTag must be PCM, format type is checked afterwards
+				audio->format_match = ((desc[5] | (desc[6] << 8)) == FORMAT_TAG_PCM);
+			} else if (desc[2] == FORMAT_TYPE && audio->format_match) {
+				audio->format_match = format_matches(desc);
+			}
+		}
+		break;
+
+	case USB_DT_ENDPOINT:
+		if (audio->interface_streaming && audio->alternate_setting) {
+			analyze_endpoint(audio, (const struct usb_endpoint_descriptor *)descriptor);
+		}
+		break;
+
+	case USB_AUDIO_DT_CS_ENDPOINT:
+		if (audio->stream_last && desc[2] == EP_GENERAL) {
+			audio->stream_last->sampling_freq_control = desc[3] & SAMPLING_FREQ_CONTROL;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	if (audio->stream[USBH_AUDIO_STREAM_PLAYBACK].active ||
+		audio->stream[USBH_AUDIO_STREAM_CAPTURE].active) {
+		audio->state_next = STATE_SET_CONFIGURATION_REQUEST;
+
+		// Both directions are found, no more descriptors are needed
+		if (audio->stream[USBH_AUDIO_STREAM_PLAYBACK].active &&
+			audio->stream[USBH_AUDIO_STREAM_CAPTURE].active &&
+			!audio->stream_last) {
+			return true;
+		}
+
+		// Device with only one direction, the whole configuration is parsed
+		if (!audio->descriptors_left) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void stream_start(audio_stream_t *stream)
+{
+	usbh_ring_init(&stream->ring, stream->ring_data, USBH_AC_AUDIO_RING);
+	memset(&stream->stats, 0, sizeof(stream->stats));
+	stream->stats.rate = nominal_rate();
+	stream->rate_remainder = 0;
+	stream->buffer_index = 0;
+	stream->buffer_len[0] = 0;
+	stream->buffer_len[1] = 0;
+	stream->busy = false;
+	stream->feedback_busy = false;
+}
+
+/**
+ * Fill next playback packet from the sample ring
+ *
+ * Size of the packet follows the rate reported by feedback endpoint
+ * (or nominal rate), silence is inserted when the ring runs empty.
+ */
+static void playback_prepare(audio_stream_t *stream, uint8_t index)
+{
+	const uint32_t samples_fixed = stream->rate_remainder + stream->stats.rate;
+	uint32_t length = (samples_fixed >> 16) * stream->frame_bytes;
+	stream->rate_remainder = samples_fixed & 0xffff;
+
+	if (length > stream->endpoint_maxpacketsize) {
+		length = stream->endpoint_maxpacketsize - (stream->endpoint_maxpacketsize % stream->frame_bytes);
+	}
+
+	const uint32_t length_read = usbh_ring_read(&stream->ring, stream->buffer[index], length);
+	if (length_read < length) {
+		stream->stats.underruns++;
+		memset(&stream->buffer[index][length_read], 0, length - length_read);
+	}
+	stream->buffer_len[index] = length;
+}
+
+static void playback_callback(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	audio_device_t *audio = (audio_device_t *)dev->drvdata;
+	audio_stream_t *stream = &audio->stream[USBH_AUDIO_STREAM_PLAYBACK];
+
+	switch (cb_data.status) {
+	case USBH_PACKET_CALLBACK_STATUS_OK:
+		stream->stats.packets++;
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+		stream->stats.missed_frames++;
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+	case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+		ERROR(cb_data.status);
+		break;
+	}
+
+	// Sent buffer becomes free, prepare it while the other one is sent
+	const uint8_t index = stream->buffer_index;
+	stream->buffer_index ^= 1;
+	playback_prepare(stream, index);
+	stream->busy = false;
+}
+
+static void capture_callback(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	audio_device_t *audio = (audio_device_t *)dev->drvdata;
+	audio_stream_t *stream = &audio->stream[USBH_AUDIO_STREAM_CAPTURE];
+	const uint8_t index = stream->buffer_index;
+
+	switch (cb_data.status) {
+	case USBH_PACKET_CALLBACK_STATUS_OK:
+	case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+		{
+			const uint32_t length = cb_data.transferred_length;
+			stream->stats.packets++;
+			stream->buffer_len[index] = length;
+			stream->buffer_index ^= 1;
+			if (usbh_ring_write(&stream->ring, stream->buffer[index], length) < length) {
+				stream->stats.overruns++;
+			}
+		}
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+		stream->stats.missed_frames++;
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+		ERROR(cb_data.status);
+		break;
+	}
+	stream->busy = false;
+}
+
+static void feedback_callback(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	audio_device_t *audio = (audio_device_t *)dev->drvdata;
+	audio_stream_t *stream = &audio->stream[USBH_AUDIO_STREAM_PLAYBACK];
+	const uint8_t *fb = stream->feedback_buffer;
+
+	switch (cb_data.status) {
+	case USBH_PACKET_CALLBACK_STATUS_OK:
+	case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+		{
+			uint32_t rate;
+			if (dev->speed != USBH_SPEED_HIGH && cb_data.transferred_length >= 3) {
+				// full speed: 10.14 samples per frame
+				rate = (fb[0] | (fb[1] << 8) | (fb[2] << 16)) << 2;
+			} else if (dev->speed == USBH_SPEED_HIGH && cb_data.transferred_length == 4) {
+				// high speed: 16.16 samples per microframe, packets are sent once per frame
+				rate = (fb[0] | (fb[1] << 8) | (fb[2] << 16) | ((uint32_t)fb[3] << 24)) * 8;
+			} else {
+				break;
+			}
+
+			// Accept only values within +-1/8 of the nominal rate
+			const uint32_t nominal = nominal_rate();
+			if (rate > nominal - nominal / 8 && rate < nominal + nominal / 8) {
+				stream->stats.rate = rate;
+			}
+		}
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+	case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+		break;
+	}
+	stream->feedback_busy = false;
+}
+
+static void stream_transfer(audio_device_t *audio, uint8_t endpoint_address, void *data, uint16_t datalen, uint16_t maxpacketsize,
+	uint8_t *toggle, usbh_packet_callback_t callback)
+{
+	usbh_packet_t packet;
+
+	packet.address = audio->usbh_device->address;
+	packet.data = data;
+	packet.datalen = datalen;
+	packet.endpoint_address = endpoint_address & 0x7f;
+	packet.endpoint_size_max = maxpacketsize;
+	packet.endpoint_type = USBH_ENDPOINT_TYPE_ISOCHRONOUS;
+	packet.speed = audio->usbh_device->speed;
+	packet.callback = callback;
+	packet.callback_arg = audio->usbh_device;
+	packet.toggle = toggle;
+
+	if (endpoint_address & 0x80) {
+		usbh_read(audio->usbh_device, &packet);
+	} else {
+		usbh_write(audio->usbh_device, &packet);
+	}
+}
+
+static void stream_poll(audio_device_t *audio)
+{
+	usbh_device_t *dev = audio->usbh_device;
+	audio_stream_t *stream = &audio->stream[USBH_AUDIO_STREAM_PLAYBACK];
+
+	if (stream->active) {
+		if (!stream->busy && usbh_periodic_due(dev, stream->endpoint_address)) {
+			const uint8_t index = stream->buffer_index;
+			stream->busy = true;
+			stream_transfer(audio, stream->endpoint_address,
+				stream->buffer[index], stream->buffer_len[index],
+				stream->endpoint_maxpacketsize, &stream->toggle, playback_callback);
+		}
+
+		if (stream->feedback_maxpacketsize && !stream->feedback_busy &&
+			usbh_periodic_due(dev, stream->feedback_address)) {
+			stream->feedback_busy = true;
+			stream_transfer(audio, stream->feedback_address,
+				stream->feedback_buffer, stream->feedback_maxpacketsize,
+				stream->feedback_maxpacketsize, &stream->feedback_toggle, feedback_callback);
+		}
+	}
+
+	stream = &audio->stream[USBH_AUDIO_STREAM_CAPTURE];
+	if (stream->active) {
+		if (!stream->busy && usbh_periodic_due(dev, stream->endpoint_address)) {
+			stream->busy = true;
+			stream_transfer(audio, stream->endpoint_address,
+				stream->buffer[stream->buffer_index], stream->endpoint_maxpacketsize,
+				stream->endpoint_maxpacketsize, &stream->toggle, capture_callback);
+		}
+	}
+}
+
+/**
+ * Find the stream, that should be set up next
+ * @returns false when all streams are set up
+ */
+static bool setup_stream_next(audio_device_t *audio)
+{
+	while (audio->setup_stream < USBH_AUDIO_STREAM_COUNT) {
+		if (audio->stream[audio->setup_stream].active) {
+			return true;
+		}
+		audio->setup_stream++;
+	}
+	return false;
+}
+
+static void streaming_start(audio_device_t *audio)
+{
+	uint8_t streams = 0;
+	uint8_t i;
+
+	for (i = 0; i < USBH_AUDIO_STREAM_COUNT; i++) {
+		if (audio->stream[i].active) {
+			stream_start(&audio->stream[i]);
+			streams |= 1 << i;
+		}
+	}
+
+	if (streams & (1 << USBH_AUDIO_STREAM_PLAYBACK)) {
+		audio_stream_t *stream = &audio->stream[USBH_AUDIO_STREAM_PLAYBACK];
+		// Callback refills the buffer just sent, so both have to be ready
+		// before the first transfer
+		playback_prepare(stream, 0);
+		playback_prepare(stream, 1);
+	}
+
+	audio->state_next = STATE_STREAMING;
+	LOG_INFO("\nAUDIO CONFIGURED\n");
+	if (audio_config->notify_connected) {
+		audio_config->notify_connected(audio->device_id, streams);
+	}
+}
+
+static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	audio_device_t *audio = (audio_device_t *)dev->drvdata;
+
+	if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
+		ERROR(cb_data.status);
+		audio->state_next = STATE_ERROR;
+		return;
+	}
+
+	switch (audio->state_next) {
+	case STATE_SET_CONFIGURATION_EMPTY_READ:
+	case STATE_SET_INTERFACE_EMPTY_READ:
+	case STATE_SET_SAMPLING_FREQ_EMPTY_READ:
+		LOG_PRINTF("|empty packet read|");
+		audio->state_next++;
+		device_xfer_control_read(0, 0, event, dev);
+		break;
+
+	case STATE_SET_CONFIGURATION_COMPLETE:
+		audio->setup_stream = 0;
+		audio->state_next = STATE_SET_INTERFACE_REQUEST;
+		break;
+
+	case STATE_SET_INTERFACE_COMPLETE:
+		{
+			audio_stream_t *stream = &audio->stream[audio->setup_stream];
+			if (stream->sampling_freq_control) {
+				struct usb_setup_data setup_data;
+				const uint32_t rate = audio_config->format.sample_rate;
+
+				audio->control_buffer[0] = rate;
+				audio->control_buffer[1] = rate >> 8;
+				audio->control_buffer[2] = rate >> 16;
+
+				setup_data.bmRequestType = 0b00100010;
+				setup_data.bRequest = AUDIO_REQ_SET_CUR;
+				setup_data.wValue = SAMPLING_FREQ_CONTROL << 8;
+				setup_data.wIndex = stream->endpoint_address;
+				setup_data.wLength = 3;
+
+				audio->state_next = STATE_SET_SAMPLING_FREQ_DATA;
+				device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+			} else {
+				audio->setup_stream++;
+				audio->state_next = STATE_SET_INTERFACE_REQUEST;
+			}
+		}
+		break;
+
+	case STATE_SET_SAMPLING_FREQ_DATA:
+		audio->state_next = STATE_SET_SAMPLING_FREQ_EMPTY_READ;
+		device_xfer_control_write_data(audio->control_buffer, 3, event, dev);
+		break;
+
+	case STATE_SET_SAMPLING_FREQ_COMPLETE:
+		audio->setup_stream++;
+		audio->state_next = STATE_SET_INTERFACE_REQUEST;
+		break;
+
+	default:
+		LOG_WARN("AUDIO: unexpected event %d\n", audio->state_next);
+		break;
+	}
+}
+
+/**
+ * @param time_curr_us - monotically rising time
+ *		unit is microseconds
+ * @see usbh_poll()
+ */
+static void poll(void *drvdata, uint32_t time_curr_us)
+{
+	(void)time_curr_us;
+
+	audio_device_t *audio = (audio_device_t *)drvdata;
+	usbh_device_t *dev = audio->usbh_device;
+
+	switch (audio->state_next) {
+	case STATE_STREAMING:
+		stream_poll(audio);
+		break;
+
+	case STATE_SET_CONFIGURATION_REQUEST:
+		{
+			struct usb_setup_data setup_data;
+
+			setup_data.bmRequestType = 0b00000000;
+			setup_data.bRequest = USB_REQ_SET_CONFIGURATION;
+			setup_data.wValue = audio->configuration_value;
+			setup_data.wIndex = 0;
+			setup_data.wLength = 0;
+
+			audio->state_next = STATE_SET_CONFIGURATION_EMPTY_READ;
+
+			device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+		}
+		break;
+
+	case STATE_SET_INTERFACE_REQUEST:
+		if (setup_stream_next(audio)) {
+			audio_stream_t *stream = &audio->stream[audio->setup_stream];
+			struct usb_setup_data setup_data;
+
+			setup_data.bmRequestType = 0b00000001;
+			setup_data.bRequest = USB_REQ_SET_INTERFACE;
+			setup_data.wValue = stream->alternate_setting;
+			setup_data.wIndex = stream->interface_number;
+			setup_data.wLength = 0;
+
+			audio->state_next = STATE_SET_INTERFACE_EMPTY_READ;
+
+			device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+		} else {
+			streaming_start(audio);
+		}
+		break;
+
+	default:
+		// do nothing - probably transfer is in progress
+		break;
+	}
+}
+
+static void remove(void *drvdata)
+{
+	LOG_INFO("Removing audio\n");
+
+	audio_device_t *audio = (audio_device_t *)drvdata;
+	uint8_t i;
+
+	if (audio->state_next == STATE_STREAMING && audio_config->notify_disconnected) {
+		audio_config->notify_disconnected(audio->device_id);
+	}
+	audio->state_next = STATE_INACTIVE;
+	for (i = 0; i < USBH_AUDIO_STREAM_COUNT; i++) {
+		audio->stream[i].active = false;
+	}
+}
+
+static audio_stream_t *stream_get(uint8_t device_id, enum USBH_AUDIO_STREAM stream)
+{
+	if (device_id >= USBH_AC_AUDIO_MAX_DEVICES || stream >= USBH_AUDIO_STREAM_COUNT) {
+		return 0;
+	}
+
+	audio_device_t *audio = &audio_device[device_id];
+	if (audio->state_next != STATE_STREAMING || !audio->stream[stream].active) {
+		return 0;
+	}
+	return &audio->stream[stream];
+}
+
+uint32_t usbh_audio_write(uint8_t device_id, const void *data, uint32_t length)
+{
+	audio_stream_t *stream = stream_get(device_id, USBH_AUDIO_STREAM_PLAYBACK);
+	if (!stream) {
+		return 0;
+	}
+	return usbh_ring_write(&stream->ring, data, length);
+}
+
+uint32_t usbh_audio_read(uint8_t device_id, void *data, uint32_t length)
+{
+	audio_stream_t *stream = stream_get(device_id, USBH_AUDIO_STREAM_CAPTURE);
+	if (!stream) {
+		return 0;
+	}
+	return usbh_ring_read(&stream->ring, data, length);
+}
+
+bool usbh_audio_get_stats(uint8_t device_id, enum USBH_AUDIO_STREAM stream_id, audio_stats_t *stats)
+{
+	audio_stream_t *stream = stream_get(device_id, stream_id);
+	if (!stream) {
+		return false;
+	}
+	*stats = stream->stats;
+	return true;
+}
+
+static const usbh_dev_driver_info_t driver_info = {
+	.deviceClass = -1,
+	.deviceSubClass = -1,
+	.deviceProtocol = -1,
+	.idVendor = -1,
+	.idProduct = -1,
+	.ifaceClass = 0x01,
+	.ifaceSubClass = 0x02,
+	.ifaceProtocol = -1
+};
+
+const usbh_dev_driver_t usbh_audio_driver = {
+	.init = init,
+	.analyze_descriptor = analyze_descriptor,
+	.poll = poll,
+	.remove = remove,
+	.info = &driver_info
+};
@@ -24,15 +24,23 @@
 #include "usbh_driver_ac_midi_private.h"
 #include "usart_helpers.h"
 
+#include <string.h>
 #include <libopencm3/usb/midi.h>
 #include <libopencm3/usb/audio.h>
 #include <libopencm3/usb/usbstd.h>
 
+#define LOG_MODULE MIDI
+
+
+#define MIDI_SUBCLASS_STREAMING	(0x03)
+#define MIDI_JACK_EXTERNAL	(0x02)
 
 static void *midi_init(void *usbh_dev);
 static bool midi_analyze_descriptor(void *drvdata, void *descriptor);
 static void midi_poll(void *drvdata, uint32_t tflp);
 static void midi_remove(void *drvdata);
+static bool midi_suspend(void *drvdata);
+static void read_midi_in(void *drvdata, const uint8_t nextstate);
 
 static midi_device_t midi_device[USBH_AC_MIDI_MAX_DEVICES];
 static const midi_config_t *midi_config = 0;
@@ -54,6 +62,7 @@ const usbh_dev_driver_t usbh_midi_driver = {
 	.analyze_descriptor = midi_analyze_descriptor,
 	.poll = midi_poll,
 	.remove = midi_remove,
+	.suspend = midi_suspend,
 	.info = &usbh_midi_driver_info
 };
 
@@ -73,7 +82,7 @@ void midi_driver_init(const midi_config_t *config)
 static void *midi_init(void *usbh_dev)
 {
 	if (!midi_config || !initialized) {
-		LOG_PRINTF("\n%s/%d : driver not initialized\n", __FILE__, __LINE__);
+		LOG_ERROR("\n%s/%d : driver not initialized\n", __FILE__, __LINE__);
 		return 0;
 	}
 	uint32_t i;
@@ -91,6 +100,18 @@ static void *midi_init(void *usbh_dev)
 			drvdata->usbh_device = usbh_dev;
 			drvdata->write_callback_user = 0;
 			drvdata->sending = false;
+			drvdata->out_sent = 0;
+			drvdata->jack_count = 0;
+			drvdata->in_cables = 0;
+			drvdata->out_cables = 0;
+			drvdata->interface_subclass = 0;
+			drvdata->endpoint_last = 0;
+			drvdata->endpoint_jacks_parsed = 0;
+			memset(drvdata->sysex, 0, sizeof(drvdata->sysex));
+			usbh_ring_init(&drvdata->out_ring, drvdata->out_ring_data, USBH_AC_MIDI_OUT_RING);
+#if USBH_AC_MIDI_IN_RING
+			usbh_ring_init(&drvdata->in_ring, drvdata->in_ring_data, USBH_AC_MIDI_IN_RING);
+#endif
 			break;
 		}
 	}
@@ -98,6 +119,63 @@ static void *midi_init(void *usbh_dev)
 	return drvdata;
 }
 
+static void midi_parse_jack(midi_device_t *midi, const uint8_t *desc)
+{
+	const uint8_t length = desc[0];
+	if (length < 6 || midi->jack_count >= USBH_AC_MIDI_JACKS) {
+		return;
+	}
+
+	midi_jack_t *jack = &midi->jack[midi->jack_count];
+	switch (desc[2]) {
+	case USB_MIDI_SUBTYPE_MIDI_IN_JACK:
+		jack->type = desc[3];
+		jack->id = desc[4];
+		jack->source = 0;
+		jack->string_index = desc[5];
+		break;
+
+	case USB_MIDI_SUBTYPE_MIDI_OUT_JACK:
+		{
+			const uint8_t pins = desc[5];
+			jack->type = desc[3];
+			jack->id = desc[4];
+			jack->source = (pins && length > 6) ? desc[6] : 0;
+			jack->string_index = (length > 6 + 2 * pins) ? desc[6 + 2 * pins] : 0;
+		}
+		break;
+
+	default:
+		return;
+	}
+	midi->jack_count++;
+}
+
+static void midi_parse_endpoint_jacks(midi_device_t *midi, const uint8_t *desc)
+{
+	if (desc[0] < 4 || desc[2] != USB_MIDI_SUBTYPE_MS_GENERAL) {
+		return;
+	}
+
+	uint8_t count = desc[3];
+	if (count > desc[0] - 4) {
+		count = desc[0] - 4;
+	}
+	if (count > USBH_AC_MIDI_CABLES) {
+		count = USBH_AC_MIDI_CABLES;
+	}
+
+	if (midi->endpoint_last & (1<<7)) {
+		memcpy(midi->in_jack, &desc[4], count);
+		midi->in_cables = count;
+		midi->endpoint_jacks_parsed |= 0x01;
+	} else {
+		memcpy(midi->out_jack, &desc[4], count);
+		midi->out_cables = count;
+		midi->endpoint_jacks_parsed |= 0x02;
+	}
+}
+
 /**
  * Returns true if all needed data are parsed
  */
@@ -116,6 +194,18 @@ static bool midi_analyze_descriptor(void *drvdata, void *descriptor)
 	case USB_DT_DEVICE:
 		break;
 	case USB_DT_INTERFACE:
+		{
+			struct usb_interface_descriptor *iface =
+				(struct usb_interface_descriptor*)descriptor;
+			midi->interface_subclass = iface->bInterfaceSubClass;
+			midi->endpoint_last = 0;
+		}
+		break;
+	case USB_AUDIO_DT_CS_INTERFACE:
+		// jack descriptors of MIDI streaming interface
+		if (midi->interface_subclass == MIDI_SUBCLASS_STREAMING) {
+			midi_parse_jack(midi, descriptor);
+		}
 		break;
 	case USB_DT_ENDPOINT:
 		{
@@ -123,6 +213,7 @@ static bool midi_analyze_descriptor(void *drvdata, void *descriptor)
 				(struct usb_endpoint_descriptor*)descriptor;
 			if ((ep->bmAttributes&0x03) == USB_ENDPOINT_ATTR_BULK) {
 				uint8_t epaddr = ep->bEndpointAddress;
+				midi->endpoint_last = epaddr;
 				if (epaddr & (1<<7)) {
 					midi->endpoint_in_address = epaddr&0x7f;
 					if (ep->wMaxPacketSize < USBH_AC_MIDI_BUFFER) {
@@ -135,42 +226,146 @@ static bool midi_analyze_descriptor(void *drvdata, void *descriptor)
 					midi->endpoint_out_maxpacketsize = ep->wMaxPacketSize;
 				}
 
+				// wait for the jack association of the endpoint that follows
 				if (midi->endpoint_in_address && midi->endpoint_out_address) {
 					midi->state = 1;
-					return true;
 				}
 			}
 		}
 		break;
 
 	case USB_AUDIO_DT_CS_ENDPOINT:
-	{
-		struct usb_midi_in_jack_descriptor *midi_in_jack_desc =
-			(struct usb_midi_in_jack_descriptor *) descriptor;
-		(void)midi_in_jack_desc;
-	}
+		if (midi->endpoint_last) {
+			midi_parse_endpoint_jacks(midi, descriptor);
+			midi->endpoint_last = 0;
+			if (midi->state == 1 && midi->endpoint_jacks_parsed == 0x03) {
+				return true;
+			}
+		}
 		break;
-	// TODO Class Specific descriptors
 	default:
 		break;
 	}
 	return false;
 }
 
+static void midi_sysex_deliver(midi_device_t *midi, uint8_t cable, uint8_t flags)
+{
+	midi_sysex_t *sysex = &midi->sysex[cable];
+	if (!sysex->started) {
+		flags |= MIDI_SYSEX_START;
+	}
+	sysex->started = true;
+	midi_config->sysex(midi->device_id, cable, sysex->buffer, sysex->fill, flags);
+	sysex->fill = 0;
+}
+
+/**
+ * Collect SysEx packet into the buffer of its cable
+ *
+ * Returns true if the packet was consumed
+ */
+static bool midi_sysex_packet(midi_device_t *midi, const uint8_t *packet)
+{
+	const uint8_t cable = packet[0] >> 4;
+	const uint8_t code_id = packet[0] & 0xf;
+	uint8_t length;
+	uint8_t i;
+
+	if (cable >= USBH_AC_MIDI_CABLES || !midi->sysex[cable].buffer) {
+		return false;
+	}
+
+	switch (code_id) {
+	case 0x4: // SysEx starts or continues
+	case 0x7: // SysEx ends with following three bytes
+		length = 3;
+		break;
+	case 0x6: // SysEx ends with following two bytes
+		length = 2;
+		break;
+	case 0x5: // SysEx ends with following single byte, or single-byte System Common
+		if (packet[1] != 0xf7) {
+			return false;
+		}
+		length = 1;
+		break;
+	default:
+		return false;
+	}
+
+	midi_sysex_t *sysex = &midi->sysex[cable];
+	if (packet[1] == 0xf0) {
+		if (sysex->running) {
+			midi_sysex_deliver(midi, cable, MIDI_SYSEX_END | MIDI_SYSEX_ABORTED);
+		}
+		sysex->running = true;
+		sysex->started = false;
+		sysex->fill = 0;
+	} else if (!sysex->running) {
+		// continuation without start, drop it
+		return true;
+	}
+
+	for (i = 0; i < length; i++) {
+		if (sysex->fill == sysex->size) {
+			midi_sysex_deliver(midi, cable, 0);
+		}
+		sysex->buffer[sysex->fill++] = packet[1 + i];
+	}
+
+	if (code_id != 0x4) {
+		midi_sysex_deliver(midi, cable, MIDI_SYSEX_END);
+		sysex->running = false;
+	}
+	return true;
+}
+
 static void midi_in_message(midi_device_t *midi, const uint8_t datalen)
 {
+	const uint32_t time_us = usbh_time_us();
+	uint8_t count = 0;
 	uint8_t i = 0;
-	if (midi_config->read_callback) {
-		for (i = 0; i < datalen; i += 4) {
 
-//			uint8_t cable_number = (midi->buffer[i] & 0xf0) >> 4;
-			uint8_t code_id = midi->buffer[i]&0xf;
+	// drop empty and reserved packets, keep the rest in place
+	for (i = 0; i + 4 <= datalen; i += 4) {
+		uint8_t code_id = midi->buffer[i]&0xf;
+		if (code_id < 2) {
+			continue;
+		}
+		if (midi_sysex_packet(midi, &midi->buffer[i])) {
+			continue;
+		}
+		if (i != count * 4) {
+			memcpy(&midi->buffer[count * 4], &midi->buffer[i], 4);
+		}
+		count++;
+	}
 
-			uint8_t *ptrdata = &midi->buffer[i];
-			if (code_id < 2) {
-				continue;
-			}
-			midi_config->read_callback(midi->device_id, ptrdata);
+	if (!count) {
+		return;
+	}
+
+#if USBH_AC_MIDI_IN_RING
+	for (i = 0; i < count; i++) {
+		if (usbh_ring_free(&midi->in_ring) < sizeof(midi_event_t)) {
+			break;
+		}
+		midi_event_t ev;
+		ev.time_us = time_us;
+		memcpy(ev.packet, &midi->buffer[i * 4], 4);
+		usbh_ring_write(&midi->in_ring, &ev, sizeof(ev));
+	}
+#endif
+
+	if (midi_config->read_events) {
+		midi_config->read_events(midi->device_id, midi->buffer, count, time_us);
+	}
+
+	if (midi_config->read_callback) {
+		for (i = 0; i < count; i++) {
+//			uint8_t cable_number = (midi->buffer[i * 4] & 0xf0) >> 4;
+			midi_config->read_callback(midi->device_id, &midi->buffer[i * 4]);
 		}
 	}
 }
@@ -183,16 +378,24 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t status)
 		{
 			switch (status.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
+				usbh_device_activity(dev);
 				midi_in_message(midi, midi->endpoint_in_maxpacketsize);
-				midi->state = 25;
+				// read again right away, without waiting for the next poll
+				read_midi_in(midi, 26);
 				break;
 			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+				if (status.transferred_length) {
+					usbh_device_activity(dev);
+				}
 				midi_in_message(midi, status.transferred_length);
+				read_midi_in(midi, 26);
+				break;
+			case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+				// no data, read again from the next poll
 				midi->state = 25;
 				break;
 			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
-			case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
-				LOG_PRINTF("FATAL ERROR, MIDI DRIVER DEAD \n");
+				LOG_ERROR("FATAL ERROR, MIDI DRIVER DEAD \n");
 				//~ dev->drv->remove();
 				midi->state = 0;
 				break;
@@ -202,7 +405,12 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t status)
 
 	case 102:
 		{
-			midi->state = 101;
+			// device sending all the time would never leave the delay in midi_poll()
+			if (usbh_time_us() - midi->time_us_config > MIDI_INITIAL_DELAY) {
+				midi->state = 25;
+			} else {
+				midi->state = 101;
+			}
 			LOG_PRINTF("\n CAN'T TOUCH THIS... ignoring data\n");
 		}
 		break;
@@ -221,7 +429,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t status)
 				midi->state = 100;
 
 				midi->endpoint_in_toggle = 0;
-				LOG_PRINTF("\nMIDI CONFIGURED\n");
+				LOG_INFO("\nMIDI CONFIGURED\n");
 
 				// Notify user
 				if (midi_config->notify_connected) {
@@ -253,7 +461,49 @@ static void read_midi_in(void *drvdata, const uint8_t nextstate)
 	packet.toggle = &midi->endpoint_in_toggle;
 
 	midi->state = nextstate;
-	usbh_read(midi->usbh_device,&packet);
+	// NAK releases the channel, so the idle device can be suspended
+	usbh_read_once(midi->usbh_device,&packet);
+}
+
+static void write_callback(usbh_device_t *dev, usbh_packet_callback_data_t status);
+
+/**
+ * Send queued events, as many as fit into one packet
+ */
+static void midi_out_send(midi_device_t *midi)
+{
+	if (midi->sending || !midi->endpoint_out_address) {
+		return;
+	}
+
+	uint32_t length = usbh_ring_used(&midi->out_ring);
+	if (length > midi->endpoint_out_maxpacketsize) {
+		length = midi->endpoint_out_maxpacketsize;
+	}
+	if (length > USBH_AC_MIDI_BUFFER) {
+		length = USBH_AC_MIDI_BUFFER;
+	}
+	length &= ~3;
+	if (!length) {
+		return;
+	}
+
+	usbh_device_t *dev = midi->usbh_device;
+	usbh_ring_read(&midi->out_ring, midi->out_buffer, length);
+
+	midi->sending = true;
+	midi->write_packet.data = midi->out_buffer;
+	midi->write_packet.datalen = length;
+	midi->write_packet.address = dev->address;
+	midi->write_packet.endpoint_address = midi->endpoint_out_address;
+	midi->write_packet.endpoint_size_max = midi->endpoint_out_maxpacketsize;
+	midi->write_packet.endpoint_type = USBH_ENDPOINT_TYPE_BULK;
+	midi->write_packet.speed = dev->speed;
+	midi->write_packet.callback = write_callback;
+	midi->write_packet.callback_arg = midi->usbh_device;
+	midi->write_packet.toggle = &midi->endpoint_out_toggle;
+
+	usbh_write(dev, &midi->write_packet);
 }
 
 /**
@@ -266,6 +516,12 @@ static void midi_poll(void *drvdata, uint32_t t_us)
 
 	midi_device_t *midi = drvdata;
 	usbh_device_t *dev = midi->usbh_device;
+
+	// device is configured, flush queued events
+	if (midi->state > 3) {
+		midi_out_send(midi);
+	}
+
 	switch (midi->state) {
 
 	/// Upon configuration, some controllers send additional error data
@@ -317,27 +573,40 @@ static void midi_poll(void *drvdata, uint32_t t_us)
 // don't call directly
 static void write_callback(usbh_device_t *dev, usbh_packet_callback_data_t status)
 {
-	(void)status;
 	midi_device_t *midi = (midi_device_t *)dev->drvdata;
 
-	if (midi->sending) {
-		midi->sending = false;
-		const midi_write_callback_t callback = midi->write_callback_user;
-		if (!callback) {
-			return;
-		}
+	if (!midi->sending) {
+		return;
+	}
 
-		if (status.status & USBH_PACKET_CALLBACK_STATUS_OK) {
-			callback(midi->write_packet.datalen);
-		} else {
-			if (status.status & USBH_PACKET_CALLBACK_STATUS_ERRSIZ) {
-				const uint32_t length = status.transferred_length;
-				callback(length);
-			} else {
-				callback(0);
-			}
-		}
+	bool success = true;
+	switch (status.status) {
+	case USBH_PACKET_CALLBACK_STATUS_OK:
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+		// send the same batch again
+		usbh_write(dev, &midi->write_packet);
+		return;
+
+	case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+	case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+		ERROR(status.status);
+		success = false;
+		break;
+	}
+
+	midi->sending = false;
+	midi->out_sent += midi->write_packet.datalen;
+
+	const midi_write_callback_t callback = midi->write_callback_user;
+	if (callback && (int32_t)(midi->out_sent - midi->write_callback_mark) >= 0) {
+		midi->write_callback_user = 0;
+		callback(success ? midi->write_callback_length : 0);
 	}
+
+	// next batch was queued meanwhile
+	midi_out_send(midi);
 }
 
 void usbh_midi_write(uint8_t device_id, const void *data, uint32_t length, midi_write_callback_t callback)
@@ -354,29 +623,170 @@ void usbh_midi_write(uint8_t device_id, const void *data, uint32_t length, midi_
 		return;
 	}
 
-	usbh_device_t *dev = midi->usbh_device;
 	if (midi->endpoint_out_address == 0) {
 		return;
 	}
 
-	midi->sending = true;
+	const uint32_t count = usbh_midi_enqueue(device_id, data, length / 4);
+	if (!callback) {
+		return;
+	}
+
+	if (!count) {
+		callback(0);
+		return;
+	}
+
+	const midi_write_callback_t previous = midi->write_callback_user;
+	const uint32_t previous_length = midi->write_callback_length;
+
+	midi->write_callback_mark = midi->out_ring.head;
+	midi->write_callback_length = count * 4;
 	midi->write_callback_user = callback;
 
-	midi->write_packet.data = (void*)data;	// it is safe cast since we are writing and function usbh_write cannot modify data
-	midi->write_packet.datalen = length;
-	midi->write_packet.address = dev->address;
-	midi->write_packet.endpoint_address = midi->endpoint_out_address;
-	midi->write_packet.endpoint_size_max = midi->endpoint_out_maxpacketsize;
-	midi->write_packet.endpoint_type = USBH_ENDPOINT_TYPE_BULK;
-	midi->write_packet.speed = dev->speed;
-	midi->write_packet.callback = write_callback;
-	midi->write_packet.callback_arg = midi->usbh_device;
-	midi->write_packet.toggle = &midi->endpoint_out_toggle;
+	if (previous) {
+		previous(previous_length);
+	}
+}
 
+uint32_t usbh_midi_enqueue(uint8_t device_id, const void *events, uint32_t count)
+{
+	// bad device_id handling
+	if (device_id >= USBH_AC_MIDI_MAX_DEVICES) {
+		return 0;
+	}
 
-	usbh_write(dev, &midi->write_packet);
+	midi_device_t *midi = &midi_device[device_id];
+
+	// device with provided device_id is not alive
+	if (midi->state == 0) {
+		return 0;
+	}
+
+	const uint32_t space = usbh_ring_free(&midi->out_ring) / 4;
+	if (count > space) {
+		count = space;
+	}
+
+	if (count) {
+		// suspended device is resumed, before it is polled again
+		usbh_device_activity(midi->usbh_device);
+	}
+
+	// sent from usbh_poll() or from completion of the previous batch
+	return usbh_ring_write(&midi->out_ring, events, count * 4) / 4;
+}
+
+uint32_t usbh_midi_out_free(uint8_t device_id)
+{
+	// bad device_id handling
+	if (device_id >= USBH_AC_MIDI_MAX_DEVICES) {
+		return 0;
+	}
+
+	midi_device_t *midi = &midi_device[device_id];
+	if (midi->state == 0) {
+		return 0;
+	}
+	return usbh_ring_free(&midi->out_ring) / 4;
+}
+
+bool usbh_midi_sysex_buffer(uint8_t device_id, uint8_t cable, uint8_t *buffer, uint16_t size)
+{
+	// bad device_id handling
+	if (device_id >= USBH_AC_MIDI_MAX_DEVICES || cable >= USBH_AC_MIDI_CABLES) {
+		return false;
+	}
+
+	if (!midi_config || !midi_config->sysex || (buffer && !size)) {
+		return false;
+	}
+
+	midi_device_t *midi = &midi_device[device_id];
+	if (midi->state == 0) {
+		return false;
+	}
+
+	midi_sysex_t *sysex = &midi->sysex[cable];
+	sysex->buffer = buffer;
+	sysex->size = size;
+	sysex->fill = 0;
+	sysex->running = false;
+	return true;
+}
+
+static const midi_jack_t *midi_find_jack(const midi_device_t *midi, uint8_t id)
+{
+	uint8_t i;
+	for (i = 0; i < midi->jack_count; i++) {
+		if (midi->jack[i].id == id) {
+			return &midi->jack[i];
+		}
+	}
+	return 0;
+}
+
+uint8_t usbh_midi_cables(uint8_t device_id, bool input, midi_cable_t *cables, uint8_t count)
+{
+	// bad device_id handling
+	if (device_id >= USBH_AC_MIDI_MAX_DEVICES) {
+		return 0;
+	}
+
+	const midi_device_t *midi = &midi_device[device_id];
+	if (midi->state == 0) {
+		return 0;
+	}
+
+	const uint8_t cable_count = input ? midi->in_cables : midi->out_cables;
+	uint8_t i;
+	for (i = 0; i < cable_count && i < count; i++) {
+		const uint8_t jack_id = input ? midi->in_jack[i] : midi->out_jack[i];
+		const midi_jack_t *embedded = midi_find_jack(midi, jack_id);
+		const midi_jack_t *external = 0;
+
+		if (embedded && input) {
+			// embedded OUT jack is fed by external IN jack
+			external = midi_find_jack(midi, embedded->source);
+		} else if (embedded) {
+			// external OUT jack is fed by embedded IN jack
+			uint8_t j;
+			for (j = 0; j < midi->jack_count; j++) {
+				if (midi->jack[j].source == jack_id) {
+					external = &midi->jack[j];
+					break;
+				}
+			}
+		}
+		if (external && external->type != MIDI_JACK_EXTERNAL) {
+			external = 0;
+		}
+
+		cables[i].jack_id = jack_id;
+		cables[i].external_jack_id = external ? external->id : 0;
+		cables[i].string_index = (external && external->string_index) ? external->string_index :
+			(embedded ? embedded->string_index : 0);
+	}
+	return cable_count;
 }
 
+#if USBH_AC_MIDI_IN_RING
+uint32_t usbh_midi_read_events(uint8_t device_id, midi_event_t *events, uint32_t count)
+{
+	// bad device_id handling
+	if (device_id >= USBH_AC_MIDI_MAX_DEVICES) {
+		return 0;
+	}
+
+	midi_device_t *midi = &midi_device[device_id];
+	const uint32_t available = usbh_ring_used(&midi->in_ring) / sizeof(midi_event_t);
+	if (count > available) {
+		count = available;
+	}
+	return usbh_ring_read(&midi->in_ring, events, count * sizeof(midi_event_t)) / sizeof(midi_event_t);
+}
+#endif
+
 static void midi_remove(void *drvdata)
 {
 	midi_device_t *midi = drvdata;
@@ -386,6 +796,17 @@ static void midi_remove(void *drvdata)
 	}
 
 	midi->state = 0;
+	midi->sending = false;
+	midi->write_callback_user = 0;
 	midi->endpoint_in_address = 0;
 	midi->endpoint_out_address = 0;
 }
+
+/**
+ * Idle device can be suspended between reads, when there is nothing to send
+ */
+static bool midi_suspend(void *drvdata)
+{
+	midi_device_t *midi = drvdata;
+	return midi->state == 25 && !midi->sending && !usbh_ring_used(&midi->out_ring);
+}
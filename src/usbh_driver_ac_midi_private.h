@@ -25,12 +25,33 @@
 
 #include "driver/usbh_device_driver.h"
 #include "usbh_driver_ac_midi.h"
+#include "usbh_ring.h"
 
 #include <stdint.h>
 
 
 #define MIDI_INITIAL_DELAY 	(100000)
 
+// System Exclusive reassembly state of one cable
+struct _midi_sysex {
+	uint8_t *buffer;
+	uint16_t size;
+	uint16_t fill;
+	bool running;
+	// first chunk of running message was already delivered
+	bool started;
+};
+typedef struct _midi_sysex midi_sysex_t;
+
+struct _midi_jack {
+	uint8_t id;
+	uint8_t type;
+	// first source of OUT jack, 0 for IN jack
+	uint8_t source;
+	uint8_t string_index;
+};
+typedef struct _midi_jack midi_jack_t;
+
 struct _midi_device {
 	usbh_device_t *usbh_device;
 	uint8_t buffer[USBH_AC_MIDI_BUFFER];
@@ -44,7 +65,39 @@ struct _midi_device {
 	uint8_t device_id;
 	bool sending;
 	midi_write_callback_t write_callback_user;
+	// ring position, where data of the write with pending callback end
+	uint32_t write_callback_mark;
+	uint32_t write_callback_length;
 	usbh_packet_t write_packet;
+
+	// queued event packets, sent in batches of up to max packet size
+	usbh_ring_t out_ring;
+	uint8_t out_ring_data[USBH_AC_MIDI_OUT_RING];
+	uint8_t out_buffer[USBH_AC_MIDI_BUFFER];
+	// count of bytes that left the queue in finished transfers
+	uint32_t out_sent;
+
+#if USBH_AC_MIDI_IN_RING
+	// received events with timestamps
+	usbh_ring_t in_ring;
+	uint8_t in_ring_data[USBH_AC_MIDI_IN_RING];
+#endif
+
+	midi_sysex_t sysex[USBH_AC_MIDI_CABLES];
+
+	// jacks and embedded jacks of cables, filled from class specific descriptors
+	midi_jack_t jack[USBH_AC_MIDI_JACKS];
+	uint8_t jack_count;
+	uint8_t in_jack[USBH_AC_MIDI_CABLES];
+	uint8_t out_jack[USBH_AC_MIDI_CABLES];
+	uint8_t in_cables;
+	uint8_t out_cables;
+
+	// descriptor parsing
+	uint8_t interface_subclass;
+	uint8_t endpoint_last;
+	uint8_t endpoint_jacks_parsed;
+
 	// Timestamp at sending config command
 	uint32_t time_us_config;
 };
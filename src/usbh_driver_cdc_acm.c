@@ -0,0 +1,613 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "driver/usbh_device_driver.h"
+#include "usbh_driver_cdc_acm.h"
+#include "usbh_ring.h"
+#include "usart_helpers.h"
+
+#include <string.h>
+#include <libopencm3/usb/usbstd.h>
+
+#define LOG_MODULE CDC_ACM
+
+#define CDC_CLASS_COMM			(0x02)
+#define CDC_CLASS_DATA			(0x0a)
+
+#define CDC_REQ_SET_LINE_CODING		(0x20)
+#define CDC_REQ_SET_CONTROL_LINE_STATE	(0x22)
+#define LINE_CODING_LENGTH		(7)
+
+enum STATES {
+	STATE_INACTIVE,
+	STATE_SET_CONFIGURATION_REQUEST,
+	STATE_SET_CONFIGURATION_EMPTY_READ,
+	STATE_SET_CONFIGURATION_COMPLETE,
+	STATE_RUNNING,
+	// device failed, slot stays assigned to it until it is removed
+	STATE_ERROR
+};
+
+enum CONTROL_STATES {
+	CONTROL_STATE_IDLE,
+	CONTROL_STATE_LINE_CODING_DATA,
+	CONTROL_STATE_EMPTY_READ,
+	CONTROL_STATE_COMPLETE
+};
+
+struct _cdc_acm_device {
+	usbh_device_t *usbh_device;
+	uint8_t rx_buffer[USBH_CDC_ACM_BUFFER];
+	uint8_t tx_buffer[USBH_CDC_ACM_BUFFER];
+	uint8_t control_buffer[LINE_CODING_LENGTH];
+	usbh_ring_t rx_ring;
+	usbh_ring_t tx_ring;
+	uint8_t rx_ring_data[USBH_CDC_ACM_RX_RING];
+	uint8_t tx_ring_data[USBH_CDC_ACM_TX_RING];
+
+	uint16_t endpoint_in_maxpacketsize;
+	uint16_t endpoint_out_maxpacketsize;
+	uint8_t endpoint_in_address;
+	uint8_t endpoint_out_address;
+	uint8_t endpoint_in_toggle;
+	uint8_t endpoint_out_toggle;
+	uint8_t interface_number;
+	uint8_t configuration_value;
+	uint8_t device_id;
+	enum STATES state_next;
+	enum CONTROL_STATES control_state;
+
+	// descriptor parsing
+	bool interface_data;
+
+	cdc_acm_line_coding_t line_coding;
+	uint8_t control_line_state;
+	bool line_coding_pending;
+	bool control_line_state_pending;
+
+	uint16_t tx_length;
+	// bytes waiting in transmit ring at previous poll
+	uint32_t tx_used_last;
+	bool tx_busy;
+	bool tx_resend;
+	// last packet was full, transfer has to be terminated by short packet
+	bool tx_zlp;
+	uint32_t rx_dropped;
+};
+typedef struct _cdc_acm_device cdc_acm_device_t;
+
+static cdc_acm_device_t cdc_acm_device[USBH_CDC_ACM_MAX_DEVICES];
+static const cdc_acm_config_t *cdc_acm_config = 0;
+static bool initialized = false;
+
+void cdc_acm_driver_init(const cdc_acm_config_t *config)
+{
+	uint32_t i;
+	cdc_acm_config = config;
+	for (i = 0; i < USBH_CDC_ACM_MAX_DEVICES; i++) {
+		cdc_acm_device[i].state_next = STATE_INACTIVE;
+	}
+	initialized = true;
+}
+
+static void *init(void *usbh_dev)
+{
+	if (!cdc_acm_config || !initialized) {
+		LOG_ERROR("\n%s/%d : driver not initialized\n", __FILE__, __LINE__);
+		return 0;
+	}
+
+	uint32_t i;
+	cdc_acm_device_t *drvdata = 0;
+
+	// find free data space for cdc device
+	for (i = 0; i < USBH_CDC_ACM_MAX_DEVICES; i++) {
+		if (cdc_acm_device[i].state_next == STATE_INACTIVE) {
+			drvdata = &cdc_acm_device[i];
+			drvdata->device_id = i;
+			drvdata->endpoint_in_address = 0;
+			drvdata->endpoint_out_address = 0;
+			drvdata->endpoint_in_toggle = 0;
+			drvdata->endpoint_out_toggle = 0;
+			drvdata->interface_data = false;
+			drvdata->usbh_device = (usbh_device_t *)usbh_dev;
+			break;
+		}
+	}
+
+	return drvdata;
+}
+
+/**
+ * Returns true if all needed data are parsed
+ */
+static bool analyze_descriptor(void *drvdata, void *descriptor)
+{
+	cdc_acm_device_t *cdc = (cdc_acm_device_t *)drvdata;
+	uint8_t desc_type = ((uint8_t *)descriptor)[1];
+	switch (desc_type) {
+	case USB_DT_CONFIGURATION:
+		{
+			struct usb_config_descriptor *cfg = (struct usb_config_descriptor*)descriptor;
+			cdc->configuration_value = cfg->bConfigurationValue;
+		}
+		break;
+
+	case USB_DT_INTERFACE:
+		{
+			struct usb_interface_descriptor *iface = (struct usb_interface_descriptor*)descriptor;
+			cdc->interface_data = (iface->bInterfaceClass == CDC_CLASS_DATA);
+			if (iface->bInterfaceClass == CDC_CLASS_COMM) {
+				cdc->interface_number = iface->bInterfaceNumber;
+			}
+		}
+		break;
+
+	case USB_DT_ENDPOINT:
+		{
+			struct usb_endpoint_descriptor *ep = (struct usb_endpoint_descriptor*)descriptor;
+			if (cdc->interface_data && (ep->bmAttributes&0x03) == USB_ENDPOINT_ATTR_BULK) {
+				uint8_t epaddr = ep->bEndpointAddress;
+				if (ep->wMaxPacketSize > USBH_CDC_ACM_BUFFER) {
+					LOG_WARN("CDC: INCREASE USBH_CDC_ACM_BUFFER to %d\n", ep->wMaxPacketSize);
+					break;
+				}
+				if (epaddr & (1<<7)) {
+					cdc->endpoint_in_address = epaddr&0x7f;
+					cdc->endpoint_in_maxpacketsize = ep->wMaxPacketSize;
+				} else {
+					cdc->endpoint_out_address = epaddr;
+					cdc->endpoint_out_maxpacketsize = ep->wMaxPacketSize;
+				}
+
+				if (cdc->endpoint_in_address && cdc->endpoint_out_address) {
+					cdc->state_next = STATE_SET_CONFIGURATION_REQUEST;
+					return true;
+				}
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+	return false;
+}
+
+static void read_cdc_in(cdc_acm_device_t *cdc);
+
+static void read_callback(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	cdc_acm_device_t *cdc = (cdc_acm_device_t *)dev->drvdata;
+
+	if (cdc->state_next != STATE_RUNNING) {
+		return;
+	}
+
+	switch (cb_data.status) {
+	case USBH_PACKET_CALLBACK_STATUS_OK:
+	case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+		{
+			const uint32_t length = cb_data.transferred_length;
+			const uint32_t written = usbh_ring_write(&cdc->rx_ring, cdc->rx_buffer, length);
+			if (written < length) {
+				cdc->rx_dropped += length - written;
+				LOG_WARN("CDC: rx dropped %d\n", cdc->rx_dropped);
+			}
+			if (written && cdc_acm_config->notify_rx) {
+				cdc_acm_config->notify_rx(cdc->device_id, usbh_ring_used(&cdc->rx_ring));
+			}
+		}
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+		ERROR(cb_data.status);
+		cdc->state_next = STATE_ERROR;
+		if (cdc_acm_config->notify_disconnected) {
+			cdc_acm_config->notify_disconnected(cdc->device_id);
+		}
+		return;
+	}
+
+	// keep one read always pending
+	read_cdc_in(cdc);
+}
+
+/**
+ * Read as many packets as fit into the buffer, short packet ends the transfer
+ */
+static void read_cdc_in(cdc_acm_device_t *cdc)
+{
+	usbh_packet_t packet;
+	const uint16_t maxpacketsize = cdc->endpoint_in_maxpacketsize;
+
+	packet.address = cdc->usbh_device->address;
+	packet.data = cdc->rx_buffer;
+	packet.datalen = USBH_CDC_ACM_BUFFER - (USBH_CDC_ACM_BUFFER % maxpacketsize);
+	packet.endpoint_address = cdc->endpoint_in_address;
+	packet.endpoint_size_max = maxpacketsize;
+	packet.endpoint_type = USBH_ENDPOINT_TYPE_BULK;
+	packet.speed = cdc->usbh_device->speed;
+	packet.callback = read_callback;
+	packet.callback_arg = cdc->usbh_device;
+	packet.toggle = &cdc->endpoint_in_toggle;
+
+	usbh_read(cdc->usbh_device, &packet);
+}
+
+static void tx_poll(cdc_acm_device_t *cdc);
+
+static void write_callback(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	cdc_acm_device_t *cdc = (cdc_acm_device_t *)dev->drvdata;
+
+	switch (cb_data.status) {
+	case USBH_PACKET_CALLBACK_STATUS_OK:
+		cdc->tx_resend = false;
+		cdc->tx_zlp = (cdc->tx_length == cdc->endpoint_out_maxpacketsize);
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+		// send the same packet again
+		cdc->tx_resend = true;
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+	case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+		ERROR(cb_data.status);
+		cdc->tx_resend = false;
+		break;
+	}
+	cdc->tx_busy = false;
+
+	// next full packet goes right away, without waiting for the next poll
+	if (cb_data.status == USBH_PACKET_CALLBACK_STATUS_OK &&
+		usbh_ring_used(&cdc->tx_ring) >= cdc->endpoint_out_maxpacketsize) {
+		tx_poll(cdc);
+	}
+}
+
+static void write_cdc_out(cdc_acm_device_t *cdc)
+{
+	usbh_packet_t packet;
+
+	packet.address = cdc->usbh_device->address;
+	packet.data = cdc->tx_buffer;
+	packet.datalen = cdc->tx_length;
+	packet.endpoint_address = cdc->endpoint_out_address;
+	packet.endpoint_size_max = cdc->endpoint_out_maxpacketsize;
+	packet.endpoint_type = USBH_ENDPOINT_TYPE_BULK;
+	packet.speed = cdc->usbh_device->speed;
+	packet.callback = write_callback;
+	packet.callback_arg = cdc->usbh_device;
+	packet.toggle = &cdc->endpoint_out_toggle;
+
+	cdc->tx_busy = true;
+	usbh_write(cdc->usbh_device, &packet);
+}
+
+/**
+ * Send transmit ring content in full packets
+ *
+ * Partial packet is sent only when no more data were queued since
+ * the previous poll, so bytes written one by one are merged.
+ * Transfer ending with full packet is terminated by zero length packet.
+ *
+ * One packet per write, since low-level driver fills whole packet into
+ * the transmit FIFO at once.
+ */
+static void tx_poll(cdc_acm_device_t *cdc)
+{
+	if (cdc->tx_busy) {
+		return;
+	}
+
+	if (cdc->tx_resend) {
+		write_cdc_out(cdc);
+		return;
+	}
+
+	const uint32_t used = usbh_ring_used(&cdc->tx_ring);
+	const uint32_t maxpacketsize = cdc->endpoint_out_maxpacketsize;
+
+	if (used >= maxpacketsize || (used && used == cdc->tx_used_last)) {
+		cdc->tx_length = usbh_ring_read(&cdc->tx_ring, cdc->tx_buffer, maxpacketsize);
+		cdc->tx_used_last = used - cdc->tx_length;
+		write_cdc_out(cdc);
+		return;
+	}
+
+	if (!used && cdc->tx_zlp) {
+		cdc->tx_length = 0;
+		write_cdc_out(cdc);
+	}
+	cdc->tx_used_last = used;
+}
+
+static void control_event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	cdc_acm_device_t *cdc = (cdc_acm_device_t *)dev->drvdata;
+
+	if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
+		ERROR(cb_data.status);
+		cdc->control_state = CONTROL_STATE_IDLE;
+		return;
+	}
+
+	switch (cdc->control_state) {
+	case CONTROL_STATE_LINE_CODING_DATA:
+		cdc->control_state = CONTROL_STATE_EMPTY_READ;
+		device_xfer_control_write_data(cdc->control_buffer, LINE_CODING_LENGTH, control_event, dev);
+		break;
+
+	case CONTROL_STATE_EMPTY_READ:
+		LOG_PRINTF("|empty packet read|");
+		cdc->control_state = CONTROL_STATE_COMPLETE;
+		device_xfer_control_read(0, 0, control_event, dev);
+		break;
+
+	case CONTROL_STATE_COMPLETE:
+		cdc->control_state = CONTROL_STATE_IDLE;
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void control_poll(cdc_acm_device_t *cdc)
+{
+	struct usb_setup_data setup_data;
+
+	if (cdc->control_state != CONTROL_STATE_IDLE) {
+		return;
+	}
+
+	setup_data.bmRequestType = 0b00100001;
+	setup_data.wIndex = cdc->interface_number;
+
+	if (cdc->line_coding_pending) {
+		const uint32_t baudrate = cdc->line_coding.baudrate;
+
+		cdc->line_coding_pending = false;
+		cdc->control_buffer[0] = baudrate;
+		cdc->control_buffer[1] = baudrate >> 8;
+		cdc->control_buffer[2] = baudrate >> 16;
+		cdc->control_buffer[3] = baudrate >> 24;
+		cdc->control_buffer[4] = cdc->line_coding.stop_bits;
+		cdc->control_buffer[5] = cdc->line_coding.parity;
+		cdc->control_buffer[6] = cdc->line_coding.data_bits;
+
+		setup_data.bRequest = CDC_REQ_SET_LINE_CODING;
+		setup_data.wValue = 0;
+		setup_data.wLength = LINE_CODING_LENGTH;
+
+		cdc->control_state = CONTROL_STATE_LINE_CODING_DATA;
+		device_xfer_control_write_setup(&setup_data, sizeof(setup_data), control_event, cdc->usbh_device);
+	} else if (cdc->control_line_state_pending) {
+		cdc->control_line_state_pending = false;
+
+		setup_data.bRequest = CDC_REQ_SET_CONTROL_LINE_STATE;
+		setup_data.wValue = cdc->control_line_state;
+		setup_data.wLength = 0;
+
+		cdc->control_state = CONTROL_STATE_EMPTY_READ;
+		device_xfer_control_write_setup(&setup_data, sizeof(setup_data), control_event, cdc->usbh_device);
+	}
+}
+
+static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	cdc_acm_device_t *cdc = (cdc_acm_device_t *)dev->drvdata;
+	switch (cdc->state_next) {
+	case STATE_SET_CONFIGURATION_EMPTY_READ:
+		{
+			LOG_PRINTF("|empty packet read|");
+			switch (cb_data.status) {
+			case USBH_PACKET_CALLBACK_STATUS_OK:
+				cdc->state_next = STATE_SET_CONFIGURATION_COMPLETE;
+				device_xfer_control_read(0, 0, event, dev);
+				break;
+
+			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+			case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+				ERROR(cb_data.status);
+				cdc->state_next = STATE_ERROR;
+				break;
+			}
+		}
+		break;
+
+	case STATE_SET_CONFIGURATION_COMPLETE: // Configured
+		{
+			switch (cb_data.status) {
+			case USBH_PACKET_CALLBACK_STATUS_OK:
+				usbh_ring_init(&cdc->rx_ring, cdc->rx_ring_data, USBH_CDC_ACM_RX_RING);
+				usbh_ring_init(&cdc->tx_ring, cdc->tx_ring_data, USBH_CDC_ACM_TX_RING);
+				cdc->endpoint_in_toggle = 0;
+				cdc->endpoint_out_toggle = 0;
+				cdc->control_state = CONTROL_STATE_IDLE;
+				cdc->line_coding = cdc_acm_config->line_coding;
+				cdc->line_coding_pending = true;
+				// DTR and RTS
+				cdc->control_line_state = 0x03;
+				cdc->control_line_state_pending = true;
+				cdc->tx_busy = false;
+				cdc->tx_resend = false;
+				cdc->tx_zlp = false;
+				cdc->tx_used_last = 0;
+				cdc->rx_dropped = 0;
+				cdc->state_next = STATE_RUNNING;
+				LOG_INFO("\nCDC ACM CONFIGURED\n");
+
+				read_cdc_in(cdc);
+
+				if (cdc_acm_config->notify_connected) {
+					cdc_acm_config->notify_connected(cdc->device_id);
+				}
+				break;
+
+			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+			case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+				ERROR(cb_data.status);
+				cdc->state_next = STATE_ERROR;
+				break;
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * @param time_curr_us - monotically rising time
+ *		unit is microseconds
+ * @see usbh_poll()
+ */
+static void poll(void *drvdata, uint32_t time_curr_us)
+{
+	(void)time_curr_us;
+
+	cdc_acm_device_t *cdc = (cdc_acm_device_t *)drvdata;
+	usbh_device_t *dev = cdc->usbh_device;
+
+	switch (cdc->state_next) {
+	case STATE_RUNNING:
+		control_poll(cdc);
+		tx_poll(cdc);
+		break;
+
+	case STATE_SET_CONFIGURATION_REQUEST:
+		{
+			struct usb_setup_data setup_data;
+
+			setup_data.bmRequestType = 0b00000000;
+			setup_data.bRequest = USB_REQ_SET_CONFIGURATION;
+			setup_data.wValue = cdc->configuration_value;
+			setup_data.wIndex = 0;
+			setup_data.wLength = 0;
+
+			cdc->state_next = STATE_SET_CONFIGURATION_EMPTY_READ;
+
+			device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+		}
+		break;
+
+	default:
+		// do nothing - probably transfer is in progress
+		break;
+	}
+}
+
+static void remove(void *drvdata)
+{
+	LOG_INFO("Removing CDC ACM\n");
+
+	cdc_acm_device_t *cdc = (cdc_acm_device_t *)drvdata;
+
+	if (cdc->state_next == STATE_RUNNING && cdc_acm_config->notify_disconnected) {
+		cdc_acm_config->notify_disconnected(cdc->device_id);
+	}
+	cdc->state_next = STATE_INACTIVE;
+	cdc->endpoint_in_address = 0;
+	cdc->endpoint_out_address = 0;
+}
+
+static cdc_acm_device_t *get_running(uint8_t device_id)
+{
+	// bad device_id handling
+	if (device_id >= USBH_CDC_ACM_MAX_DEVICES) {
+		return 0;
+	}
+
+	cdc_acm_device_t *cdc = &cdc_acm_device[device_id];
+	if (cdc->state_next != STATE_RUNNING) {
+		return 0;
+	}
+	return cdc;
+}
+
+uint32_t usbh_cdc_acm_write(uint8_t device_id, const void *data, uint32_t length)
+{
+	cdc_acm_device_t *cdc = get_running(device_id);
+	if (!cdc) {
+		return 0;
+	}
+	return usbh_ring_write(&cdc->tx_ring, data, length);
+}
+
+uint32_t usbh_cdc_acm_read(uint8_t device_id, void *data, uint32_t length)
+{
+	cdc_acm_device_t *cdc = get_running(device_id);
+	if (!cdc) {
+		return 0;
+	}
+	return usbh_ring_read(&cdc->rx_ring, data, length);
+}
+
+bool usbh_cdc_acm_set_line_coding(uint8_t device_id, const cdc_acm_line_coding_t *line_coding)
+{
+	cdc_acm_device_t *cdc = get_running(device_id);
+	if (!cdc) {
+		return false;
+	}
+	cdc->line_coding = *line_coding;
+	cdc->line_coding_pending = true;
+	return true;
+}
+
+bool usbh_cdc_acm_set_control_line_state(uint8_t device_id, bool dtr, bool rts)
+{
+	cdc_acm_device_t *cdc = get_running(device_id);
+	if (!cdc) {
+		return false;
+	}
+	cdc->control_line_state = (dtr ? 0x01 : 0) | (rts ? 0x02 : 0);
+	cdc->control_line_state_pending = true;
+	return true;
+}
+
+static const usbh_dev_driver_info_t driver_info = {
+	.deviceClass = -1,
+	.deviceSubClass = -1,
+	.deviceProtocol = -1,
+	.idVendor = -1,
+	.idProduct = -1,
+	.ifaceClass = 0x02,
+	.ifaceSubClass = 0x02,
+	.ifaceProtocol = -1
+};
+
+const usbh_dev_driver_t usbh_cdc_acm_driver = {
+	.init = init,
+	.analyze_descriptor = analyze_descriptor,
+	.poll = poll,
+	.remove = remove,
+	.info = &driver_info
+};
@@ -0,0 +1,946 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "driver/usbh_device_driver.h"
+#include "usbh_driver_cdc_ncm.h"
+#include "usart_helpers.h"
+
+#include <string.h>
+#include <libopencm3/usb/usbstd.h>
+
+#define LOG_MODULE CDC_NCM
+
+/*
+ * CDC Network Control Model
+ *
+ * Ethernet frames are carried in NTBs (NCM Transfer Blocks). Every NTB
+ * starts with NTH16 header, that points to the NDP16 - table of frames in the
+ * block. Each NTB is one bulk transfer, so several frames share the
+ * per-transfer overhead.
+ *
+ * Received NTB stays in its buffer, frames are handed to the user by
+ * pointer. Buffer is reused when all its frames are released.
+ * Transmitted frames are written directly into the NTB being built.
+ */
+
+#define CDC_CLASS_COMM			(0x02)
+#define CDC_CLASS_DATA			(0x0a)
+#define CDC_DT_CS_INTERFACE		(0x24)
+#define CDC_ETHERNET_NETWORKING		(0x0f)
+
+#define NCM_REQ_GET_NTB_PARAMETERS	(0x80)
+#define NCM_REQ_SET_NTB_INPUT_SIZE	(0x86)
+#define NTB_PARAMETERS_LENGTH		(28)
+
+#define NTH16_SIGNATURE		(0x484d434e) // "NCMH"
+#define NDP16_SIGNATURE		(0x304d434e) // "NCM0"
+#define NTH16_LENGTH		(12)
+#define NDP16_HEADER_LENGTH	(8)
+
+// MAC address as unicode string of 12 hex digits
+#define MAC_STRING_LENGTH	(2 + 12 * 2)
+#define LANGID_EN_US		(0x0409)
+
+// guard against NDP chains pointing in circle
+#define NDP_MAX_CHAIN		(8)
+
+enum STATES {
+	STATE_INACTIVE,
+	STATE_SET_CONFIGURATION_REQUEST,
+	STATE_SET_CONFIGURATION_EMPTY_READ,
+	STATE_SET_CONFIGURATION_COMPLETE,
+	STATE_GET_NTB_PARAMETERS_READ,
+	STATE_GET_NTB_PARAMETERS_COMPLETE,
+	STATE_SET_NTB_INPUT_SIZE_DATA,
+	STATE_SET_NTB_INPUT_SIZE_EMPTY_READ,
+	STATE_SET_NTB_INPUT_SIZE_COMPLETE,
+	STATE_GET_MAC_READ,
+	STATE_GET_MAC_COMPLETE,
+	STATE_SET_INTERFACE_EMPTY_READ,
+	STATE_SET_INTERFACE_COMPLETE,
+	STATE_RUNNING,
+	// device failed, slot stays assigned to it until it is removed
+	STATE_ERROR
+};
+
+enum NTB_STATES {
+	NTB_STATE_FREE,
+	NTB_STATE_RX_PENDING,
+	NTB_STATE_RX_HELD,
+	NTB_STATE_TX_FILLING,
+	NTB_STATE_TX_QUEUED,
+	NTB_STATE_TX_SENDING
+};
+
+struct _ntb_buffer {
+	uint8_t data[USBH_CDC_NCM_NTB_SIZE];
+	enum NTB_STATES state;
+
+	// receive: frames not released yet
+	uint16_t refs;
+
+	// transmit: datagram table, written into NDP when the block is closed
+	uint16_t datagram_index[USBH_CDC_NCM_TX_DATAGRAMS];
+	uint16_t datagram_length[USBH_CDC_NCM_TX_DATAGRAMS];
+	uint8_t datagram_count;
+	uint16_t end;
+	uint16_t length;
+	uint16_t sequence;
+};
+typedef struct _ntb_buffer ntb_buffer_t;
+
+struct _cdc_ncm_device {
+	usbh_device_t *usbh_device;
+	ntb_buffer_t ntb[USBH_CDC_NCM_NTB_COUNT];
+	uint8_t control_buffer[MAC_STRING_LENGTH + 2];
+	uint8_t mac[6];
+
+	uint16_t endpoint_in_maxpacketsize;
+	uint16_t endpoint_out_maxpacketsize;
+	uint8_t endpoint_in_address;
+	uint8_t endpoint_out_address;
+	uint8_t endpoint_in_toggle;
+	uint8_t endpoint_out_toggle;
+	uint8_t interface_comm;
+	uint8_t interface_data;
+	uint8_t interface_data_alternate;
+	uint8_t mac_string_index;
+	uint8_t configuration_value;
+	uint8_t device_id;
+	enum STATES state_next;
+
+	// descriptor parsing
+	uint8_t interface_class;
+	uint8_t alternate_setting;
+
+	// NTB parameters of the device
+	uint16_t ntb_out_max;
+	// dwNtbOutMaxSize, device ends the transfer of this length without short packet
+	uint32_t ntb_out_max_device;
+	uint16_t ndp_out_divisor;
+	uint16_t ndp_out_remainder;
+	uint16_t ndp_out_alignment;
+	uint8_t ntb_out_datagrams;
+
+	ntb_buffer_t *rx;
+	ntb_buffer_t *tx_filling;
+	ntb_buffer_t *tx_sending;
+	uint8_t tx_frames_last;
+	uint16_t tx_sequence;
+	uint16_t tx_index;
+	uint16_t tx_chunk;
+	bool tx_zlp;
+};
+typedef struct _cdc_ncm_device cdc_ncm_device_t;
+
+static cdc_ncm_device_t cdc_ncm_device[USBH_CDC_NCM_MAX_DEVICES];
+static const cdc_ncm_config_t *cdc_ncm_config = 0;
+static bool initialized = false;
+
+static inline void store_le16(uint8_t *buf, uint16_t value)
+{
+	buf[0] = value;
+	buf[1] = value >> 8;
+}
+
+static inline void store_le32(uint8_t *buf, uint32_t value)
+{
+	buf[0] = value;
+	buf[1] = value >> 8;
+	buf[2] = value >> 16;
+	buf[3] = value >> 24;
+}
+
+static inline uint16_t load_le16(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8);
+}
+
+static inline uint32_t load_le32(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+void cdc_ncm_driver_init(const cdc_ncm_config_t *config)
+{
+	uint32_t i;
+	cdc_ncm_config = config;
+	for (i = 0; i < USBH_CDC_NCM_MAX_DEVICES; i++) {
+		cdc_ncm_device[i].state_next = STATE_INACTIVE;
+	}
+	initialized = true;
+}
+
+static void *init(void *usbh_dev)
+{
+	if (!cdc_ncm_config || !initialized) {
+		LOG_ERROR("\n%s/%d : driver not initialized\n", __FILE__, __LINE__);
+		return 0;
+	}
+
+	uint32_t i;
+	cdc_ncm_device_t *drvdata = 0;
+
+	// find free data space for ncm device
+	for (i = 0; i < USBH_CDC_NCM_MAX_DEVICES; i++) {
+		if (cdc_ncm_device[i].state_next == STATE_INACTIVE) {
+			drvdata = &cdc_ncm_device[i];
+			drvdata->device_id = i;
+			drvdata->endpoint_in_address = 0;
+			drvdata->endpoint_out_address = 0;
+			drvdata->endpoint_in_toggle = 0;
+			drvdata->endpoint_out_toggle = 0;
+			drvdata->mac_string_index = 0;
+			drvdata->interface_class = 0;
+			drvdata->usbh_device = (usbh_device_t *)usbh_dev;
+			break;
+		}
+	}
+
+	return drvdata;
+}
+
+/**
+ * Returns true if all needed data are parsed
+ */
+static bool analyze_descriptor(void *drvdata, void *descriptor)
+{
+	cdc_ncm_device_t *ncm = (cdc_ncm_device_t *)drvdata;
+	const uint8_t *desc = (const uint8_t *)descriptor;
+	uint8_t desc_type = desc[1];
+	switch (desc_type) {
+	case USB_DT_CONFIGURATION:
+		{
+			struct usb_config_descriptor *cfg = (struct usb_config_descriptor*)descriptor;
+			ncm->configuration_value = cfg->bConfigurationValue;
+		}
+		break;
+
+	case USB_DT_INTERFACE:
+		{
+			struct usb_interface_descriptor *iface = (struct usb_interface_descriptor*)descriptor;
+			ncm->interface_class = iface->bInterfaceClass;
+			ncm->alternate_setting = iface->bAlternateSetting;
+			if (iface->bInterfaceClass == CDC_CLASS_COMM) {
+				ncm->interface_comm = iface->bInterfaceNumber;
+			} else if (iface->bInterfaceClass == CDC_CLASS_DATA) {
+				ncm->interface_data = iface->bInterfaceNumber;
+			}
+		}
+		break;
+
+	case CDC_DT_CS_INTERFACE:
+		if (ncm->interface_class == CDC_CLASS_COMM && desc[2] == CDC_ETHERNET_NETWORKING) {
+			ncm->mac_string_index = desc[3];
+		}
+		break;
+
+	case USB_DT_ENDPOINT:
+		{
+			struct usb_endpoint_descriptor *ep = (struct usb_endpoint_descriptor*)descriptor;
+			// data endpoints are in the alternate setting, that is not empty
+			if (ncm->interface_class == CDC_CLASS_DATA && (ep->bmAttributes&0x03) == USB_ENDPOINT_ATTR_BULK) {
+				uint8_t epaddr = ep->bEndpointAddress;
+				ncm->interface_data_alternate = ncm->alternate_setting;
+				if (epaddr & (1<<7)) {
+					ncm->endpoint_in_address = epaddr&0x7f;
+					ncm->endpoint_in_maxpacketsize = ep->wMaxPacketSize;
+				} else {
+					ncm->endpoint_out_address = epaddr;
+					ncm->endpoint_out_maxpacketsize = ep->wMaxPacketSize;
+				}
+
+				if (ncm->endpoint_in_address && ncm->endpoint_out_address) {
+					ncm->state_next = STATE_SET_CONFIGURATION_REQUEST;
+					return true;
+				}
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+	return false;
+}
+
+static ntb_buffer_t *ntb_get_free(cdc_ncm_device_t *ncm, enum NTB_STATES state)
+{
+	uint32_t i;
+	for (i = 0; i < USBH_CDC_NCM_NTB_COUNT; i++) {
+		if (ncm->ntb[i].state == NTB_STATE_FREE) {
+			ncm->ntb[i].state = state;
+			return &ncm->ntb[i];
+		}
+	}
+	return 0;
+}
+
+/*
+ * Receive
+ */
+
+static void rx_arm(cdc_ncm_device_t *ncm);
+
+static void rx_ntb_release(ntb_buffer_t *ntb)
+{
+	if (!--ntb->refs) {
+		ntb->state = NTB_STATE_FREE;
+	}
+}
+
+/**
+ * Hand frames of received NTB to the user
+ */
+static void rx_parse(cdc_ncm_device_t *ncm, ntb_buffer_t *ntb, uint32_t length)
+{
+	const uint8_t *data = ntb->data;
+
+	if (length < NTH16_LENGTH || load_le32(&data[0]) != NTH16_SIGNATURE) {
+		LOG_WARN("NCM: bad NTH\n");
+		return;
+	}
+
+	const uint16_t block_length = load_le16(&data[8]);
+	uint16_t ndp_index = load_le16(&data[10]);
+	uint32_t chain;
+
+	if (block_length > length) {
+		LOG_WARN("NCM: short NTB %d/%d\n", length, block_length);
+		return;
+	}
+
+	for (chain = 0; chain < NDP_MAX_CHAIN && ndp_index; chain++) {
+		if (ndp_index + NDP16_HEADER_LENGTH > block_length ||
+			load_le32(&data[ndp_index]) != NDP16_SIGNATURE) {
+			LOG_WARN("NCM: bad NDP\n");
+			return;
+		}
+
+		const uint16_t ndp_length = load_le16(&data[ndp_index + 4]);
+		uint32_t entry = ndp_index + NDP16_HEADER_LENGTH;
+		const uint32_t ndp_end = ndp_index + ndp_length;
+
+		while (entry + 4 <= ndp_end && ndp_end <= block_length) {
+			const uint16_t index = load_le16(&data[entry]);
+			const uint16_t datagram_length = load_le16(&data[entry + 2]);
+			entry += 4;
+
+			if (!index || !datagram_length) {
+				break;
+			}
+			if (index + datagram_length > block_length) {
+				continue;
+			}
+
+			ntb->refs++;
+			cdc_ncm_config->rx_frame(ncm->device_id, &data[index], datagram_length);
+		}
+
+		ndp_index = load_le16(&data[ndp_index + 6]);
+	}
+}
+
+static void rx_callback(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	cdc_ncm_device_t *ncm = (cdc_ncm_device_t *)dev->drvdata;
+	ntb_buffer_t *ntb = ncm->rx;
+
+	ncm->rx = 0;
+	if (ncm->state_next != STATE_RUNNING) {
+		return;
+	}
+
+	switch (cb_data.status) {
+	case USBH_PACKET_CALLBACK_STATUS_OK:
+	case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+		// reference held while parsing, so the buffer is not freed in between
+		ntb->state = NTB_STATE_RX_HELD;
+		ntb->refs = 1;
+		if (cdc_ncm_config->rx_frame) {
+			rx_parse(ncm, ntb, cb_data.transferred_length);
+		}
+		rx_ntb_release(ntb);
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+		ntb->state = NTB_STATE_FREE;
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+		// device is stopped, poll would re-arm the failing read forever
+		ERROR(cb_data.status);
+		ntb->state = NTB_STATE_FREE;
+		ncm->state_next = STATE_ERROR;
+		if (cdc_ncm_config->notify_disconnected) {
+			cdc_ncm_config->notify_disconnected(ncm->device_id);
+		}
+		return;
+	}
+
+	// keep one read always pending
+	rx_arm(ncm);
+}
+
+static void rx_arm(cdc_ncm_device_t *ncm)
+{
+	ntb_buffer_t *ntb = ntb_get_free(ncm, NTB_STATE_RX_PENDING);
+	if (!ntb) {
+		// all buffers are held by user or transmit, poll retries
+		return;
+	}
+
+	usbh_packet_t packet;
+
+	packet.address = ncm->usbh_device->address;
+	packet.data = ntb->data;
+	packet.datalen = USBH_CDC_NCM_NTB_SIZE;
+	packet.endpoint_address = ncm->endpoint_in_address;
+	packet.endpoint_size_max = ncm->endpoint_in_maxpacketsize;
+	packet.endpoint_type = USBH_ENDPOINT_TYPE_BULK;
+	packet.speed = ncm->usbh_device->speed;
+	packet.callback = rx_callback;
+	packet.callback_arg = ncm->usbh_device;
+	packet.toggle = &ncm->endpoint_in_toggle;
+
+	ncm->rx = ntb;
+	usbh_read(ncm->usbh_device, &packet);
+}
+
+/*
+ * Transmit
+ */
+
+static uint16_t align_up(uint16_t offset, uint16_t alignment)
+{
+	return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+/**
+ * Datagram offset, that satisfies offset % divisor == remainder
+ */
+static uint16_t align_datagram(const cdc_ncm_device_t *ncm, uint16_t offset)
+{
+	const uint16_t divisor = ncm->ndp_out_divisor;
+	const uint16_t remainder = offset % divisor;
+	return offset + (ncm->ndp_out_remainder + divisor - remainder) % divisor;
+}
+
+/**
+ * Write NTH16 and NDP16 behind the last datagram
+ */
+static void tx_close(cdc_ncm_device_t *ncm)
+{
+	ntb_buffer_t *ntb = ncm->tx_filling;
+	uint8_t *data = ntb->data;
+	const uint16_t ndp_index = align_up(ntb->end, ncm->ndp_out_alignment);
+	const uint16_t ndp_length = NDP16_HEADER_LENGTH + 4 * (ntb->datagram_count + 1);
+	uint8_t i;
+
+	ntb->length = ndp_index + ndp_length;
+	ntb->sequence = ncm->tx_sequence++;
+
+	store_le32(&data[0], NTH16_SIGNATURE);
+	store_le16(&data[4], NTH16_LENGTH);
+	store_le16(&data[6], ntb->sequence);
+	store_le16(&data[8], ntb->length);
+	store_le16(&data[10], ndp_index);
+
+	memset(&data[ntb->end], 0, ndp_index - ntb->end);
+	store_le32(&data[ndp_index], NDP16_SIGNATURE);
+	store_le16(&data[ndp_index + 4], ndp_length);
+	store_le16(&data[ndp_index + 6], 0);
+	for (i = 0; i < ntb->datagram_count; i++) {
+		store_le16(&data[ndp_index + 8 + 4 * i], ntb->datagram_index[i]);
+		store_le16(&data[ndp_index + 10 + 4 * i], ntb->datagram_length[i]);
+	}
+	store_le32(&data[ndp_index + 8 + 4 * i], 0);
+
+	ntb->state = NTB_STATE_TX_QUEUED;
+	ncm->tx_filling = 0;
+	ncm->tx_frames_last = 0;
+}
+
+static bool tx_fits(const cdc_ncm_device_t *ncm, const ntb_buffer_t *ntb, uint16_t length)
+{
+	const uint32_t start = align_datagram(ncm, ntb->end);
+	const uint32_t ndp_index = align_up(start + length, ncm->ndp_out_alignment);
+	const uint32_t ndp_length = NDP16_HEADER_LENGTH + 4 * (ntb->datagram_count + 2);
+	return ndp_index + ndp_length <= ncm->ntb_out_max;
+}
+
+static void tx_send_chunk(cdc_ncm_device_t *ncm);
+static void tx_start(cdc_ncm_device_t *ncm);
+
+static void tx_callback(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	cdc_ncm_device_t *ncm = (cdc_ncm_device_t *)dev->drvdata;
+	ntb_buffer_t *ntb = ncm->tx_sending;
+
+	if (ncm->state_next != STATE_RUNNING || !ntb) {
+		return;
+	}
+
+	switch (cb_data.status) {
+	case USBH_PACKET_CALLBACK_STATUS_OK:
+		if (!ncm->tx_chunk) {
+			// zero length packet terminated the transfer
+			ncm->tx_zlp = false;
+		}
+		ncm->tx_index += ncm->tx_chunk;
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+		// send the same packet again
+		break;
+
+	case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+	case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+		ERROR(cb_data.status);
+		ntb->state = NTB_STATE_FREE;
+		ncm->tx_sending = 0;
+		return;
+	}
+
+	if (ncm->tx_index < ntb->length || ncm->tx_zlp) {
+		tx_send_chunk(ncm);
+	} else {
+		ntb->state = NTB_STATE_FREE;
+		ncm->tx_sending = 0;
+		// next queued block goes right away, without waiting for the next poll
+		tx_start(ncm);
+	}
+}
+
+/**
+ * NTB is sent packet by packet, since low-level driver fills whole packet
+ * into the transmit FIFO at once
+ */
+static void tx_send_chunk(cdc_ncm_device_t *ncm)
+{
+	ntb_buffer_t *ntb = ncm->tx_sending;
+	usbh_packet_t packet;
+	uint16_t chunk = ntb->length - ncm->tx_index;
+
+	if (chunk > ncm->endpoint_out_maxpacketsize) {
+		chunk = ncm->endpoint_out_maxpacketsize;
+	}
+	ncm->tx_chunk = chunk;
+
+	packet.address = ncm->usbh_device->address;
+	packet.data = &ntb->data[ncm->tx_index];
+	packet.datalen = chunk;
+	packet.endpoint_address = ncm->endpoint_out_address;
+	packet.endpoint_size_max = ncm->endpoint_out_maxpacketsize;
+	packet.endpoint_type = USBH_ENDPOINT_TYPE_BULK;
+	packet.speed = ncm->usbh_device->speed;
+	packet.callback = tx_callback;
+	packet.callback_arg = ncm->usbh_device;
+	packet.toggle = &ncm->endpoint_out_toggle;
+
+	usbh_write(ncm->usbh_device, &packet);
+}
+
+static void tx_start(cdc_ncm_device_t *ncm)
+{
+	ntb_buffer_t *ntb = 0;
+	uint32_t i;
+
+	if (ncm->tx_sending) {
+		return;
+	}
+
+	// oldest queued block goes first
+	for (i = 0; i < USBH_CDC_NCM_NTB_COUNT; i++) {
+		ntb_buffer_t *queued = &ncm->ntb[i];
+		if (queued->state == NTB_STATE_TX_QUEUED &&
+			(!ntb || (int16_t)(queued->sequence - ntb->sequence) < 0)) {
+			ntb = queued;
+		}
+	}
+
+	if (ntb) {
+		ntb->state = NTB_STATE_TX_SENDING;
+		ncm->tx_sending = ntb;
+		ncm->tx_index = 0;
+		// transfer shorter than dwNtbOutMaxSize has to end with short packet,
+		// blocks are limited by the buffer size, that can be less than that
+		ncm->tx_zlp = !(ntb->length % ncm->endpoint_out_maxpacketsize) &&
+			ntb->length < ncm->ntb_out_max_device;
+		tx_send_chunk(ncm);
+	}
+}
+
+static void tx_poll(cdc_ncm_device_t *ncm)
+{
+	ntb_buffer_t *ntb = ncm->tx_filling;
+
+	// nothing was added since previous poll, send what we have
+	if (ntb && ntb->datagram_count == ncm->tx_frames_last) {
+		tx_close(ncm);
+	} else if (ntb) {
+		ncm->tx_frames_last = ntb->datagram_count;
+	}
+
+	tx_start(ncm);
+}
+
+/*
+ * Configuration
+ */
+
+static void parse_ntb_parameters(cdc_ncm_device_t *ncm, const uint8_t *param)
+{
+	const uint32_t ntb_out_max = load_le32(&param[16]);
+	const uint16_t divisor = load_le16(&param[20]);
+	const uint16_t remainder = load_le16(&param[22]);
+	const uint16_t alignment = load_le16(&param[24]);
+	const uint16_t datagrams = load_le16(&param[26]);
+
+	ncm->ntb_out_max = USBH_CDC_NCM_NTB_SIZE;
+	if (ntb_out_max && ntb_out_max < USBH_CDC_NCM_NTB_SIZE) {
+		ncm->ntb_out_max = ntb_out_max;
+	}
+	ncm->ntb_out_max_device = ntb_out_max ? ntb_out_max : ncm->ntb_out_max;
+
+	// divisor and alignment have to be power of two, 4 is the default
+	ncm->ndp_out_divisor = 4;
+	if (divisor && !(divisor & (divisor - 1)) && divisor <= 64) {
+		ncm->ndp_out_divisor = divisor;
+	}
+	ncm->ndp_out_remainder = remainder % ncm->ndp_out_divisor;
+
+	ncm->ndp_out_alignment = 4;
+	if (alignment && !(alignment & (alignment - 1)) && alignment <= 64) {
+		ncm->ndp_out_alignment = alignment;
+	}
+
+	ncm->ntb_out_datagrams = USBH_CDC_NCM_TX_DATAGRAMS;
+	if (datagrams && datagrams < USBH_CDC_NCM_TX_DATAGRAMS) {
+		ncm->ntb_out_datagrams = datagrams;
+	}
+
+	LOG_INFO("NCM: out max %d, divisor %d, datagrams %d\n",
+		ncm->ntb_out_max, ncm->ndp_out_divisor, ncm->ntb_out_datagrams);
+}
+
+static uint8_t hex_value(uint8_t c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return 0;
+}
+
+static void parse_mac(cdc_ncm_device_t *ncm, const uint8_t *string, uint32_t length)
+{
+	uint32_t i;
+	if (length < MAC_STRING_LENGTH) {
+		return;
+	}
+	// unicode string, low byte of each character is the digit
+	for (i = 0; i < 6; i++) {
+		ncm->mac[i] = (hex_value(string[2 + 4 * i]) << 4) | hex_value(string[4 + 4 * i]);
+	}
+}
+
+static void running_start(cdc_ncm_device_t *ncm)
+{
+	uint32_t i;
+	for (i = 0; i < USBH_CDC_NCM_NTB_COUNT; i++) {
+		ncm->ntb[i].state = NTB_STATE_FREE;
+	}
+	ncm->rx = 0;
+	ncm->tx_filling = 0;
+	ncm->tx_sending = 0;
+	ncm->tx_frames_last = 0;
+	ncm->tx_sequence = 0;
+	ncm->endpoint_in_toggle = 0;
+	ncm->endpoint_out_toggle = 0;
+	ncm->state_next = STATE_RUNNING;
+	LOG_INFO("\nCDC NCM CONFIGURED\n");
+
+	rx_arm(ncm);
+
+	if (cdc_ncm_config->notify_connected) {
+		cdc_ncm_config->notify_connected(ncm->device_id, ncm->mac);
+	}
+}
+
+static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data);
+
+static void control_request(cdc_ncm_device_t *ncm, uint8_t request_type, uint8_t request,
+	uint16_t value, uint16_t index, uint16_t length, enum STATES state_next)
+{
+	struct usb_setup_data setup_data;
+
+	setup_data.bmRequestType = request_type;
+	setup_data.bRequest = request;
+	setup_data.wValue = value;
+	setup_data.wIndex = index;
+	setup_data.wLength = length;
+
+	ncm->state_next = state_next;
+	device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, ncm->usbh_device);
+}
+
+static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	cdc_ncm_device_t *ncm = (cdc_ncm_device_t *)dev->drvdata;
+
+	// Reading of parameters and MAC address may return less data
+	if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK &&
+		!(cb_data.status == USBH_PACKET_CALLBACK_STATUS_ERRSIZ &&
+			(ncm->state_next == STATE_GET_NTB_PARAMETERS_COMPLETE ||
+			ncm->state_next == STATE_GET_MAC_COMPLETE))) {
+		ERROR(cb_data.status);
+		ncm->state_next = STATE_ERROR;
+		return;
+	}
+
+	switch (ncm->state_next) {
+	case STATE_SET_CONFIGURATION_EMPTY_READ:
+	case STATE_SET_NTB_INPUT_SIZE_EMPTY_READ:
+	case STATE_SET_INTERFACE_EMPTY_READ:
+		LOG_PRINTF("|empty packet read|");
+		ncm->state_next++;
+		device_xfer_control_read(0, 0, event, dev);
+		break;
+
+	case STATE_SET_CONFIGURATION_COMPLETE:
+		control_request(ncm, 0b10100001, NCM_REQ_GET_NTB_PARAMETERS, 0, ncm->interface_comm,
+			NTB_PARAMETERS_LENGTH, STATE_GET_NTB_PARAMETERS_READ);
+		break;
+
+	case STATE_GET_NTB_PARAMETERS_READ:
+		ncm->state_next = STATE_GET_NTB_PARAMETERS_COMPLETE;
+		memset(ncm->control_buffer, 0, sizeof(ncm->control_buffer));
+		device_xfer_control_read(ncm->control_buffer, NTB_PARAMETERS_LENGTH, event, dev);
+		break;
+
+	case STATE_GET_NTB_PARAMETERS_COMPLETE:
+		parse_ntb_parameters(ncm, ncm->control_buffer);
+		// limit NTBs from device to the size of our buffers
+		control_request(ncm, 0b00100001, NCM_REQ_SET_NTB_INPUT_SIZE, 0, ncm->interface_comm,
+			4, STATE_SET_NTB_INPUT_SIZE_DATA);
+		break;
+
+	case STATE_SET_NTB_INPUT_SIZE_DATA:
+		store_le32(ncm->control_buffer, USBH_CDC_NCM_NTB_SIZE);
+		ncm->state_next = STATE_SET_NTB_INPUT_SIZE_EMPTY_READ;
+		device_xfer_control_write_data(ncm->control_buffer, 4, event, dev);
+		break;
+
+	case STATE_SET_NTB_INPUT_SIZE_COMPLETE:
+		memset(ncm->mac, 0, sizeof(ncm->mac));
+		if (ncm->mac_string_index) {
+			control_request(ncm, 0b10000000, USB_REQ_GET_DESCRIPTOR,
+				(USB_DT_STRING << 8) | ncm->mac_string_index, LANGID_EN_US,
+				MAC_STRING_LENGTH, STATE_GET_MAC_READ);
+			break;
+		}
+		// no MAC address
+		control_request(ncm, 0b00000001, USB_REQ_SET_INTERFACE, ncm->interface_data_alternate,
+			ncm->interface_data, 0, STATE_SET_INTERFACE_EMPTY_READ);
+		break;
+
+	case STATE_GET_MAC_READ:
+		ncm->state_next = STATE_GET_MAC_COMPLETE;
+		device_xfer_control_read(ncm->control_buffer, MAC_STRING_LENGTH, event, dev);
+		break;
+
+	case STATE_GET_MAC_COMPLETE:
+		parse_mac(ncm, ncm->control_buffer, cb_data.transferred_length);
+		// select alternate setting with data endpoints
+		control_request(ncm, 0b00000001, USB_REQ_SET_INTERFACE, ncm->interface_data_alternate,
+			ncm->interface_data, 0, STATE_SET_INTERFACE_EMPTY_READ);
+		break;
+
+	case STATE_SET_INTERFACE_COMPLETE:
+		running_start(ncm);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * @param time_curr_us - monotically rising time
+ *		unit is microseconds
+ * @see usbh_poll()
+ */
+static void poll(void *drvdata, uint32_t time_curr_us)
+{
+	(void)time_curr_us;
+
+	cdc_ncm_device_t *ncm = (cdc_ncm_device_t *)drvdata;
+	usbh_device_t *dev = ncm->usbh_device;
+
+	switch (ncm->state_next) {
+	case STATE_RUNNING:
+		if (!ncm->rx) {
+			rx_arm(ncm);
+		}
+		tx_poll(ncm);
+		break;
+
+	case STATE_SET_CONFIGURATION_REQUEST:
+		{
+			struct usb_setup_data setup_data;
+
+			setup_data.bmRequestType = 0b00000000;
+			setup_data.bRequest = USB_REQ_SET_CONFIGURATION;
+			setup_data.wValue = ncm->configuration_value;
+			setup_data.wIndex = 0;
+			setup_data.wLength = 0;
+
+			ncm->state_next = STATE_SET_CONFIGURATION_EMPTY_READ;
+
+			device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+		}
+		break;
+
+	default:
+		// do nothing - probably transfer is in progress
+		break;
+	}
+}
+
+static void remove(void *drvdata)
+{
+	LOG_INFO("Removing CDC NCM\n");
+
+	cdc_ncm_device_t *ncm = (cdc_ncm_device_t *)drvdata;
+
+	if (ncm->state_next == STATE_RUNNING && cdc_ncm_config->notify_disconnected) {
+		cdc_ncm_config->notify_disconnected(ncm->device_id);
+	}
+	ncm->state_next = STATE_INACTIVE;
+	ncm->endpoint_in_address = 0;
+	ncm->endpoint_out_address = 0;
+}
+
+void usbh_cdc_ncm_rx_release(uint8_t device_id, const uint8_t *frame)
+{
+	// bad device_id handling
+	if (device_id >= USBH_CDC_NCM_MAX_DEVICES) {
+		return;
+	}
+
+	cdc_ncm_device_t *ncm = &cdc_ncm_device[device_id];
+	uint32_t i;
+
+	for (i = 0; i < USBH_CDC_NCM_NTB_COUNT; i++) {
+		ntb_buffer_t *ntb = &ncm->ntb[i];
+		if (frame >= ntb->data && frame < &ntb->data[USBH_CDC_NCM_NTB_SIZE]) {
+			if (ntb->state == NTB_STATE_RX_HELD && ntb->refs) {
+				rx_ntb_release(ntb);
+			}
+			return;
+		}
+	}
+}
+
+uint8_t *usbh_cdc_ncm_tx_frame(uint8_t device_id, uint16_t length)
+{
+	// bad device_id handling
+	if (device_id >= USBH_CDC_NCM_MAX_DEVICES) {
+		return 0;
+	}
+
+	cdc_ncm_device_t *ncm = &cdc_ncm_device[device_id];
+	if (ncm->state_next != STATE_RUNNING) {
+		return 0;
+	}
+
+	ntb_buffer_t *ntb = ncm->tx_filling;
+	if (ntb && !tx_fits(ncm, ntb, length)) {
+		tx_close(ncm);
+		ntb = 0;
+	}
+
+	if (!ntb) {
+		ntb = ntb_get_free(ncm, NTB_STATE_TX_FILLING);
+		if (!ntb) {
+			return 0;
+		}
+		ntb->datagram_count = 0;
+		ntb->end = NTH16_LENGTH;
+		ncm->tx_filling = ntb;
+		ncm->tx_frames_last = 0;
+		if (!tx_fits(ncm, ntb, length)) {
+			// frame larger than the whole block
+			ntb->state = NTB_STATE_FREE;
+			ncm->tx_filling = 0;
+			return 0;
+		}
+	}
+
+	const uint16_t start = align_datagram(ncm, ntb->end);
+	memset(&ntb->data[ntb->end], 0, start - ntb->end);
+	ntb->datagram_index[ntb->datagram_count] = start;
+	ntb->datagram_length[ntb->datagram_count] = length;
+	ntb->datagram_count++;
+	ntb->end = start + length;
+
+	uint8_t *frame = &ntb->data[start];
+	if (ntb->datagram_count == ncm->ntb_out_datagrams) {
+		tx_close(ncm);
+	}
+	return frame;
+}
+
+bool usbh_cdc_ncm_send(uint8_t device_id, const void *frame, uint16_t length)
+{
+	uint8_t *data = usbh_cdc_ncm_tx_frame(device_id, length);
+	if (!data) {
+		return false;
+	}
+	memcpy(data, frame, length);
+	return true;
+}
+
+static const usbh_dev_driver_info_t driver_info = {
+	.deviceClass = -1,
+	.deviceSubClass = -1,
+	.deviceProtocol = -1,
+	.idVendor = -1,
+	.idProduct = -1,
+	.ifaceClass = 0x02,
+	.ifaceSubClass = 0x0d,
+	.ifaceProtocol = -1
+};
+
+const usbh_dev_driver_t usbh_cdc_ncm_driver = {
+	.init = init,
+	.analyze_descriptor = analyze_descriptor,
+	.poll = poll,
+	.remove = remove,
+	.info = &driver_info
+};
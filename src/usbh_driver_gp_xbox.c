@@ -24,10 +24,14 @@
 #include "usart_helpers.h"
 #include "usbh_driver_gp_xbox.h"
 #include "driver/usbh_device_driver.h"
+#include "usbh_seqlock.h"
 
 #include <stdint.h>
+#include <string.h>
 #include <libopencm3/usb/usbstd.h>
 
+#define LOG_MODULE XBOX
+
 enum STATES {
 	STATE_INACTIVE,
 	STATE_READING_COMPLETE,
@@ -48,6 +52,15 @@ struct _gp_xbox_device {
 	uint8_t endpoint_in_toggle;
 	uint8_t device_id;
 	uint8_t configuration_value;
+
+	// last raw report and last reported state, for change detection
+	uint8_t report_last[GP_XBOX_CORRECT_TRANSFERRED_LENGTH];
+	bool report_valid;
+	gp_xbox_packet_t packet_last;
+
+	// latest state for readers outside of usbh_poll()
+	usbh_seqlock_t state_lock;
+	gp_xbox_packet_t state;
 };
 typedef struct _gp_xbox_device gp_xbox_device_t;
 
@@ -67,6 +80,7 @@ void gp_xbox_driver_init(const gp_xbox_config_t *config)
 	gp_xbox_config = config;
 	for (i = 0; i < USBH_GP_XBOX_MAX_DEVICES; i++) {
 		gp_xbox_device[i].state_next = STATE_INACTIVE;
+		gp_xbox_device[i].usbh_device = 0;
 	}
 }
 
@@ -77,21 +91,23 @@ void gp_xbox_driver_init(const gp_xbox_config_t *config)
 static void *init(void *usbh_dev)
 {
 	if (!initialized) {
-		LOG_PRINTF("\n%s/%d : driver not initialized\n", __FILE__, __LINE__);
+		LOG_ERROR("\n%s/%d : driver not initialized\n", __FILE__, __LINE__);
 		return 0;
 	}
 
 	uint32_t i;
 	gp_xbox_device_t *drvdata = 0;
 
-	// find free data space for gp_xbox device
+	// find free data space for gp_xbox device, device stopped by a transfer
+	// error keeps its data space until it is removed
 	for (i = 0; i < USBH_GP_XBOX_MAX_DEVICES; i++) {
-		if (gp_xbox_device[i].state_next == STATE_INACTIVE) {
+		if (!gp_xbox_device[i].usbh_device) {
 			drvdata = &gp_xbox_device[i];
 			drvdata->device_id = i;
 			drvdata->endpoint_in_address = 0;
 			drvdata->endpoint_in_toggle = 0;
 			drvdata->usbh_device = (usbh_device_t *)usbh_dev;
+			usbh_seqlock_init(&drvdata->state_lock);
 			break;
 		}
 	}
@@ -122,7 +138,7 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 			struct usb_endpoint_descriptor *ep = (struct usb_endpoint_descriptor*)descriptor;
 			if ((ep->bmAttributes&0x03) == USB_ENDPOINT_ATTR_INTERRUPT) {
 				uint8_t epaddr = ep->bEndpointAddress;
-				if (epaddr & (1<<7)) {
+				if ((epaddr & (1<<7)) && usbh_periodic_open(gp_xbox->usbh_device, epaddr)) {
 					gp_xbox->endpoint_in_address = epaddr&0x7f;
 					if (ep->wMaxPacketSize < USBH_GP_XBOX_BUFFER) {
 						gp_xbox->endpoint_in_maxpacketsize = ep->wMaxPacketSize;
@@ -145,99 +161,128 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 	return false;
 }
 
-static void parse_data(usbh_device_t *dev)
-{
-	gp_xbox_device_t *gp_xbox = (gp_xbox_device_t *)dev->drvdata;
-
-	uint8_t *packet = gp_xbox->buffer;
-
-	gp_xbox_packet_t gp_xbox_packet;
-	gp_xbox_packet.buttons = 0;
-
-	// DPAD
-	const uint8_t data1 = packet[2];
-	const uint8_t data2 = packet[3];
-	if (data1 & (1 << 0)) {
-		gp_xbox_packet.buttons |= GP_XBOX_DPAD_TOP;
-	}
-
-	if (data1 & (1 << 1)) {
-		gp_xbox_packet.buttons |= GP_XBOX_DPAD_BOTTOM;
-	}
-
-	if (data1 & (1 << 2)) {
-		gp_xbox_packet.buttons |= GP_XBOX_DPAD_LEFT;
-	}
-
-	if (data1 & (1 << 3)) {
-		gp_xbox_packet.buttons |= GP_XBOX_DPAD_RIGHT;
-	}
+/*
+ * Button masks of the report bits, looked up by nibble
+ *
+ * Entry i contains masks of bits set in i, in order of bit 0..3
+ */
+#define NIBBLE_TABLE(b0, b1, b2, b3) { \
+	0, (b0), (b1), (b1)|(b0), \
+	(b2), (b2)|(b0), (b2)|(b1), (b2)|(b1)|(b0), \
+	(b3), (b3)|(b0), (b3)|(b1), (b3)|(b1)|(b0), \
+	(b3)|(b2), (b3)|(b2)|(b0), (b3)|(b2)|(b1), (b3)|(b2)|(b1)|(b0) \
+}
 
-	// Start + select
+static const uint16_t buttons_data1_low[16] = NIBBLE_TABLE(
+	GP_XBOX_DPAD_TOP, GP_XBOX_DPAD_BOTTOM, GP_XBOX_DPAD_LEFT, GP_XBOX_DPAD_RIGHT);
+static const uint16_t buttons_data1_high[16] = NIBBLE_TABLE(
+	GP_XBOX_BUTTON_START, GP_XBOX_BUTTON_SELECT, GP_XBOX_BUTTON_AXIS_LEFT, GP_XBOX_BUTTON_AXIS_RIGHT);
+static const uint16_t buttons_data2_low[16] = NIBBLE_TABLE(
+	GP_XBOX_BUTTON_LT, GP_XBOX_BUTTON_RT, GP_XBOX_BUTTON_XBOX, 0);
+static const uint16_t buttons_data2_high[16] = NIBBLE_TABLE(
+	GP_XBOX_BUTTON_A, GP_XBOX_BUTTON_B, GP_XBOX_BUTTON_X, GP_XBOX_BUTTON_Y);
 
-	if (data1 & (1 << 4)) {
-		gp_xbox_packet.buttons |= GP_XBOX_BUTTON_START;
-	}
-
-	if (data1 & (1 << 5)) {
-		gp_xbox_packet.buttons |= GP_XBOX_BUTTON_SELECT;
+/**
+ * Apply deadzone and hysteresis to one axis
+ *
+ * Returns value to be reported
+ */
+static int32_t filter_axis(int32_t value, int32_t value_last, const gp_xbox_axis_filter_t *filter,
+	int32_t min, int32_t max)
+{
+	const int32_t magnitude = value < 0 ? -value : value;
+	if (magnitude <= filter->deadzone) {
+		return 0;
 	}
 
-	// axis buttons
-
-	if (data1 & (1 << 6)) {
-		gp_xbox_packet.buttons |= GP_XBOX_BUTTON_AXIS_LEFT;
+	// extremes are always reported, so the full range stays reachable
+	const int32_t delta = value - value_last;
+	if (value == min || value == max || delta > filter->hysteresis || -delta > filter->hysteresis) {
+		return value;
 	}
+	return value_last;
+}
 
-	if (data1 & (1 << 7)) {
-		gp_xbox_packet.buttons |= GP_XBOX_BUTTON_AXIS_RIGHT;
+static void report(gp_xbox_device_t *gp_xbox, gp_xbox_packet_t *gp_xbox_packet)
+{
+	const gp_xbox_axis_filter_t *filter = gp_xbox_config->axis_filter;
+	const gp_xbox_packet_t *last = &gp_xbox->packet_last;
+
+	gp_xbox_packet->axis_left_x = filter_axis(gp_xbox_packet->axis_left_x, last->axis_left_x,
+		&filter[GP_XBOX_AXIS_LEFT_X], INT16_MIN, INT16_MAX);
+	gp_xbox_packet->axis_left_y = filter_axis(gp_xbox_packet->axis_left_y, last->axis_left_y,
+		&filter[GP_XBOX_AXIS_LEFT_Y], INT16_MIN, INT16_MAX);
+	gp_xbox_packet->axis_right_x = filter_axis(gp_xbox_packet->axis_right_x, last->axis_right_x,
+		&filter[GP_XBOX_AXIS_RIGHT_X], INT16_MIN, INT16_MAX);
+	gp_xbox_packet->axis_right_y = filter_axis(gp_xbox_packet->axis_right_y, last->axis_right_y,
+		&filter[GP_XBOX_AXIS_RIGHT_Y], INT16_MIN, INT16_MAX);
+	gp_xbox_packet->axis_rear_left = filter_axis(gp_xbox_packet->axis_rear_left, last->axis_rear_left,
+		&filter[GP_XBOX_AXIS_REAR_LEFT], 0, UINT8_MAX);
+	gp_xbox_packet->axis_rear_right = filter_axis(gp_xbox_packet->axis_rear_right, last->axis_rear_right,
+		&filter[GP_XBOX_AXIS_REAR_RIGHT], 0, UINT8_MAX);
+
+	const uint32_t buttons_changed = gp_xbox_packet->buttons ^ last->buttons;
+	uint8_t axes_changed = 0;
+	axes_changed |= (gp_xbox_packet->axis_left_x != last->axis_left_x) << GP_XBOX_AXIS_LEFT_X;
+	axes_changed |= (gp_xbox_packet->axis_left_y != last->axis_left_y) << GP_XBOX_AXIS_LEFT_Y;
+	axes_changed |= (gp_xbox_packet->axis_right_x != last->axis_right_x) << GP_XBOX_AXIS_RIGHT_X;
+	axes_changed |= (gp_xbox_packet->axis_right_y != last->axis_right_y) << GP_XBOX_AXIS_RIGHT_Y;
+	axes_changed |= (gp_xbox_packet->axis_rear_left != last->axis_rear_left) << GP_XBOX_AXIS_REAR_LEFT;
+	axes_changed |= (gp_xbox_packet->axis_rear_right != last->axis_rear_right) << GP_XBOX_AXIS_REAR_RIGHT;
+
+	// movement within hysteresis, nothing to report
+	if (!buttons_changed && !axes_changed) {
+		return;
 	}
 
-	// buttons ABXY
+	gp_xbox->packet_last = *gp_xbox_packet;
+	usbh_seqlock_write(&gp_xbox->state_lock, &gp_xbox->state, gp_xbox_packet, sizeof(gp_xbox->state));
 
-	if (data2 & (1 << 4)) {
-		gp_xbox_packet.buttons |= GP_XBOX_BUTTON_A;
+	// call update callback
+	if (gp_xbox_config->update) {
+		gp_xbox_config->update(gp_xbox->device_id, gp_xbox_packet);
 	}
 
-	if (data2 & (1 << 5)) {
-		gp_xbox_packet.buttons |= GP_XBOX_BUTTON_B;
+	if (gp_xbox_config->diff) {
+		gp_xbox_config->diff(gp_xbox->device_id, gp_xbox_packet, buttons_changed, axes_changed);
 	}
+}
 
-	if (data2 & (1 << 6)) {
-		gp_xbox_packet.buttons |= GP_XBOX_BUTTON_X;
-	}
+static inline int16_t load_le16(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8);
+}
 
-	if (data2 & (1 << 7)) {
-		gp_xbox_packet.buttons |= GP_XBOX_BUTTON_Y;
-	}
+static void parse_data(usbh_device_t *dev)
+{
+	gp_xbox_device_t *gp_xbox = (gp_xbox_device_t *)dev->drvdata;
 
-	// buttons rear
+	const uint8_t *packet = gp_xbox->buffer;
 
-	if (data2 & (1 << 0)) {
-		gp_xbox_packet.buttons |= GP_XBOX_BUTTON_LT;
+	// controller repeats the same report, skip decoding
+	if (gp_xbox->report_valid && !memcmp(gp_xbox->report_last, packet, GP_XBOX_CORRECT_TRANSFERRED_LENGTH)) {
+		return;
 	}
+	memcpy(gp_xbox->report_last, packet, GP_XBOX_CORRECT_TRANSFERRED_LENGTH);
+	gp_xbox->report_valid = true;
 
-	if (data2 & (1 << 1)) {
-		gp_xbox_packet.buttons |= GP_XBOX_BUTTON_RT;
-	}
+	gp_xbox_packet_t gp_xbox_packet;
 
-	if (data2 & (1 << 2)) {
-		gp_xbox_packet.buttons |= GP_XBOX_BUTTON_XBOX;
-	}
+	// DPAD, start + select, axis buttons in packet[2]; rear buttons and ABXY in packet[3]
+	const uint8_t data1 = packet[2];
+	const uint8_t data2 = packet[3];
+	gp_xbox_packet.buttons = buttons_data1_low[data1 & 0x0f] | buttons_data1_high[data1 >> 4] |
+		buttons_data2_low[data2 & 0x0f] | buttons_data2_high[data2 >> 4];
 
 	// rear levers
-
 	gp_xbox_packet.axis_rear_left = packet[4];
 	gp_xbox_packet.axis_rear_right = packet[5];
-	gp_xbox_packet.axis_left_x = packet[7]*256 + packet[6];
-	gp_xbox_packet.axis_left_y = packet[9]*256 + packet[8];
-	gp_xbox_packet.axis_right_x = packet[11]*256 + packet[10];
-	gp_xbox_packet.axis_right_y = packet[13]*256 + packet[12];
+	gp_xbox_packet.axis_left_x = load_le16(&packet[6]);
+	gp_xbox_packet.axis_left_y = load_le16(&packet[8]);
+	gp_xbox_packet.axis_right_x = load_le16(&packet[10]);
+	gp_xbox_packet.axis_right_y = load_le16(&packet[12]);
 
-	// call update callback
-	if (gp_xbox_config->update) {
-		gp_xbox_config->update(gp_xbox->device_id, gp_xbox_packet);
-	}
+	report(gp_xbox, &gp_xbox_packet);
 }
 
 static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
@@ -248,19 +293,25 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 		{
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
+				usbh_device_activity(dev);
 				parse_data(dev);
 				gp_xbox->state_next = STATE_READING_REQUEST;
 				break;
 
 			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
 				if (cb_data.transferred_length == GP_XBOX_CORRECT_TRANSFERRED_LENGTH) {
+					usbh_device_activity(dev);
 					parse_data(dev);
 				}
 				gp_xbox->state_next = STATE_READING_REQUEST;
 				break;
 
-			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
 			case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+				// no report in this interval
+				gp_xbox->state_next = STATE_READING_REQUEST;
+				break;
+
+			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
 				ERROR(cb_data.status);
 				gp_xbox->state_next = STATE_INACTIVE;
 				break;
@@ -291,7 +342,11 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 			case USBH_PACKET_CALLBACK_STATUS_OK:
 				gp_xbox->state_next = STATE_READING_REQUEST;
 				gp_xbox->endpoint_in_toggle = 0;
-				LOG_PRINTF("\ngp_xbox CONFIGURED\n");
+				gp_xbox->report_valid = false;
+				memset(&gp_xbox->packet_last, 0, sizeof(gp_xbox->packet_last));
+				usbh_seqlock_write(&gp_xbox->state_lock, &gp_xbox->state, &gp_xbox->packet_last, sizeof(gp_xbox->state));
+				usbh_periodic_interval(dev, gp_xbox->endpoint_in_address | 0x80, gp_xbox_config->poll_interval_ms);
+				LOG_INFO("\ngp_xbox CONFIGURED\n");
 				if (gp_xbox_config->notify_connected) {
 					gp_xbox_config->notify_connected(gp_xbox->device_id);
 				}
@@ -337,7 +392,7 @@ static void read_gp_xbox_in(gp_xbox_device_t *gp_xbox)
 	packet.toggle = &gp_xbox->endpoint_in_toggle;
 
 	gp_xbox->state_next = STATE_READING_COMPLETE;
-	usbh_read(gp_xbox->usbh_device, &packet);
+	usbh_read_once(gp_xbox->usbh_device, &packet);
 
 	// LOG_PRINTF("@gp_xbox EP1 |  \n");
 }
@@ -355,7 +410,8 @@ static void poll(void *drvdata, uint32_t time_curr_us)
 
 	switch (gp_xbox->state_next) {
 	case STATE_READING_REQUEST:
-		{
+		// read only in frames assigned to the endpoint
+		if (usbh_periodic_due(dev, gp_xbox->endpoint_in_address | 0x80)) {
 			read_gp_xbox_in(gp_xbox);
 		}
 		break;
@@ -386,7 +442,7 @@ static void poll(void *drvdata, uint32_t time_curr_us)
 
 static void remove(void *drvdata)
 {
-	LOG_PRINTF("Removing xbox\n");
+	LOG_INFO("Removing xbox\n");
 
 	gp_xbox_device_t *gp_xbox = (gp_xbox_device_t *)drvdata;
 	if (gp_xbox_config->notify_disconnected) {
@@ -394,6 +450,31 @@ static void remove(void *drvdata)
 	}
 	gp_xbox->state_next = STATE_INACTIVE;
 	gp_xbox->endpoint_in_address = 0;
+	gp_xbox->usbh_device = 0;
+}
+
+/**
+ * Idle gamepad can be suspended between reads
+ */
+static bool suspend(void *drvdata)
+{
+	const gp_xbox_device_t *gp_xbox = (const gp_xbox_device_t *)drvdata;
+	return gp_xbox->state_next == STATE_READING_REQUEST;
+}
+
+bool usbh_gp_xbox_read_state(uint8_t device_id, gp_xbox_packet_t *packet, uint32_t *generation)
+{
+	// bad device_id handling
+	if (device_id >= USBH_GP_XBOX_MAX_DEVICES) {
+		return false;
+	}
+
+	const gp_xbox_device_t *gp_xbox = &gp_xbox_device[device_id];
+	if (gp_xbox->state_next != STATE_READING_REQUEST && gp_xbox->state_next != STATE_READING_COMPLETE) {
+		return false;
+	}
+
+	return usbh_seqlock_read(&gp_xbox->state_lock, &gp_xbox->state, packet, sizeof(*packet), generation);
 }
 
 static const usbh_dev_driver_info_t driver_info = {
@@ -412,5 +493,6 @@ const usbh_dev_driver_t usbh_gp_xbox_driver = {
 	.analyze_descriptor = analyze_descriptor,
 	.poll = poll,
 	.remove = remove,
+	.suspend = suspend,
 	.info = &driver_info
 };
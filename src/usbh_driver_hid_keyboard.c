@@ -0,0 +1,735 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "usbh_core.h"
+#include "driver/usbh_device_driver.h"
+#include "usbh_driver_hid_keyboard.h"
+#include "usart_helpers.h"
+#include "usbh_hid_report.h"
+#include "usbh_hid_request.h"
+
+#include <libopencm3/usb/usbstd.h>
+#include <string.h>
+
+#define LOG_MODULE HID
+
+// keyboard usages with special meaning
+#define KEY_ERROR_ROLL_OVER	(0x01)
+#define KEY_FIRST		(0x04)
+#define KEY_MODIFIER_FIRST	(0xE0)
+
+// minimal count of bitmap elements to consider keyboard to be NKRO
+#define NKRO_BITMAP_MIN		(32)
+
+// key set is a bitmap over all 256 keyboard usages
+#define KEY_WORDS		(256 / 32)
+
+enum STATES {
+	STATE_INACTIVE,
+	STATE_READING_COMPLETE,
+	STATE_READING_REQUEST,
+	STATE_SET_CONFIGURATION_REQUEST,
+	STATE_SET_CONFIGURATION_EMPTY_READ,
+	STATE_SET_CONFIGURATION_COMPLETE,
+	STATE_GET_REPORT_DESCRIPTOR_READ,
+	STATE_GET_REPORT_DESCRIPTOR_COMPLETE,
+	STATE_SET_PROTOCOL_COMPLETE,
+	STATE_SET_IDLE_COMPLETE,
+	// device failed, slot stays assigned to it until it is removed
+	STATE_ERROR
+};
+
+struct _hid_keyboard_device {
+	usbh_device_t *usbh_device;
+	uint8_t buffer[USBH_HID_KEYBOARD_BUFFER];
+	uint16_t endpoint_in_maxpacketsize;
+	uint8_t endpoint_in_address;
+	enum STATES state_next;
+	uint8_t endpoint_in_toggle;
+	uint8_t device_id;
+	uint8_t configuration_value;
+
+	// keyboard interface is being analyzed
+	bool interface_keyboard;
+	uint8_t interface_number;
+
+	// pressed keys, read also outside of usbh_poll()
+	uint32_t keys[KEY_WORDS];
+
+	// typematic repeat of the last pressed key, 0 when nothing repeats
+	uint8_t repeat_usage;
+	uint32_t repeat_interval_us;
+	uint32_t repeat_timestamp_us;
+
+	// report layout of NKRO keyboard, boot protocol is used otherwise
+	uint16_t report_descriptor_length;
+	uint8_t report_descriptor[USBH_HID_REPORT_DESCRIPTOR_SIZE];
+	usbh_hid_report_info_t report_info;
+	bool report_layout;
+	uint8_t report_id;
+};
+typedef struct _hid_keyboard_device hid_keyboard_device_t;
+
+static hid_keyboard_device_t keyboard_device[USBH_HID_KEYBOARD_MAX_DEVICES];
+static const hid_keyboard_config_t *keyboard_config;
+
+static bool initialized = false;
+
+void hid_keyboard_driver_init(const hid_keyboard_config_t *config)
+{
+	uint32_t i;
+
+	initialized = true;
+
+	keyboard_config = config;
+	for (i = 0; i < USBH_HID_KEYBOARD_MAX_DEVICES; i++) {
+		keyboard_device[i].state_next = STATE_INACTIVE;
+	}
+}
+
+/**
+ *
+ *
+ */
+static void *init(void *usbh_dev)
+{
+	if (!initialized) {
+		LOG_ERROR("\n%s/%d : driver not initialized\n", __FILE__, __LINE__);
+		return 0;
+	}
+
+	uint32_t i;
+	hid_keyboard_device_t *drvdata = 0;
+
+	// find free data space for keyboard device
+	for (i = 0; i < USBH_HID_KEYBOARD_MAX_DEVICES; i++) {
+		if (keyboard_device[i].state_next == STATE_INACTIVE) {
+			drvdata = &keyboard_device[i];
+			drvdata->device_id = i;
+			drvdata->endpoint_in_address = 0;
+			drvdata->endpoint_in_toggle = 0;
+			drvdata->usbh_device = (usbh_device_t *)usbh_dev;
+			drvdata->interface_keyboard = false;
+			drvdata->report_descriptor_length = 0;
+			drvdata->report_layout = false;
+			break;
+		}
+	}
+
+	return drvdata;
+}
+
+/**
+ * Returns true if all needed data are parsed
+ */
+static bool analyze_descriptor(void *drvdata, void *descriptor)
+{
+	hid_keyboard_device_t *keyboard = (hid_keyboard_device_t *)drvdata;
+	uint8_t desc_type = ((uint8_t *)descriptor)[1];
+	switch (desc_type) {
+	case USB_DT_CONFIGURATION:
+		{
+			struct usb_config_descriptor *cfg = (struct usb_config_descriptor*)descriptor;
+			keyboard->configuration_value = cfg->bConfigurationValue;
+		}
+		break;
+	case USB_DT_DEVICE:
+		break;
+	case USB_DT_INTERFACE:
+		{
+			// composite devices often put a mouse or media keys next to the keyboard
+			struct usb_interface_descriptor *iface = (struct usb_interface_descriptor*)descriptor;
+			keyboard->interface_keyboard = iface->bInterfaceClass == 0x03 && iface->bInterfaceProtocol == 0x01;
+			if (keyboard->interface_keyboard) {
+				keyboard->interface_number = iface->bInterfaceNumber;
+			}
+		}
+		break;
+	case USBH_HID_DT_HID:
+		{
+			const uint8_t *hid = (const uint8_t *)descriptor;
+			if (keyboard->interface_keyboard && hid[0] >= 9 && hid[6] == USBH_HID_DT_REPORT) {
+				keyboard->report_descriptor_length = hid[7] | (hid[8] << 8);
+			}
+		}
+		break;
+	case USB_DT_ENDPOINT:
+		{
+			struct usb_endpoint_descriptor *ep = (struct usb_endpoint_descriptor*)descriptor;
+			if (keyboard->interface_keyboard && (ep->bmAttributes&0x03) == USB_ENDPOINT_ATTR_INTERRUPT) {
+				uint8_t epaddr = ep->bEndpointAddress;
+				if ((epaddr & (1<<7)) && usbh_periodic_open(keyboard->usbh_device, epaddr)) {
+					keyboard->endpoint_in_address = epaddr&0x7f;
+					if (ep->wMaxPacketSize < USBH_HID_KEYBOARD_BUFFER) {
+						keyboard->endpoint_in_maxpacketsize = ep->wMaxPacketSize;
+					} else {
+						keyboard->endpoint_in_maxpacketsize = USBH_HID_KEYBOARD_BUFFER;
+					}
+				}
+
+				if (keyboard->endpoint_in_address) {
+					keyboard->state_next = STATE_SET_CONFIGURATION_REQUEST;
+					return true;
+				}
+			}
+		}
+		break;
+	default:
+		break;
+	}
+	return false;
+}
+
+/**
+ * Use the report descriptor only for keyboards with key bitmap,
+ * which cannot be expressed by the boot protocol
+ */
+static void report_layout_setup(hid_keyboard_device_t *keyboard, uint16_t length)
+{
+	const usbh_hid_report_info_t *info = &keyboard->report_info;
+	uint8_t i;
+
+	keyboard->report_layout = false;
+	if (!usbh_hid_report_compile(&keyboard->report_info, keyboard->report_descriptor, length)) {
+		LOG_WARN("KEYBOARD: bad report descriptor\n");
+		return;
+	}
+
+	for (i = 0; i < info->field_count; i++) {
+		const usbh_hid_field_t *field = &info->field[i];
+		if (field->type == USBH_HID_REPORT_INPUT && (field->usage >> 16) == USBH_HID_PAGE_KEYBOARD &&
+			(field->flags & USBH_HID_FIELD_VARIABLE) && field->count >= NKRO_BITMAP_MIN) {
+			keyboard->report_id = field->report_id;
+			keyboard->report_layout = true;
+			LOG_INFO("KEYBOARD: NKRO\n");
+			return;
+		}
+	}
+}
+
+static inline void keys_set(uint32_t *keys, uint32_t usage)
+{
+	if (usage < 256) {
+		keys[usage / 32] |= 1UL << (usage % 32);
+	}
+}
+
+/**
+ * Collect keys from all keyboard fields of the report
+ *
+ * @returns false when the report has to be ignored
+ */
+static bool parse_report(const hid_keyboard_device_t *keyboard, const uint8_t *data, uint16_t length,
+	uint32_t *keys)
+{
+	const usbh_hid_report_info_t *info = &keyboard->report_info;
+	uint8_t i;
+	uint8_t k;
+
+	if (info->report_ids) {
+		if (!length || data[0] != keyboard->report_id) {
+			return false;
+		}
+		data++;
+		length--;
+	}
+
+	for (i = 0; i < info->field_count; i++) {
+		const usbh_hid_field_t *field = &info->field[i];
+		if (field->type != USBH_HID_REPORT_INPUT || field->report_id != keyboard->report_id ||
+			(field->usage >> 16) != USBH_HID_PAGE_KEYBOARD) {
+			continue;
+		}
+
+		const uint32_t usage = field->usage & 0xffff;
+		if (!(field->flags & USBH_HID_FIELD_VARIABLE)) {
+			// array of pressed keys
+			for (k = 0; k < field->count; k++) {
+				const int32_t value = usbh_hid_field_value(field, k, data, length);
+				if (value < field->logical_minimum || value > field->logical_maximum) {
+					continue;
+				}
+				const uint32_t key = usage + (value - field->logical_minimum);
+				if (key == KEY_ERROR_ROLL_OVER) {
+					return false;
+				}
+				if (key >= KEY_FIRST) {
+					keys_set(keys, key);
+				}
+			}
+		} else if (field->bit_size == 1 && !(field->bit_offset % 8) && !(usage % 8)) {
+			// byte aligned bitmap is copied byte by byte
+			for (k = 0; k < (field->count + 7) / 8; k++) {
+				const uint16_t byte = field->bit_offset / 8 + k;
+				const uint32_t key = usage + k * 8;
+				uint8_t bits;
+				if (byte >= length || key >= 256) {
+					break;
+				}
+				bits = data[byte];
+				if (field->count - k * 8 < 8) {
+					bits &= (1 << (field->count - k * 8)) - 1;
+				}
+				keys[key / 32] |= (uint32_t)bits << (key % 32);
+			}
+		} else {
+			for (k = 0; k < field->count; k++) {
+				if (usbh_hid_field_value(field, k, data, length)) {
+					keys_set(keys, usage + k);
+				}
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * Boot protocol report: modifiers, reserved, 6 key codes
+ */
+static bool parse_boot(const uint8_t *data, uint16_t length, uint32_t *keys)
+{
+	uint8_t i;
+
+	if (length < 3) {
+		return false;
+	}
+
+	keys[KEY_MODIFIER_FIRST / 32] |= (uint32_t)data[0] << (KEY_MODIFIER_FIRST % 32);
+	for (i = 2; i < length && i < 8; i++) {
+		if (data[i] == KEY_ERROR_ROLL_OVER) {
+			return false;
+		}
+		if (data[i] >= KEY_FIRST) {
+			keys_set(keys, data[i]);
+		}
+	}
+	return true;
+}
+
+static inline uint8_t keys_modifiers(const uint32_t *keys)
+{
+	return keys[KEY_MODIFIER_FIRST / 32] >> (KEY_MODIFIER_FIRST % 32);
+}
+
+static void repeat_stop(hid_keyboard_device_t *keyboard)
+{
+	keyboard->repeat_usage = 0;
+}
+
+/**
+ * Report differences between the old and new key set
+ *
+ * Unchanged words are skipped by one comparison, changed keys are
+ * found by counting trailing zeros, so the cost does not depend
+ * on the number of keys held.
+ */
+static void keys_update(hid_keyboard_device_t *keyboard, const uint32_t *keys)
+{
+	const uint8_t modifiers = keys_modifiers(keys);
+	uint8_t w;
+
+	for (w = 0; w < KEY_WORDS; w++) {
+		uint32_t changed = keyboard->keys[w] ^ keys[w];
+		if (!changed) {
+			continue;
+		}
+
+		__atomic_store_n(&keyboard->keys[w], keys[w], __ATOMIC_RELAXED);
+		do {
+			const uint8_t bit = __builtin_ctz(changed);
+			const uint8_t usage = w * 32 + bit;
+			const bool pressed = (keys[w] >> bit) & 1;
+
+			changed &= changed - 1;
+			if (pressed) {
+				if (usage < KEY_MODIFIER_FIRST) {
+					keyboard->repeat_usage = usage;
+					keyboard->repeat_interval_us = keyboard_config->repeat_delay_us;
+					keyboard->repeat_timestamp_us = usbh_time_us();
+				}
+			} else if (usage == keyboard->repeat_usage) {
+				repeat_stop(keyboard);
+			}
+
+			if (keyboard_config->key) {
+				keyboard_config->key(keyboard->device_id, usage,
+					pressed ? HID_KEYBOARD_EVENT_PRESSED : HID_KEYBOARD_EVENT_RELEASED, modifiers);
+			}
+		} while (changed);
+	}
+}
+
+static void parse_data(hid_keyboard_device_t *keyboard, uint16_t length)
+{
+	uint32_t keys[KEY_WORDS] = {0};
+	bool valid;
+
+	if (keyboard->report_layout) {
+		valid = parse_report(keyboard, keyboard->buffer, length, keys);
+	} else {
+		valid = parse_boot(keyboard->buffer, length, keys);
+	}
+
+	// phantom state keeps the previous keys
+	if (valid) {
+		keys_update(keyboard, keys);
+	}
+}
+
+static void reading_start(hid_keyboard_device_t *keyboard)
+{
+	uint8_t w;
+
+	keyboard->state_next = STATE_READING_REQUEST;
+	keyboard->endpoint_in_toggle = 0;
+	usbh_periodic_interval(keyboard->usbh_device, keyboard->endpoint_in_address | 0x80,
+		keyboard_config->poll_interval_ms);
+	for (w = 0; w < KEY_WORDS; w++) {
+		__atomic_store_n(&keyboard->keys[w], 0, __ATOMIC_RELAXED);
+	}
+	repeat_stop(keyboard);
+	LOG_INFO("\nKEYBOARD CONFIGURED\n");
+
+	if (keyboard_config->notify_connected) {
+		keyboard_config->notify_connected(keyboard->device_id);
+	}
+}
+
+static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data);
+
+/**
+ * Reports are sent only on change, repeat is generated by the driver
+ */
+static void idle_setup(hid_keyboard_device_t *keyboard)
+{
+	keyboard->state_next = STATE_SET_IDLE_COMPLETE;
+	if (!usbh_hid_set_idle(keyboard->usbh_device, keyboard->interface_number, 0, 0, event)) {
+		reading_start(keyboard);
+	}
+}
+
+/**
+ * Keyboards without bitmap are switched to the boot protocol,
+ * so that the report layout is known
+ */
+static void protocol_select(hid_keyboard_device_t *keyboard)
+{
+	if (keyboard->report_layout) {
+		idle_setup(keyboard);
+		return;
+	}
+
+	keyboard->state_next = STATE_SET_PROTOCOL_COMPLETE;
+	if (!usbh_hid_set_protocol(keyboard->usbh_device, keyboard->interface_number,
+		USBH_HID_PROTOCOL_BOOT, event)) {
+		idle_setup(keyboard);
+	}
+}
+
+static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	hid_keyboard_device_t *keyboard = (hid_keyboard_device_t *)dev->drvdata;
+	switch (keyboard->state_next) {
+	case STATE_READING_COMPLETE:
+		{
+			switch (cb_data.status) {
+			case USBH_PACKET_CALLBACK_STATUS_OK:
+			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+				if (cb_data.transferred_length) {
+					usbh_device_activity(dev);
+				}
+				parse_data(keyboard, cb_data.transferred_length);
+				keyboard->state_next = STATE_READING_REQUEST;
+				break;
+
+			case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+				// no report in this interval
+				keyboard->state_next = STATE_READING_REQUEST;
+				break;
+
+			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+				ERROR(cb_data.status);
+				keyboard->state_next = STATE_ERROR;
+				repeat_stop(keyboard);
+				if (keyboard_config->notify_disconnected) {
+					keyboard_config->notify_disconnected(keyboard->device_id);
+				}
+				break;
+			}
+		}
+		break;
+
+	case STATE_SET_CONFIGURATION_EMPTY_READ:
+		{
+			LOG_PRINTF("|empty packet read|");
+			switch (cb_data.status) {
+			case USBH_PACKET_CALLBACK_STATUS_OK:
+				keyboard->state_next = STATE_SET_CONFIGURATION_COMPLETE;
+				device_xfer_control_read(0, 0, event, dev);
+				break;
+
+			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+			case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+				ERROR(cb_data.status);
+				keyboard->state_next = STATE_ERROR;
+				break;
+			}
+		}
+		break;
+
+	case STATE_SET_CONFIGURATION_COMPLETE: // Configured
+		{
+			switch (cb_data.status) {
+			case USBH_PACKET_CALLBACK_STATUS_OK:
+				if (keyboard->report_descriptor_length) {
+					struct usb_setup_data setup_data;
+					uint16_t length = keyboard->report_descriptor_length;
+					if (length > USBH_HID_REPORT_DESCRIPTOR_SIZE) {
+						length = USBH_HID_REPORT_DESCRIPTOR_SIZE;
+					}
+
+					setup_data.bmRequestType = 0b10000001;
+					setup_data.bRequest = USB_REQ_GET_DESCRIPTOR;
+					setup_data.wValue = USBH_HID_DT_REPORT << 8;
+					setup_data.wIndex = keyboard->interface_number;
+					setup_data.wLength = length;
+
+					keyboard->state_next = STATE_GET_REPORT_DESCRIPTOR_READ;
+					device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+				} else {
+					protocol_select(keyboard);
+				}
+				break;
+
+			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+			case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+				ERROR(cb_data.status);
+				keyboard->state_next = STATE_ERROR;
+				break;
+			}
+		}
+		break;
+
+	case STATE_GET_REPORT_DESCRIPTOR_READ:
+		if (cb_data.status == USBH_PACKET_CALLBACK_STATUS_OK) {
+			uint16_t length = keyboard->report_descriptor_length;
+			if (length > USBH_HID_REPORT_DESCRIPTOR_SIZE) {
+				length = USBH_HID_REPORT_DESCRIPTOR_SIZE;
+			}
+			keyboard->state_next = STATE_GET_REPORT_DESCRIPTOR_COMPLETE;
+			device_xfer_control_read(keyboard->report_descriptor, length, event, dev);
+		} else {
+			// continue without report descriptor
+			ERROR(cb_data.status);
+			protocol_select(keyboard);
+		}
+		break;
+
+	case STATE_GET_REPORT_DESCRIPTOR_COMPLETE:
+		switch (cb_data.status) {
+		case USBH_PACKET_CALLBACK_STATUS_OK:
+		case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+			report_layout_setup(keyboard, cb_data.transferred_length);
+			break;
+
+		default:
+			ERROR(cb_data.status);
+			break;
+		}
+		protocol_select(keyboard);
+		break;
+
+	case STATE_SET_PROTOCOL_COMPLETE:
+		// boot interface keyboard has to support it, try to continue anyway
+		if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
+			ERROR(cb_data.status);
+		}
+		idle_setup(keyboard);
+		break;
+
+	case STATE_SET_IDLE_COMPLETE:
+		if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
+			LOG_WARN("KEYBOARD: SET_IDLE not supported\n");
+		}
+		reading_start(keyboard);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void read_keyboard_in(hid_keyboard_device_t *keyboard)
+{
+	usbh_packet_t packet;
+
+	packet.address = keyboard->usbh_device->address;
+	packet.data = &keyboard->buffer[0];
+	packet.datalen = keyboard->endpoint_in_maxpacketsize;
+	packet.endpoint_address = keyboard->endpoint_in_address;
+	packet.endpoint_size_max = keyboard->endpoint_in_maxpacketsize;
+	packet.endpoint_type = USBH_ENDPOINT_TYPE_INTERRUPT;
+	packet.speed = keyboard->usbh_device->speed;
+	packet.callback = event;
+	packet.callback_arg = keyboard->usbh_device;
+	packet.toggle = &keyboard->endpoint_in_toggle;
+
+	keyboard->state_next = STATE_READING_COMPLETE;
+	usbh_read_once(keyboard->usbh_device, &packet);
+}
+
+/**
+ * Typematic repeat is generated here, devices in boot protocol
+ * do not send reports while keys are held
+ */
+static void repeat(hid_keyboard_device_t *keyboard, uint32_t time_curr_us)
+{
+	if (!keyboard->repeat_usage || !keyboard_config->repeat_delay_us) {
+		return;
+	}
+
+	if (time_curr_us - keyboard->repeat_timestamp_us > keyboard->repeat_interval_us) {
+		keyboard->repeat_interval_us = keyboard_config->repeat_period_us;
+		keyboard->repeat_timestamp_us = time_curr_us;
+		if (keyboard_config->key) {
+			keyboard_config->key(keyboard->device_id, keyboard->repeat_usage,
+				HID_KEYBOARD_EVENT_REPEAT, keys_modifiers(keyboard->keys));
+		}
+	}
+}
+
+/**
+ * @param time_curr_us - monotically rising time
+ *		unit is microseconds
+ * @see usbh_poll()
+ */
+static void poll(void *drvdata, uint32_t time_curr_us)
+{
+	hid_keyboard_device_t *keyboard = (hid_keyboard_device_t *)drvdata;
+	usbh_device_t *dev = keyboard->usbh_device;
+	switch (keyboard->state_next) {
+	case STATE_READING_REQUEST:
+		repeat(keyboard, time_curr_us);
+		// read only in frames assigned to the endpoint
+		if (usbh_periodic_due(dev, keyboard->endpoint_in_address | 0x80)) {
+			read_keyboard_in(keyboard);
+		}
+		break;
+
+	case STATE_READING_COMPLETE:
+		repeat(keyboard, time_curr_us);
+		break;
+
+	case STATE_SET_CONFIGURATION_REQUEST:
+		{
+			struct usb_setup_data setup_data;
+
+			setup_data.bmRequestType = 0b00000000;
+			setup_data.bRequest = USB_REQ_SET_CONFIGURATION;
+			setup_data.wValue = keyboard->configuration_value;
+			setup_data.wIndex = 0;
+			setup_data.wLength = 0;
+
+			keyboard->state_next = STATE_SET_CONFIGURATION_EMPTY_READ;
+
+			device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+		}
+		break;
+
+	default:
+		// do nothing - probably transfer is in progress
+		break;
+	}
+}
+
+static void remove(void *drvdata)
+{
+	hid_keyboard_device_t *keyboard = (hid_keyboard_device_t *)drvdata;
+	const bool connected = keyboard->state_next == STATE_READING_REQUEST ||
+		keyboard->state_next == STATE_READING_COMPLETE;
+
+	usbh_hid_request_cancel(keyboard->usbh_device);
+	keyboard->state_next = STATE_INACTIVE;
+	keyboard->endpoint_in_address = 0;
+	memset(keyboard->keys, 0, sizeof(keyboard->keys));
+	repeat_stop(keyboard);
+
+	if (connected && keyboard_config->notify_disconnected) {
+		keyboard_config->notify_disconnected(keyboard->device_id);
+	}
+}
+
+/**
+ * Idle keyboard can be suspended, unless a key is held (typematic repeat)
+ */
+static bool suspend(void *drvdata)
+{
+	hid_keyboard_device_t *keyboard = (hid_keyboard_device_t *)drvdata;
+	uint8_t w;
+
+	if (keyboard->state_next != STATE_READING_REQUEST) {
+		return false;
+	}
+	for (w = 0; w < KEY_WORDS; w++) {
+		if (keyboard->keys[w]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool usbh_hid_keyboard_key_pressed(uint8_t device_id, uint8_t usage)
+{
+	// bad device_id handling
+	if (device_id >= USBH_HID_KEYBOARD_MAX_DEVICES) {
+		return false;
+	}
+
+	const hid_keyboard_device_t *keyboard = &keyboard_device[device_id];
+	if (keyboard->state_next != STATE_READING_REQUEST && keyboard->state_next != STATE_READING_COMPLETE) {
+		return false;
+	}
+
+	return (__atomic_load_n(&keyboard->keys[usage / 32], __ATOMIC_RELAXED) >> (usage % 32)) & 1;
+}
+
+static const usbh_dev_driver_info_t driver_info = {
+	.deviceClass = -1,
+	.deviceSubClass = -1,
+	.deviceProtocol = -1,
+	.idVendor = -1,
+	.idProduct = -1,
+	.ifaceClass = 0x03,
+	.ifaceSubClass = -1,
+	.ifaceProtocol = 0x01
+};
+
+const usbh_dev_driver_t usbh_hid_keyboard_driver = {
+	.init = init,
+	.analyze_descriptor = analyze_descriptor,
+	.poll = poll,
+	.remove = remove,
+	.suspend = suspend,
+	.info = &driver_info
+};
@@ -24,16 +24,24 @@
 #include "driver/usbh_device_driver.h"
 #include "usbh_driver_hid_mouse.h"
 #include "usart_helpers.h"
+#include "usbh_seqlock.h"
+#include "usbh_hid_report.h"
+#include "usbh_hid_request.h"
 
 #include <libopencm3/usb/usbstd.h>
 
+#define LOG_MODULE HID
+
 enum STATES {
 	STATE_INACTIVE,
 	STATE_READING_COMPLETE,
 	STATE_READING_REQUEST,
 	STATE_SET_CONFIGURATION_REQUEST,
 	STATE_SET_CONFIGURATION_EMPTY_READ,
-	STATE_SET_CONFIGURATION_COMPLETE
+	STATE_SET_CONFIGURATION_COMPLETE,
+	STATE_GET_REPORT_DESCRIPTOR_READ,
+	STATE_GET_REPORT_DESCRIPTOR_COMPLETE,
+	STATE_SET_IDLE_COMPLETE
 };
 
 struct _hid_mouse_device {
@@ -45,6 +53,32 @@ struct _hid_mouse_device {
 	uint8_t endpoint_in_toggle;
 	uint8_t device_id;
 	uint8_t configuration_value;
+
+	// latest state for readers outside of usbh_poll()
+	usbh_seqlock_t state_lock;
+	hid_mouse_state_t state;
+
+	// motion accumulators, cleared by the reader
+	// x in low and y in high half
+	uint32_t motion_xy;
+	// wheel in low half, pressed and released buttons in high half
+	uint32_t motion_wheel_buttons;
+	uint8_t buttons_last;
+
+	// report layout, boot protocol layout is used when not available
+	uint8_t interface_number;
+	uint16_t report_descriptor_length;
+	uint8_t report_descriptor[USBH_HID_REPORT_DESCRIPTOR_SIZE];
+	usbh_hid_report_info_t report_info;
+	bool report_layout;
+	uint8_t report_id;
+	const usbh_hid_field_t *field_buttons;
+	const usbh_hid_field_t *field_x;
+	const usbh_hid_field_t *field_y;
+	const usbh_hid_field_t *field_wheel;
+	uint8_t index_x;
+	uint8_t index_y;
+	uint8_t index_wheel;
 };
 typedef struct _hid_mouse_device hid_mouse_device_t;
 
@@ -77,7 +111,7 @@ void hid_mouse_driver_init(const hid_mouse_config_t *config)
 static void *init(void *usbh_dev)
 {
 	if (!initialized) {
-		LOG_PRINTF("\n%s/%d : driver not initialized\n", __FILE__, __LINE__);
+		LOG_ERROR("\n%s/%d : driver not initialized\n", __FILE__, __LINE__);
 		return 0;
 	}
 
@@ -92,6 +126,9 @@ static void *init(void *usbh_dev)
 			drvdata->endpoint_in_address = 0;
 			drvdata->endpoint_in_toggle = 0;
 			drvdata->usbh_device = (usbh_device_t *)usbh_dev;
+			drvdata->report_descriptor_length = 0;
+			drvdata->report_layout = false;
+			usbh_seqlock_init(&drvdata->state_lock);
 			break;
 		}
 	}
@@ -116,13 +153,25 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 	case USB_DT_DEVICE:
 		break;
 	case USB_DT_INTERFACE:
+		{
+			struct usb_interface_descriptor *iface = (struct usb_interface_descriptor*)descriptor;
+			mouse->interface_number = iface->bInterfaceNumber;
+		}
+		break;
+	case USBH_HID_DT_HID:
+		{
+			const uint8_t *hid = (const uint8_t *)descriptor;
+			if (hid[0] >= 9 && hid[6] == USBH_HID_DT_REPORT) {
+				mouse->report_descriptor_length = hid[7] | (hid[8] << 8);
+			}
+		}
 		break;
 	case USB_DT_ENDPOINT:
 		{
 			struct usb_endpoint_descriptor *ep = (struct usb_endpoint_descriptor*)descriptor;
 			if ((ep->bmAttributes&0x03) == USB_ENDPOINT_ATTR_INTERRUPT) {
 				uint8_t epaddr = ep->bEndpointAddress;
-				if (epaddr & (1<<7)) {
+				if ((epaddr & (1<<7)) && usbh_periodic_open(mouse->usbh_device, epaddr)) {
 					mouse->endpoint_in_address = epaddr&0x7f;
 					if (ep->wMaxPacketSize < USBH_HID_MOUSE_BUFFER) {
 						mouse->endpoint_in_maxpacketsize = ep->wMaxPacketSize;
@@ -138,13 +187,189 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 			}
 		}
 		break;
-	// TODO Class Specific descriptors
 	default:
 		break;
 	}
 	return false;
 }
 
+/**
+ * Find mouse fields in the compiled report layout
+ */
+static void report_layout_setup(hid_mouse_device_t *mouse, uint16_t length)
+{
+	usbh_hid_report_info_t *info = &mouse->report_info;
+
+	mouse->report_layout = false;
+	if (!usbh_hid_report_compile(info, mouse->report_descriptor, length)) {
+		LOG_WARN("MOUSE: bad report descriptor\n");
+		return;
+	}
+
+	mouse->field_x = usbh_hid_report_find(info, USBH_HID_REPORT_INPUT, USBH_HID_USAGE_X, &mouse->index_x);
+	mouse->field_y = usbh_hid_report_find(info, USBH_HID_REPORT_INPUT, USBH_HID_USAGE_Y, &mouse->index_y);
+	mouse->field_wheel = usbh_hid_report_find(info, USBH_HID_REPORT_INPUT, USBH_HID_USAGE_WHEEL, &mouse->index_wheel);
+	mouse->field_buttons = usbh_hid_report_find(info, USBH_HID_REPORT_INPUT,
+		USBH_HID_USAGE(USBH_HID_PAGE_BUTTON, 1), 0);
+
+	// X and Y have to be in the same report
+	if (!mouse->field_x || !mouse->field_y || mouse->field_x->report_id != mouse->field_y->report_id) {
+		return;
+	}
+
+	mouse->report_id = mouse->field_x->report_id;
+	if (mouse->field_wheel && mouse->field_wheel->report_id != mouse->report_id) {
+		mouse->field_wheel = 0;
+	}
+	if (mouse->field_buttons && (mouse->field_buttons->report_id != mouse->report_id ||
+		!(mouse->field_buttons->flags & USBH_HID_FIELD_VARIABLE))) {
+		mouse->field_buttons = 0;
+	}
+	mouse->report_layout = true;
+}
+
+static inline int16_t saturate16(int32_t value)
+{
+	if (value > INT16_MAX) {
+		return INT16_MAX;
+	}
+	if (value < INT16_MIN) {
+		return INT16_MIN;
+	}
+	return value;
+}
+
+static inline uint32_t motion_pack(int16_t low, uint16_t high)
+{
+	return (uint16_t)low | ((uint32_t)high << 16);
+}
+
+/**
+ * Add the report to motion accumulators
+ *
+ * Reader clears the accumulators by atomic exchange, so they are updated
+ * by compare and exchange.
+ */
+static void accumulate(hid_mouse_device_t *mouse, const hid_mouse_state_t *state)
+{
+	const uint8_t pressed = state->buttons & ~mouse->buttons_last;
+	const uint8_t released = ~state->buttons & mouse->buttons_last;
+	uint32_t old;
+	uint32_t new;
+
+	mouse->buttons_last = state->buttons;
+
+	old = __atomic_load_n(&mouse->motion_xy, __ATOMIC_RELAXED);
+	do {
+		new = motion_pack(saturate16((int16_t)old + state->x),
+			saturate16((int16_t)(old >> 16) + state->y));
+	} while (!__atomic_compare_exchange_n(&mouse->motion_xy, &old, new, true,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	old = __atomic_load_n(&mouse->motion_wheel_buttons, __ATOMIC_RELAXED);
+	do {
+		new = motion_pack(saturate16((int16_t)old + state->wheel),
+			(old >> 16) | pressed | (released << 8));
+	} while (!__atomic_compare_exchange_n(&mouse->motion_wheel_buttons, &old, new, true,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * Decode report using fields found in the report descriptor
+ */
+static bool parse_report(const hid_mouse_device_t *mouse, const uint8_t *data, uint32_t length,
+	hid_mouse_state_t *state)
+{
+	if (mouse->report_info.report_ids) {
+		if (!length || data[0] != mouse->report_id) {
+			return false;
+		}
+		data++;
+		length--;
+	}
+
+	state->buttons = 0;
+	if (mouse->field_buttons) {
+		uint8_t i;
+		for (i = 0; i < mouse->field_buttons->count && i < 8; i++) {
+			if (usbh_hid_field_value(mouse->field_buttons, i, data, length)) {
+				state->buttons |= 1 << i;
+			}
+		}
+	}
+
+	state->x = saturate16(usbh_hid_field_value(mouse->field_x, mouse->index_x, data, length));
+	state->y = saturate16(usbh_hid_field_value(mouse->field_y, mouse->index_y, data, length));
+	state->wheel = 0;
+	if (mouse->field_wheel) {
+		state->wheel = saturate16(usbh_hid_field_value(mouse->field_wheel, mouse->index_wheel, data, length));
+	}
+	return true;
+}
+
+/**
+ * Publish the report. Without report descriptor, boot protocol layout is expected:
+ * buttons, x, y and optional wheel
+ */
+static void parse_data(hid_mouse_device_t *mouse, uint32_t length)
+{
+	const uint8_t *report = mouse->buffer;
+	hid_mouse_state_t state;
+
+	if (mouse->report_layout) {
+		if (!parse_report(mouse, report, length, &state)) {
+			return;
+		}
+	} else {
+		if (length < 3) {
+			return;
+		}
+
+		state.buttons = report[0];
+		state.x = (int8_t)report[1];
+		state.y = (int8_t)report[2];
+		state.wheel = length > 3 ? (int8_t)report[3] : 0;
+	}
+
+	usbh_seqlock_write(&mouse->state_lock, &mouse->state, &state, sizeof(state));
+	accumulate(mouse, &state);
+
+	// per-report callbacks
+	if (mouse_config->mouse_in_message_handler) {
+		mouse_config->mouse_in_message_handler(mouse->device_id, report);
+	}
+	if (mouse_config->report) {
+		mouse_config->report(mouse->device_id, &state);
+	}
+}
+
+static void reading_start(hid_mouse_device_t *mouse)
+{
+	const hid_mouse_state_t state = {0};
+
+	mouse->state_next = STATE_READING_REQUEST;
+	mouse->endpoint_in_toggle = 0;
+	usbh_periodic_interval(mouse->usbh_device, mouse->endpoint_in_address | 0x80, mouse_config->poll_interval_ms);
+	usbh_seqlock_write(&mouse->state_lock, &mouse->state, &state, sizeof(state));
+	mouse->buttons_last = 0;
+	__atomic_store_n(&mouse->motion_xy, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&mouse->motion_wheel_buttons, 0, __ATOMIC_RELAXED);
+	LOG_INFO("\nMOUSE CONFIGURED\n");
+}
+
+static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data);
+
+/**
+ * Ask the mouse to stay silent while nothing changes
+ */
+static void idle_setup(hid_mouse_device_t *mouse)
+{
+	mouse->state_next = STATE_SET_IDLE_COMPLETE;
+	if (!usbh_hid_set_idle(mouse->usbh_device, mouse->interface_number, 0, mouse_config->idle_ms, event)) {
+		reading_start(mouse);
+	}
+}
+
 static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 {
 	hid_mouse_device_t *mouse = (hid_mouse_device_t *)dev->drvdata;
@@ -154,11 +379,19 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
 			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+				if (cb_data.transferred_length) {
+					usbh_device_activity(dev);
+				}
+				parse_data(mouse, cb_data.transferred_length);
 				mouse->state_next = STATE_READING_REQUEST;
 				break;
 
-			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
 			case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+				// no report in this interval
+				mouse->state_next = STATE_READING_REQUEST;
+				break;
+
+			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
 				ERROR(cb_data.status);
 				mouse->state_next = STATE_INACTIVE;
 				break;
@@ -188,9 +421,24 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 		{
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
-				mouse->state_next = STATE_READING_REQUEST;
-				mouse->endpoint_in_toggle = 0;
-				LOG_PRINTF("\nMOUSE CONFIGURED\n");
+				if (mouse->report_descriptor_length) {
+					struct usb_setup_data setup_data;
+					uint16_t length = mouse->report_descriptor_length;
+					if (length > USBH_HID_REPORT_DESCRIPTOR_SIZE) {
+						length = USBH_HID_REPORT_DESCRIPTOR_SIZE;
+					}
+
+					setup_data.bmRequestType = 0b10000001;
+					setup_data.bRequest = USB_REQ_GET_DESCRIPTOR;
+					setup_data.wValue = USBH_HID_DT_REPORT << 8;
+					setup_data.wIndex = mouse->interface_number;
+					setup_data.wLength = length;
+
+					mouse->state_next = STATE_GET_REPORT_DESCRIPTOR_READ;
+					device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+				} else {
+					idle_setup(mouse);
+				}
 				break;
 
 			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
@@ -202,6 +450,44 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 			}
 		}
 		break;
+
+	case STATE_GET_REPORT_DESCRIPTOR_READ:
+		if (cb_data.status == USBH_PACKET_CALLBACK_STATUS_OK) {
+			uint16_t length = mouse->report_descriptor_length;
+			if (length > USBH_HID_REPORT_DESCRIPTOR_SIZE) {
+				length = USBH_HID_REPORT_DESCRIPTOR_SIZE;
+			}
+			mouse->state_next = STATE_GET_REPORT_DESCRIPTOR_COMPLETE;
+			device_xfer_control_read(mouse->report_descriptor, length, event, dev);
+		} else {
+			// continue without report descriptor
+			ERROR(cb_data.status);
+			idle_setup(mouse);
+		}
+		break;
+
+	case STATE_GET_REPORT_DESCRIPTOR_COMPLETE:
+		switch (cb_data.status) {
+		case USBH_PACKET_CALLBACK_STATUS_OK:
+		case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+			report_layout_setup(mouse, cb_data.transferred_length);
+			break;
+
+		default:
+			ERROR(cb_data.status);
+			break;
+		}
+		idle_setup(mouse);
+		break;
+
+	case STATE_SET_IDLE_COMPLETE:
+		// SET_IDLE is optional for mice
+		if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
+			LOG_WARN("MOUSE: SET_IDLE not supported\n");
+		}
+		reading_start(mouse);
+		break;
+
 	default:
 		break;
 	}
@@ -225,7 +511,7 @@ static void read_mouse_in(void *drvdata)
 	packet.toggle = &mouse->endpoint_in_toggle;
 
 	mouse->state_next = STATE_READING_COMPLETE;
-	usbh_read(mouse->usbh_device, &packet);
+	usbh_read_once(mouse->usbh_device, &packet);
 
 	// LOG_PRINTF("@MOUSE EP1 |  \n");
 
@@ -244,7 +530,8 @@ static void poll(void *drvdata, uint32_t time_curr_us)
 	usbh_device_t *dev = mouse->usbh_device;
 	switch (mouse->state_next) {
 	case STATE_READING_REQUEST:
-		{
+		// read only in frames assigned to the endpoint
+		if (usbh_periodic_due(dev, mouse->endpoint_in_address | 0x80)) {
 			read_mouse_in(drvdata);
 		}
 		break;
@@ -274,10 +561,58 @@ static void poll(void *drvdata, uint32_t time_curr_us)
 static void remove(void *drvdata)
 {
 	hid_mouse_device_t *mouse = (hid_mouse_device_t *)drvdata;
+	usbh_hid_request_cancel(mouse->usbh_device);
 	mouse->state_next = STATE_INACTIVE;
 	mouse->endpoint_in_address = 0;
 }
 
+/**
+ * Idle mouse can be suspended between reads
+ */
+static bool suspend(void *drvdata)
+{
+	const hid_mouse_device_t *mouse = (const hid_mouse_device_t *)drvdata;
+	return mouse->state_next == STATE_READING_REQUEST;
+}
+
+bool usbh_hid_mouse_read_state(uint8_t device_id, hid_mouse_state_t *state, uint32_t *generation)
+{
+	// bad device_id handling
+	if (device_id >= USBH_HID_MOUSE_MAX_DEVICES) {
+		return false;
+	}
+
+	const hid_mouse_device_t *mouse = &mouse_device[device_id];
+	if (mouse->state_next != STATE_READING_REQUEST && mouse->state_next != STATE_READING_COMPLETE) {
+		return false;
+	}
+
+	return usbh_seqlock_read(&mouse->state_lock, &mouse->state, state, sizeof(*state), generation);
+}
+
+bool usbh_hid_mouse_read_motion(uint8_t device_id, hid_mouse_motion_t *motion)
+{
+	// bad device_id handling
+	if (device_id >= USBH_HID_MOUSE_MAX_DEVICES) {
+		return false;
+	}
+
+	hid_mouse_device_t *mouse = &mouse_device[device_id];
+	if (mouse->state_next != STATE_READING_REQUEST && mouse->state_next != STATE_READING_COMPLETE) {
+		return false;
+	}
+
+	const uint32_t xy = __atomic_exchange_n(&mouse->motion_xy, 0, __ATOMIC_ACQUIRE);
+	const uint32_t wheel_buttons = __atomic_exchange_n(&mouse->motion_wheel_buttons, 0, __ATOMIC_ACQUIRE);
+
+	motion->x = (int16_t)xy;
+	motion->y = (int16_t)(xy >> 16);
+	motion->wheel = (int16_t)wheel_buttons;
+	motion->buttons_pressed = wheel_buttons >> 16;
+	motion->buttons_released = wheel_buttons >> 24;
+	return true;
+}
+
 static const usbh_dev_driver_info_t driver_info = {
 	.deviceClass = -1,
 	.deviceSubClass = -1,
@@ -294,5 +629,6 @@ const usbh_dev_driver_t usbh_hid_mouse_driver = {
 	.analyze_descriptor = analyze_descriptor,
 	.poll = poll,
 	.remove = remove,
+	.suspend = suspend,
 	.info = &driver_info
 };
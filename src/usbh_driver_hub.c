@@ -27,6 +27,8 @@
 
 #include <stdint.h>
 
+#define LOG_MODULE HUB
+
 
 static hub_device_t hub_device[USBH_MAX_HUBS];
 
@@ -48,7 +50,7 @@ void hub_driver_init(void)
 static void *init(void *usbh_dev)
 {
 	if (!initialized) {
-		LOG_PRINTF("\n%s/%d : driver not initialized\n", __FILE__, __LINE__);
+		LOG_ERROR("\n%s/%d : driver not initialized\n", __FILE__, __LINE__);
 		return 0;
 	}
 
@@ -71,13 +73,36 @@ static void *init(void *usbh_dev)
 	drvdata->state = 0;
 	drvdata->ports_num = 0;
 	drvdata->device[0] = (usbh_device_t *)usbh_dev;
-	drvdata->busy = 0;
+	for (i = 1; i < USBH_HUB_MAX_DEVICES + 1; i++) {
+		drvdata->device[i] = 0;
+	}
+	drvdata->reset_port = CURRENT_PORT_NONE;
 	drvdata->endpoint_in_address = 0;
 	drvdata->endpoint_in_maxpacketsize = 0;
+	drvdata->current_port = CURRENT_PORT_NONE;
+	drvdata->power_on_to_good = 0;
+	for (i = 0; i < sizeof(drvdata->pending) / sizeof(drvdata->pending[0]); i++) {
+		drvdata->pending[i] = 0;
+		drvdata->suspend_request[i] = 0;
+		drvdata->resume_request[i] = 0;
+	}
 
 	return drvdata;
 }
 
+static void ports_setup(hub_device_t *hub, const struct usb_hub_descriptor_head *head)
+{
+	const uint8_t ports_num = head->bNbrPorts;
+
+	hub->power_on_to_good = head->bPwrOn2PwrGood;
+	if (ports_num <= USBH_HUB_MAX_DEVICES) {
+		hub->ports_num = ports_num;
+	} else {
+		LOG_WARN("INCREASE NUMBER OF ENABLED PORTS\n");
+		hub->ports_num = USBH_HUB_MAX_DEVICES;
+	}
+}
+
 /**
  * @returns true if all needed data are parsed
  */
@@ -98,7 +123,7 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 			struct usb_endpoint_descriptor *ep = (struct usb_endpoint_descriptor *)descriptor;
 			if ((ep->bmAttributes&0x03) == USB_ENDPOINT_ATTR_INTERRUPT) {
 				uint8_t epaddr = ep->bEndpointAddress;
-				if (epaddr & (1<<7)) {
+				if ((epaddr & (1<<7)) && usbh_periodic_open(hub->device[0], epaddr)) {
 					hub->endpoint_in_address = epaddr&0x7f;
 					hub->endpoint_in_maxpacketsize = ep->wMaxPacketSize;
 				}
@@ -110,13 +135,7 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 	case USB_DT_HUB:
 		{
 			struct usb_hub_descriptor *desc = (struct usb_hub_descriptor *)descriptor;
-			//~ hub->ports_num = desc->head.bNbrPorts;
-			if ( desc->head.bNbrPorts <= USBH_HUB_MAX_DEVICES) {
-				hub->ports_num = desc->head.bNbrPorts;
-			} else {
-				LOG_PRINTF("INCREASE NUMBER OF ENABLED PORTS\n");
-				hub->ports_num = USBH_HUB_MAX_DEVICES;
-			}
+			ports_setup(hub, &desc->head);
 			LOG_PRINTF("HUB DESCRIPTOR FOUND \n");
 		}
 		break;
@@ -134,6 +153,98 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 	return false;
 }
 
+static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data);
+
+/**
+ * @returns true, when a port of any hub is in debounce, reset or reset recovery
+ */
+static bool port_reset_running(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < USBH_MAX_HUBS; i++) {
+		if (hub_device[i].device[0] && hub_device[i].reset_port != CURRENT_PORT_NONE) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Add ports from the status change bitmap to the pending ports
+ *
+ * Bits of ports that are not used are dropped.
+ */
+static void pending_add(hub_device_t *hub, const uint8_t *bitmap, uint32_t length)
+{
+	uint32_t i;
+
+	if (length > HUB_CHANGE_BITMAP_SIZE) {
+		length = HUB_CHANGE_BITMAP_SIZE;
+	}
+	for (i = 0; i < length && i * 8 <= hub->ports_num; i++) {
+		uint8_t bits = bitmap[i];
+		if (hub->ports_num - i * 8 < 7) {
+			// keep bits 0 .. ports_num
+			bits &= (2 << (hub->ports_num - i * 8)) - 1;
+		}
+		hub->pending[i / 4] |= (uint32_t)bits << ((i % 4) * 8);
+	}
+}
+
+/**
+ * Take the lowest port out of the port bitmap
+ * @returns port, CURRENT_PORT_NONE when no port is set
+ */
+static int16_t bitmap_take(uint32_t *bitmap)
+{
+	uint8_t i;
+
+	for (i = 0; i < HUB_CHANGE_BITMAP_SIZE / 4; i++) {
+		if (bitmap[i]) {
+			int16_t port = i * 32 + __builtin_ctz(bitmap[i]);
+			bitmap[i] &= bitmap[i] - 1;
+			return port;
+		}
+	}
+	return CURRENT_PORT_NONE;
+}
+
+/**
+ * Start processing of the next pending port
+ *
+ * Ports are processed one after another without reading the status
+ * change endpoint in between. Hub goes back to reading the status change
+ * endpoint, when no port is pending.
+ */
+static void port_next(hub_device_t *hub)
+{
+	struct usb_setup_data setup_data;
+	int16_t port = bitmap_take(hub->pending);
+
+	if (port == CURRENT_PORT_NONE) {
+		hub->state = 25;
+		return;
+	}
+
+	// If regular port event, else hub event
+	if (port) {
+		setup_data.bmRequestType = 0b10100011;
+	} else {
+		setup_data.bmRequestType = 0b10100000;
+	}
+
+	setup_data.bRequest = USB_REQ_GET_STATUS;
+	setup_data.wValue = 0;
+	setup_data.wIndex = port;
+	setup_data.wLength = 4;
+	hub->state = 31;
+
+	hub->current_port = port;
+	LOG_INFO("\n\nPORT FOUND: %d\n", port);
+	device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, hub->device[0]);
+}
+
 // Enumerate
 static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 {
@@ -144,56 +255,8 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 	case 26:
 		switch (cb_data.status) {
 		case USBH_PACKET_CALLBACK_STATUS_OK:
-			{
-				uint8_t i;
-				uint8_t *buf = hub->buffer;
-				uint32_t psc = 0;	// Limit: up to 4 bytes...
-				for (i = 0; i < cb_data.transferred_length; i++) {
-					psc += buf[i] << (i*8);
-				}
-				int8_t port = 0;
-
-				LOG_PRINTF("psc:%d\n",psc);
-				// Driver error... port not found
-				if (!psc) {
-					// Continue reading status change endpoint
-					hub->state = 25;
-					break;
-				}
-
-				for (i = 0; i <= hub->ports_num; i++) {
-					if (psc & (1<<i)) {
-						port = i;
-						psc = 0;
-						break;
-					}
-				}
-
-				if (hub->current_port >= 1) {
-					if (hub->current_port != port) {
-						LOG_PRINTF("X");
-						hub->state = 25;
-						break;
-					}
-				}
-				struct usb_setup_data setup_data;
-				// If regular port event, else hub event
-				if (port) {
-					setup_data.bmRequestType = 0b10100011;
-				} else {
-					setup_data.bmRequestType = 0b10100000;
-				}
-
-				setup_data.bRequest = USB_REQ_GET_STATUS;
-				setup_data.wValue = 0;
-				setup_data.wIndex = port;
-				setup_data.wLength = 4;
-				hub->state = 31;
-
-				hub->current_port = port;
-				LOG_PRINTF("\n\nPORT FOUND: %d\n", port);
-				device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
-			}
+			pending_add(hub, hub->buffer, cb_data.transferred_length);
+			port_next(hub);
 			break;
 
 		case USBH_PACKET_CALLBACK_STATUS_EFATAL:
@@ -204,9 +267,8 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 
 		case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
 
-			// In case of EAGAIN error, retry read on status endpoint
+			// No status change (NAK), read status endpoint again in the next interval
 			hub->state = 25;
-			LOG_PRINTF("HUB: Retrying...\n");
 			break;
 		}
 		break;
@@ -245,6 +307,9 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 
 					struct usb_setup_data setup_data;
 					hub->desc_len = hub->device[0]->packet_size_max0;
+					if (hub->desc_len > USBH_HUB_BUFFER_SIZE) {
+						hub->desc_len = USBH_HUB_BUFFER_SIZE;
+					}
 
 					setup_data.bmRequestType = 0b10100000;
 					setup_data.bRequest = USB_REQ_GET_DESCRIPTOR;
@@ -293,7 +358,8 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 						(struct usb_hub_descriptor *)hub->buffer;
 
 					// Check size
-					if (hub_descriptor->head.bDescLength > hub->desc_len) {
+					if (hub_descriptor->head.bDescLength > hub->desc_len &&
+						hub_descriptor->head.bDescLength <= USBH_HUB_BUFFER_SIZE) {
 						struct usb_setup_data setup_data;
 						hub->desc_len = hub_descriptor->head.bDescLength;
 
@@ -307,7 +373,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 						device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
 						break;
 					} else if (hub_descriptor->head.bDescLength == hub->desc_len) {
-						hub->ports_num = hub_descriptor->head.bNbrPorts;
+						ports_setup(hub, &hub_descriptor->head);
 
 						hub->state++;
 						hub->index = 0;
@@ -328,12 +394,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 					if (cb_data.transferred_length >= sizeof(struct usb_hub_descriptor_head)) {
 						if (cb_data.transferred_length == hub_descriptor->head.bDescLength) {
 							// Process HUB descriptor
-							if ( hub_descriptor->head.bNbrPorts <= USBH_HUB_MAX_DEVICES) {
-								hub->ports_num = hub_descriptor->head.bNbrPorts;
-							} else {
-								LOG_PRINTF("INCREASE NUMBER OF ENABLED PORTS\n");
-								hub->ports_num = USBH_HUB_MAX_DEVICES;
-							}
+							ports_setup(hub, &hub_descriptor->head);
 							hub->state++;
 							hub->index = 0;
 
@@ -372,15 +433,11 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 
 					device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
 				} else {
-					hub->state++;
-					// TODO:
-					// Delay Based on hub descriptor field bPwr2PwrGood
-					// delay_ms_busy_loop(200);
+					// wait for power good, continued from poll()
+					hub->timestamp_us = hub->time_curr_us;
+					hub->state = 101;
 
-					LOG_PRINTF("\nHUB CONFIGURED & PORTS POWERED\n");
-
-					cb_data.status = USBH_PACKET_CALLBACK_STATUS_OK;
-					event(dev, cb_data);
+					LOG_INFO("\nHUB CONFIGURED & PORTS POWERED\n");
 				}
 				break;
 
@@ -494,8 +551,8 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 					cb_data.status = USBH_PACKET_CALLBACK_STATUS_OK;
 					event(dev, cb_data);
 				} else {
-					hub->busy = 0;
 					hub->state = 25;
+					usbh_periodic_interval(dev, hub->endpoint_in_address | 0x80, USBH_HUB_POLL_INTERVAL_MS);
 				}
 				break;
 
@@ -513,7 +570,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
 				{
-					int8_t port = hub->current_port;
+					int16_t port = hub->current_port;
 					hub->state++;
 
 					// TODO: rework to endianess aware,
@@ -530,7 +587,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
 				ERROR(cb_data.status);
 				// continue
-				hub->state = 25;
+				port_next(hub);
 				break;
 			}
 
@@ -541,24 +598,36 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
 				{
-					int8_t port = hub->current_port;
+					int16_t port = hub->current_port;
 					LOG_PRINTF("|%d",port);
 
 
 					// Get Port status, else Get Hub status
 					if (port) {
 						uint16_t stc = hub->hub_and_port_status[port].stc;
+						uint16_t sts = hub->hub_and_port_status[port].sts;
 
 						// Connection status changed
 						if (stc & (1<<HUB_FEATURE_PORT_CONNECTION)) {
 
-							// Check, whether device is in connected state
-							if (!hub->device[port]) {
-								if (!usbh_enum_available() || hub->busy) {
-									LOG_PRINTF("\n\t\t\tCannot enumerate %d %d\n", !usbh_enum_available(), hub->busy);
-									hub->state = 25;
+							// Device was unplugged, maybe another one is plugged in already
+							if (hub->device[port]) {
+								LOG_INFO("\t\t\t\tDISCONNECT EVENT\n");
+								usbh_device_detach(hub->device[port]);
+								hub->device[port] = 0;
+							}
+
+							if (port == hub->reset_port) {
+								// unplugged or plugged again during debounce or reset, start over
+								LOG_INFO("PORT %d CHANGED DURING RESET\n", port);
+							} else if (sts & (1<<HUB_FEATURE_PORT_CONNECTION)) {
+								if (!usbh_enum_available() || port_reset_running()) {
+									// change stays set in the hub, it is reported again
+									LOG_WARN("\n\t\t\tCannot enumerate %d %d\n", !usbh_enum_available(), hub->reset_port);
+									port_next(hub);
 									break;
 								}
+								hub->reset_port = port;
 							}
 
 							// clear feature C_PORT_CONNECTION
@@ -586,17 +655,52 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 							setup_data.wIndex = port;
 							setup_data.wLength = 0;
 
-							hub->state_after_empty_read = 35;
+							// reset of the port, which was started over, is only acknowledged
+							hub->state_after_empty_read = port == hub->reset_port ? 35 : 34;
 							hub->state = EMPTY_PACKET_READ_STATE;
 
 							LOG_PRINTF("RESET");
 							device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
-						} else {
+						} else if (stc & (1<<HUB_FEATURE_PORT_SUSPEND)) {
+							// clear feature C_PORT_SUSPEND
+							// Resume is complete (requested by host or remote wakeup)
+							struct usb_setup_data setup_data;
+
+							setup_data.bmRequestType = 0b00100011;
+							setup_data.bRequest = HUB_REQ_CLEAR_FEATURE;
+							setup_data.wValue = HUB_FEATURE_C_PORT_SUSPEND;
+							setup_data.wIndex = port;
+							setup_data.wLength = 0;
+
+							hub->state_after_empty_read = 34;
+							hub->state = EMPTY_PACKET_READ_STATE;
+
+							if (hub->device[port]) {
+								usbh_device_resumed(hub->device[port]);
+							}
+							LOG_PRINTF("RESUME");
+							device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+						} else if (stc & HUB_PORT_CHANGES_OTHER) {
+							// acknowledge the change, so the hub stops reporting it
+							struct usb_setup_data setup_data;
+
+							setup_data.bmRequestType = 0b00100011;
+							setup_data.bRequest = HUB_REQ_CLEAR_FEATURE;
+							setup_data.wValue = HUB_FEATURE_C_PORT_CONNECTION + __builtin_ctz(stc & HUB_PORT_CHANGES_OTHER);
+							setup_data.wIndex = port;
+							setup_data.wLength = 0;
+
+							hub->state_after_empty_read = 34;
+							hub->state = EMPTY_PACKET_READ_STATE;
+
 							LOG_PRINTF("another STC %d\n", stc);
+							device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+						} else {
+							port_next(hub);
 						}
 					} else {
-						hub->state = 25;
 						LOG_PRINTF("HUB status change\n");
+						port_next(hub);
 					}
 				}
 				break;
@@ -606,7 +710,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
 				ERROR(cb_data.status);
 				// continue
-				hub->state = 25;
+				port_next(hub);
 				break;
 			}
 		}
@@ -616,39 +720,19 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
 				{
-					int8_t port = hub->current_port;
-					uint16_t stc = hub->hub_and_port_status[port].stc;
-					if (!hub->device[port]) {
-						if ((stc) & (1<<HUB_FEATURE_PORT_CONNECTION)) {
-							struct usb_setup_data setup_data;
-
-							setup_data.bmRequestType = 0b00100011;
-							setup_data.bRequest = HUB_REQ_SET_FEATURE;
-							setup_data.wValue = HUB_FEATURE_PORT_RESET;
-							setup_data.wIndex = port;
-							setup_data.wLength = 0;
-
-							hub->state_after_empty_read = 11;
-							hub->state = EMPTY_PACKET_READ_STATE;
-
-							LOG_PRINTF("CONN");
+					int16_t port = hub->current_port;
+					uint16_t sts = hub->hub_and_port_status[port].sts;
+					if (sts & (1<<HUB_FEATURE_PORT_CONNECTION)) {
+						LOG_PRINTF("CONN");
 
-							hub->busy = 1;
-							device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
-						}
+						// debounce, port is reset from poll()
+						hub->timestamp_us = hub->time_curr_us;
+						hub->state = 102;
 					} else {
-						LOG_PRINTF("\t\t\t\tDISCONNECT EVENT\n");
-						if (hub->device[port]->drv && hub->device[port]->drvdata) {
-							hub->device[port]->drv->remove(hub->device[port]->drvdata);
+						if (port == hub->reset_port) {
+							hub->reset_port = CURRENT_PORT_NONE;
 						}
-						hub->device[port]->address = -1;
-
-						hub->device[port]->drv = 0;
-						hub->device[port]->drvdata = 0;
-						hub->device[port] = 0;
-						hub->current_port = CURRENT_PORT_NONE;
-						hub->state = 25;
-						hub->busy = 0;
+						port_next(hub);
 					}
 				}
 				break;
@@ -658,31 +742,55 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
 				ERROR(cb_data.status);
 				// continue
-				hub->state = 25;
+				port_next(hub);
 				break;
 			}
 		}
 		break;
+	case 34:	// Port request complete, continue with other ports
+		if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
+			ERROR(cb_data.status);
+		}
+		port_next(hub);
+		break;
 	case 35:	// RESET COMPLETE, start enumeration
 		{
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
 				{
 					LOG_PRINTF("\nPOLL\n");
-					int8_t port = hub->current_port;
+					int16_t port = hub->current_port;
 					uint16_t sts = hub->hub_and_port_status[port].sts;
 
+					if (sts & (1<<HUB_FEATURE_PORT_RESET)) {
+						// change of the reset before the port was plugged again, wait for the current one
+						port_next(hub);
+						return;
+					}
 
 					if (sts & (1<<HUB_FEATURE_PORT_ENABLE)) {
-						hub->device[port] = usbh_get_free_device(dev);
+						hub->device[port] = usbh_get_free_device(dev, port);
 
 						if (!hub->device[port]) {
-							LOG_PRINTF("\nFATAL ERROR\n");
-							return;// DEAD END
+							LOG_ERROR("\nFATAL ERROR\n");
+							hub->reset_port = CURRENT_PORT_NONE;
+							port_next(hub);
+							return;
 						}
-						if ((sts & (1<<(HUB_FEATURE_PORT_LOWSPEED))) &&
-							!(sts & (1<<(HUB_FEATURE_PORT_HIGHSPEED)))) {
-							LOG_PRINTF("Low speed device");
+						if (sts & (1<<(HUB_FEATURE_PORT_HIGHSPEED))) {
+							hub->device[port]->speed = USBH_SPEED_HIGH;
+							LOG_INFO("High speed device");
+							hub->timestamp_us = hub->time_curr_us;
+							hub->state = 100; // schedule wait for reset recovery
+						} else if ((sts & (1<<(HUB_FEATURE_PORT_LOWSPEED))) &&
+							(dev->speed == USBH_SPEED_HIGH || dev->tt_hub)) {
+							// Transaction translator of high speed hub talks to low speed device
+							hub->device[port]->speed = USBH_SPEED_LOW;
+							LOG_INFO("Low speed device behind TT");
+							hub->timestamp_us = hub->time_curr_us;
+							hub->state = 100; // schedule wait for reset recovery
+						} else if (sts & (1<<(HUB_FEATURE_PORT_LOWSPEED))) {
+							LOG_INFO("Low speed device");
 
 							// Disable Low speed device immediately
 							struct usb_setup_data setup_data;
@@ -694,23 +802,24 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 							setup_data.wLength = 0;
 
 							// After write process another devices, poll for events
-							hub->state_after_empty_read = 11;//Expecting all ports are powered (constant/non-changeable after init)
+							hub->state_after_empty_read = 34;
 							hub->state = EMPTY_PACKET_READ_STATE;
 
 							hub->current_port = CURRENT_PORT_NONE;
+							hub->reset_port = CURRENT_PORT_NONE;
 							device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
-						} else if (!(sts & (1<<(HUB_FEATURE_PORT_LOWSPEED))) &&
-							!(sts & (1<<(HUB_FEATURE_PORT_HIGHSPEED)))) {
+						} else {
 							hub->device[port]->speed = USBH_SPEED_FULL;
-							LOG_PRINTF("Full speed device");
+							LOG_INFO("Full speed device");
 							hub->timestamp_us = hub->time_curr_us;
-							hub->state = 100; // schedule wait for 500ms
+							hub->state = 100; // schedule wait for reset recovery
 						}
 
 
 					} else {
-						LOG_PRINTF("%s:%d Do not know what to do, when device is disabled after reset\n", __FILE__, __LINE__);
-						hub->state = 25;
+						LOG_WARN("%s:%d Do not know what to do, when device is disabled after reset\n", __FILE__, __LINE__);
+						hub->reset_port = CURRENT_PORT_NONE;
+						port_next(hub);
 						return;
 					}
 				}
@@ -721,17 +830,136 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
 				ERROR(cb_data.status);
 				// continue
-				hub->state = 25;
+				port_next(hub);
+				break;
+			}
+		}
+		break;
+	case 36: // Read port status at the end of debounce
+		{
+			switch (cb_data.status) {
+			case USBH_PACKET_CALLBACK_STATUS_OK:
+				hub->state++;
+				device_xfer_control_read(&hub->hub_and_port_status[hub->reset_port], 4, event, dev);
+				break;
+
+			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+			case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+				ERROR(cb_data.status);
+				// try again from poll()
+				hub->state = 102;
+				break;
+			}
+		}
+		break;
+	case 37:
+		{
+			switch (cb_data.status) {
+			case USBH_PACKET_CALLBACK_STATUS_OK:
+				{
+					int16_t port = hub->reset_port;
+					uint16_t stc = hub->hub_and_port_status[port].stc;
+					uint16_t sts = hub->hub_and_port_status[port].sts;
+					struct usb_setup_data setup_data;
+
+					setup_data.bmRequestType = 0b00100011;
+					setup_data.wIndex = port;
+					setup_data.wLength = 0;
+
+					if (stc & (1<<HUB_FEATURE_PORT_CONNECTION)) {
+						// connection changed during debounce, acknowledge the change
+						// and debounce again when the port is still connected
+						LOG_INFO("PORT %d CHANGED DURING DEBOUNCE\n", port);
+						setup_data.bRequest = HUB_REQ_CLEAR_FEATURE;
+						setup_data.wValue = HUB_FEATURE_C_PORT_CONNECTION;
+						hub->state_after_empty_read = 33;
+					} else if (sts & (1<<HUB_FEATURE_PORT_CONNECTION)) {
+						setup_data.bRequest = HUB_REQ_SET_FEATURE;
+						setup_data.wValue = HUB_FEATURE_PORT_RESET;
+						hub->state_after_empty_read = 34;
+					} else {
+						hub->reset_port = CURRENT_PORT_NONE;
+						port_next(hub);
+						break;
+					}
+
+					hub->state = EMPTY_PACKET_READ_STATE;
+					device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+				}
+				break;
+
+			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+			case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+				ERROR(cb_data.status);
+				hub->state = 102;
 				break;
 			}
 		}
 		break;
 	default:
-		LOG_PRINTF("UNHANDLED EVENT %d\n",hub->state);
+		LOG_WARN("UNHANDLED EVENT %d\n",hub->state);
 		break;
 	}
 }
 
+/**
+ * Send the next requested port suspend or resume
+ * @returns true, when the request is sent
+ */
+static bool port_suspend_next(hub_device_t *hub)
+{
+	struct usb_setup_data setup_data;
+	int16_t port = bitmap_take(hub->resume_request);
+
+	if (port != CURRENT_PORT_NONE) {
+		setup_data.bRequest = HUB_REQ_CLEAR_FEATURE;
+	} else {
+		port = bitmap_take(hub->suspend_request);
+		if (port == CURRENT_PORT_NONE) {
+			return false;
+		}
+		setup_data.bRequest = HUB_REQ_SET_FEATURE;
+	}
+
+	setup_data.bmRequestType = 0b00100011;
+	setup_data.wValue = HUB_FEATURE_PORT_SUSPEND;
+	setup_data.wIndex = port;
+	setup_data.wLength = 0;
+
+	hub->state_after_empty_read = 34;
+	hub->state = EMPTY_PACKET_READ_STATE;
+
+	LOG_INFO("HUB PORT %d SUSPEND %d\n", port, setup_data.bRequest == HUB_REQ_SET_FEATURE);
+	device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, hub->device[0]);
+	return true;
+}
+
+/**
+ * @brief port_suspend request suspend or resume of the port
+ *
+ * Request is sent, when the hub is not busy with port changes
+ */
+static bool port_suspend(void *drvdata, uint8_t port, bool suspend)
+{
+	hub_device_t *hub = (hub_device_t *)drvdata;
+	const uint32_t bit = 1UL << (port % 32);
+
+	if (!port || port > hub->ports_num) {
+		return false;
+	}
+
+	if (suspend) {
+		hub->suspend_request[port / 32] |= bit;
+		hub->resume_request[port / 32] &= ~bit;
+	} else {
+		hub->resume_request[port / 32] |= bit;
+		hub->suspend_request[port / 32] &= ~bit;
+	}
+	return true;
+}
+
 static void read_ep1(void *drvdata)
 {
 	hub_device_t *hub = (hub_device_t *)drvdata;
@@ -740,6 +968,9 @@ static void read_ep1(void *drvdata)
 	packet.address = hub->device[0]->address;
 	packet.data = hub->buffer;
 	packet.datalen = hub->endpoint_in_maxpacketsize;
+	if (packet.datalen > HUB_CHANGE_BITMAP_SIZE) {
+		packet.datalen = HUB_CHANGE_BITMAP_SIZE;
+	}
 	packet.endpoint_address = hub->endpoint_in_address;
 	packet.endpoint_size_max = hub->endpoint_in_maxpacketsize;
 	packet.endpoint_type = USBH_ENDPOINT_TYPE_INTERRUPT;
@@ -749,7 +980,7 @@ static void read_ep1(void *drvdata)
 	packet.toggle = &hub->endpoint_in_toggle;
 
 	hub->state = 26;
-	usbh_read(hub->device[0], &packet);
+	usbh_read_once(hub->device[0], &packet);
 	LOG_PRINTF("@hub %d/EP1 |  \n", hub->device[0]->address);
 
 }
@@ -769,10 +1000,16 @@ static void poll(void *drvdata, uint32_t time_curr_us)
 	switch (hub->state) {
 	case 25:
 		{
-			if (usbh_enum_available()) {
+			if (usbh_enum_available() && port_suspend_next(hub)) {
+				break;
+			}
+
+			// Status changes are rare, so the endpoint is read once per interval.
+			// Completion of the port reset is expected soon, do not wait for it.
+			// Changes are read also during enumeration: device unplugged
+			// in the middle of it is detached, which ends the enumeration.
+			if (hub->reset_port != CURRENT_PORT_NONE || usbh_periodic_due(dev, hub->endpoint_in_address | 0x80)) {
 				read_ep1(hub);
-			} else {
-				LOG_PRINTF("enum not available\n");
 			}
 		}
 		break;
@@ -794,11 +1031,46 @@ static void poll(void *drvdata, uint32_t time_curr_us)
 
 		}
 		break;
+	case 101:
+		{
+			// bPwrOn2PwrGood is in 2 ms units
+			uint32_t power_good_us = hub->power_on_to_good * 2000;
+			if (power_good_us < usbh_timing()->power_good_min_us) {
+				power_good_us = usbh_timing()->power_good_min_us;
+			}
+
+			if (hub->time_curr_us - hub->timestamp_us > power_good_us) {
+				const usbh_packet_callback_data_t cb_data = { USBH_PACKET_CALLBACK_STATUS_OK, 0 };
+
+				hub->state = 7;
+				event(dev, cb_data);
+			}
+		}
+		break;
+
+	case 102:
+		if (hub->time_curr_us - hub->timestamp_us > usbh_timing()->debounce_us) {
+			// connection has to be stable for the whole debounce interval,
+			// check the change once more before the reset
+			struct usb_setup_data setup_data;
+
+			setup_data.bmRequestType = 0b10100011;
+			setup_data.bRequest = USB_REQ_GET_STATUS;
+			setup_data.wValue = 0;
+			setup_data.wIndex = hub->reset_port;
+			setup_data.wLength = 4;
+
+			hub->current_port = hub->reset_port;
+			hub->state = 36;
+			device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+		}
+		break;
+
 	case 100:
-		if (hub->time_curr_us - hub->timestamp_us > 500000) {
-			int8_t port = hub->current_port;
+		if (hub->time_curr_us - hub->timestamp_us > usbh_timing()->reset_recovery_us) {
+			int16_t port = hub->reset_port;
 			LOG_PRINTF("PORT: %d", port);
-			LOG_PRINTF("\nNEW device at address: %d\n", hub->device[port]->address);
+			LOG_INFO("\nNEW device at address: %d\n", hub->device[port]->address);
 			hub->device[port]->lld = hub->device[0]->lld;
 
 			device_enumeration_start(hub->device[port]);
@@ -810,26 +1082,16 @@ static void poll(void *drvdata, uint32_t time_curr_us)
 			// USB hub cannot enable another port while the device
 			// the current one is also in address state (has address==0)
 			// Only one device on bus can have address==0
-			hub->busy = 0;
+			hub->reset_port = CURRENT_PORT_NONE;
 
-			hub->state = 25;
+			port_next(hub);
 		}
 		break;
 	default:
 		break;
 	}
-
-	if (usbh_enum_available()) {
-		uint32_t i;
-		for (i = 1; i < USBH_HUB_MAX_DEVICES + 1; i++) {
-			if (hub->device[i]) {
-				if (hub->device[i]->drv && hub->device[i]->drvdata) {
-					hub->device[i]->drv->poll(hub->device[i]->drvdata, time_curr_us);
-				}
-			}
-		}
-	}
 }
+
 static void remove(void *drvdata)
 {
 	hub_device_t *hub = (hub_device_t *)drvdata;
@@ -838,21 +1100,11 @@ static void remove(void *drvdata)
 	// Call fast... to avoid polling
 	hub->state = 0;
 	hub->endpoint_in_address = 0;
-	hub->busy = 0;
-	for (i = 1; i < USBH_HUB_MAX_DEVICES + 1; i++) {
-		if (hub->device[i]) {
-			if (hub->device[i]->drv && hub->device[i]->drvdata) {
-				if (hub->device[i]->drv->remove != remove) {
-					LOG_PRINTF("\t\t\t\tHUB REMOVE %d\n",hub->device[i]->address);
-					hub->device[i]->drv->remove(hub->device[i]->drvdata);
-				}
-			}
-			hub->device[i] = 0;
-		}
-		hub->device[0]->drv = 0;
-		hub->device[0]->drvdata = 0;
-		hub->device[0] = 0;
+	hub->reset_port = CURRENT_PORT_NONE;
 
+	// Devices connected to the hub are detached by the core
+	for (i = 0; i < USBH_HUB_MAX_DEVICES + 1; i++) {
+		hub->device[i] = 0;
 	}
 }
 
@@ -872,5 +1124,6 @@ const usbh_dev_driver_t usbh_hub_driver = {
 	.analyze_descriptor = analyze_descriptor,
 	.poll = poll,
 	.remove = remove,
+	.port_suspend = port_suspend,
 	.info = &driver_info
 };
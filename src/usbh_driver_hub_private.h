@@ -48,6 +48,11 @@
 #define HUB_FEATURE_C_PORT_OVERCURRENT 19
 #define HUB_FEATURE_C_PORT_RESET 20
 
+// port changes, that only need to be acknowledged (bits of wPortChange)
+#define HUB_PORT_CHANGES_OTHER	((1 << (HUB_FEATURE_C_PORT_ENABLE - HUB_FEATURE_C_PORT_CONNECTION)) | \
+	(1 << (HUB_FEATURE_C_PORT_SUSPEND - HUB_FEATURE_C_PORT_CONNECTION)) | \
+	(1 << (HUB_FEATURE_C_PORT_OVERCURRENT - HUB_FEATURE_C_PORT_CONNECTION)))
+
 #define HUB_REQ_GET_STATUS 		0
 #define HUB_REQ_CLEAR_FEATURE 	1
 #define HUB_REQ_SET_FEATURE 	3
@@ -55,8 +60,18 @@
 
 #define USB_DT_HUB 		(41)
 #define USB_DT_HUB_SIZE	(9)
-// Hub buffer: must be larger than hub descriptor
-#define USBH_HUB_BUFFER_SIZE	(USB_DT_HUB_SIZE)
+
+// Max ports of the hub
+#define HUB_PORTS_MAX	(255)
+
+// Status change bitmap: bit 0 is the hub, bit n is port n
+#define HUB_CHANGE_BITMAP_SIZE	((HUB_PORTS_MAX + 1) / 8)
+
+// Hub descriptor of the hub with all ports
+#define USB_DT_HUB_SIZE_MAX	(7 + 2 * HUB_CHANGE_BITMAP_SIZE)
+
+// Hub buffer: must be larger than hub descriptor and the status change bitmap
+#define USBH_HUB_BUFFER_SIZE	(USB_DT_HUB_SIZE_MAX)
 
 
 #define CURRENT_PORT_NONE -1
@@ -74,15 +89,27 @@ struct _hub_device {
 
 	uint8_t desc_len;
 	uint16_t ports_num;
-	int8_t index;
-	int8_t current_port;
+	// bPwrOn2PwrGood of the hub descriptor
+	uint8_t power_on_to_good;
+	uint8_t index;
+	int16_t current_port;
+
+	// ports with change reported by the status change endpoint, not yet processed
+	uint32_t pending[HUB_CHANGE_BITMAP_SIZE / 4];
+
+	// ports to be suspended or resumed @see usbh_dev_driver_t::port_suspend
+	uint32_t suspend_request[HUB_CHANGE_BITMAP_SIZE / 4];
+	uint32_t resume_request[HUB_CHANGE_BITMAP_SIZE / 4];
 
 	struct {
 		uint16_t sts;
 		uint16_t stc;
 	} hub_and_port_status[USBH_HUB_MAX_DEVICES + 1];
 
-	bool busy;
+	// port in debounce, reset or reset recovery, CURRENT_PORT_NONE when none.
+	// Device of the port answers address 0 until its enumeration starts,
+	// so only one port of all hubs is reset at a time.
+	int16_t reset_port;
 
 	uint32_t time_curr_us;
 	uint32_t timestamp_us;
@@ -0,0 +1,1248 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "driver/usbh_device_driver.h"
+#include "usbh_driver_msc.h"
+#include "usart_helpers.h"
+
+#include <string.h>
+#include <libopencm3/usb/usbstd.h>
+
+#define LOG_MODULE MSC
+
+/*
+ * Mass storage, Bulk-Only Transport
+ *
+ * Every SCSI command is sent as a Command Block Wrapper, followed by
+ * optional data phase and Command Status Wrapper. Small requests go through
+ * a cache of sector aligned lines: reads fill the rest of the line (read-ahead),
+ * writes are collected in the line and written as one multi-sector command
+ * later (write coalescing). Requests of at least one line's size bypass the
+ * cache and are transferred with one command directly from/to user's buffer.
+ */
+
+#define CBW_SIGNATURE		(0x43425355)
+#define CSW_SIGNATURE		(0x53425355)
+#define CBW_LENGTH		(31)
+#define CSW_LENGTH		(13)
+
+#define CSW_STATUS_PASSED	(0)
+#define CSW_STATUS_FAILED	(1)
+
+#define MSC_REQ_RESET		(0xff)
+
+#define SCSI_TEST_UNIT_READY	(0x00)
+#define SCSI_REQUEST_SENSE	(0x03)
+#define SCSI_INQUIRY		(0x12)
+#define SCSI_READ_CAPACITY	(0x25)
+#define SCSI_READ_10		(0x28)
+#define SCSI_WRITE_10		(0x2a)
+
+#define SENSE_LENGTH		(18)
+#define INQUIRY_LENGTH		(36)
+#define CAPACITY_LENGTH		(8)
+
+#define TEST_UNIT_READY_DELAY_US	(100000)
+
+#define LINE_SIZE	(USBH_MSC_CACHE_LINE_SECTORS * USBH_MSC_SECTOR_SIZE)
+#define LINE_TAG(sector)	((sector) & ~(uint32_t)(USBH_MSC_CACHE_LINE_SECTORS - 1))
+#define LINE_OFFSET(sector)	((sector) & (USBH_MSC_CACHE_LINE_SECTORS - 1))
+
+enum STATES {
+	STATE_INACTIVE,
+	STATE_SET_CONFIGURATION_REQUEST,
+	STATE_SET_CONFIGURATION_EMPTY_READ,
+	STATE_SET_CONFIGURATION_COMPLETE,
+	STATE_INQUIRY,
+	STATE_TEST_UNIT_READY,
+	STATE_TEST_UNIT_READY_WAIT,
+	STATE_READ_CAPACITY,
+	STATE_INIT_COMMAND,
+	STATE_READY,
+	STATE_COMMAND,
+
+	// device failed, slot stays assigned to it until it is removed
+	STATE_ERROR
+};
+
+enum BOT_STATES {
+	BOT_STATE_IDLE,
+	BOT_STATE_CBW,
+	BOT_STATE_DATA,
+	BOT_STATE_CSW,
+	BOT_STATE_CLEAR_HALT,
+	BOT_STATE_CLEAR_HALT_EMPTY_READ,
+	BOT_STATE_RESET,
+	BOT_STATE_RESET_EMPTY_READ
+};
+
+// what to do when the endpoint halt is cleared
+enum RECOVERY {
+	RECOVERY_CSW,
+	RECOVERY_RESET_IN,
+	RECOVERY_RESET_OUT
+};
+
+enum RESULT {
+	RESULT_OK,
+	// command failed, sense data were read
+	RESULT_FAILED,
+	// transport error, device was reset
+	RESULT_ERROR
+};
+
+enum REQUEST {
+	REQUEST_NONE,
+	REQUEST_READ,
+	REQUEST_WRITE,
+	REQUEST_FLUSH
+};
+
+// what to do when the command for the request finishes
+enum PENDING {
+	PENDING_NONE,
+	PENDING_DIRECT,
+	PENDING_FILL,
+	PENDING_WRITEBACK
+};
+
+struct _msc_cache_line {
+	uint8_t data[LINE_SIZE];
+	/// first sector of the line
+	uint32_t tag;
+	/// for least recently used replacement
+	uint32_t used;
+	/// bitmask of sectors with valid data
+	uint8_t valid;
+	/// bitmask of sectors not written to the device yet
+	uint8_t dirty;
+};
+typedef struct _msc_cache_line msc_cache_line_t;
+
+typedef struct _msc_device msc_device_t;
+typedef void (*command_done_t)(msc_device_t *msc, enum RESULT result);
+
+struct _msc_device {
+	usbh_device_t *usbh_device;
+	uint8_t cbw[CBW_LENGTH];
+	uint8_t csw[USBH_MSC_BUFFER];
+	uint8_t buffer[USBH_MSC_BUFFER];
+	uint16_t endpoint_in_maxpacketsize;
+	uint16_t endpoint_out_maxpacketsize;
+	uint8_t endpoint_in_address;
+	uint8_t endpoint_out_address;
+	uint8_t endpoint_in_toggle;
+	uint8_t endpoint_out_toggle;
+	uint8_t interface_number;
+	uint8_t configuration_value;
+	uint8_t device_id;
+	enum STATES state_next;
+
+	uint32_t sector_count;
+	uint32_t time_curr_us;
+	uint32_t timestamp_us;
+
+	// Bulk-Only Transport
+	struct {
+		enum BOT_STATES state;
+		enum RECOVERY recovery;
+		uint32_t tag;
+		uint8_t *data;
+		uint32_t length;
+		uint32_t index;
+		uint8_t halt_endpoint;
+		bool in;
+		bool csw_retry;
+		command_done_t done;
+		command_done_t done_after_sense;
+	} bot;
+
+	// Request of the user
+	struct {
+		enum REQUEST type;
+		uint8_t *data;
+		uint32_t sector;
+		uint32_t count;
+		msc_callback_t callback;
+		bool sequential;
+
+		enum PENDING pending;
+		msc_cache_line_t *line;
+		uint8_t mask;
+		uint32_t run;
+	} request;
+
+	msc_cache_line_t cache[USBH_MSC_CACHE_LINES];
+	uint32_t cache_clock;
+	uint32_t read_next;
+	uint32_t prefetch_tag;
+	bool prefetch;
+};
+
+static msc_device_t msc_device[USBH_MSC_MAX_DEVICES];
+static const msc_config_t *msc_config = 0;
+static bool initialized = false;
+
+static void bot_event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data);
+
+void msc_driver_init(const msc_config_t *config)
+{
+	uint32_t i;
+	msc_config = config;
+	for (i = 0; i < USBH_MSC_MAX_DEVICES; i++) {
+		msc_device[i].state_next = STATE_INACTIVE;
+	}
+	initialized = true;
+}
+
+static void *init(void *usbh_dev)
+{
+	if (!msc_config || !initialized) {
+		LOG_ERROR("\n%s/%d : driver not initialized\n", __FILE__, __LINE__);
+		return 0;
+	}
+
+	uint32_t i;
+	msc_device_t *drvdata = 0;
+
+	// find free data space for mass storage device
+	for (i = 0; i < USBH_MSC_MAX_DEVICES; i++) {
+		if (msc_device[i].state_next == STATE_INACTIVE) {
+			drvdata = &msc_device[i];
+			drvdata->device_id = i;
+			drvdata->endpoint_in_address = 0;
+			drvdata->endpoint_out_address = 0;
+			drvdata->endpoint_in_toggle = 0;
+			drvdata->endpoint_out_toggle = 0;
+			drvdata->usbh_device = (usbh_device_t *)usbh_dev;
+			break;
+		}
+	}
+
+	return drvdata;
+}
+
+/**
+ * Returns true if all needed data are parsed
+ */
+static bool analyze_descriptor(void *drvdata, void *descriptor)
+{
+	msc_device_t *msc = (msc_device_t *)drvdata;
+	uint8_t desc_type = ((uint8_t *)descriptor)[1];
+	switch (desc_type) {
+	case USB_DT_CONFIGURATION:
+		{
+			struct usb_config_descriptor *cfg = (struct usb_config_descriptor*)descriptor;
+			msc->configuration_value = cfg->bConfigurationValue;
+		}
+		break;
+
+	case USB_DT_INTERFACE:
+		{
+			struct usb_interface_descriptor *iface = (struct usb_interface_descriptor*)descriptor;
+			msc->interface_number = iface->bInterfaceNumber;
+		}
+		break;
+
+	case USB_DT_ENDPOINT:
+		{
+			struct usb_endpoint_descriptor *ep = (struct usb_endpoint_descriptor*)descriptor;
+			if ((ep->bmAttributes&0x03) == USB_ENDPOINT_ATTR_BULK) {
+				uint8_t epaddr = ep->bEndpointAddress;
+				if (epaddr & (1<<7)) {
+					msc->endpoint_in_address = epaddr;
+					msc->endpoint_in_maxpacketsize = ep->wMaxPacketSize;
+				} else {
+					msc->endpoint_out_address = epaddr;
+					msc->endpoint_out_maxpacketsize = ep->wMaxPacketSize;
+				}
+
+				if (msc->endpoint_in_address && msc->endpoint_out_address) {
+					msc->state_next = STATE_SET_CONFIGURATION_REQUEST;
+					return true;
+				}
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+	return false;
+}
+
+static inline void store_le32(uint8_t *buf, uint32_t value)
+{
+	buf[0] = value;
+	buf[1] = value >> 8;
+	buf[2] = value >> 16;
+	buf[3] = value >> 24;
+}
+
+static inline uint32_t load_le32(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/*
+ * Bulk-Only Transport
+ */
+
+static void bot_transfer(msc_device_t *msc, bool in, void *data, uint16_t datalen)
+{
+	usbh_device_t *dev = msc->usbh_device;
+	usbh_packet_t packet;
+
+	packet.address = dev->address;
+	packet.data = data;
+	packet.datalen = datalen;
+	packet.endpoint_type = USBH_ENDPOINT_TYPE_BULK;
+	packet.speed = dev->speed;
+	packet.callback = bot_event;
+	packet.callback_arg = dev;
+
+	if (in) {
+		packet.endpoint_address = msc->endpoint_in_address & 0x7f;
+		packet.endpoint_size_max = msc->endpoint_in_maxpacketsize;
+		packet.toggle = &msc->endpoint_in_toggle;
+		usbh_read(dev, &packet);
+	} else {
+		packet.endpoint_address = msc->endpoint_out_address;
+		packet.endpoint_size_max = msc->endpoint_out_maxpacketsize;
+		packet.toggle = &msc->endpoint_out_toggle;
+		usbh_write(dev, &packet);
+	}
+}
+
+static void bot_control(msc_device_t *msc, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index)
+{
+	struct usb_setup_data setup_data;
+
+	setup_data.bmRequestType = request_type;
+	setup_data.bRequest = request;
+	setup_data.wValue = value;
+	setup_data.wIndex = index;
+	setup_data.wLength = 0;
+
+	device_xfer_control_write_setup(&setup_data, sizeof(setup_data), bot_event, msc->usbh_device);
+}
+
+static void bot_clear_halt(msc_device_t *msc, uint8_t endpoint_address, enum RECOVERY recovery)
+{
+	msc->bot.state = BOT_STATE_CLEAR_HALT;
+	msc->bot.recovery = recovery;
+	msc->bot.halt_endpoint = endpoint_address;
+	bot_control(msc, 0b00000010, USB_REQ_CLEAR_FEATURE, USB_FEAT_ENDPOINT_HALT, endpoint_address);
+}
+
+/**
+ * Reset recovery: Bulk-Only Mass Storage Reset, then clear halt of both endpoints
+ */
+static void bot_reset(msc_device_t *msc)
+{
+	LOG_WARN("MSC: reset recovery\n");
+	msc->bot.state = BOT_STATE_RESET;
+	bot_control(msc, 0b00100001, MSC_REQ_RESET, 0, msc->interface_number);
+}
+
+static void bot_csw_read(msc_device_t *msc)
+{
+	msc->bot.state = BOT_STATE_CSW;
+	bot_transfer(msc, true, msc->csw, CSW_LENGTH);
+}
+
+/**
+ * Continue with next chunk of data phase, or read status
+ *
+ * OUT data are sent by max packet size since low-level driver fills whole
+ * packet into the transmit FIFO at once
+ */
+static void bot_data_next(msc_device_t *msc)
+{
+	const uint32_t remaining = msc->bot.length - msc->bot.index;
+
+	if (!remaining) {
+		bot_csw_read(msc);
+		return;
+	}
+
+	uint32_t chunk;
+	if (msc->bot.in) {
+		chunk = USBH_MSC_SECTOR_SIZE;
+	} else {
+		chunk = msc->endpoint_out_maxpacketsize;
+	}
+	if (chunk > remaining) {
+		chunk = remaining;
+	}
+
+	msc->bot.state = BOT_STATE_DATA;
+	bot_transfer(msc, msc->bot.in, &msc->bot.data[msc->bot.index], chunk);
+}
+
+static void sense_done(msc_device_t *msc, enum RESULT result)
+{
+	if (result == RESULT_OK) {
+		LOG_WARN("MSC: sense key %X, ASC %02X, ASCQ %02X\n",
+			msc->buffer[2] & 0x0f, msc->buffer[12], msc->buffer[13]);
+	}
+	msc->bot.done_after_sense(msc, RESULT_FAILED);
+}
+
+static void bot_command(msc_device_t *msc, const uint8_t *cdb, uint8_t cdb_length,
+	void *data, uint32_t length, bool in, command_done_t done);
+
+static void bot_finish(msc_device_t *msc, enum RESULT result)
+{
+	msc->bot.state = BOT_STATE_IDLE;
+
+	// Failed command leaves the sense data, that has to be read out
+	if (result == RESULT_FAILED && msc->cbw[15] != SCSI_REQUEST_SENSE) {
+		const uint8_t cdb[6] = {SCSI_REQUEST_SENSE, 0, 0, 0, SENSE_LENGTH, 0};
+		msc->bot.done_after_sense = msc->bot.done;
+		bot_command(msc, cdb, sizeof(cdb), msc->buffer, SENSE_LENGTH, true, sense_done);
+		return;
+	}
+
+	msc->bot.done(msc, result);
+}
+
+static void bot_csw_check(msc_device_t *msc)
+{
+	const uint8_t *csw = msc->csw;
+	if (load_le32(&csw[0]) != CSW_SIGNATURE || load_le32(&csw[4]) != msc->bot.tag) {
+		LOG_WARN("MSC: invalid CSW\n");
+		bot_reset(msc);
+		return;
+	}
+
+	switch (csw[12]) {
+	case CSW_STATUS_PASSED:
+		bot_finish(msc, RESULT_OK);
+		break;
+
+	case CSW_STATUS_FAILED:
+		bot_finish(msc, RESULT_FAILED);
+		break;
+
+	default:
+		// phase error
+		bot_reset(msc);
+		break;
+	}
+}
+
+static void bot_event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	msc_device_t *msc = (msc_device_t *)dev->drvdata;
+
+	switch (msc->bot.state) {
+	case BOT_STATE_CBW:
+		if (cb_data.status == USBH_PACKET_CALLBACK_STATUS_OK) {
+			bot_data_next(msc);
+		} else {
+			bot_reset(msc);
+		}
+		break;
+
+	case BOT_STATE_DATA:
+		switch (cb_data.status) {
+		case USBH_PACKET_CALLBACK_STATUS_OK:
+			msc->bot.index += cb_data.transferred_length;
+			bot_data_next(msc);
+			break;
+
+		case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+			// short packet, device has no more data
+			msc->bot.index += cb_data.transferred_length;
+			bot_csw_read(msc);
+			break;
+
+		case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+			// device stalled data phase
+			if (msc->bot.in) {
+				bot_clear_halt(msc, msc->endpoint_in_address, RECOVERY_CSW);
+			} else {
+				bot_clear_halt(msc, msc->endpoint_out_address, RECOVERY_CSW);
+			}
+			break;
+
+		case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+			bot_reset(msc);
+			break;
+		}
+		break;
+
+	case BOT_STATE_CSW:
+		switch (cb_data.status) {
+		case USBH_PACKET_CALLBACK_STATUS_OK:
+		case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+			if (cb_data.transferred_length == CSW_LENGTH) {
+				bot_csw_check(msc);
+			} else {
+				bot_reset(msc);
+			}
+			break;
+
+		case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+			// status may be stalled once
+			if (!msc->bot.csw_retry) {
+				msc->bot.csw_retry = true;
+				bot_clear_halt(msc, msc->endpoint_in_address, RECOVERY_CSW);
+			} else {
+				bot_reset(msc);
+			}
+			break;
+
+		case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+			bot_reset(msc);
+			break;
+		}
+		break;
+
+	case BOT_STATE_CLEAR_HALT:
+	case BOT_STATE_RESET:
+		if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
+			ERROR(cb_data.status);
+			bot_finish(msc, RESULT_ERROR);
+			break;
+		}
+		LOG_PRINTF("|empty packet read|");
+		msc->bot.state++;
+		device_xfer_control_read(0, 0, bot_event, dev);
+		break;
+
+	case BOT_STATE_CLEAR_HALT_EMPTY_READ:
+		if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
+			ERROR(cb_data.status);
+			bot_finish(msc, RESULT_ERROR);
+			break;
+		}
+
+		// endpoint starts with DATA0 after halt is cleared
+		if (msc->bot.halt_endpoint & 0x80) {
+			msc->endpoint_in_toggle = 0;
+		} else {
+			msc->endpoint_out_toggle = 0;
+		}
+
+		switch (msc->bot.recovery) {
+		case RECOVERY_CSW:
+			bot_csw_read(msc);
+			break;
+
+		case RECOVERY_RESET_IN:
+			bot_clear_halt(msc, msc->endpoint_out_address, RECOVERY_RESET_OUT);
+			break;
+
+		case RECOVERY_RESET_OUT:
+			bot_finish(msc, RESULT_ERROR);
+			break;
+		}
+		break;
+
+	case BOT_STATE_RESET_EMPTY_READ:
+		if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
+			ERROR(cb_data.status);
+			bot_finish(msc, RESULT_ERROR);
+			break;
+		}
+		bot_clear_halt(msc, msc->endpoint_in_address, RECOVERY_RESET_IN);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * @brief bot_command send SCSI command
+ * @param cdb command block
+ * @param cdb_length length of command block
+ * @param data data phase buffer
+ * @param length length of data phase
+ * @param in direction of data phase
+ * @param done called when the command finishes
+ */
+static void bot_command(msc_device_t *msc, const uint8_t *cdb, uint8_t cdb_length,
+	void *data, uint32_t length, bool in, command_done_t done)
+{
+	uint8_t *cbw = msc->cbw;
+	const uint32_t tag = msc->bot.tag + 1;
+
+	memset(cbw, 0, CBW_LENGTH);
+	store_le32(&cbw[0], CBW_SIGNATURE);
+	store_le32(&cbw[4], tag);
+	store_le32(&cbw[8], length);
+	cbw[12] = in ? 0x80 : 0x00;
+	cbw[13] = 0; // LUN
+	cbw[14] = cdb_length;
+	memcpy(&cbw[15], cdb, cdb_length);
+
+	msc->bot.tag = tag;
+	msc->bot.data = data;
+	msc->bot.length = length;
+	msc->bot.index = 0;
+	msc->bot.in = in;
+	msc->bot.csw_retry = false;
+	msc->bot.done = done;
+	msc->bot.state = BOT_STATE_CBW;
+
+	bot_transfer(msc, false, cbw, CBW_LENGTH);
+}
+
+/**
+ * READ(10) or WRITE(10) of count sectors
+ */
+static void bot_command_rw(msc_device_t *msc, bool read, uint32_t sector, uint32_t count,
+	void *data, command_done_t done)
+{
+	const uint8_t cdb[10] = {
+		read ? SCSI_READ_10 : SCSI_WRITE_10, 0,
+		sector >> 24, sector >> 16, sector >> 8, sector,
+		0,
+		count >> 8, count,
+		0
+	};
+	bot_command(msc, cdb, sizeof(cdb), data, count * USBH_MSC_SECTOR_SIZE, read, done);
+}
+
+/*
+ * Sector cache
+ */
+
+static msc_cache_line_t *cache_find(msc_device_t *msc, uint32_t sector)
+{
+	const uint32_t tag = LINE_TAG(sector);
+	uint32_t i;
+	for (i = 0; i < USBH_MSC_CACHE_LINES; i++) {
+		msc_cache_line_t *line = &msc->cache[i];
+		if (line->valid && line->tag == tag) {
+			return line;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Least recently used line, empty lines first
+ */
+static msc_cache_line_t *cache_victim(msc_device_t *msc)
+{
+	msc_cache_line_t *victim = &msc->cache[0];
+	uint32_t i;
+	for (i = 0; i < USBH_MSC_CACHE_LINES; i++) {
+		msc_cache_line_t *line = &msc->cache[i];
+		if (!line->valid) {
+			return line;
+		}
+		if ((int32_t)(line->used - victim->used) < 0) {
+			victim = line;
+		}
+	}
+	return victim;
+}
+
+static void cache_touch(msc_device_t *msc, msc_cache_line_t *line)
+{
+	line->used = ++msc->cache_clock;
+}
+
+static void cache_invalidate(msc_device_t *msc)
+{
+	uint32_t i;
+	for (i = 0; i < USBH_MSC_CACHE_LINES; i++) {
+		msc->cache[i].valid = 0;
+		msc->cache[i].dirty = 0;
+	}
+	msc->prefetch = false;
+}
+
+/**
+ * Count of sectors from sector, whose lines are not cached at all
+ */
+static uint32_t cache_uncached_run(msc_device_t *msc, uint32_t sector, uint32_t count)
+{
+	uint32_t run = 0;
+	if (count > 0xffff) {
+		count = 0xffff;
+	}
+	while (run < count && !cache_find(msc, sector + run)) {
+		run += USBH_MSC_CACHE_LINE_SECTORS - LINE_OFFSET(sector + run);
+	}
+	if (run > count) {
+		run = count;
+	}
+	return run;
+}
+
+static void request_done(msc_device_t *msc, enum RESULT result);
+
+/**
+ * Write first run of dirty sectors of the line
+ */
+static void cache_writeback(msc_device_t *msc, msc_cache_line_t *line)
+{
+	uint8_t first = 0;
+	uint8_t n = 0;
+
+	while (!(line->dirty & (1 << first))) {
+		first++;
+	}
+	while (first + n < USBH_MSC_CACHE_LINE_SECTORS && (line->dirty & (1 << (first + n)))) {
+		n++;
+	}
+
+	msc->request.pending = PENDING_WRITEBACK;
+	msc->request.line = line;
+	msc->request.mask = ((1 << n) - 1) << first;
+	bot_command_rw(msc, false, line->tag + first, n,
+		&line->data[first * USBH_MSC_SECTOR_SIZE], request_done);
+}
+
+/**
+ * Read invalid sectors of the line from sector up to the end of the line
+ * or the end of the medium, only those become valid
+ */
+static void cache_fill(msc_device_t *msc, msc_cache_line_t *line, uint32_t sector)
+{
+	const uint8_t first = LINE_OFFSET(sector);
+	uint32_t last = USBH_MSC_CACHE_LINE_SECTORS;
+	uint8_t n = 0;
+
+	// the last line of the medium may be partial
+	if (last > msc->sector_count - line->tag) {
+		last = msc->sector_count - line->tag;
+	}
+
+	while (first + n < last && !(line->valid & (1 << (first + n)))) {
+		n++;
+	}
+
+	msc->request.pending = PENDING_FILL;
+	msc->request.line = line;
+	msc->request.mask = ((1 << n) - 1) << first;
+	bot_command_rw(msc, true, sector, n,
+		&line->data[first * USBH_MSC_SECTOR_SIZE], request_done);
+}
+
+/**
+ * Get line for the sector, start write back of the replaced line when needed
+ * @returns 0 if a command was started, line otherwise
+ */
+static msc_cache_line_t *cache_allocate(msc_device_t *msc, uint32_t sector)
+{
+	msc_cache_line_t *line = cache_victim(msc);
+	if (line->valid && line->dirty) {
+		cache_writeback(msc, line);
+		return 0;
+	}
+	line->tag = LINE_TAG(sector);
+	line->valid = 0;
+	line->dirty = 0;
+	cache_touch(msc, line);
+	return line;
+}
+
+/*
+ * Requests
+ */
+
+static void request_complete(msc_device_t *msc, bool success)
+{
+	const msc_callback_t callback = msc->request.callback;
+
+	msc->request.type = REQUEST_NONE;
+	msc->request.pending = PENDING_NONE;
+	if (callback) {
+		callback(msc->device_id, success);
+	}
+}
+
+static void request_advance(msc_device_t *msc, uint32_t count)
+{
+	msc->request.data += count * USBH_MSC_SECTOR_SIZE;
+	msc->request.sector += count;
+	msc->request.count -= count;
+}
+
+static void request_done(msc_device_t *msc, enum RESULT result)
+{
+	const enum PENDING pending = msc->request.pending;
+	msc_cache_line_t *line = msc->request.line;
+
+	msc->request.pending = PENDING_NONE;
+	msc->state_next = STATE_READY;
+
+	if (result != RESULT_OK) {
+		LOG_WARN("MSC: transfer failed %d\n", result);
+		if (pending == PENDING_WRITEBACK) {
+			// data are lost, do not retry forever
+			line->dirty &= ~msc->request.mask;
+		}
+		if (msc->request.type != REQUEST_NONE) {
+			request_complete(msc, false);
+		}
+		return;
+	}
+
+	switch (pending) {
+	case PENDING_DIRECT:
+		request_advance(msc, msc->request.run);
+		break;
+
+	case PENDING_FILL:
+		line->valid |= msc->request.mask;
+		break;
+
+	case PENDING_WRITEBACK:
+		line->dirty &= ~msc->request.mask;
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * Serve the request from the cache, until a command has to be sent
+ * @returns true if command was started
+ */
+static bool request_read_step(msc_device_t *msc)
+{
+	while (msc->request.count) {
+		const uint32_t sector = msc->request.sector;
+		msc_cache_line_t *line = cache_find(msc, sector);
+
+		if (line && (line->valid & (1 << LINE_OFFSET(sector)))) {
+			memcpy(msc->request.data, &line->data[LINE_OFFSET(sector) * USBH_MSC_SECTOR_SIZE],
+				USBH_MSC_SECTOR_SIZE);
+			cache_touch(msc, line);
+			request_advance(msc, 1);
+			continue;
+		}
+
+		// large reads go directly into user's buffer
+		if (!line && msc->request.count >= USBH_MSC_CACHE_LINE_SECTORS) {
+			msc->request.run = cache_uncached_run(msc, sector, msc->request.count);
+			msc->request.pending = PENDING_DIRECT;
+			bot_command_rw(msc, true, sector, msc->request.run, msc->request.data, request_done);
+			return true;
+		}
+
+		if (!line) {
+			line = cache_allocate(msc, sector);
+			if (!line) {
+				return true;
+			}
+		}
+		cache_fill(msc, line, sector);
+		return true;
+	}
+	return false;
+}
+
+static bool request_write_step(msc_device_t *msc)
+{
+	while (msc->request.count) {
+		const uint32_t sector = msc->request.sector;
+		msc_cache_line_t *line = cache_find(msc, sector);
+
+		// large writes go directly from user's buffer
+		if (!line && msc->request.count >= USBH_MSC_CACHE_LINE_SECTORS) {
+			msc->request.run = cache_uncached_run(msc, sector, msc->request.count);
+			msc->request.pending = PENDING_DIRECT;
+			bot_command_rw(msc, false, sector, msc->request.run, msc->request.data, request_done);
+			return true;
+		}
+
+		if (!line) {
+			line = cache_allocate(msc, sector);
+			if (!line) {
+				return true;
+			}
+		}
+
+		const uint8_t bit = 1 << LINE_OFFSET(sector);
+		memcpy(&line->data[LINE_OFFSET(sector) * USBH_MSC_SECTOR_SIZE], msc->request.data,
+			USBH_MSC_SECTOR_SIZE);
+		line->valid |= bit;
+		line->dirty |= bit;
+		cache_touch(msc, line);
+		request_advance(msc, 1);
+	}
+	return false;
+}
+
+static msc_cache_line_t *cache_dirty_line(msc_device_t *msc)
+{
+	uint32_t i;
+	for (i = 0; i < USBH_MSC_CACHE_LINES; i++) {
+		if (msc->cache[i].valid && msc->cache[i].dirty) {
+			return &msc->cache[i];
+		}
+	}
+	return 0;
+}
+
+static void request_step(msc_device_t *msc)
+{
+	bool started = false;
+
+	switch (msc->request.type) {
+	case REQUEST_READ:
+		started = request_read_step(msc);
+		if (!started && msc->request.sequential) {
+			// sequential reading, prefetch line following the request
+			const uint32_t sector = msc->request.sector;
+			if (sector < msc->sector_count && !cache_find(msc, sector)) {
+				msc->prefetch_tag = LINE_TAG(sector);
+				msc->prefetch = true;
+			}
+		}
+		break;
+
+	case REQUEST_WRITE:
+		started = request_write_step(msc);
+		break;
+
+	case REQUEST_FLUSH:
+		{
+			msc_cache_line_t *line = cache_dirty_line(msc);
+			if (line) {
+				cache_writeback(msc, line);
+				started = true;
+			}
+		}
+		break;
+
+	default:
+		return;
+	}
+
+	if (started) {
+		msc->state_next = STATE_COMMAND;
+	} else {
+		request_complete(msc, true);
+	}
+}
+
+/**
+ * Background work of idle device: read-ahead and delayed write back
+ */
+static void idle_step(msc_device_t *msc)
+{
+	if (msc->prefetch) {
+		msc->prefetch = false;
+		if (!cache_find(msc, msc->prefetch_tag)) {
+			msc_cache_line_t *line = cache_victim(msc);
+			// never write back only to make space for speculative read
+			if (!line->valid || !line->dirty) {
+				line->tag = msc->prefetch_tag;
+				line->valid = 0;
+				line->dirty = 0;
+				// read-ahead line is the oldest, so it does not replace hot lines
+				line->used = msc->cache_clock - USBH_MSC_CACHE_LINES;
+				msc->state_next = STATE_COMMAND;
+				cache_fill(msc, line, line->tag);
+				return;
+			}
+		}
+	}
+
+	if (msc->time_curr_us - msc->timestamp_us > USBH_MSC_WRITEBACK_DELAY_US) {
+		msc_cache_line_t *line = cache_dirty_line(msc);
+		if (line) {
+			msc->state_next = STATE_COMMAND;
+			cache_writeback(msc, line);
+		}
+	}
+}
+
+/*
+ * Enumeration
+ */
+
+static void read_capacity_done(msc_device_t *msc, enum RESULT result)
+{
+	if (result != RESULT_OK) {
+		msc->timestamp_us = msc->time_curr_us;
+		msc->state_next = STATE_TEST_UNIT_READY_WAIT;
+		return;
+	}
+
+	const uint8_t *cap = msc->buffer;
+	const uint32_t last = ((uint32_t)cap[0] << 24) | (cap[1] << 16) | (cap[2] << 8) | cap[3];
+	const uint32_t block = ((uint32_t)cap[4] << 24) | (cap[5] << 16) | (cap[6] << 8) | cap[7];
+
+	if (block != USBH_MSC_SECTOR_SIZE) {
+		LOG_WARN("MSC: unsupported block size %d\n", block);
+		msc->state_next = STATE_ERROR;
+		return;
+	}
+
+	msc->sector_count = last + 1;
+	msc->request.type = REQUEST_NONE;
+	msc->request.pending = PENDING_NONE;
+	msc->read_next = 0;
+	cache_invalidate(msc);
+
+	msc->state_next = STATE_READY;
+	LOG_INFO("\nMSC CONFIGURED, %d sectors\n", msc->sector_count);
+	if (msc_config->notify_connected) {
+		msc_config->notify_connected(msc->device_id, msc->sector_count);
+	}
+}
+
+static void test_unit_ready_done(msc_device_t *msc, enum RESULT result)
+{
+	if (result == RESULT_OK) {
+		msc->state_next = STATE_READ_CAPACITY;
+	} else {
+		// medium not present or becoming ready
+		msc->timestamp_us = msc->time_curr_us;
+		msc->state_next = STATE_TEST_UNIT_READY_WAIT;
+	}
+}
+
+static void inquiry_done(msc_device_t *msc, enum RESULT result)
+{
+	(void)result;
+	msc->state_next = STATE_TEST_UNIT_READY;
+}
+
+static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	msc_device_t *msc = (msc_device_t *)dev->drvdata;
+	switch (msc->state_next) {
+	case STATE_SET_CONFIGURATION_EMPTY_READ:
+		{
+			LOG_PRINTF("|empty packet read|");
+			switch (cb_data.status) {
+			case USBH_PACKET_CALLBACK_STATUS_OK:
+				msc->state_next = STATE_SET_CONFIGURATION_COMPLETE;
+				device_xfer_control_read(0, 0, event, dev);
+				break;
+
+			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+			case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+				ERROR(cb_data.status);
+				msc->state_next = STATE_ERROR;
+				break;
+			}
+		}
+		break;
+
+	case STATE_SET_CONFIGURATION_COMPLETE: // Configured
+		{
+			switch (cb_data.status) {
+			case USBH_PACKET_CALLBACK_STATUS_OK:
+				msc->endpoint_in_toggle = 0;
+				msc->endpoint_out_toggle = 0;
+				msc->bot.state = BOT_STATE_IDLE;
+				msc->bot.tag = 0;
+				msc->state_next = STATE_INQUIRY;
+				break;
+
+			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
+			case USBH_PACKET_CALLBACK_STATUS_EFATAL:
+			case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
+				ERROR(cb_data.status);
+				msc->state_next = STATE_ERROR;
+				break;
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * @param time_curr_us - monotically rising time
+ *		unit is microseconds
+ * @see usbh_poll()
+ */
+static void poll(void *drvdata, uint32_t time_curr_us)
+{
+	msc_device_t *msc = (msc_device_t *)drvdata;
+	usbh_device_t *dev = msc->usbh_device;
+
+	msc->time_curr_us = time_curr_us;
+
+	switch (msc->state_next) {
+	case STATE_READY:
+		if (msc->request.type != REQUEST_NONE) {
+			request_step(msc);
+		} else {
+			idle_step(msc);
+		}
+		break;
+
+	case STATE_SET_CONFIGURATION_REQUEST:
+		{
+			struct usb_setup_data setup_data;
+
+			setup_data.bmRequestType = 0b00000000;
+			setup_data.bRequest = USB_REQ_SET_CONFIGURATION;
+			setup_data.wValue = msc->configuration_value;
+			setup_data.wIndex = 0;
+			setup_data.wLength = 0;
+
+			msc->state_next = STATE_SET_CONFIGURATION_EMPTY_READ;
+
+			device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+		}
+		break;
+
+	case STATE_INQUIRY:
+		{
+			const uint8_t cdb[6] = {SCSI_INQUIRY, 0, 0, 0, INQUIRY_LENGTH, 0};
+			msc->state_next = STATE_INIT_COMMAND;
+			bot_command(msc, cdb, sizeof(cdb), msc->buffer, INQUIRY_LENGTH, true, inquiry_done);
+		}
+		break;
+
+	case STATE_TEST_UNIT_READY:
+		{
+			const uint8_t cdb[6] = {SCSI_TEST_UNIT_READY, 0, 0, 0, 0, 0};
+			msc->state_next = STATE_INIT_COMMAND;
+			bot_command(msc, cdb, sizeof(cdb), 0, 0, false, test_unit_ready_done);
+		}
+		break;
+
+	case STATE_TEST_UNIT_READY_WAIT:
+		if (time_curr_us - msc->timestamp_us > TEST_UNIT_READY_DELAY_US) {
+			msc->state_next = STATE_TEST_UNIT_READY;
+		}
+		break;
+
+	case STATE_READ_CAPACITY:
+		{
+			const uint8_t cdb[10] = {SCSI_READ_CAPACITY, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+			msc->state_next = STATE_INIT_COMMAND;
+			bot_command(msc, cdb, sizeof(cdb), msc->buffer, CAPACITY_LENGTH, true, read_capacity_done);
+		}
+		break;
+
+	default:
+		// do nothing - probably transfer is in progress
+		break;
+	}
+}
+
+static void remove(void *drvdata)
+{
+	LOG_INFO("Removing mass storage\n");
+
+	msc_device_t *msc = (msc_device_t *)drvdata;
+	const bool ready = msc->state_next == STATE_READY || msc->state_next == STATE_COMMAND;
+
+	msc->state_next = STATE_INACTIVE;
+	msc->endpoint_in_address = 0;
+	msc->endpoint_out_address = 0;
+
+	if (!ready) {
+		return;
+	}
+
+	if (msc->request.type != REQUEST_NONE) {
+		request_complete(msc, false);
+	}
+	cache_invalidate(msc);
+	if (msc_config->notify_disconnected) {
+		msc_config->notify_disconnected(msc->device_id);
+	}
+}
+
+static msc_device_t *request_start(uint8_t device_id, enum REQUEST type, uint32_t sector, uint32_t count,
+	void *data, msc_callback_t callback)
+{
+	// bad device_id handling
+	if (device_id >= USBH_MSC_MAX_DEVICES) {
+		return 0;
+	}
+
+	msc_device_t *msc = &msc_device[device_id];
+
+	// device is not ready or busy with another request
+	if ((msc->state_next != STATE_READY && msc->state_next != STATE_COMMAND) ||
+		msc->request.type != REQUEST_NONE) {
+		return 0;
+	}
+
+	if (sector >= msc->sector_count || count > msc->sector_count - sector) {
+		return 0;
+	}
+
+	msc->request.type = type;
+	msc->request.sector = sector;
+	msc->request.count = count;
+	msc->request.data = data;
+	msc->request.callback = callback;
+	msc->request.sequential = false;
+	msc->timestamp_us = msc->time_curr_us;
+	return msc;
+}
+
+bool usbh_msc_read(uint8_t device_id, uint32_t sector, uint32_t count, void *data, msc_callback_t callback)
+{
+	msc_device_t *msc = request_start(device_id, REQUEST_READ, sector, count, data, callback);
+	if (!msc) {
+		return false;
+	}
+	msc->request.sequential = (msc->read_next == sector);
+	msc->read_next = sector + count;
+	return true;
+}
+
+bool usbh_msc_write(uint8_t device_id, uint32_t sector, uint32_t count, const void *data, msc_callback_t callback)
+{
+	// it is safe cast since the data are only read from
+	return request_start(device_id, REQUEST_WRITE, sector, count, (void *)data, callback) != 0;
+}
+
+bool usbh_msc_flush(uint8_t device_id, msc_callback_t callback)
+{
+	return request_start(device_id, REQUEST_FLUSH, 0, 0, 0, callback) != 0;
+}
+
+static const usbh_dev_driver_info_t driver_info = {
+	.deviceClass = -1,
+	.deviceSubClass = -1,
+	.deviceProtocol = -1,
+	.idVendor = -1,
+	.idProduct = -1,
+	.ifaceClass = 0x08,
+	.ifaceSubClass = 0x06,
+	.ifaceProtocol = 0x50
+};
+
+const usbh_dev_driver_t usbh_msc_driver = {
+	.init = init,
+	.analyze_descriptor = analyze_descriptor,
+	.poll = poll,
+	.remove = remove,
+	.info = &driver_info
+};
@@ -0,0 +1,455 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "usbh_config.h"
+#include "usbh_hid_report.h"
+#include "usart_helpers.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LOG_MODULE HID
+
+/*
+ * HID report descriptor compiler
+ *
+ * Report descriptor is walked once, when the device is configured.
+ * Every Input, Output and Feature item is turned into field entries
+ * with their position in the report, so decoding of a report is only
+ * a lookup in the small table and extraction of bits.
+ * Consecutive variable elements with consecutive usages (buttons, X and Y)
+ * share one entry, which keeps the table short.
+ */
+
+enum ITEM_TYPE {
+	ITEM_TYPE_MAIN,
+	ITEM_TYPE_GLOBAL,
+	ITEM_TYPE_LOCAL
+};
+
+enum MAIN_TAG {
+	MAIN_TAG_INPUT = 0x8,
+	MAIN_TAG_OUTPUT = 0x9,
+	MAIN_TAG_COLLECTION = 0xa,
+	MAIN_TAG_FEATURE = 0xb,
+	MAIN_TAG_END_COLLECTION = 0xc
+};
+
+enum GLOBAL_TAG {
+	GLOBAL_TAG_USAGE_PAGE = 0x0,
+	GLOBAL_TAG_LOGICAL_MINIMUM = 0x1,
+	GLOBAL_TAG_LOGICAL_MAXIMUM = 0x2,
+	GLOBAL_TAG_REPORT_SIZE = 0x7,
+	GLOBAL_TAG_REPORT_ID = 0x8,
+	GLOBAL_TAG_REPORT_COUNT = 0x9,
+	GLOBAL_TAG_PUSH = 0xa,
+	GLOBAL_TAG_POP = 0xb
+};
+
+enum LOCAL_TAG {
+	LOCAL_TAG_USAGE = 0x0,
+	LOCAL_TAG_USAGE_MINIMUM = 0x1,
+	LOCAL_TAG_USAGE_MAXIMUM = 0x2
+};
+
+// bits of the Input, Output and Feature item data
+#define MAIN_DATA_CONSTANT	(1 << 0)
+#define MAIN_DATA_VARIABLE	(1 << 1)
+#define MAIN_DATA_RELATIVE	(1 << 2)
+
+#define ITEM_LONG	(0xfe)
+
+// depth of Push/Pop stack
+#define GLOBAL_STACK_DEPTH	(2)
+
+struct _global_state {
+	uint16_t usage_page;
+	int32_t logical_minimum;
+	// maximum is interpreted when the main item is known, see logical_range()
+	uint32_t logical_maximum;
+	uint8_t logical_maximum_size;
+	uint8_t report_size;
+	uint8_t report_id;
+	uint16_t report_count;
+};
+typedef struct _global_state global_state_t;
+
+struct _local_state {
+	uint32_t usage[USBH_HID_REPORT_USAGES];
+	uint8_t usage_count;
+	uint32_t usage_minimum;
+	uint32_t usage_maximum;
+	bool usage_range;
+};
+typedef struct _local_state local_state_t;
+
+static struct _usbh_hid_report_size *report_size_get(usbh_hid_report_info_t *info, uint8_t report_id)
+{
+	uint8_t i;
+	for (i = 0; i < info->report_count; i++) {
+		if (info->report[i].id == report_id) {
+			return &info->report[i];
+		}
+	}
+
+	if (info->report_count == USBH_HID_REPORT_IDS) {
+		return 0;
+	}
+
+	struct _usbh_hid_report_size *report = &info->report[info->report_count++];
+	memset(report, 0, sizeof(*report));
+	report->id = report_id;
+	return report;
+}
+
+/**
+ * Logical maximum is unsigned, when logical minimum is not negative
+ */
+static int32_t logical_maximum(const global_state_t *global)
+{
+	if (global->logical_minimum >= 0 || global->logical_maximum_size == 4) {
+		return global->logical_maximum;
+	}
+
+	const uint32_t sign = 1u << (global->logical_maximum_size * 8 - 1);
+	return (int32_t)((global->logical_maximum ^ sign) - sign);
+}
+
+static uint32_t element_usage(const local_state_t *local, uint16_t index)
+{
+	if (local->usage_count) {
+		// the last usage applies to all remaining elements
+		return local->usage[index < local->usage_count ? index : local->usage_count - 1];
+	}
+
+	if (local->usage_range) {
+		const uint32_t usage = local->usage_minimum + index;
+		return usage < local->usage_maximum ? usage : local->usage_maximum;
+	}
+	return 0;
+}
+
+static usbh_hid_field_t *field_add(usbh_hid_report_info_t *info, const global_state_t *global,
+	uint8_t type, uint8_t flags, uint16_t bit_offset, uint32_t usage)
+{
+	if (info->field_count == USBH_HID_REPORT_FIELDS) {
+		return 0;
+	}
+
+	usbh_hid_field_t *field = &info->field[info->field_count++];
+	field->usage = usage;
+	field->logical_minimum = global->logical_minimum;
+	field->logical_maximum = logical_maximum(global);
+	field->bit_offset = bit_offset;
+	field->bit_size = global->report_size;
+	field->count = 0;
+	field->report_id = global->report_id;
+	field->type = type;
+	field->flags = flags;
+	return field;
+}
+
+/**
+ * Add one variable element, extend the previous field when possible
+ */
+static void field_variable(usbh_hid_report_info_t *info, const global_state_t *global,
+	uint8_t type, uint8_t flags, uint16_t bit_offset, uint32_t usage)
+{
+	if (info->field_count) {
+		usbh_hid_field_t *field = &info->field[info->field_count - 1];
+		if (field->type == type && field->flags == flags && field->report_id == global->report_id &&
+			field->bit_size == global->report_size && field->count < UINT8_MAX &&
+			field->bit_offset + field->count * field->bit_size == bit_offset &&
+			field->usage + field->count == usage &&
+			field->logical_minimum == global->logical_minimum &&
+			field->logical_maximum == logical_maximum(global)) {
+			field->count++;
+			return;
+		}
+	}
+
+	usbh_hid_field_t *field = field_add(info, global, type, flags, bit_offset, usage);
+	if (field) {
+		field->count = 1;
+	}
+}
+
+static void main_item(usbh_hid_report_info_t *info, const global_state_t *global,
+	const local_state_t *local, uint8_t type, uint32_t data)
+{
+	struct _usbh_hid_report_size *report = report_size_get(info, global->report_id);
+	if (!report) {
+		LOG_PRINTF("HID: too many reports\n");
+		return;
+	}
+
+	const uint16_t bit_offset = report->bits[type];
+	report->bits[type] += global->report_size * global->report_count;
+
+	// padding
+	if ((data & MAIN_DATA_CONSTANT) || !global->report_size || global->report_size > 32) {
+		return;
+	}
+
+	uint8_t flags = 0;
+	if (data & MAIN_DATA_VARIABLE) {
+		flags |= USBH_HID_FIELD_VARIABLE;
+	}
+	if (data & MAIN_DATA_RELATIVE) {
+		flags |= USBH_HID_FIELD_RELATIVE;
+	}
+	if (global->logical_minimum < 0) {
+		flags |= USBH_HID_FIELD_SIGNED;
+	}
+
+	uint16_t i;
+	if (flags & USBH_HID_FIELD_VARIABLE) {
+		for (i = 0; i < global->report_count; i++) {
+			field_variable(info, global, type, flags, bit_offset + i * global->report_size,
+				element_usage(local, i));
+		}
+		return;
+	}
+
+	// array, elements carry usage indices
+	const uint32_t usage = local->usage_range ? local->usage_minimum : element_usage(local, 0);
+	for (i = 0; i < global->report_count; i += UINT8_MAX) {
+		usbh_hid_field_t *field = field_add(info, global, type, flags,
+			bit_offset + i * global->report_size, usage);
+		if (!field) {
+			return;
+		}
+		field->count = global->report_count - i < UINT8_MAX ? global->report_count - i : UINT8_MAX;
+	}
+}
+
+bool usbh_hid_report_compile(usbh_hid_report_info_t *info, const uint8_t *descriptor, uint16_t length)
+{
+	global_state_t global;
+	global_state_t stack[GLOBAL_STACK_DEPTH];
+	uint8_t stack_depth = 0;
+	local_state_t local;
+	uint32_t i = 0;
+
+	memset(info, 0, sizeof(*info));
+	memset(&global, 0, sizeof(global));
+	memset(&local, 0, sizeof(local));
+
+	while (i < length) {
+		const uint8_t prefix = descriptor[i];
+
+		if (prefix == ITEM_LONG) {
+			// long items are reserved, skip them
+			if (i + 2 >= length) {
+				return false;
+			}
+			i += 3 + descriptor[i + 1];
+			continue;
+		}
+
+		const uint8_t size = (prefix & 0x03) == 3 ? 4 : (prefix & 0x03);
+		const uint8_t type = (prefix >> 2) & 0x03;
+		const uint8_t tag = prefix >> 4;
+
+		if (i + 1 + size > length) {
+			return false;
+		}
+
+		uint32_t value = 0;
+		uint8_t k;
+		for (k = 0; k < size; k++) {
+			value |= (uint32_t)descriptor[i + 1 + k] << (8 * k);
+		}
+		int32_t svalue = value;
+		if (size && size < 4) {
+			const uint32_t sign = 1u << (size * 8 - 1);
+			svalue = (int32_t)((value ^ sign) - sign);
+		}
+		i += 1 + size;
+
+		switch (type) {
+		case ITEM_TYPE_MAIN:
+			switch (tag) {
+			case MAIN_TAG_INPUT:
+				main_item(info, &global, &local, USBH_HID_REPORT_INPUT, value);
+				break;
+			case MAIN_TAG_OUTPUT:
+				main_item(info, &global, &local, USBH_HID_REPORT_OUTPUT, value);
+				break;
+			case MAIN_TAG_FEATURE:
+				main_item(info, &global, &local, USBH_HID_REPORT_FEATURE, value);
+				break;
+			default:
+				break;
+			}
+			// local items apply to one main item only
+			memset(&local, 0, sizeof(local));
+			break;
+
+		case ITEM_TYPE_GLOBAL:
+			switch (tag) {
+			case GLOBAL_TAG_USAGE_PAGE:
+				global.usage_page = value;
+				break;
+			case GLOBAL_TAG_LOGICAL_MINIMUM:
+				global.logical_minimum = svalue;
+				break;
+			case GLOBAL_TAG_LOGICAL_MAXIMUM:
+				global.logical_maximum = value;
+				global.logical_maximum_size = size ? size : 1;
+				break;
+			case GLOBAL_TAG_REPORT_SIZE:
+				global.report_size = value;
+				break;
+			case GLOBAL_TAG_REPORT_ID:
+				global.report_id = value;
+				info->report_ids = true;
+				break;
+			case GLOBAL_TAG_REPORT_COUNT:
+				global.report_count = value;
+				break;
+			case GLOBAL_TAG_PUSH:
+				if (stack_depth == GLOBAL_STACK_DEPTH) {
+					return false;
+				}
+				stack[stack_depth++] = global;
+				break;
+			case GLOBAL_TAG_POP:
+				if (!stack_depth) {
+					return false;
+				}
+				global = stack[--stack_depth];
+				break;
+			default:
+				break;
+			}
+			break;
+
+		case ITEM_TYPE_LOCAL:
+			{
+				// 4 byte usage contains its own usage page
+				const uint32_t usage = size == 4 ? value : USBH_HID_USAGE(global.usage_page, value);
+				switch (tag) {
+				case LOCAL_TAG_USAGE:
+					if (local.usage_count < USBH_HID_REPORT_USAGES) {
+						local.usage[local.usage_count++] = usage;
+					}
+					break;
+				case LOCAL_TAG_USAGE_MINIMUM:
+					local.usage_minimum = usage;
+					local.usage_range = true;
+					break;
+				case LOCAL_TAG_USAGE_MAXIMUM:
+					local.usage_maximum = usage;
+					local.usage_range = true;
+					break;
+				default:
+					break;
+				}
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	LOG_INFO("HID: %d fields, %d reports\n", info->field_count, info->report_count);
+	return true;
+}
+
+const usbh_hid_field_t *usbh_hid_report_find(const usbh_hid_report_info_t *info, uint8_t type,
+	uint32_t usage, uint8_t *index)
+{
+	uint8_t i;
+	for (i = 0; i < info->field_count; i++) {
+		const usbh_hid_field_t *field = &info->field[i];
+		if (field->type != type) {
+			continue;
+		}
+
+		if (field->flags & USBH_HID_FIELD_VARIABLE) {
+			if (usage >= field->usage && usage - field->usage < field->count) {
+				if (index) {
+					*index = usage - field->usage;
+				}
+				return field;
+			}
+		} else if (usage == field->usage) {
+			if (index) {
+				*index = 0;
+			}
+			return field;
+		}
+	}
+	return 0;
+}
+
+uint16_t usbh_hid_report_bytes(const usbh_hid_report_info_t *info, uint8_t type, uint8_t report_id)
+{
+	uint8_t i;
+	for (i = 0; i < info->report_count; i++) {
+		if (info->report[i].id == report_id) {
+			return (info->report[i].bits[type] + 7) / 8;
+		}
+	}
+	return 0;
+}
+
+int32_t usbh_hid_field_value(const usbh_hid_field_t *field, uint8_t index, const uint8_t *data, uint16_t length)
+{
+	const uint32_t offset = field->bit_offset + index * field->bit_size;
+	const uint8_t size = field->bit_size;
+	const uint32_t byte = offset >> 3;
+	uint32_t value;
+
+	if (offset + size > (uint32_t)length * 8) {
+		return 0;
+	}
+
+	// byte aligned fields are the common case
+	if (!(offset & 7) && size == 8) {
+		value = data[byte];
+	} else if (!(offset & 7) && size == 16) {
+		value = data[byte] | (data[byte + 1] << 8);
+	} else {
+		uint64_t bits = 0;
+		uint32_t b = (offset + size - 1) >> 3;
+		for (;;) {
+			bits = (bits << 8) | data[b];
+			if (b == byte) {
+				break;
+			}
+			b--;
+		}
+		value = bits >> (offset & 7);
+		if (size < 32) {
+			value &= (1u << size) - 1;
+		}
+	}
+
+	if ((field->flags & USBH_HID_FIELD_SIGNED) && size < 32) {
+		const uint32_t sign = 1u << (size - 1);
+		return (int32_t)((value ^ sign) - sign);
+	}
+	return value;
+}
@@ -0,0 +1,139 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_HID_REPORT_
+#define USBH_HID_REPORT_
+
+#include "usbh_core.h"
+
+#include <stdint.h>
+
+BEGIN_DECLS
+
+/// HID class descriptor types
+#define USBH_HID_DT_HID		(0x21)
+#define USBH_HID_DT_REPORT	(0x22)
+
+/// Usage with its usage page in the upper half
+#define USBH_HID_USAGE(page, id)	(((uint32_t)(page) << 16) | (id))
+
+#define USBH_HID_PAGE_GENERIC_DESKTOP	(0x01)
+#define USBH_HID_PAGE_KEYBOARD		(0x07)
+#define USBH_HID_PAGE_LED		(0x08)
+#define USBH_HID_PAGE_BUTTON		(0x09)
+
+#define USBH_HID_USAGE_X	USBH_HID_USAGE(USBH_HID_PAGE_GENERIC_DESKTOP, 0x30)
+#define USBH_HID_USAGE_Y	USBH_HID_USAGE(USBH_HID_PAGE_GENERIC_DESKTOP, 0x31)
+#define USBH_HID_USAGE_WHEEL	USBH_HID_USAGE(USBH_HID_PAGE_GENERIC_DESKTOP, 0x38)
+
+enum USBH_HID_REPORT_TYPE {
+	USBH_HID_REPORT_INPUT,
+	USBH_HID_REPORT_OUTPUT,
+	USBH_HID_REPORT_FEATURE,
+	USBH_HID_REPORT_TYPES
+};
+
+enum USBH_HID_FIELD_FLAGS {
+	/// element values are states of usages (usage + index), otherwise they are usage indices
+	USBH_HID_FIELD_VARIABLE = (1 << 0),
+	USBH_HID_FIELD_RELATIVE = (1 << 1),
+	/// logical minimum is negative, values are sign extended
+	USBH_HID_FIELD_SIGNED = (1 << 2)
+};
+
+/**
+ * @brief one run of report elements of the same size
+ *
+ * Element i is at bit_offset + i * bit_size. Variable field covers usages
+ * usage .. usage + count - 1, array field elements carry
+ * usage index relative to usage.
+ */
+struct _usbh_hid_field {
+	uint32_t usage;
+	int32_t logical_minimum;
+	int32_t logical_maximum;
+	/// offset in the report, report ID byte not included
+	uint16_t bit_offset;
+	uint8_t bit_size;
+	uint8_t count;
+	uint8_t report_id;
+	/// @see USBH_HID_REPORT_TYPE
+	uint8_t type;
+	/// @see USBH_HID_FIELD_FLAGS
+	uint8_t flags;
+};
+typedef struct _usbh_hid_field usbh_hid_field_t;
+
+struct _usbh_hid_report_size {
+	uint8_t id;
+	/// size in bits of each report type, report ID byte not included
+	uint16_t bits[USBH_HID_REPORT_TYPES];
+};
+
+/**
+ * @brief Report layout compiled from the report descriptor
+ */
+struct _usbh_hid_report_info {
+	usbh_hid_field_t field[USBH_HID_REPORT_FIELDS];
+	uint8_t field_count;
+	/// reports are prefixed by report ID byte
+	bool report_ids;
+	struct _usbh_hid_report_size report[USBH_HID_REPORT_IDS];
+	uint8_t report_count;
+};
+typedef struct _usbh_hid_report_info usbh_hid_report_info_t;
+
+/**
+ * @brief usbh_hid_report_compile parse the report descriptor into the field table
+ *
+ * Fields that do not fit into the table are left out.
+ *
+ * @returns false when the descriptor is malformed
+ */
+bool usbh_hid_report_compile(usbh_hid_report_info_t *info, const uint8_t *descriptor, uint16_t length);
+
+/**
+ * @brief usbh_hid_report_find find the field carrying the usage
+ * @param type @see USBH_HID_REPORT_TYPE
+ * @param usage
+ * @param index set to the index of element with the usage (variable fields)
+ * @returns 0 when not found
+ */
+const usbh_hid_field_t *usbh_hid_report_find(const usbh_hid_report_info_t *info, uint8_t type,
+	uint32_t usage, uint8_t *index);
+
+/**
+ * @brief usbh_hid_report_bytes size of the report in bytes, report ID byte not included
+ */
+uint16_t usbh_hid_report_bytes(const usbh_hid_report_info_t *info, uint8_t type, uint8_t report_id);
+
+/**
+ * @brief usbh_hid_field_value extract value of one element
+ * @param data report, report ID byte not included
+ * @param length length of data
+ * @returns 0 when the element lies outside of data
+ */
+int32_t usbh_hid_field_value(const usbh_hid_field_t *field, uint8_t index, const uint8_t *data, uint16_t length);
+
+END_DECLS
+
+#endif
@@ -0,0 +1,213 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "usbh_hid_request.h"
+#include "usbh_config.h"
+#include "usart_helpers.h"
+
+#include <libopencm3/usb/usbstd.h>
+
+#define LOG_MODULE HID
+
+// HID class requests
+#define HID_REQ_GET_REPORT	(0x01)
+#define HID_REQ_SET_REPORT	(0x09)
+#define HID_REQ_SET_IDLE	(0x0A)
+#define HID_REQ_SET_PROTOCOL	(0x0B)
+
+enum STAGES {
+	STAGE_FREE,
+	STAGE_SETUP,
+	STAGE_DATA_IN,
+	STAGE_DATA_OUT,
+	STAGE_EMPTY_READ
+};
+
+/**
+ * @brief request in progress
+ *
+ * Packet callback gets only the device, so requests are
+ * looked up by the device.
+ */
+struct _hid_request {
+	usbh_device_t *dev;
+	usbh_packet_callback_t callback;
+	void *data;
+	uint16_t length;
+	bool in;
+	enum STAGES stage;
+};
+typedef struct _hid_request hid_request_t;
+
+static hid_request_t hid_request[USBH_HID_REQUESTS];
+
+static hid_request_t *request_find(const usbh_device_t *dev)
+{
+	uint8_t i;
+	for (i = 0; i < USBH_HID_REQUESTS; i++) {
+		if (hid_request[i].stage != STAGE_FREE && hid_request[i].dev == dev) {
+			return &hid_request[i];
+		}
+	}
+	return 0;
+}
+
+static void request_complete(hid_request_t *request, usbh_packet_callback_data_t cb_data)
+{
+	usbh_device_t *dev = request->dev;
+	usbh_packet_callback_t callback = request->callback;
+
+	request->stage = STAGE_FREE;
+	if (callback) {
+		callback(dev, cb_data);
+	}
+}
+
+static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	hid_request_t *request = request_find(dev);
+	if (!request) {
+		return;
+	}
+
+	switch (request->stage) {
+	case STAGE_SETUP:
+		if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
+			request_complete(request, cb_data);
+		} else if (!request->length) {
+			LOG_PRINTF("|empty packet read|");
+			request->stage = STAGE_EMPTY_READ;
+			device_xfer_control_read(0, 0, event, dev);
+		} else if (request->in) {
+			request->stage = STAGE_DATA_IN;
+			device_xfer_control_read(request->data, request->length, event, dev);
+		} else {
+			request->stage = STAGE_DATA_OUT;
+			device_xfer_control_write_data(request->data, request->length, event, dev);
+		}
+		break;
+
+	case STAGE_DATA_IN:
+		// short report is not an error
+		if (cb_data.status == USBH_PACKET_CALLBACK_STATUS_ERRSIZ) {
+			cb_data.status = USBH_PACKET_CALLBACK_STATUS_OK;
+		}
+		request_complete(request, cb_data);
+		break;
+
+	case STAGE_DATA_OUT:
+		if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
+			request_complete(request, cb_data);
+		} else {
+			LOG_PRINTF("|empty packet read|");
+			request->stage = STAGE_EMPTY_READ;
+			device_xfer_control_read(0, 0, event, dev);
+		}
+		break;
+
+	case STAGE_EMPTY_READ:
+		cb_data.transferred_length = request->length;
+		request_complete(request, cb_data);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static bool request_start(usbh_device_t *dev, uint8_t bRequest, uint16_t wValue, uint8_t interface,
+	void *data, uint16_t length, bool in, usbh_packet_callback_t callback)
+{
+	struct usb_setup_data setup_data;
+	hid_request_t *request = 0;
+	uint8_t i;
+
+	if (request_find(dev)) {
+		return false;
+	}
+
+	for (i = 0; i < USBH_HID_REQUESTS; i++) {
+		if (hid_request[i].stage == STAGE_FREE) {
+			request = &hid_request[i];
+			break;
+		}
+	}
+	if (!request) {
+		LOG_WARN("INCREASE USBH_HID_REQUESTS\n");
+		return false;
+	}
+
+	request->dev = dev;
+	request->callback = callback;
+	request->data = data;
+	request->length = length;
+	request->in = in;
+	request->stage = STAGE_SETUP;
+
+	setup_data.bmRequestType = in ? 0b10100001 : 0b00100001;
+	setup_data.bRequest = bRequest;
+	setup_data.wValue = wValue;
+	setup_data.wIndex = interface;
+	setup_data.wLength = length;
+
+	device_xfer_control_write_setup(&setup_data, sizeof(setup_data), event, dev);
+	return true;
+}
+
+bool usbh_hid_set_idle(usbh_device_t *dev, uint8_t interface, uint8_t report_id, uint16_t duration_ms,
+	usbh_packet_callback_t callback)
+{
+	uint16_t duration = duration_ms / 4;
+	if (duration > 255) {
+		duration = 255;
+	}
+	return request_start(dev, HID_REQ_SET_IDLE, (duration << 8) | report_id, interface, 0, 0, false, callback);
+}
+
+bool usbh_hid_set_protocol(usbh_device_t *dev, uint8_t interface, uint8_t protocol,
+	usbh_packet_callback_t callback)
+{
+	return request_start(dev, HID_REQ_SET_PROTOCOL, protocol, interface, 0, 0, false, callback);
+}
+
+bool usbh_hid_get_report(usbh_device_t *dev, uint8_t interface, uint8_t type, uint8_t report_id,
+	void *data, uint16_t length, usbh_packet_callback_t callback)
+{
+	// report types are numbered from 1 in requests
+	return request_start(dev, HID_REQ_GET_REPORT, ((type + 1) << 8) | report_id, interface,
+		data, length, true, callback);
+}
+
+bool usbh_hid_set_report(usbh_device_t *dev, uint8_t interface, uint8_t type, uint8_t report_id,
+	const void *data, uint16_t length, usbh_packet_callback_t callback)
+{
+	return request_start(dev, HID_REQ_SET_REPORT, ((type + 1) << 8) | report_id, interface,
+		(void *)data, length, false, callback);
+}
+
+void usbh_hid_request_cancel(usbh_device_t *dev)
+{
+	hid_request_t *request = request_find(dev);
+	if (request) {
+		request->stage = STAGE_FREE;
+	}
+}
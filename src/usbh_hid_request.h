@@ -0,0 +1,92 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_HID_REQUEST_
+#define USBH_HID_REQUEST_
+
+#include "usbh_core.h"
+#include "driver/usbh_device_driver.h"
+
+#include <stdint.h>
+
+BEGIN_DECLS
+
+/*
+ * HID class requests
+ *
+ * Each function runs the whole control transfer (setup, data and status
+ * stage) and calls the callback once with the status of the transfer.
+ * Transferred length is the length of the data stage.
+ * Only one request per device can be in progress.
+ */
+
+#define USBH_HID_PROTOCOL_BOOT		(0)
+#define USBH_HID_PROTOCOL_REPORT	(1)
+
+/**
+ * @brief usbh_hid_set_idle limit reports of unchanged data
+ * @param interface interface number
+ * @param report_id 0 applies to all reports
+ * @param duration_ms report is repeated after this time when unchanged,
+ * 0 sends reports only on change. Rounded down to 4 ms, up to 1020 ms.
+ * @returns false when other request is in progress
+ */
+bool usbh_hid_set_idle(usbh_device_t *dev, uint8_t interface, uint8_t report_id, uint16_t duration_ms,
+	usbh_packet_callback_t callback);
+
+/**
+ * @brief usbh_hid_set_protocol switch between boot and report protocol
+ * @param protocol @see USBH_HID_PROTOCOL_BOOT
+ * @returns false when other request is in progress
+ */
+bool usbh_hid_set_protocol(usbh_device_t *dev, uint8_t interface, uint8_t protocol,
+	usbh_packet_callback_t callback);
+
+/**
+ * @brief usbh_hid_get_report read report through control endpoint
+ * @param type @see USBH_HID_REPORT_TYPE
+ * @param data has to stay valid until the callback is called
+ * @returns false when other request is in progress
+ */
+bool usbh_hid_get_report(usbh_device_t *dev, uint8_t interface, uint8_t type, uint8_t report_id,
+	void *data, uint16_t length, usbh_packet_callback_t callback);
+
+/**
+ * @brief usbh_hid_set_report send report through control endpoint
+ * @param type @see USBH_HID_REPORT_TYPE
+ * @param data including report ID byte when report IDs are used,
+ * has to stay valid until the callback is called
+ * @returns false when other request is in progress
+ */
+bool usbh_hid_set_report(usbh_device_t *dev, uint8_t interface, uint8_t type, uint8_t report_id,
+	const void *data, uint16_t length, usbh_packet_callback_t callback);
+
+/**
+ * @brief usbh_hid_request_cancel forget request of the removed device
+ *
+ * Callback is not called.
+ */
+void usbh_hid_request_cancel(usbh_device_t *dev);
+
+END_DECLS
+
+#endif
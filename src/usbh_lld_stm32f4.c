@@ -23,12 +23,15 @@
 #include "driver/usbh_device_driver.h"
 #include "usbh_lld_stm32f4.h"
 #include "usart_helpers.h"
+#include "usbh_trace.h"
 
 #include <string.h>
 #include <stdint.h>
 #include <libopencm3/stm32/otg_hs.h>
 #include <libopencm3/stm32/otg_fs.h>
 
+#define LOG_MODULE LLD
+
 
 
 /* Receive FIFO size in 32-bit words. */
@@ -37,6 +40,16 @@
 #define TX_NP_FIFO_SIZE (64)
 /* Transmit periodic FIFO size in 32-bit words. */
 #define TX_P_FIFO_SIZE  (64)
+/* Duration of resume signaling (TDRSMDN) in microseconds. */
+#define RESUME_US       (20000)
+
+/* HPRT bits cleared by writing 1, PENA included */
+#define HPRT_WRITE_MASK (~(OTG_HPRT_PENA | OTG_HPRT_PCDET | OTG_HPRT_PENCHNG | OTG_HPRT_POCCHNG))
+
+#ifndef OTG_HCTSIZ_DOPING
+// Do PING before the OUT transaction of high speed channel
+#define OTG_HCTSIZ_DOPING (1U << 31)
+#endif
 
 enum CHANNEL_STATE {
 	CHANNEL_STATE_FREE = 0,
@@ -46,8 +59,10 @@ enum CHANNEL_STATE {
 struct _channel {
 	enum CHANNEL_STATE state;
 	usbh_packet_t packet;
-	uint32_t data_index; //used in receive function
+	uint32_t data_index; //used in receive function, and by split OUT transfer
 	uint8_t error_count;
+	// transfer size register of the started transaction, used to restart split transaction
+	uint32_t hctsiz;
 };
 typedef struct _channel channel_t;
 
@@ -76,6 +91,9 @@ struct _usbh_lld_stm32f4_driver_data {
 	uint32_t state_prev;//for reset only
 	uint32_t time_curr_us;
 	uint32_t timestamp_us;
+	// resume signaling of the suspended port is driven
+	bool resuming;
+	uint32_t resume_timestamp_us;
 };
 typedef struct _usbh_lld_stm32f4_driver_data usbh_lld_stm32f4_driver_data_t;
 
@@ -102,6 +120,7 @@ typedef struct _usbh_lld_stm32f4_driver_data usbh_lld_stm32f4_driver_data_t;
 
 static int8_t get_free_channel(void *drvdata);
 static void channels_init(void *drvdata);
+static void write_fifo(void *drvdata, uint8_t channel);
 static void rxflvl_handle(void *drvdata);
 static void free_channel(void *drvdata, uint8_t channel);
 
@@ -121,7 +140,7 @@ static inline void reset_start(usbh_lld_stm32f4_driver_data_t *dev)
 	// move to new state
 	dev->state = DEVICE_STATE_RESET;
 
-	// schedule disable reset condition after ~10ms
+	// schedule disable reset condition
 	dev->timestamp_us = dev->time_curr_us;
 }
 
@@ -168,7 +187,7 @@ static void stm32f4_usbh_port_channel_setup(
 		eptyp = OTG_HCCHAR_EPTYP_ISOCHRONOUS;
 		break;
 	default:
-		LOG_PRINTF("\n\n\n\nWRONG EP TYPE\n\n\n\n\n");
+		LOG_ERROR("\n\n\n\nWRONG EP TYPE\n\n\n\n\n");
 		return;
 	}
 
@@ -177,11 +196,32 @@ static void stm32f4_usbh_port_channel_setup(
 		speed = OTG_HCCHAR_LSDEV;
 	}
 
+	// Isochronous transfer is started in the next frame
+	uint32_t oddfrm = 0;
+	if (eptyp == OTG_HCCHAR_EPTYP_ISOCHRONOUS) {
+		if (!(REBASE(OTG_HFNUM) & 1)) {
+			oddfrm = OTG_HCCHAR_ODDFRM;
+		}
+	}
+
+	// Full/low speed device behind high speed hub, transaction is split into
+	// start split and complete split addressed to the hub's transaction translator.
+	// Only control and bulk transactions are split (periodic ones are refused by
+	// core), their packets of up to 64 bytes are sent whole (XACTPOS_ALL)
+	if (channels[channel].packet.split_hub_address) {
+		REBASE_CH(OTG_HCSPLT, channel) = OTG_HCSPLT_SPLITEN | OTG_HCSPLT_XACTPOS_ALL |
+			(OTG_HCSPLT_HUBADDR_MASK & (channels[channel].packet.split_hub_address << 7)) |
+			(OTG_HCSPLT_PORTADDR_MASK & channels[channel].packet.split_port);
+	} else {
+		REBASE_CH(OTG_HCSPLT, channel) = 0;
+	}
+
 	REBASE_CH(OTG_HCCHAR, channel) = OTG_HCCHAR_CHENA |
 				(OTG_HCCHAR_DAD_MASK & (address << 22)) |
 				OTG_HCCHAR_MCNT_1 |
 				(OTG_HCCHAR_EPTYP_MASK & (eptyp)) |
 				(speed) |
+				(oddfrm) |
 				(epdir) |
 				(OTG_HCCHAR_EPNUM_MASK & (epnum << 11)) |
 				(OTG_HCCHAR_MPSIZ_MASK & max_packet_size);
@@ -200,7 +240,7 @@ static void read(void *drvdata, usbh_packet_t *packet)
 	int8_t channel = get_free_channel(dev);
 	if (channel == -1) {
 		// BIG PROBLEM
-		LOG_PRINTF("FATAL ERROR IN, NO CHANNEL LEFT \n");
+		LOG_ERROR("FATAL ERROR IN, NO CHANNEL LEFT \n");
 		usbh_packet_callback_data_t cb_data;
 		cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
 		cb_data.transferred_length = 0;
@@ -212,7 +252,10 @@ static void read(void *drvdata, usbh_packet_t *packet)
 	channels[channel].packet = *packet;
 
 	uint32_t dpid;
-	if (packet->toggle[0]) {
+	if (packet->endpoint_type == USBH_ENDPOINT_TYPE_ISOCHRONOUS) {
+		// Full speed isochronous transfers use always DATA0
+		dpid = OTG_HCTSIZ_DPID_DATA0;
+	} else if (packet->toggle[0]) {
 		dpid = OTG_HCTSIZ_DPID_DATA1;
 	} else {
 		dpid = OTG_HCTSIZ_DPID_DATA0;
@@ -248,7 +291,7 @@ static void write(void *drvdata, const usbh_packet_t *packet)
 
 	if (channel == -1) {
 		// BIG PROBLEM
-		LOG_PRINTF("FATAL ERROR OUT, NO CHANNEL LEFT \n");
+		LOG_ERROR("FATAL ERROR OUT, NO CHANNEL LEFT \n");
 		usbh_packet_callback_data_t cb_data;
 		cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
 		cb_data.transferred_length = 0;
@@ -272,17 +315,25 @@ static void write(void *drvdata, const usbh_packet_t *packet)
 	} else if (packet->endpoint_type == USBH_ENDPOINT_TYPE_BULK) {
 		dpid = packet->toggle[0] ? OTG_HCTSIZ_DPID_DATA1 : OTG_HCTSIZ_DPID_DATA0;
 	} else {
-		dpid = OTG_HCTSIZ_DPID_DATA0; // ! TODO: BUG
-		ERROR("");
+		// Full speed isochronous transfers use always DATA0
+		dpid = OTG_HCTSIZ_DPID_DATA0;
 	}
 
 	uint32_t num_packets;
-	if (packet->datalen) {
+	uint32_t length = packet->datalen;
+	if (packet->split_hub_address) {
+		// Every packet is sent by its own start split, see split_handle()
+		num_packets = 1;
+		if (length > packet->endpoint_size_max) {
+			length = packet->endpoint_size_max;
+		}
+	} else if (packet->datalen) {
 		num_packets = ((packet->datalen - 1) / packet->endpoint_size_max) + 1;
 	} else {
 		num_packets = 1;
 	}
-	REBASE_CH(OTG_HCTSIZ, channel) = dpid | (num_packets << 19) | packet->datalen;
+	channels[channel].hctsiz = dpid | (num_packets << 19) | length;
+	REBASE_CH(OTG_HCTSIZ, channel) = channels[channel].hctsiz;
 
 	stm32f4_usbh_port_channel_setup(dev, channel,
 									packet->address,
@@ -291,16 +342,53 @@ static void write(void *drvdata, const usbh_packet_t *packet)
 									OTG_HCCHAR_EPDIR_OUT,
 									packet->endpoint_size_max);
 
+	write_fifo(dev, channel);
+	LOG_TRACE(LLD_WRITE, REBASE_CH(OTG_HCCHAR, channel));
+}
+
+#ifdef USBH_TRACE
+// Data dumps are replaced by the length and first 8 bytes in the trace
+#define LOG_DATA_PRINTF(format, ...) do {} while (0)
+
+static void trace_data(uint16_t event, const void *data, uint32_t length)
+{
+	uint32_t args[3] = {length, 0, 0};
+	memcpy(&args[1], data, length < 8 ? length : 8);
+	usbh_trace_write(event, args, 3);
+}
+#else
+#define LOG_DATA_PRINTF(format, ...) LOG_PRINTF(format, ##__VA_ARGS__)
+#endif
+
+/**
+ * Push data of the packet into the transmit FIFO of the enabled channel
+ *
+ * Data are taken from data_index, split transaction takes one packet only
+ */
+static void write_fifo(void *drvdata, uint8_t channel)
+{
+	usbh_lld_stm32f4_driver_data_t *dev = drvdata;
+	const usbh_packet_t *packet = &dev->channels[channel].packet;
+	const uint8_t *data = (const uint8_t *)packet->data + dev->channels[channel].data_index;
+	uint32_t length = packet->datalen - dev->channels[channel].data_index;
+
+	if (packet->split_hub_address && length > packet->endpoint_size_max) {
+		length = packet->endpoint_size_max;
+	}
+
 	if (packet->endpoint_type == USBH_ENDPOINT_TYPE_CONTROL ||
 		packet->endpoint_type == USBH_ENDPOINT_TYPE_BULK) {
 
 		volatile uint32_t *fifo = &REBASE_CH(OTG_FIFO, channel) + RX_FIFO_SIZE;
-		const uint32_t * buf32 = packet->data;
+		const uint32_t * buf32 = (const uint32_t *)data;
 		int i;
-		LOG_PRINTF("\nSending[%d]: ", packet->datalen);
-		for(i = packet->datalen; i >= 4; i-=4) {
+#ifdef USBH_TRACE
+		trace_data(USBH_TRACE_LLD_SEND, data, length);
+#endif
+		LOG_DATA_PRINTF("\nSending[%d]: ", length);
+		for(i = length; i >= 4; i-=4) {
 			const uint8_t *buf8 = (const uint8_t *)buf32;
-			LOG_PRINTF("%02X %02X %02X %02X, ", buf8[0], buf8[1], buf8[2], buf8[3]);
+			LOG_DATA_PRINTF("%02X %02X %02X %02X, ", buf8[0], buf8[1], buf8[2], buf8[3]);
 			*fifo++ = *buf32++;
 
 		}
@@ -309,21 +397,122 @@ static void write(void *drvdata, const usbh_packet_t *packet)
 			*fifo = *buf32&((1 << (8*i)) - 1);
 			uint8_t *buf8 = (uint8_t *)buf32;
 			while (i--) {
-				LOG_PRINTF("%02X ", *buf8++);
+				LOG_DATA_PRINTF("%02X ", *buf8++);
 			}
 		}
-		LOG_PRINTF("\n");
+		LOG_DATA_PRINTF("\n");
 
 	} else {
 		volatile uint32_t *fifo = &REBASE_CH(OTG_FIFO, channel) +
 			RX_FIFO_SIZE + TX_NP_FIFO_SIZE;
-		const uint32_t * buf32 = packet->data;
+		const uint32_t * buf32 = (const uint32_t *)data;
 		int i;
-		for(i = packet->datalen; i > 0; i-=4) {
+		for(i = length; i > 0; i-=4) {
 			*fifo++ = *buf32++;
 		}
 	}
-	LOG_PRINTF("->WRITE %08X\n", REBASE_CH(OTG_HCCHAR, channel));
+}
+
+/**
+ * Split transaction of full/low speed device behind high speed hub
+ *
+ * Start split is acknowledged by the hub's transaction translator, then
+ * complete split is repeated while the TT has no result yet (NYET).
+ * NAK of the complete split is NAK of the device, the transaction is
+ * retried from start split.
+ *
+ * Each packet of the transfer is a separate start split / complete split
+ * pair, so after the complete split of a packet, that is not the last one,
+ * the channel returns to start split. OUT transfer reloads the transfer
+ * size and the FIFO with the next packet.
+ *
+ * @returns true, when the channel interrupt is handled
+ */
+static bool split_handle(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel, uint32_t hcint)
+{
+	channel_t *channels = dev->channels;
+	const uint32_t hcsplt = REBASE_CH(OTG_HCSPLT, channel);
+	const bool in = REBASE_CH(OTG_HCCHAR, channel) & OTG_HCCHAR_EPDIR_IN;
+
+	if (!(hcsplt & OTG_HCSPLT_SPLITEN)) {
+		return false;
+	}
+
+	if (!(hcsplt & OTG_HCSPLT_COMPLSPLT)) {
+		if (!(hcint & OTG_HCINT_ACK)) {
+			return false;
+		}
+		// Start split accepted by the TT, data toggle is not changed yet
+		REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_ACK | OTG_HCINT_CHH;
+		REBASE_CH(OTG_HCSPLT, channel) = hcsplt | OTG_HCSPLT_COMPLSPLT;
+		if (!in) {
+			// Complete split of OUT transaction carries no data
+			REBASE_CH(OTG_HCTSIZ, channel) = (channels[channel].hctsiz & OTG_HCTSIZ_DPID_MDATA) | (1 << 19);
+		}
+		REBASE_CH(OTG_HCCHAR, channel) |= OTG_HCCHAR_CHENA;
+		return true;
+	}
+
+	if (hcint & OTG_HCINT_NYET) {
+		REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_NYET | OTG_HCINT_CHH;
+		REBASE_CH(OTG_HCCHAR, channel) |= OTG_HCCHAR_CHENA;
+		return true;
+	}
+
+	if (hcint & OTG_HCINT_NAK) {
+		REBASE_CH(OTG_HCSPLT, channel) = hcsplt & ~OTG_HCSPLT_COMPLSPLT;
+		if (!in) {
+			// Start split is sent again together with the data
+			REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_NAK | OTG_HCINT_CHH;
+			REBASE_CH(OTG_HCTSIZ, channel) = channels[channel].hctsiz;
+			REBASE_CH(OTG_HCCHAR, channel) |= OTG_HCCHAR_CHENA;
+			write_fifo(dev, channel);
+			return true;
+		}
+		// IN is re-enabled (from start split) or finished by the read handler
+		return false;
+	}
+
+	if (!(hcint & OTG_HCINT_ACK)) {
+		// Result of the complete split is handled as normal transaction
+		return false;
+	}
+
+	usbh_packet_t *packet = &channels[channel].packet;
+
+	if (in) {
+		if (hcint & OTG_HCINT_XFRC) {
+			return false;
+		}
+		// Full packet received, but the transfer continues with the next one
+		REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_ACK | OTG_HCINT_CHH;
+		REBASE_CH(OTG_HCSPLT, channel) = hcsplt & ~OTG_HCSPLT_COMPLSPLT;
+		packet->toggle[0] ^= 1;
+		REBASE_CH(OTG_HCCHAR, channel) |= OTG_HCCHAR_CHENA;
+		return true;
+	}
+
+	// Transfer size (XFRSIZ) of the start split is the length of the sent packet
+	channels[channel].data_index += channels[channel].hctsiz & 0x7ffff;
+	if (channels[channel].data_index >= packet->datalen) {
+		// Last packet, ACK and XFRC finish the transfer as usual
+		return false;
+	}
+
+	uint32_t length = packet->datalen - channels[channel].data_index;
+	if (length > packet->endpoint_size_max) {
+		length = packet->endpoint_size_max;
+	}
+
+	REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_ACK | OTG_HCINT_XFRC | OTG_HCINT_CHH;
+	REBASE_CH(OTG_HCSPLT, channel) = hcsplt & ~OTG_HCSPLT_COMPLSPLT;
+	packet->toggle[0] ^= 1;
+	channels[channel].hctsiz = (packet->toggle[0] ? OTG_HCTSIZ_DPID_DATA1 : OTG_HCTSIZ_DPID_DATA0) |
+		(1 << 19) | length;
+	REBASE_CH(OTG_HCTSIZ, channel) = channels[channel].hctsiz;
+	REBASE_CH(OTG_HCCHAR, channel) |= OTG_HCCHAR_CHENA;
+	write_fifo(dev, channel);
+	return true;
 }
 
 static void rxflvl_handle(void *drvdata)
@@ -353,16 +542,20 @@ static void rxflvl_handle(void *drvdata)
 		channels[channel].data_index += len;
 
 		// If transfer not complete, Enable channel to continue
-		if ( channels[channel].data_index < channels[channel].packet.datalen) {
+		// Split transaction continues from split_handle(), with start split
+		if ( channels[channel].data_index < channels[channel].packet.datalen &&
+			!(REBASE_CH(OTG_HCSPLT, channel) & OTG_HCSPLT_SPLITEN)) {
 			if (len == channels[channel].packet.endpoint_size_max) {
 				REBASE_CH(OTG_HCCHAR, channel) |= OTG_HCCHAR_CHENA;
-				LOG_PRINTF("CHENA[%d/%d] ", channels[channel].data_index, channels[channel].packet.datalen);
+				LOG_TRACE(LLD_CHENA, channels[channel].data_index, channels[channel].packet.datalen);
 			}
 
 		}
 
 	} else if ((rxstsp&OTG_GRXSTSP_PKTSTS_MASK) == OTG_GRXSTSP_PKTSTS_IN_COMP) {
-#ifdef USART_DEBUG
+#ifdef USBH_TRACE
+		trace_data(USBH_TRACE_LLD_DATA, channels[channel].packet.data, channels[channel].data_index);
+#elif defined(USART_DEBUG)
 		uint32_t i;
 		LOG_PRINTF("\nDATA: ");
 		for (i = 0; i < channels[channel].data_index; i++) {
@@ -394,10 +587,23 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 		}
 	}
 
+	// Remote wakeup, core drives resume signaling by itself
+	if (REBASE(OTG_GINTSTS) & OTG_GINTSTS_WKUPINT) {
+		REBASE(OTG_GINTSTS) = OTG_GINTSTS_WKUPINT;
+		LOG_PRINTF("WKUPINT");
+		dev->resuming = true;
+		dev->resume_timestamp_us = dev->time_curr_us;
+	}
+
+	if (dev->resuming && dev->time_curr_us - dev->resume_timestamp_us > RESUME_US) {
+		REBASE(OTG_HPRT) = REBASE(OTG_HPRT) & HPRT_WRITE_MASK & ~OTG_HPRT_PRES;
+		dev->resuming = false;
+		return USBH_POLL_STATUS_DEVICE_RESUMED;
+	}
+
 	if (dev->dpstate == DEVICE_POLL_STATE_DEVCONN) {
-		// May be other condition, e.g. Debounce done,
-		// using 0.5s wait by default
-		if (dev->time_curr_us - dev->timestamp_us < 500000) {
+		// Debounce
+		if (dev->time_curr_us - dev->timestamp_us < usbh_timing()->debounce_us) {
 			return USBH_POLL_STATUS_NONE;
 		}
 
@@ -407,7 +613,7 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 				REBASE(OTG_HFIR) = (REBASE(OTG_HFIR) & ~OTG_HFIR_FRIVL_MASK) | 48000;
 				if ((REBASE(OTG_HCFG) & OTG_HCFG_FSLSPCS_MASK) != OTG_HCFG_FSLSPCS_48MHz) {
 					REBASE(OTG_HCFG) = (REBASE(OTG_HCFG) & ~OTG_HCFG_FSLSPCS_MASK) | OTG_HCFG_FSLSPCS_48MHz;
-					LOG_PRINTF("\n Reset Full-Speed \n");
+					LOG_INFO("\n Reset Full-Speed \n");
 				}
 				channels_init(dev);
 				dev->dpstate = DEVICE_POLL_STATE_DEVRST;
@@ -417,7 +623,7 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 				REBASE(OTG_HFIR) = (REBASE(OTG_HFIR) & ~OTG_HFIR_FRIVL_MASK) | 6000;
 				if ((REBASE(OTG_HCFG) & OTG_HCFG_FSLSPCS_MASK) != OTG_HCFG_FSLSPCS_6MHz) {
 					REBASE(OTG_HCFG) = (REBASE(OTG_HCFG) & ~OTG_HCFG_FSLSPCS_MASK) | OTG_HCFG_FSLSPCS_6MHz;
-					LOG_PRINTF("\n Reset Low-Speed \n");
+					LOG_INFO("\n Reset Low-Speed \n");
 				}
 
 				channels_init(dev);
@@ -429,7 +635,9 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 	}
 
 	if (dev->dpstate == DEVICE_POLL_STATE_DEVRST) {
-		if (dev->time_curr_us - dev->timestamp_us < 210000) {
+		// reset and reset recovery, timestamp is from the start of reset
+		const usbh_timing_t *timing = usbh_timing();
+		if (dev->time_curr_us - dev->timestamp_us < timing->reset_us + timing->reset_recovery_us) {
 			return USBH_POLL_STATUS_NONE;
 		} else {
 			dev->dpstate = DEVICE_POLL_STATE_RUN;
@@ -484,6 +692,7 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 		}
 		REBASE(OTG_GINTSTS) = REBASE(OTG_GINTSTS);
 		dev->dpstate = DEVICE_POLL_STATE_DISCONN;
+		dev->resuming = false;
 		return USBH_POLL_STATUS_DEVICE_DISCONNECTED;
 	}
 
@@ -499,12 +708,16 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 			uint32_t hcint = REBASE_CH(OTG_HCINT, channel);
 			uint8_t eptyp = channels[channel].packet.endpoint_type;
 
+			if (split_handle(dev, channel, hcint)) {
+				continue;
+			}
+
 			// Write
 			if (!(REBASE_CH(OTG_HCCHAR, channel)&OTG_HCCHAR_EPDIR_IN)) {
 
 				if (hcint & OTG_HCINT_NAK) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_NAK;
-					LOG_PRINTF("NAK");
+					LOG_TRACE(LLD_NAK);
 
 					REBASE_CH(OTG_HCCHAR, channel) |= OTG_HCCHAR_CHENA;
 
@@ -512,7 +725,7 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 
 				if (hcint & OTG_HCINT_ACK) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_ACK;
-					LOG_PRINTF("ACK");
+					LOG_TRACE(LLD_ACK);
 					if (eptyp == USBH_ENDPOINT_TYPE_CONTROL) {
 						channels[channel].packet.toggle[0] = 1;
 					} else {
@@ -520,15 +733,36 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 					}
 				}
 
+				if (hcint & OTG_HCINT_NYET) {
+					// High speed device accepted the packet, but has no space
+					// for the next one yet. Data toggle advances as with ACK,
+					// the rest of the transfer is preceded by PING.
+					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_NYET;
+					LOG_TRACE(LLD_NYET);
+					if (!(hcint & OTG_HCINT_ACK)) {
+						if (eptyp == USBH_ENDPOINT_TYPE_CONTROL) {
+							channels[channel].packet.toggle[0] = 1;
+						} else {
+							channels[channel].packet.toggle[0] ^= 1;
+						}
+					}
+					if (!(hcint & OTG_HCINT_XFRC)) {
+						REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_CHH;
+						REBASE_CH(OTG_HCTSIZ, channel) |= OTG_HCTSIZ_DOPING;
+						REBASE_CH(OTG_HCCHAR, channel) |= OTG_HCCHAR_CHENA;
+						continue;
+					}
+				}
+
 				if (hcint & OTG_HCINT_XFRC) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_XFRC;
-					LOG_PRINTF("XFRC\n");
+					LOG_TRACE(LLD_XFRC);
 
 					free_channel(dev, channel);
 
 					usbh_packet_callback_data_t cb_data;
 					cb_data.status = USBH_PACKET_CALLBACK_STATUS_OK;
-					cb_data.transferred_length = channels[channel].data_index;
+					cb_data.transferred_length = channels[channel].packet.datalen;
 
 					channels[channel].packet.callback(
 						channels[channel].packet.callback_arg,
@@ -538,21 +772,27 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 
 				if (hcint & OTG_HCINT_FRMOR) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_FRMOR;
-					LOG_PRINTF("FRMOR");
+					LOG_TRACE(LLD_FRMOR);
+
+					free_channel(dev, channel);
 
 					usbh_packet_callback_data_t cb_data;
-					cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
+					if (eptyp == USBH_ENDPOINT_TYPE_ISOCHRONOUS) {
+						// Frame was missed, next one can be used
+						cb_data.status = USBH_PACKET_CALLBACK_STATUS_EAGAIN;
+					} else {
+						cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
+					}
 					cb_data.transferred_length = 0;
 
 					channels[channel].packet.callback(
 						channels[channel].packet.callback_arg,
 						cb_data);
-					free_channel(dev, channel);
 				}
 
 				if (hcint & OTG_HCINT_TXERR) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_TXERR;
-					LOG_PRINTF("TXERR");
+					LOG_TRACE(LLD_TXERR);
 
 					free_channel(dev, channel);
 
@@ -569,7 +809,7 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 
 				if (hcint & OTG_HCINT_STALL) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_STALL;
-					LOG_PRINTF("STALL");
+					LOG_TRACE(LLD_STALL);
 
 					free_channel(dev, channel);
 
@@ -585,7 +825,7 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 
 				if (hcint & OTG_HCINT_CHH) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_CHH;
-					LOG_PRINTF("CHH");
+					LOG_TRACE(LLD_CHH);
 
 					free_channel(dev, channel);
 				}
@@ -594,7 +834,20 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 				if (hcint & OTG_HCINT_NAK) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_NAK;
 					if (eptyp == USBH_ENDPOINT_TYPE_CONTROL) {
-						 LOG_PRINTF("NAK");
+						LOG_TRACE(LLD_NAK);
+					}
+
+					if (channels[channel].packet.nak_eagain) {
+						free_channel(dev, channel);
+
+						usbh_packet_callback_data_t cb_data;
+						cb_data.status = USBH_PACKET_CALLBACK_STATUS_EAGAIN;
+						cb_data.transferred_length = 0;
+
+						channels[channel].packet.callback(
+							channels[channel].packet.callback_arg,
+							cb_data);
+						continue;
 					}
 
 					REBASE_CH(OTG_HCCHAR, channel) |= OTG_HCCHAR_CHENA;
@@ -603,12 +856,12 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 
 				if (hcint & OTG_HCINT_DTERR) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_DTERR;
-					LOG_PRINTF("DTERR");
+					LOG_TRACE(LLD_DTERR);
 				}
 
 				if (hcint & OTG_HCINT_ACK) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_ACK;
-					LOG_PRINTF("ACK");
+					LOG_TRACE(LLD_ACK);
 
 					channels[channel].packet.toggle[0] ^= 1;
 
@@ -618,7 +871,14 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 
 				if (hcint & OTG_HCINT_XFRC) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_XFRC;
-					LOG_PRINTF("XFRC\n");
+					LOG_TRACE(LLD_XFRC);
+
+					// ACKs of multi-packet transfer may be merged into one interrupt,
+					// so take the next data toggle from the channel
+					if (eptyp == USBH_ENDPOINT_TYPE_BULK || eptyp == USBH_ENDPOINT_TYPE_INTERRUPT) {
+						channels[channel].packet.toggle[0] =
+							(REBASE_CH(OTG_HCTSIZ, channel) & OTG_HCTSIZ_DPID_MDATA) == OTG_HCTSIZ_DPID_DATA1;
+					}
 
 					free_channel(dev, channel);
 					usbh_packet_callback_data_t cb_data;
@@ -638,7 +898,7 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 
 				if (hcint & OTG_HCINT_BBERR) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_BBERR;
-					LOG_PRINTF("BBERR");
+					LOG_TRACE(LLD_BBERR);
 					free_channel(dev, channel);
 
 					usbh_packet_callback_data_t cb_data;
@@ -652,13 +912,25 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 
 				if (hcint & OTG_HCINT_FRMOR) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_FRMOR;
-					LOG_PRINTF("FRMOR");
+					LOG_TRACE(LLD_FRMOR);
 
+					if (eptyp == USBH_ENDPOINT_TYPE_ISOCHRONOUS) {
+						// Frame was missed, next one can be used
+						free_channel(dev, channel);
+
+						usbh_packet_callback_data_t cb_data;
+						cb_data.status = USBH_PACKET_CALLBACK_STATUS_EAGAIN;
+						cb_data.transferred_length = 0;
+
+						channels[channel].packet.callback(
+							channels[channel].packet.callback_arg,
+							cb_data);
+					}
 				}
 
 				if (hcint & OTG_HCINT_TXERR) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_TXERR;
-					LOG_PRINTF("TXERR");
+					LOG_TRACE(LLD_TXERR);
 
 					free_channel(dev, channel);
 
@@ -674,7 +946,7 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 
 				if (hcint & OTG_HCINT_STALL) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_STALL;
-					LOG_PRINTF("STALL");
+					LOG_TRACE(LLD_STALL);
 
 					free_channel(dev, channel);
 
@@ -689,7 +961,7 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 				}
 				if (hcint & OTG_HCINT_CHH) {
 					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_CHH;
-					LOG_PRINTF("CHH");
+					LOG_TRACE(LLD_CHH);
 					free_channel(dev, channel);
 				}
 
@@ -699,7 +971,7 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 
 	if (REBASE(OTG_GINTSTS) & OTG_GINTSTS_MMIS) {
 		REBASE(OTG_GINTSTS) = OTG_GINTSTS_MMIS;
-		LOG_PRINTF("Mode mismatch");
+		LOG_WARN("Mode mismatch");
 	}
 
 	if (REBASE(OTG_GINTSTS) & OTG_GINTSTS_IPXFR) {
@@ -839,7 +1111,7 @@ static void poll_init(usbh_lld_stm32f4_driver_data_t *dev)
 			// Uncomment to enable Interrupt generation
 			REBASE(OTG_GAHBCFG) |= OTG_GAHBCFG_GINT;
 
-			LOG_PRINTF("INIT COMPLETE\n");
+			LOG_INFO("INIT COMPLETE\n");
 
 			// Finish
 			dev->state = DEVICE_STATE_RUN;
@@ -859,7 +1131,7 @@ static void poll_init(usbh_lld_stm32f4_driver_data_t *dev)
 
 static void poll_reset(usbh_lld_stm32f4_driver_data_t *dev)
 {
-	if (dev->time_curr_us - dev->timestamp_us > 10000) {
+	if (dev->time_curr_us - dev->timestamp_us > usbh_timing()->reset_us) {
 		REBASE(OTG_HPRT) &= ~OTG_HPRT_PRST;
 		dev->state = dev->state_prev;
 		dev->state_prev = DEVICE_STATE_RESET;
@@ -916,7 +1188,7 @@ static int8_t get_free_channel(void *drvdata)
 			!(REBASE_CH(OTG_HCCHAR, i) & OTG_HCCHAR_CHENA)) {
 			channels[i].state = CHANNEL_STATE_WORK;
 			REBASE_CH(OTG_HCINT, i) = ~0;
-			REBASE_CH(OTG_HCINTMSK, i) |= OTG_HCINTMSK_ACKM | OTG_HCINTMSK_NAKM |
+			REBASE_CH(OTG_HCINTMSK, i) |= OTG_HCINTMSK_ACKM | OTG_HCINTMSK_NAKM | OTG_HCINTMSK_NYET |
 				OTG_HCINTMSK_TXERRM | OTG_HCINTMSK_XFRCM |
 				OTG_HCINTMSK_DTERRM | OTG_HCINTMSK_BBERRM |
 				OTG_HCINTMSK_CHHM | OTG_HCINTMSK_STALLM |
@@ -984,6 +1256,34 @@ static enum USBH_SPEED root_speed(void *drvdata)
 		return USBH_SPEED_FULL;
 	}
 }
+
+/**
+ * Suspend or resume the root port
+ *
+ * Resume signaling is ended in poll_run()
+ */
+static void root_suspend(void *drvdata, bool suspend)
+{
+	usbh_lld_stm32f4_driver_data_t *dev = drvdata;
+
+	if (suspend) {
+		REBASE(OTG_HPRT) = (REBASE(OTG_HPRT) & HPRT_WRITE_MASK) | OTG_HPRT_PSUSP;
+	} else {
+		REBASE(OTG_HPRT) = (REBASE(OTG_HPRT) & HPRT_WRITE_MASK) | OTG_HPRT_PRES;
+		dev->resuming = true;
+		dev->resume_timestamp_us = dev->time_curr_us;
+	}
+}
+
+/**
+ * Get current frame number (FRNUM field of HFNUM register)
+ */
+static uint16_t frame_number(void *drvdata)
+{
+	usbh_lld_stm32f4_driver_data_t *dev = drvdata;
+	(void)dev;
+	return REBASE(OTG_HFNUM) & 0xffff;
+}
 #endif // if defined otg_hs or otg_fs
 
 
@@ -1019,6 +1319,8 @@ static const usbh_low_level_driver_t driver_fs = {
 	.read = read,
 	.write = write,
 	.root_speed = root_speed,
+	.frame_number = frame_number,
+	.root_suspend = root_suspend,
 	.driver_data = &driver_data_fs
 };
 const void *usbh_lld_stm32f4_driver_fs = &driver_fs;
@@ -1039,6 +1341,8 @@ static const usbh_low_level_driver_t driver_hs = {
 	.read = read,
 	.write = write,
 	.root_speed = root_speed,
+	.frame_number = frame_number,
+	.root_suspend = root_suspend,
 	.driver_data = &driver_data_hs
 };
 const void *usbh_lld_stm32f4_driver_hs = &driver_hs;
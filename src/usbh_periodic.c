@@ -0,0 +1,374 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2015 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "usbh_config.h"
+#include "driver/usbh_device_driver.h"
+#include "usart_helpers.h"
+
+#include <stdint.h>
+#include <libopencm3/usb/usbstd.h>
+
+#define LOG_MODULE CORE
+
+/*
+ * Periodic schedule
+ *
+ * Every interrupt and isochronous endpoint found in the configuration
+ * descriptor is registered with its bus time cost. Device driver opens
+ * the endpoint before it starts to use it. The endpoint is then admitted
+ * into the frames phase, phase + period, phase + 2*period, ... of the
+ * schedule, where phase is chosen so the most loaded of these frames
+ * is as light as possible. Endpoint, that does not fit into the frame budget
+ * is rejected.
+ *
+ * Transfers are started once per frame, not in a chosen microframe, so
+ * high speed bus is accounted per frame too, with the budget of its
+ * 8 microframes.
+ *
+ * Periodic split transactions need start splits in chosen microframes and
+ * complete splits in the following ones, which the low-level driver does
+ * not schedule. Periodic endpoints of full/low speed devices behind high
+ * speed hub are therefore not admitted.
+ */
+
+// Bit times in picoseconds
+#define BIT_TIME_PS_LOW		(677080)
+#define BIT_TIME_PS_FULL	(83540)
+#define BIT_TIME_PS_HIGH	(2083)
+
+static usbh_generic_data_t *bus_data(const usbh_device_t *dev)
+{
+	const usbh_low_level_driver_t *lld = dev->lld;
+	return lld->driver_data;
+}
+
+/**
+ * Periodic bus time available in one frame of the device's bus
+ */
+static uint32_t frame_budget_ns(const usbh_device_t *dev)
+{
+	if (dev->speed == USBH_SPEED_HIGH) {
+		return 8 * USBH_PERIODIC_MICROFRAME_BUDGET_NS;
+	}
+	return USBH_PERIODIC_FRAME_BUDGET_NS;
+}
+
+/**
+ * Bus time of one transaction as defined by USB 2.0, chapter 5.11.3
+ * Host_Delay and Hub_LS_Setup are not included
+ */
+static uint32_t transaction_cost_ns(enum USBH_SPEED speed, uint8_t type, bool in, uint16_t maxpacketsize)
+{
+	// BitStuffTime(), the last 0.167 of the protocol overhead is ignored
+	const uint32_t bits = 3 + (7 * 8 * (uint32_t)maxpacketsize) / 6;
+
+	switch (speed) {
+	case USBH_SPEED_LOW:
+		return (in ? 64060 : 64107) + (BIT_TIME_PS_LOW / 100) * bits / 10;
+
+	case USBH_SPEED_HIGH:
+		if (type == USBH_ENDPOINT_TYPE_ISOCHRONOUS) {
+			return 633 + BIT_TIME_PS_HIGH * bits / 1000;
+		}
+		return 917 + BIT_TIME_PS_HIGH * bits / 1000;
+
+	case USBH_SPEED_FULL:
+	default:
+		if (type == USBH_ENDPOINT_TYPE_ISOCHRONOUS) {
+			return (in ? 7268 : 6265) + BIT_TIME_PS_FULL * bits / 1000;
+		}
+		return 9107 + BIT_TIME_PS_FULL * bits / 1000;
+	}
+}
+
+/**
+ * Convert bInterval to period in frames (power of two)
+ *
+ * High speed (micro)frame periods shorter than one frame are accounted as
+ * multiple transactions in each frame
+ */
+static uint8_t interval_to_period(enum USBH_SPEED speed, uint8_t type, uint8_t interval, uint8_t *per_frame)
+{
+	uint32_t frames;
+	*per_frame = 1;
+
+	if (speed == USBH_SPEED_HIGH || type == USBH_ENDPOINT_TYPE_ISOCHRONOUS) {
+		// 2^(bInterval-1) (micro)frames
+		if (interval < 1) {
+			interval = 1;
+		} else if (interval > 16) {
+			interval = 16;
+		}
+		frames = 1 << (interval - 1);
+		if (speed == USBH_SPEED_HIGH) {
+			if (frames < 8) {
+				*per_frame = 8 / frames;
+				frames = 1;
+			} else {
+				frames /= 8;
+			}
+		}
+	} else {
+		// bInterval frames, round down to power of two
+		frames = 1;
+		while (frames * 2 <= interval) {
+			frames *= 2;
+		}
+	}
+
+	if (frames > USBH_PERIODIC_FRAMES) {
+		frames = USBH_PERIODIC_FRAMES;
+	}
+	return frames;
+}
+
+static usbh_periodic_endpoint_t *find_endpoint(usbh_device_t *dev, uint8_t endpoint_address)
+{
+	uint8_t i;
+	for (i = 0; i < dev->periodic_num; i++) {
+		if (dev->periodic[i].address == endpoint_address) {
+			return &dev->periodic[i];
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief usbh_periodic_register remember periodic endpoint of the device
+ * @param dev device that owns the endpoint
+ * @param endpoint_descriptor pointer to the endpoint descriptor
+ *
+ * Called by core while parsing configuration descriptor. Non-periodic endpoints are ignored.
+ */
+void usbh_periodic_register(usbh_device_t *dev, const void *endpoint_descriptor)
+{
+	const struct usb_endpoint_descriptor *ep = endpoint_descriptor;
+	const uint8_t type = ep->bmAttributes & 0x03;
+
+	if (type != USB_ENDPOINT_ATTR_INTERRUPT && type != USB_ENDPOINT_ATTR_ISOCHRONOUS) {
+		return;
+	}
+
+	// bits 12..11 of high speed endpoints are additional transactions
+	const uint16_t maxpacketsize = ep->wMaxPacketSize & 0x7ff;
+	usbh_periodic_endpoint_t *pep = find_endpoint(dev, ep->bEndpointAddress);
+
+	if (pep) {
+		// Alternate settings may reuse the endpoint, account the largest one
+		if (pep->admitted || pep->maxpacketsize >= maxpacketsize) {
+			return;
+		}
+	} else {
+		if (dev->periodic_num == USBH_PERIODIC_MAX_ENDPOINTS) {
+			LOG_WARN("INCREASE USBH_PERIODIC_MAX_ENDPOINTS\n");
+			return;
+		}
+		pep = &dev->periodic[dev->periodic_num++];
+	}
+
+	uint8_t per_frame;
+
+	pep->address = ep->bEndpointAddress;
+	pep->type = type;
+	pep->maxpacketsize = maxpacketsize;
+	pep->period = interval_to_period(dev->speed, type, ep->bInterval, &per_frame);
+	pep->phase = 0;
+	pep->interval = pep->period;
+	pep->frame_last = 0;
+	pep->admitted = false;
+	pep->cost_ns = per_frame *
+		transaction_cost_ns(dev->speed, type, ep->bEndpointAddress & 0x80, pep->maxpacketsize);
+
+	LOG_PRINTF("PERIODIC EP %02X: period %d, cost %dns\n", pep->address, pep->period, pep->cost_ns);
+}
+
+/**
+ * @brief usbh_periodic_open reserve bus time for the endpoint
+ * @param dev device that owns the endpoint
+ * @param endpoint_address bEndpointAddress (including direction bit)
+ * @retval true endpoint is admitted into the periodic schedule
+ * @retval false bus time is not available, endpoint is unknown, or the device
+ * is behind transaction translator
+ */
+bool usbh_periodic_open(usbh_device_t *dev, uint8_t endpoint_address)
+{
+	usbh_periodic_endpoint_t *pep = find_endpoint(dev, endpoint_address);
+	if (!pep) {
+		LOG_WARN("PERIODIC EP %02X not found\n", endpoint_address);
+		return false;
+	}
+
+	if (pep->admitted) {
+		return true;
+	}
+
+	if (dev->tt_hub) {
+		LOG_WARN("PERIODIC EP %02X rejected: periodic split transactions not supported\n", endpoint_address);
+		return false;
+	}
+
+	uint32_t *load = bus_data(dev)->periodic_load_ns;
+	uint32_t best_load = UINT32_MAX;
+	uint8_t best_phase = 0;
+	uint32_t phase;
+
+	for (phase = 0; phase < pep->period; phase++) {
+		uint32_t worst = 0;
+		uint32_t frame;
+		for (frame = phase; frame < USBH_PERIODIC_FRAMES; frame += pep->period) {
+			if (load[frame] > worst) {
+				worst = load[frame];
+			}
+		}
+		if (worst < best_load) {
+			best_load = worst;
+			best_phase = phase;
+		}
+	}
+
+	if (best_load + pep->cost_ns > frame_budget_ns(dev)) {
+		LOG_WARN("PERIODIC EP %02X rejected: %d + %d ns\n", endpoint_address, best_load, pep->cost_ns);
+		return false;
+	}
+
+	uint32_t frame;
+	for (frame = best_phase; frame < USBH_PERIODIC_FRAMES; frame += pep->period) {
+		load[frame] += pep->cost_ns;
+	}
+
+	pep->phase = best_phase;
+	pep->frame_last = usbh_frame_number(dev) - pep->period;
+	pep->admitted = true;
+
+	LOG_INFO("PERIODIC EP %02X admitted: phase %d/%d\n", endpoint_address, pep->phase, pep->period);
+	return true;
+}
+
+/**
+ * @brief usbh_periodic_due check whether the endpoint should be serviced in current frame
+ * @param dev device that owns the endpoint
+ * @param endpoint_address bEndpointAddress (including direction bit)
+ * @retval true transfer should be started now
+ *
+ * Returns true in frames, that belong to the endpoint's phase, or when the frame
+ * was missed (polling is slower than the endpoint's interval).
+ * Returns always true for endpoints that are not admitted and when the
+ * low-level driver cannot report frame number.
+ */
+bool usbh_periodic_due(usbh_device_t *dev, uint8_t endpoint_address)
+{
+	usbh_periodic_endpoint_t *pep = find_endpoint(dev, endpoint_address);
+	const usbh_low_level_driver_t *lld = dev->lld;
+
+	if (!pep || !pep->admitted || !lld->frame_number) {
+		return true;
+	}
+
+	const uint16_t frame = usbh_frame_number(dev);
+	const uint16_t elapsed = (frame - pep->frame_last) & USBH_FRAME_NUMBER_MASK;
+
+	if (!elapsed) {
+		return false;
+	}
+
+	if (((frame & (pep->interval - 1)) == pep->phase) || (elapsed > pep->interval)) {
+		pep->frame_last = frame;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief usbh_periodic_interval poll the endpoint less often than its bInterval
+ * @param dev device that owns the endpoint
+ * @param endpoint_address bEndpointAddress (including direction bit)
+ * @param frames requested polling period, 0 restores the endpoint's period
+ *
+ * Period is rounded up to power of two multiple of the endpoint's period,
+ * so the endpoint stays in its reserved frames. Bus time is not released.
+ */
+void usbh_periodic_interval(usbh_device_t *dev, uint8_t endpoint_address, uint16_t frames)
+{
+	usbh_periodic_endpoint_t *pep = find_endpoint(dev, endpoint_address);
+	if (!pep) {
+		return;
+	}
+
+	pep->interval = pep->period;
+	while (pep->interval < frames && pep->interval < (USBH_FRAME_NUMBER_MASK + 1) / 4) {
+		pep->interval *= 2;
+	}
+	LOG_PRINTF("PERIODIC EP %02X: interval %d\n", endpoint_address, pep->interval);
+}
+
+/**
+ * @brief usbh_periodic_release release bus time of all endpoints of the device
+ */
+void usbh_periodic_release(usbh_device_t *dev)
+{
+	uint8_t i;
+
+	if (!dev->lld) {
+		dev->periodic_num = 0;
+		return;
+	}
+
+	uint32_t *load = bus_data(dev)->periodic_load_ns;
+	for (i = 0; i < dev->periodic_num; i++) {
+		usbh_periodic_endpoint_t *pep = &dev->periodic[i];
+		if (pep->admitted) {
+			uint32_t frame;
+			for (frame = pep->phase; frame < USBH_PERIODIC_FRAMES; frame += pep->period) {
+				load[frame] -= pep->cost_ns;
+			}
+			pep->admitted = false;
+		}
+	}
+	dev->periodic_num = 0;
+}
+
+/**
+ * @brief usbh_periodic_reset clear the whole periodic schedule of the bus
+ * @param lld low-level driver
+ */
+void usbh_periodic_reset(const void *lld)
+{
+	usbh_generic_data_t *lld_data = ((const usbh_low_level_driver_t *)lld)->driver_data;
+	uint32_t i;
+
+	for (i = 0; i < USBH_PERIODIC_FRAMES; i++) {
+		lld_data->periodic_load_ns[i] = 0;
+	}
+
+	for (i = 0; i < USBH_MAX_DEVICES; i++) {
+		lld_data->usbh_device[i].periodic_num = 0;
+	}
+}
+
+uint16_t usbh_frame_number(const usbh_device_t *dev)
+{
+	const usbh_low_level_driver_t *lld = dev->lld;
+	if (!lld->frame_number) {
+		return 0;
+	}
+	return lld->frame_number(lld->driver_data) & USBH_FRAME_NUMBER_MASK;
+}
@@ -0,0 +1,158 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2015 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_RING_
+#define USBH_RING_
+
+#include "usbh_core.h"
+
+#include <stdint.h>
+#include <string.h>
+
+BEGIN_DECLS
+
+/**
+ * @brief Single producer, single consumer byte ring
+ *
+ * Producer only writes head, consumer only writes tail, so producer and
+ * consumer can run in different contexts (e.g. interrupt and main loop)
+ * without locking. Indices are free running, size must be power of two.
+ */
+struct _usbh_ring {
+	uint8_t *data;
+	uint32_t size;
+	uint32_t head;
+	uint32_t tail;
+};
+typedef struct _usbh_ring usbh_ring_t;
+
+static inline void usbh_ring_init(usbh_ring_t *ring, uint8_t *data, uint32_t size)
+{
+	ring->data = data;
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+/**
+ * @brief usbh_ring_used count of bytes ready to be read
+ */
+static inline uint32_t usbh_ring_used(const usbh_ring_t *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief usbh_ring_free count of bytes that can be written
+ */
+static inline uint32_t usbh_ring_free(const usbh_ring_t *ring)
+{
+	return ring->size - usbh_ring_used(ring);
+}
+
+/**
+ * @brief usbh_ring_write copy data into the ring (producer side)
+ * @returns count of bytes actually written
+ */
+static inline uint32_t usbh_ring_write(usbh_ring_t *ring, const void *data, uint32_t length)
+{
+	const uint32_t head = ring->head;
+	const uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	const uint32_t space = ring->size - (head - tail);
+	if (length > space) {
+		length = space;
+	}
+
+	const uint32_t index = head & (ring->size - 1);
+	uint32_t first = ring->size - index;
+	if (first > length) {
+		first = length;
+	}
+	memcpy(&ring->data[index], data, first);
+	memcpy(&ring->data[0], (const uint8_t *)data + first, length - first);
+
+	__atomic_store_n(&ring->head, head + length, __ATOMIC_RELEASE);
+	return length;
+}
+
+/**
+ * @brief usbh_ring_read copy data out of the ring (consumer side)
+ * @returns count of bytes actually read
+ */
+static inline uint32_t usbh_ring_read(usbh_ring_t *ring, void *data, uint32_t length)
+{
+	const uint32_t tail = ring->tail;
+	const uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (length > head - tail) {
+		length = head - tail;
+	}
+
+	const uint32_t index = tail & (ring->size - 1);
+	uint32_t first = ring->size - index;
+	if (first > length) {
+		first = length;
+	}
+	memcpy(data, &ring->data[index], first);
+	memcpy((uint8_t *)data + first, &ring->data[0], length - first);
+
+	__atomic_store_n(&ring->tail, tail + length, __ATOMIC_RELEASE);
+	return length;
+}
+
+/**
+ * @brief usbh_ring_peek contiguous data ready to be read, without reading them (consumer side)
+ *
+ * Data can be handed over to DMA and released by usbh_ring_consume() when done.
+ * @param data set to the first byte
+ * @returns count of contiguous bytes, rest of the data is at the start of the buffer
+ */
+static inline uint32_t usbh_ring_peek(const usbh_ring_t *ring, const uint8_t **data)
+{
+	const uint32_t tail = ring->tail;
+	const uint32_t length = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+	const uint32_t index = tail & (ring->size - 1);
+	const uint32_t first = ring->size - index;
+
+	*data = &ring->data[index];
+	return length < first ? length : first;
+}
+
+/**
+ * @brief usbh_ring_consume release data returned by usbh_ring_peek() (consumer side)
+ */
+static inline void usbh_ring_consume(usbh_ring_t *ring, uint32_t length)
+{
+	__atomic_store_n(&ring->tail, ring->tail + length, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief usbh_ring_flush drop all data (consumer side)
+ */
+static inline void usbh_ring_flush(usbh_ring_t *ring)
+{
+	__atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+END_DECLS
+
+#endif
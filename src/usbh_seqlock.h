@@ -0,0 +1,94 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_SEQLOCK_
+#define USBH_SEQLOCK_
+
+#include "usbh_core.h"
+
+#include <stdint.h>
+#include <string.h>
+
+BEGIN_DECLS
+
+/**
+ * @brief Sequence lock protecting a small snapshot with one writer
+ *
+ * Sequence is odd while the writer updates the data. Reader copies the data
+ * and retries when the sequence was odd or changed meanwhile.
+ * Reader never blocks the writer. Reader interrupting the writer
+ * (e.g. from interrupt) cannot succeed until the writer finishes,
+ * so the count of read attempts is bounded.
+ */
+struct _usbh_seqlock {
+	uint32_t sequence;
+};
+typedef struct _usbh_seqlock usbh_seqlock_t;
+
+#define USBH_SEQLOCK_READ_ATTEMPTS	(4)
+
+static inline void usbh_seqlock_init(usbh_seqlock_t *lock)
+{
+	__atomic_store_n(&lock->sequence, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief usbh_seqlock_write copy data into the snapshot (writer side)
+ */
+static inline void usbh_seqlock_write(usbh_seqlock_t *lock, void *snapshot, const void *data, uint32_t length)
+{
+	const uint32_t sequence = lock->sequence;
+	__atomic_store_n(&lock->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(snapshot, data, length);
+	__atomic_store_n(&lock->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief usbh_seqlock_read copy consistent data out of the snapshot (reader side)
+ * @param generation optional, count of writes done so far
+ * @retval false writer did not finish in USBH_SEQLOCK_READ_ATTEMPTS attempts
+ */
+static inline bool usbh_seqlock_read(const usbh_seqlock_t *lock, const void *snapshot, void *data,
+	uint32_t length, uint32_t *generation)
+{
+	uint32_t attempt;
+	for (attempt = 0; attempt < USBH_SEQLOCK_READ_ATTEMPTS; attempt++) {
+		const uint32_t sequence = __atomic_load_n(&lock->sequence, __ATOMIC_ACQUIRE);
+		if (sequence & 1) {
+			continue;
+		}
+		memcpy(data, snapshot, length);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&lock->sequence, __ATOMIC_RELAXED) == sequence) {
+			if (generation) {
+				*generation = sequence / 2;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+END_DECLS
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "usbh_trace.h"
+#include "usbh_config.h"
+#include "usbh_ring.h"
+
+#include <string.h>
+
+#ifdef USBH_TRACE
+
+static uint8_t trace_data[USBH_TRACE_BUFFER];
+
+static struct {
+	usbh_ring_t ring;
+	uint32_t time_us;
+	// records lost since the last record written
+	uint32_t dropped;
+} trace = {
+	.ring = { trace_data, USBH_TRACE_BUFFER, 0, 0 }
+};
+
+static bool record_write(uint16_t event, const uint32_t *args, uint8_t count)
+{
+	uint32_t record[2 + USBH_TRACE_ARGS_MAX];
+	const uint32_t length = (2 + count) * sizeof(uint32_t);
+
+	// Record is written whole or not at all
+	if (usbh_ring_free(&trace.ring) < length) {
+		return false;
+	}
+
+	record[0] = USBH_TRACE_SYNC | ((uint32_t)event << 8) | count;
+	record[1] = trace.time_us;
+	memcpy(&record[2], args, count * sizeof(uint32_t));
+	usbh_ring_write(&trace.ring, record, length);
+	return true;
+}
+
+void usbh_trace_write(uint16_t event, const uint32_t *args, uint8_t count)
+{
+	if (count > USBH_TRACE_ARGS_MAX) {
+		count = USBH_TRACE_ARGS_MAX;
+	}
+
+	if (trace.dropped) {
+		if (!record_write(USBH_TRACE_DROPPED, &trace.dropped, 1)) {
+			trace.dropped++;
+			return;
+		}
+		trace.dropped = 0;
+	}
+
+	if (!record_write(event, args, count)) {
+		trace.dropped++;
+	}
+}
+
+void usbh_trace_timestamp(uint32_t time_us)
+{
+	trace.time_us = time_us;
+}
+
+uint32_t usbh_trace_read(void *data, uint32_t length)
+{
+	return usbh_ring_read(&trace.ring, data, length);
+}
+
+#elif defined(USART_DEBUG)
+
+#define USBH_TRACE_FORMAT(name, format) format,
+const char * const usbh_trace_format[USBH_TRACE_EVENT_COUNT] = {
+	USBH_TRACE_EVENTS(USBH_TRACE_FORMAT)
+};
+#undef USBH_TRACE_FORMAT
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_TRACE_H
+#define USBH_TRACE_H
+
+#include "usbh_core.h"
+#include "usart_helpers.h"
+
+#include <stdint.h>
+
+BEGIN_DECLS
+
+/*
+ * Binary trace of hot paths
+ *
+ * LOG_TRACE(EVENT, args...) logs an event from the table below.
+ *
+ * Built with USBH_TRACE, the event ID and raw argument words are copied
+ * into a ring, formatting is done on the host by decodeTrace.py, which
+ * reads the formats from this table. Binary events do not depend on log
+ * levels. Without USBH_TRACE the format is printed by LOG_DEBUG.
+ *
+ * Record in the ring (little endian words):
+ *   header: USBH_TRACE_SYNC | event << 8 | count of arguments
+ *   timestamp of the last usbh_poll() in us
+ *   arguments, each converted to uint32_t
+ *
+ * Only append to the table, or rebuild the decoder input together with the firmware.
+ * Formats may use %d %i %u %x %X %c with flags and width.
+ */
+#define USBH_TRACE_EVENTS(EVENT) \
+	EVENT(DROPPED,		"\nTRACE: %u records dropped\n") \
+	EVENT(LLD_WRITE,	"->WRITE %08X\n") \
+	EVENT(LLD_SEND,		"\nSending[%d]: %08X %08X\n") \
+	EVENT(LLD_CHENA,	"CHENA[%d/%d] ") \
+	EVENT(LLD_DATA,		"\nDATA[%d]: %08X %08X\n") \
+	EVENT(LLD_NAK,		"NAK") \
+	EVENT(LLD_ACK,		"ACK") \
+	EVENT(LLD_XFRC,		"XFRC\n") \
+	EVENT(LLD_FRMOR,	"FRMOR") \
+	EVENT(LLD_TXERR,	"TXERR") \
+	EVENT(LLD_STALL,	"STALL") \
+	EVENT(LLD_CHH,		"CHH") \
+	EVENT(LLD_DTERR,	"DTERR") \
+	EVENT(LLD_BBERR,	"BBERR") \
+	EVENT(LLD_NYET,		"NYET")
+
+#define USBH_TRACE_ENUM(name, format) USBH_TRACE_##name,
+enum USBH_TRACE_EVENT {
+	USBH_TRACE_EVENTS(USBH_TRACE_ENUM)
+	USBH_TRACE_EVENT_COUNT
+};
+#undef USBH_TRACE_ENUM
+
+#define USBH_TRACE_SYNC		(0xA5000000UL)
+
+// Max count of arguments of one event
+#define USBH_TRACE_ARGS_MAX	(4)
+
+#ifdef USBH_TRACE
+
+/**
+ * @brief usbh_trace_write append one record
+ *
+ * Called by LOG_TRACE. Producer side of the ring, so all events
+ * have to be logged from the context of usbh_poll().
+ * Record is dropped, when the ring is full.
+ */
+void usbh_trace_write(uint16_t event, const uint32_t *args, uint8_t count);
+
+/**
+ * @brief usbh_trace_timestamp set the timestamp of following records
+ */
+void usbh_trace_timestamp(uint32_t time_us);
+
+/**
+ * @brief usbh_trace_read copy raw trace data out of the ring
+ *
+ * Records may be split between calls, the data form one stream
+ * for decodeTrace.py
+ * @returns count of bytes actually read
+ */
+uint32_t usbh_trace_read(void *data, uint32_t length);
+
+#define LOG_TRACE(event, ...) \
+	do { \
+		const uint32_t log_trace_args[] = {0, ##__VA_ARGS__}; \
+		usbh_trace_write(USBH_TRACE_##event, &log_trace_args[1], \
+			sizeof(log_trace_args) / sizeof(log_trace_args[0]) - 1); \
+	} while (0)
+#define LOG_TRACE_TIMESTAMP(time_us) usbh_trace_timestamp(time_us)
+
+#elif defined(USART_DEBUG)
+
+extern const char * const usbh_trace_format[USBH_TRACE_EVENT_COUNT];
+
+#define LOG_TRACE(event, ...) LOG_DEBUG(usbh_trace_format[USBH_TRACE_##event], ##__VA_ARGS__)
+#define LOG_TRACE_TIMESTAMP(time_us) ((void)(time_us))
+
+#else
+
+#define LOG_TRACE(event, ...) do {} while (0)
+#define LOG_TRACE_TIMESTAMP(time_us) ((void)(time_us))
+
+#endif
+
+END_DECLS
+
+#endif
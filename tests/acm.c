@@ -0,0 +1,408 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * CDC-ACM driver against a simulated serial device: line coding and
+ * control line state requests, data integrity through a loopback device,
+ * termination of transfers by zero length packet, and throughput of
+ * transmit, receive and loopback compared with the full speed bulk limit.
+ */
+
+#include "test.h"
+#include "usbh_sim.h"
+#include "usbh_driver_cdc_acm.h"
+
+#include <string.h>
+
+#define CDC_REQ_SET_LINE_CODING		(0x20)
+#define CDC_REQ_SET_CONTROL_LINE_STATE	(0x22)
+
+#define MAXPACKETSIZE		(64)
+
+// full speed bulk packet of 64 bytes takes 52.13 us on the simulated bus,
+// which does not count bit stuffing (19 packets in a frame with it)
+#define BULK_LIMIT_BPS		(64 * 1000000000ull / 52130)
+
+enum ACM_MODE {
+	// OUT data are sent back on IN
+	MODE_LOOPBACK,
+	// OUT data are dropped, IN is always NAKed
+	MODE_SINK,
+	// IN returns full packets, OUT is NAKed
+	MODE_SOURCE
+};
+
+struct acm_device {
+	usbh_sim_device_t sim;
+	uint8_t device_descriptor[USB_DT_DEVICE_SIZE];
+	uint8_t config_descriptor[67];
+
+	enum ACM_MODE mode;
+	uint8_t fifo[1024];
+	uint32_t fifo_head;
+	uint32_t fifo_tail;
+
+	uint8_t line_coding[7];
+	uint16_t control_line_state;
+	uint32_t line_coding_requests;
+
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	uint32_t zlps;
+	uint8_t source_counter;
+};
+
+static uint32_t fifo_used(const struct acm_device *acm)
+{
+	return acm->fifo_head - acm->fifo_tail;
+}
+
+static int acm_in(usbh_sim_device_t *sim, uint8_t endpoint, uint8_t *data, uint16_t length)
+{
+	struct acm_device *acm = sim->priv;
+	uint16_t i;
+	(void)endpoint;
+
+	switch (acm->mode) {
+	case MODE_LOOPBACK:
+		if (!fifo_used(acm)) {
+			return USBH_SIM_NAK;
+		}
+		if (length > fifo_used(acm)) {
+			length = fifo_used(acm);
+		}
+		for (i = 0; i < length; i++) {
+			data[i] = acm->fifo[acm->fifo_tail++ % sizeof(acm->fifo)];
+		}
+		break;
+
+	case MODE_SOURCE:
+		for (i = 0; i < length; i++) {
+			data[i] = acm->source_counter++;
+		}
+		break;
+
+	default:
+		return USBH_SIM_NAK;
+	}
+	acm->bytes_in += length;
+	return length;
+}
+
+static int acm_out(usbh_sim_device_t *sim, uint8_t endpoint, const uint8_t *data, uint16_t length)
+{
+	struct acm_device *acm = sim->priv;
+	uint16_t i;
+	(void)endpoint;
+
+	switch (acm->mode) {
+	case MODE_LOOPBACK:
+		// whole packet has to fit, as in the endpoint buffer of the device
+		if (sizeof(acm->fifo) - fifo_used(acm) < length) {
+			return USBH_SIM_NAK;
+		}
+		for (i = 0; i < length; i++) {
+			acm->fifo[acm->fifo_head++ % sizeof(acm->fifo)] = data[i];
+		}
+		break;
+
+	case MODE_SINK:
+		break;
+
+	default:
+		return USBH_SIM_NAK;
+	}
+	acm->zlps += !length;
+	acm->bytes_out += length;
+	return 0;
+}
+
+static int acm_control(usbh_sim_device_t *sim, const struct usb_setup_data *setup, uint8_t *data)
+{
+	struct acm_device *acm = sim->priv;
+
+	if (setup->bmRequestType != 0x21) {
+		return USBH_SIM_UNHANDLED;
+	}
+	switch (setup->bRequest) {
+	case CDC_REQ_SET_LINE_CODING:
+		if (setup->wLength != sizeof(acm->line_coding)) {
+			return USBH_SIM_STALL;
+		}
+		memcpy(acm->line_coding, data, sizeof(acm->line_coding));
+		acm->line_coding_requests++;
+		return 0;
+
+	case CDC_REQ_SET_CONTROL_LINE_STATE:
+		acm->control_line_state = setup->wValue;
+		return 0;
+
+	default:
+		return USBH_SIM_STALL;
+	}
+}
+
+static void acm_init(struct acm_device *acm, enum ACM_MODE mode)
+{
+	const uint8_t device_descriptor[USB_DT_DEVICE_SIZE] = {
+		USB_DT_DEVICE_SIZE, USB_DT_DEVICE, 0x00, 0x02, 0x02, 0, 0, 64,
+		0x83, 0x04, 0x40, 0x57, 0x00, 0x02, 0, 0, 0, 1
+	};
+	const uint8_t config_descriptor[67] = {
+		9, USB_DT_CONFIGURATION, 67, 0, 2, 1, 0, 0x80, 50,
+		// communication interface with header, call management, ACM and union descriptors
+		9, USB_DT_INTERFACE, 0, 0, 1, 0x02, 0x02, 0x01, 0,
+		5, 0x24, 0x00, 0x10, 0x01,
+		5, 0x24, 0x01, 0x00, 0x01,
+		4, 0x24, 0x02, 0x02,
+		5, 0x24, 0x06, 0x00, 0x01,
+		7, USB_DT_ENDPOINT, 0x83, USB_ENDPOINT_ATTR_INTERRUPT, 16, 0, 255,
+		// data interface
+		9, USB_DT_INTERFACE, 1, 0, 2, 0x0a, 0, 0, 0,
+		7, USB_DT_ENDPOINT, 0x81, USB_ENDPOINT_ATTR_BULK, MAXPACKETSIZE, 0, 0,
+		7, USB_DT_ENDPOINT, 0x02, USB_ENDPOINT_ATTR_BULK, MAXPACKETSIZE, 0, 0
+	};
+
+	memset(acm, 0, sizeof(*acm));
+	memcpy(acm->device_descriptor, device_descriptor, sizeof(device_descriptor));
+	memcpy(acm->config_descriptor, config_descriptor, sizeof(config_descriptor));
+	acm->mode = mode;
+	acm->sim.speed = USBH_SPEED_FULL;
+	acm->sim.device_descriptor = acm->device_descriptor;
+	acm->sim.config_descriptor = acm->config_descriptor;
+	acm->sim.control = acm_control;
+	acm->sim.in = acm_in;
+	acm->sim.out = acm_out;
+	acm->sim.priv = acm;
+}
+
+/*
+ * Host side
+ */
+static volatile bool connected;
+
+static void notify_connected(uint8_t device_id)
+{
+	(void)device_id;
+	connected = true;
+}
+
+static void notify_disconnected(uint8_t device_id)
+{
+	(void)device_id;
+	connected = false;
+}
+
+static const cdc_acm_config_t acm_config = {
+	.line_coding = {
+		.baudrate = 115200,
+		.stop_bits = CDC_ACM_STOP_BITS_1,
+		.parity = CDC_ACM_PARITY_NONE,
+		.data_bits = 8
+	},
+	.notify_connected = notify_connected,
+	.notify_disconnected = notify_disconnected
+};
+
+static const usbh_dev_driver_t *device_drivers[] = {
+	&usbh_cdc_acm_driver,
+	0
+};
+
+// kept by usbh_init()
+static const void *lld_drivers[] = {
+	0,
+	0
+};
+
+static struct acm_device acm;
+
+static bool setup(enum ACM_MODE mode)
+{
+	lld_drivers[0] = usbh_sim_lld;
+	usbh_sim_reset(false, 8);
+	usbh_init(lld_drivers, device_drivers);
+	cdc_acm_driver_init(&acm_config);
+	connected = false;
+
+	acm_init(&acm, mode);
+	usbh_sim_connect(0, 0, &acm.sim);
+	if (!usbh_sim_run_until(&connected, 2000000)) {
+		return false;
+	}
+	// line coding and control line state
+	usbh_sim_run(10000);
+	return true;
+}
+
+static void teardown(void)
+{
+	usbh_sim_disconnect(&acm.sim);
+	usbh_sim_run(10000);
+}
+
+static void test_line_coding(void)
+{
+	const cdc_acm_line_coding_t coding = {
+		.baudrate = 9600,
+		.stop_bits = CDC_ACM_STOP_BITS_2,
+		.parity = CDC_ACM_PARITY_EVEN,
+		.data_bits = 7
+	};
+	const uint8_t expected_initial[7] = { 0x00, 0xc2, 0x01, 0x00, 0, 0, 8 };
+	const uint8_t expected[7] = { 0x80, 0x25, 0x00, 0x00, 2, 2, 7 };
+
+	CHECK(setup(MODE_SINK));
+	CHECK_EQ(acm.line_coding_requests, 1);
+	CHECK(!memcmp(acm.line_coding, expected_initial, sizeof(expected_initial)));
+	CHECK_EQ(acm.control_line_state, 0x03);
+
+	CHECK(usbh_cdc_acm_set_line_coding(0, &coding));
+	CHECK(usbh_cdc_acm_set_control_line_state(0, true, false));
+	usbh_sim_run(10000);
+	CHECK_EQ(acm.line_coding_requests, 2);
+	CHECK(!memcmp(acm.line_coding, expected, sizeof(expected)));
+	CHECK_EQ(acm.control_line_state, 0x01);
+	teardown();
+	CHECK(!connected);
+}
+
+static uint32_t random_next(uint32_t *state)
+{
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+/*
+ * Writes of random lengths come back in order and complete
+ */
+static void test_loopback(void)
+{
+	static uint8_t sent[20000];
+	static uint8_t received[sizeof(sent)];
+	uint32_t random = 9;
+	uint32_t written = 0;
+	uint32_t read = 0;
+	uint32_t i;
+
+	for (i = 0; i < sizeof(sent); i++) {
+		sent[i] = random_next(&random);
+	}
+
+	CHECK(setup(MODE_LOOPBACK));
+	for (i = 0; i < 200000 && read < sizeof(received); i++) {
+		uint32_t length = 1 + random_next(&random) % 300;
+
+		if (length > sizeof(sent) - written) {
+			length = sizeof(sent) - written;
+		}
+		written += usbh_cdc_acm_write(0, &sent[written], length);
+		read += usbh_cdc_acm_read(0, &received[read], sizeof(received) - read);
+		usbh_sim_step();
+	}
+	CHECK_EQ(written, sizeof(sent));
+	CHECK_EQ(read, sizeof(received));
+	CHECK(!memcmp(sent, received, sizeof(sent)));
+	CHECK_EQ(usbh_sim_stats()->errors, 0);
+	teardown();
+}
+
+/*
+ * Transfer ending with full packet is terminated by zero length packet
+ */
+static void test_zlp(void)
+{
+	static const uint8_t data[2 * MAXPACKETSIZE];
+
+	CHECK(setup(MODE_SINK));
+	CHECK_EQ(usbh_cdc_acm_write(0, data, MAXPACKETSIZE), MAXPACKETSIZE);
+	usbh_sim_run(5000);
+	CHECK_EQ(acm.bytes_out, MAXPACKETSIZE);
+	CHECK_EQ(acm.zlps, 1);
+
+	CHECK_EQ(usbh_cdc_acm_write(0, data, MAXPACKETSIZE - 1), MAXPACKETSIZE - 1);
+	usbh_sim_run(5000);
+	CHECK_EQ(acm.bytes_out, 2 * MAXPACKETSIZE - 1);
+	CHECK_EQ(acm.zlps, 1);
+
+	CHECK_EQ(usbh_cdc_acm_write(0, data, 2 * MAXPACKETSIZE), 2 * MAXPACKETSIZE);
+	usbh_sim_run(5000);
+	CHECK_EQ(acm.bytes_out, 4 * MAXPACKETSIZE - 1);
+	CHECK_EQ(acm.zlps, 2);
+	teardown();
+}
+
+/*
+ * Benchmark: the application writes whatever fits and reads whatever
+ * arrived between polls
+ */
+static void bench_mode(enum ACM_MODE mode, const char *name, uint32_t step_us)
+{
+	static uint8_t buffer[USBH_CDC_ACM_TX_RING];
+	const uint32_t duration_us = 500000;
+	uint64_t tx = 0;
+	uint64_t rx = 0;
+
+	CHECK(setup(mode));
+	usbh_sim_step_set(step_us);
+	const uint64_t bytes_start = mode == MODE_SINK ? acm.bytes_out : acm.bytes_in;
+	const uint32_t start = usbh_sim_time_us();
+	while (usbh_sim_time_us() - start < duration_us) {
+		if (mode != MODE_SOURCE) {
+			tx += usbh_cdc_acm_write(0, buffer, sizeof(buffer));
+		}
+		rx += usbh_cdc_acm_read(0, buffer, sizeof(buffer));
+		usbh_sim_step();
+	}
+
+	const double seconds = duration_us / 1e6;
+	const uint64_t bytes = (mode == MODE_SINK ? acm.bytes_out : acm.bytes_in) - bytes_start;
+	printf("  %-10s poll every %3d us: %7.1f KB/s, %5.1f %% of bulk limit\n",
+		name, step_us, bytes / seconds / 1000, 100.0 * bytes / seconds / BULK_LIMIT_BPS);
+	CHECK(tx || rx);
+	teardown();
+}
+
+static void bench_acm(void)
+{
+	static const uint32_t steps[] = { USBH_SIM_STEP_US, 50, 20 };
+	uint32_t i;
+
+	printf("CDC-ACM, full speed, simulated time, bulk limit %d KB/s\n", (int)(BULK_LIMIT_BPS / 1000));
+	for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+		bench_mode(MODE_SINK, "transmit", steps[i]);
+		bench_mode(MODE_SOURCE, "receive", steps[i]);
+		bench_mode(MODE_LOOPBACK, "loopback", steps[i]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_bench_requested(argc, argv)) {
+		bench_acm();
+	} else {
+		test_line_coding();
+		test_loopback();
+		test_zlp();
+	}
+	return test_exit("acm");
+}
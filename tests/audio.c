@@ -0,0 +1,511 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Audio streaming driver against a simulated full and high speed USB audio
+ * device with asynchronous playback (explicit feedback) and capture, 48 kHz,
+ * 2 channels of 16 bits: samples in order in both directions, rate reported
+ * by the feedback endpoint, underruns and overruns, and the stream
+ * statistics when usbh_poll() is called less often.
+ */
+
+#include "test.h"
+#include "usbh_sim.h"
+#include "usbh_driver_ac_audio.h"
+
+#include <string.h>
+
+#define SAMPLE_RATE		(48000)
+#define FRAME_BYTES		(4)
+// samples of one frame, one more for the feedback above the nominal rate
+#define MAXPACKETSIZE		((SAMPLE_RATE / 1000 + 1) * FRAME_BYTES)
+
+// samples per frame, 16.16
+#define RATE_NOMINAL		((SAMPLE_RATE / 1000) << 16)
+#define RATE_FAST		(RATE_NOMINAL + (1 << 15))
+
+#define CONFIG_LENGTH		(141)
+
+#define AUDIO_REQ_SET_CUR	(0x01)
+
+struct audio_device {
+	usbh_sim_device_t sim;
+	uint8_t device_descriptor[USB_DT_DEVICE_SIZE];
+	uint8_t config_descriptor[CONFIG_LENGTH];
+
+	// set by the host
+	uint8_t alternate_setting[3];
+	uint32_t sampling_freq[3];
+
+	// samples per frame sent on the feedback endpoint, 16.16
+	uint32_t feedback_rate;
+	uint32_t feedback_packets;
+
+	// playback, samples hold their sequence number, silence is zero
+	uint32_t out_samples;
+	uint32_t out_silence;
+	uint32_t out_bad;
+	uint32_t out_expected;
+
+	// capture
+	uint32_t in_sequence;
+};
+
+/**
+ * Byte of the sample stream, sample n holds the number n + 1
+ */
+static uint8_t stream_byte(uint32_t offset)
+{
+	return ((offset / FRAME_BYTES + 1) >> (8 * (offset % FRAME_BYTES))) & 0xff;
+}
+
+static inline uint32_t load_le32(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static inline void store_le32(uint8_t *buf, uint32_t value)
+{
+	buf[0] = value;
+	buf[1] = value >> 8;
+	buf[2] = value >> 16;
+	buf[3] = value >> 24;
+}
+
+static int audio_in(usbh_sim_device_t *sim, uint8_t endpoint, uint8_t *data, uint16_t length)
+{
+	struct audio_device *audio = sim->priv;
+	uint16_t i;
+
+	if (endpoint == 1) {
+		audio->feedback_packets++;
+		if (sim->speed == USBH_SPEED_HIGH) {
+			// 16.16 samples per microframe
+			if (length < 4) {
+				return USBH_SIM_STALL;
+			}
+			store_le32(data, audio->feedback_rate / 8);
+			return 4;
+		}
+
+		// 10.14 samples per frame
+		if (length < 3) {
+			return USBH_SIM_STALL;
+		}
+		data[0] = audio->feedback_rate >> 2;
+		data[1] = audio->feedback_rate >> 10;
+		data[2] = audio->feedback_rate >> 18;
+		return 3;
+	}
+
+	if (!audio->alternate_setting[2]) {
+		return USBH_SIM_NAK;
+	}
+
+	for (i = 0; i < SAMPLE_RATE / 1000 && (i + 1) * FRAME_BYTES <= length; i++) {
+		store_le32(&data[i * FRAME_BYTES], ++audio->in_sequence);
+	}
+	return i * FRAME_BYTES;
+}
+
+static int audio_out(usbh_sim_device_t *sim, uint8_t endpoint, const uint8_t *data, uint16_t length)
+{
+	struct audio_device *audio = sim->priv;
+	uint16_t i;
+	(void)endpoint;
+
+	if (length % FRAME_BYTES) {
+		audio->out_bad++;
+	}
+
+	for (i = 0; i + FRAME_BYTES <= length; i += FRAME_BYTES) {
+		const uint32_t sample = load_le32(&data[i]);
+		if (!sample) {
+			audio->out_silence++;
+			continue;
+		}
+		if (sample != audio->out_expected) {
+			audio->out_bad++;
+		}
+		audio->out_expected = sample + 1;
+		audio->out_samples++;
+	}
+	return 0;
+}
+
+static int audio_control(usbh_sim_device_t *sim, const struct usb_setup_data *setup, uint8_t *data)
+{
+	struct audio_device *audio = sim->priv;
+	const uint8_t index = setup->wIndex & 0x7f;
+
+	if (setup->bmRequestType == 0x22 && setup->bRequest == AUDIO_REQ_SET_CUR) {
+		if (setup->wLength != 3 || index > 2) {
+			return USBH_SIM_STALL;
+		}
+		audio->sampling_freq[index] = data[0] | (data[1] << 8) | (data[2] << 16);
+		return 0;
+	}
+
+	if (setup->bmRequestType == 0x01 && setup->bRequest == USB_REQ_SET_INTERFACE && index <= 2) {
+		audio->alternate_setting[index] = setup->wValue;
+	}
+	return USBH_SIM_UNHANDLED;
+}
+
+static void audio_device_init(struct audio_device *audio, enum USBH_SPEED speed)
+{
+	// data endpoints every 1 ms, feedback every 8 ms
+	const uint8_t interval = speed == USBH_SPEED_HIGH ? 4 : 1;
+	const uint8_t feedback_interval = speed == USBH_SPEED_HIGH ? 7 : 4;
+	const uint8_t feedback_size = speed == USBH_SPEED_HIGH ? 4 : 3;
+	const uint8_t device_descriptor[USB_DT_DEVICE_SIZE] = {
+		USB_DT_DEVICE_SIZE, USB_DT_DEVICE, 0x00, 0x02, 0, 0, 0, 64,
+		0x83, 0x04, 0x30, 0x57, 0x00, 0x01, 0, 0, 0, 1
+	};
+	const uint8_t config_descriptor[CONFIG_LENGTH] = {
+		9, USB_DT_CONFIGURATION, CONFIG_LENGTH, 0, 3, 1, 0, 0x80, 50,
+		// audio control
+		9, USB_DT_INTERFACE, 0, 0, 0, 0x01, 0x01, 0, 0,
+		10, 0x24, 0x01, 0x00, 0x01, 10, 0, 2, 1, 2,
+		// playback: asynchronous OUT endpoint with feedback IN endpoint
+		9, USB_DT_INTERFACE, 1, 0, 0, 0x01, 0x02, 0, 0,
+		9, USB_DT_INTERFACE, 1, 1, 2, 0x01, 0x02, 0, 0,
+		7, 0x24, 0x01, 1, 1, 0x01, 0x00,
+		11, 0x24, 0x02, 0x01, 2, 2, 16, 1,
+		SAMPLE_RATE & 0xff, (SAMPLE_RATE >> 8) & 0xff, SAMPLE_RATE >> 16,
+		9, USB_DT_ENDPOINT, 0x01, 0x05, MAXPACKETSIZE, 0, interval, 0, 0x81,
+		7, 0x25, 0x01, 0x01, 0, 0, 0,
+		9, USB_DT_ENDPOINT, 0x81, 0x11, feedback_size, 0, feedback_interval, 3, 0,
+		// capture
+		9, USB_DT_INTERFACE, 2, 0, 0, 0x01, 0x02, 0, 0,
+		9, USB_DT_INTERFACE, 2, 1, 1, 0x01, 0x02, 0, 0,
+		7, 0x24, 0x01, 3, 1, 0x01, 0x00,
+		11, 0x24, 0x02, 0x01, 2, 2, 16, 1,
+		SAMPLE_RATE & 0xff, (SAMPLE_RATE >> 8) & 0xff, SAMPLE_RATE >> 16,
+		9, USB_DT_ENDPOINT, 0x82, 0x05, MAXPACKETSIZE, 0, interval, 0, 0,
+		7, 0x25, 0x01, 0x01, 0, 0, 0
+	};
+
+	memset(audio, 0, sizeof(*audio));
+	memcpy(audio->device_descriptor, device_descriptor, sizeof(device_descriptor));
+	memcpy(audio->config_descriptor, config_descriptor, sizeof(config_descriptor));
+	audio->feedback_rate = RATE_NOMINAL;
+	audio->out_expected = 1;
+	audio->sim.speed = speed;
+	audio->sim.device_descriptor = audio->device_descriptor;
+	audio->sim.config_descriptor = audio->config_descriptor;
+	audio->sim.control = audio_control;
+	audio->sim.in = audio_in;
+	audio->sim.out = audio_out;
+	audio->sim.priv = audio;
+}
+
+/*
+ * Host side
+ */
+static volatile bool connected;
+static uint8_t connected_streams;
+
+// application side of the streams
+static bool playing;
+static bool capturing;
+static uint32_t play_offset;
+static uint32_t capture_offset;
+static uint32_t capture_bad;
+
+static struct audio_device device;
+
+static void notify_connected(uint8_t device_id, uint8_t streams)
+{
+	(void)device_id;
+	connected_streams = streams;
+	connected = true;
+}
+
+static void notify_disconnected(uint8_t device_id)
+{
+	(void)device_id;
+	connected = false;
+}
+
+static const audio_config_t audio_config = {
+	.format = {
+		.sample_rate = SAMPLE_RATE,
+		.channels = 2,
+		.subframe_size = 2,
+		.bit_resolution = 16
+	},
+	.notify_connected = notify_connected,
+	.notify_disconnected = notify_disconnected
+};
+
+static const usbh_dev_driver_t *device_drivers[] = {
+	&usbh_audio_driver,
+	0
+};
+
+// kept by usbh_init()
+static const void *lld_drivers[] = {
+	0,
+	0
+};
+
+/**
+ * Keep the playback ring full and the capture ring empty
+ */
+static void pump(void)
+{
+	uint8_t buffer[512];
+	uint32_t i;
+
+	if (playing) {
+		for (i = 0; i < sizeof(buffer); i++) {
+			buffer[i] = stream_byte(play_offset + i);
+		}
+		play_offset += usbh_audio_write(0, buffer, sizeof(buffer));
+	}
+
+	if (capturing) {
+		const uint32_t length = usbh_audio_read(0, buffer, sizeof(buffer));
+		for (i = 0; i < length; i++) {
+			if (buffer[i] != stream_byte(capture_offset + i)) {
+				capture_bad++;
+			}
+		}
+		capture_offset += length;
+	}
+}
+
+static void run(uint32_t duration_us)
+{
+	const uint32_t start = usbh_sim_time_us();
+	while (usbh_sim_time_us() - start < duration_us) {
+		pump();
+		usbh_sim_step();
+	}
+}
+
+static bool setup(bool high_speed)
+{
+	lld_drivers[0] = usbh_sim_lld;
+	usbh_sim_reset(high_speed, 8);
+	usbh_init(lld_drivers, device_drivers);
+	audio_driver_init(&audio_config);
+	connected = false;
+	connected_streams = 0;
+	playing = true;
+	capturing = true;
+	play_offset = 0;
+	capture_offset = 0;
+	capture_bad = 0;
+
+	audio_device_init(&device, high_speed ? USBH_SPEED_HIGH : USBH_SPEED_FULL);
+	usbh_sim_connect(0, 0, &device.sim);
+	if (!usbh_sim_run_until(&connected, 2000000)) {
+		return false;
+	}
+	// both buffers of the playback are prepared before the application
+	// could write anything, the stream settles afterwards
+	run(20000);
+	return true;
+}
+
+static void teardown(void)
+{
+	usbh_sim_disconnect(&device.sim);
+	usbh_sim_run(10000);
+}
+
+static audio_stats_t stats_get(enum USBH_AUDIO_STREAM stream)
+{
+	audio_stats_t stats;
+
+	memset(&stats, 0, sizeof(stats));
+	CHECK(usbh_audio_get_stats(0, stream, &stats));
+	return stats;
+}
+
+static void test_enumeration(bool high_speed)
+{
+	CHECK(setup(high_speed));
+	CHECK_EQ(connected_streams, (1 << USBH_AUDIO_STREAM_PLAYBACK) | (1 << USBH_AUDIO_STREAM_CAPTURE));
+	CHECK_EQ(device.alternate_setting[1], 1);
+	CHECK_EQ(device.alternate_setting[2], 1);
+	CHECK_EQ(device.sampling_freq[1], SAMPLE_RATE);
+	CHECK_EQ(device.sampling_freq[2], SAMPLE_RATE);
+	teardown();
+	CHECK(!connected);
+	CHECK(!usbh_audio_get_stats(0, USBH_AUDIO_STREAM_PLAYBACK, 0));
+}
+
+/*
+ * One second of both streams at the nominal rate: one packet per frame,
+ * samples in order, no underrun or overrun
+ */
+static void test_streaming(bool high_speed)
+{
+	CHECK(setup(high_speed));
+	const audio_stats_t play_start = stats_get(USBH_AUDIO_STREAM_PLAYBACK);
+	const audio_stats_t capture_start = stats_get(USBH_AUDIO_STREAM_CAPTURE);
+	const uint32_t out_samples = device.out_samples;
+	const uint32_t out_silence = device.out_silence;
+	const uint32_t capture_start_offset = capture_offset;
+
+	run(1000000);
+
+	const audio_stats_t play = stats_get(USBH_AUDIO_STREAM_PLAYBACK);
+	const audio_stats_t capture = stats_get(USBH_AUDIO_STREAM_CAPTURE);
+	CHECK_EQ(play.packets - play_start.packets, 1000);
+	CHECK_EQ(play.underruns, play_start.underruns);
+	CHECK_EQ(play.missed_frames, 0);
+	CHECK_EQ(play.rate, RATE_NOMINAL);
+	CHECK_EQ(device.out_samples - out_samples, SAMPLE_RATE);
+	CHECK_EQ(device.out_silence, out_silence);
+	CHECK_EQ(device.out_bad, 0);
+	CHECK(device.feedback_packets > 0);
+
+	CHECK_EQ(capture.packets - capture_start.packets, 1000);
+	CHECK_EQ(capture.overruns, 0);
+	CHECK_EQ(capture.missed_frames, 0);
+	CHECK_EQ(capture_offset - capture_start_offset, SAMPLE_RATE * FRAME_BYTES);
+	CHECK_EQ(capture_bad, 0);
+	teardown();
+}
+
+/*
+ * Device consuming 48.5 samples per frame: the driver follows the feedback
+ * (10.14 per frame at full speed, 16.16 per microframe at high speed)
+ */
+static void test_feedback(bool high_speed)
+{
+	CHECK(setup(high_speed));
+	device.feedback_rate = RATE_FAST;
+	run(50000);
+	CHECK_EQ(stats_get(USBH_AUDIO_STREAM_PLAYBACK).rate, RATE_FAST);
+
+	const uint32_t out_samples = device.out_samples;
+	run(1000000);
+	CHECK_EQ(device.out_samples - out_samples, SAMPLE_RATE + 500);
+	CHECK_EQ(device.out_bad, 0);
+
+	// values far from the nominal rate are ignored
+	device.feedback_rate = RATE_NOMINAL * 2;
+	run(50000);
+	CHECK_EQ(stats_get(USBH_AUDIO_STREAM_PLAYBACK).rate, RATE_FAST);
+	teardown();
+}
+
+/*
+ * Empty playback ring is padded with silence, the stream continues
+ * in order when the application catches up
+ */
+static void test_underrun(void)
+{
+	CHECK(setup(false));
+	const uint32_t underruns = stats_get(USBH_AUDIO_STREAM_PLAYBACK).underruns;
+
+	playing = false;
+	run(100000);
+	CHECK(stats_get(USBH_AUDIO_STREAM_PLAYBACK).underruns > underruns);
+	CHECK(device.out_silence > 0);
+
+	playing = true;
+	run(100000);
+	const uint32_t silence = device.out_silence;
+	const uint32_t underruns_resumed = stats_get(USBH_AUDIO_STREAM_PLAYBACK).underruns;
+	run(100000);
+	CHECK_EQ(device.out_silence, silence);
+	CHECK_EQ(stats_get(USBH_AUDIO_STREAM_PLAYBACK).underruns, underruns_resumed);
+	CHECK_EQ(device.out_bad, 0);
+	teardown();
+}
+
+/*
+ * Full capture ring drops the packets, that do not fit
+ */
+static void test_overrun(void)
+{
+	CHECK(setup(false));
+	CHECK_EQ(stats_get(USBH_AUDIO_STREAM_CAPTURE).overruns, 0);
+
+	capturing = false;
+	run(100000);
+	CHECK(stats_get(USBH_AUDIO_STREAM_CAPTURE).overruns > 0);
+	CHECK_EQ(usbh_audio_read(0, 0, 0), 0);
+	teardown();
+}
+
+/*
+ * Benchmark: statistics of one second of streaming, when usbh_poll() is
+ * called less often than once per frame
+ */
+static void bench_stream(bool high_speed, uint32_t step_us)
+{
+	const uint32_t duration_us = 1000000;
+
+	CHECK(setup(high_speed));
+	usbh_sim_step_set(step_us);
+	const audio_stats_t play_start = stats_get(USBH_AUDIO_STREAM_PLAYBACK);
+	const audio_stats_t capture_start = stats_get(USBH_AUDIO_STREAM_CAPTURE);
+
+	run(duration_us);
+
+	const audio_stats_t play = stats_get(USBH_AUDIO_STREAM_PLAYBACK);
+	const audio_stats_t capture = stats_get(USBH_AUDIO_STREAM_CAPTURE);
+	printf("  %s, usbh_poll() every %4d us: playback %4d packets, %4d underruns, %4d missed;"
+		" capture %4d packets, %4d overruns, %4d missed\n",
+		high_speed ? "high" : "full", step_us,
+		play.packets - play_start.packets, play.underruns - play_start.underruns,
+		play.missed_frames - play_start.missed_frames,
+		capture.packets - capture_start.packets, capture.overruns - capture_start.overruns,
+		capture.missed_frames - capture_start.missed_frames);
+	teardown();
+}
+
+static void bench_audio(void)
+{
+	static const uint32_t steps[] = { 125, 1000, 1500, 3000 };
+	uint32_t i;
+
+	printf("Audio, 48 kHz stereo 16 bit, simulated time, 1 s of streaming\n");
+	for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+		bench_stream(false, steps[i]);
+		bench_stream(true, steps[i]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_bench_requested(argc, argv)) {
+		bench_audio();
+	} else {
+		test_enumeration(false);
+		test_enumeration(true);
+		test_streaming(false);
+		test_streaming(true);
+		test_feedback(false);
+		test_feedback(true);
+		test_underrun();
+		test_overrun();
+	}
+	return test_exit("audio");
+}
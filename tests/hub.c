@@ -0,0 +1,721 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Hub driver against simulated hubs: a gamepad behind a hub keeps
+ * streaming its reports while another device is plugged into the hub
+ * and enumerated, and devices of a tree of hubs are plugged and unplugged
+ * at random, also in the middle of reset and enumeration. A device
+ * bouncing on its port is reset only after a full debounce. An idle
+ * gamepad is suspended by its port and resumed by a transfer. Full speed
+ * gamepad behind high speed hub is enumerated, but its interrupt endpoints
+ * are refused. The benchmark reports the largest gap between reports of
+ * the streaming gamepad.
+ */
+
+#include "test.h"
+#include "usbh_sim.h"
+#include "usbh_driver_hub.h"
+#include "usbh_driver_gp_xbox.h"
+
+#include <string.h>
+
+#define GAMEPADS		(2)
+#define REPORT_LENGTH		(20)
+
+// wPortStatus of the hub port
+#define PORT_SUSPEND		(1 << 2)
+
+/*
+ * Wired Xbox 360 controller, report of every interrupt transaction
+ * moves the left stick. Idle controller NAKs.
+ */
+struct gamepad {
+	usbh_sim_device_t sim;
+	uint8_t device_descriptor[USB_DT_DEVICE_SIZE];
+	uint8_t config_descriptor[32];
+	uint16_t position;
+	uint32_t reports;
+	uint32_t polls;
+	bool idle;
+};
+
+static int gamepad_in(usbh_sim_device_t *sim, uint8_t endpoint, uint8_t *data, uint16_t length)
+{
+	struct gamepad *gamepad = sim->priv;
+	(void)endpoint;
+
+	gamepad->polls++;
+	if (length < REPORT_LENGTH) {
+		return USBH_SIM_STALL;
+	}
+	if (gamepad->idle) {
+		return USBH_SIM_NAK;
+	}
+	memset(data, 0, REPORT_LENGTH);
+	data[1] = REPORT_LENGTH;
+	gamepad->position++;
+	data[6] = gamepad->position;
+	data[7] = gamepad->position >> 8;
+	gamepad->reports++;
+	return REPORT_LENGTH;
+}
+
+/**
+ * Gamepad of the same speed as its hub, full speed one behind high speed hub
+ * would need periodic split transactions
+ */
+static void gamepad_init(struct gamepad *gamepad, enum USBH_SPEED speed, uint8_t interval_ms)
+{
+	uint8_t interval_in = interval_ms;
+	uint8_t interval_out = 8;
+	if (speed == USBH_SPEED_HIGH) {
+		// 2^(bInterval-1) microframes
+		interval_in = 4;
+		while ((1 << (interval_in - 1)) < interval_ms * 8) {
+			interval_in++;
+		}
+		interval_out = 7;
+	}
+
+	const uint8_t device_descriptor[USB_DT_DEVICE_SIZE] = {
+		USB_DT_DEVICE_SIZE, USB_DT_DEVICE, 0x00, 0x02, 0xff, 0xff, 0xff, 8,
+		0x5e, 0x04, 0x8e, 0x02, 0x14, 0x01, 1, 2, 3, 1
+	};
+	const uint8_t config_descriptor[32] = {
+		9, USB_DT_CONFIGURATION, 32, 0, 1, 1, 0, 0xa0, 250,
+		9, USB_DT_INTERFACE, 0, 0, 2, 0xff, 93, 0x01, 0,
+		7, USB_DT_ENDPOINT, 0x81, USB_ENDPOINT_ATTR_INTERRUPT, 32, 0, interval_in,
+		7, USB_DT_ENDPOINT, 0x01, USB_ENDPOINT_ATTR_INTERRUPT, 32, 0, interval_out
+	};
+
+	memset(gamepad, 0, sizeof(*gamepad));
+	memcpy(gamepad->device_descriptor, device_descriptor, sizeof(device_descriptor));
+	memcpy(gamepad->config_descriptor, config_descriptor, sizeof(config_descriptor));
+	gamepad->sim.speed = speed;
+	gamepad->sim.device_descriptor = gamepad->device_descriptor;
+	gamepad->sim.config_descriptor = gamepad->config_descriptor;
+	gamepad->sim.in = gamepad_in;
+	gamepad->sim.priv = gamepad;
+}
+
+/*
+ * Device without driver, which is only enumerated
+ */
+struct other {
+	usbh_sim_device_t sim;
+	uint8_t device_descriptor[USB_DT_DEVICE_SIZE];
+	uint8_t config_descriptor[18];
+};
+
+static void other_init(struct other *other)
+{
+	const uint8_t device_descriptor[USB_DT_DEVICE_SIZE] = {
+		USB_DT_DEVICE_SIZE, USB_DT_DEVICE, 0x00, 0x02, 0xff, 0, 0, 64,
+		0x34, 0x12, 0x78, 0x56, 0x00, 0x01, 0, 0, 0, 1
+	};
+	const uint8_t config_descriptor[18] = {
+		9, USB_DT_CONFIGURATION, 18, 0, 1, 1, 0, 0x80, 50,
+		9, USB_DT_INTERFACE, 0, 0, 0, 0xff, 0, 0, 0
+	};
+
+	memset(other, 0, sizeof(*other));
+	memcpy(other->device_descriptor, device_descriptor, sizeof(device_descriptor));
+	memcpy(other->config_descriptor, config_descriptor, sizeof(config_descriptor));
+	other->sim.speed = USBH_SPEED_HIGH;
+	other->sim.device_descriptor = other->device_descriptor;
+	other->sim.config_descriptor = other->config_descriptor;
+}
+
+/*
+ * Host side
+ */
+static volatile bool connected[GAMEPADS];
+
+// reports of the first gamepad
+static uint32_t updates;
+static uint32_t update_last_us;
+static uint32_t update_gap_max_us;
+
+static void gamepad_update(uint8_t device_id, const gp_xbox_packet_t *data)
+{
+	const uint32_t now = usbh_sim_time_us();
+	(void)data;
+
+	if (device_id) {
+		return;
+	}
+	if (updates && now - update_last_us > update_gap_max_us) {
+		update_gap_max_us = now - update_last_us;
+	}
+	update_last_us = now;
+	updates++;
+}
+
+static void gamepad_connected(uint8_t device_id)
+{
+	connected[device_id] = true;
+}
+
+static void gamepad_disconnected(uint8_t device_id)
+{
+	connected[device_id] = false;
+}
+
+static const gp_xbox_config_t gamepad_config = {
+	.update = gamepad_update,
+	.notify_connected = gamepad_connected,
+	.notify_disconnected = gamepad_disconnected
+};
+
+static const usbh_dev_driver_t *device_drivers[] = {
+	&usbh_hub_driver,
+	&usbh_gp_xbox_driver,
+	0
+};
+
+// kept by usbh_init()
+static const void *lld_drivers[] = {
+	0,
+	0
+};
+
+static usbh_sim_hub_t hubs[2];
+static struct gamepad gamepads[GAMEPADS];
+static struct other others[4];
+
+static void setup(bool high_speed)
+{
+	lld_drivers[0] = usbh_sim_lld;
+	usbh_sim_reset(high_speed, 8);
+	usbh_init(lld_drivers, device_drivers);
+	hub_driver_init();
+	gp_xbox_driver_init(&gamepad_config);
+	memset((void *)connected, 0, sizeof(connected));
+	updates = 0;
+	update_gap_max_us = 0;
+}
+
+static void measure_start(void)
+{
+	updates = 0;
+	update_gap_max_us = 0;
+}
+
+struct plug_result {
+	uint32_t enumeration_us;
+	uint32_t gap_max_us;
+	uint32_t updates;
+	uint32_t reports;
+};
+
+/**
+ * First gamepad streams behind the hub, the second one is plugged
+ * into the hub, or behind another hub plugged into it when nested
+ */
+static bool plug_while_streaming(enum USBH_SPEED hub_speed, uint8_t interval_ms, bool nested,
+	struct plug_result *result)
+{
+	setup(true);
+	usbh_sim_hub_init(&hubs[0], hub_speed, 4);
+	usbh_sim_hub_init(&hubs[1], hub_speed, 4);
+	gamepad_init(&gamepads[0], hub_speed, interval_ms);
+	gamepad_init(&gamepads[1], hub_speed, interval_ms);
+
+	usbh_sim_connect(0, 0, &hubs[0].device);
+	usbh_sim_connect(&hubs[0].device, 1, &gamepads[0].sim);
+	if (!usbh_sim_run_until(&connected[0], 3000000)) {
+		return false;
+	}
+	usbh_sim_run(50000);
+
+	measure_start();
+	const uint32_t reports = gamepads[0].reports;
+	const uint32_t start = usbh_sim_time_us();
+	if (nested) {
+		usbh_sim_connect(&hubs[0].device, 3, &hubs[1].device);
+		usbh_sim_connect(&hubs[1].device, 2, &gamepads[1].sim);
+	} else {
+		usbh_sim_connect(&hubs[0].device, 3, &gamepads[1].sim);
+	}
+	if (!usbh_sim_run_until(&connected[1], 3000000)) {
+		return false;
+	}
+	result->enumeration_us = usbh_sim_time_us() - start;
+	usbh_sim_run(50000);
+
+	result->gap_max_us = update_gap_max_us;
+	result->updates = updates;
+	result->reports = gamepads[0].reports - reports;
+
+	usbh_sim_disconnect(&hubs[0].device);
+	usbh_sim_run(10000);
+	return !connected[0] && !connected[1];
+}
+
+/*
+ * Gamepad polled every 4 ms (bInterval of the Xbox 360 controller) does
+ * not miss a poll while its sibling is enumerated
+ */
+static void test_plug_while_streaming(enum USBH_SPEED hub_speed, bool nested)
+{
+	struct plug_result result;
+
+	CHECK(plug_while_streaming(hub_speed, 4, nested, &result));
+	CHECK(result.updates > 0);
+	CHECK_EQ(result.updates, result.reports);
+	CHECK(result.gap_max_us <= 4000);
+}
+
+/*
+ * Hot-plug stress
+ */
+struct node {
+	usbh_sim_device_t *dev;
+	// parent node, -1 for the root port
+	int8_t parent;
+	uint8_t port;
+	bool plugged;
+	// gamepad index, -1 for other devices
+	int8_t gamepad;
+};
+
+static struct node nodes[8];
+
+static uint32_t random_next(uint32_t *state)
+{
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+static void node_set(uint8_t i, usbh_sim_device_t *dev, int8_t parent, uint8_t port, int8_t gamepad)
+{
+	nodes[i].dev = dev;
+	nodes[i].parent = parent;
+	nodes[i].port = port;
+	nodes[i].plugged = false;
+	nodes[i].gamepad = gamepad;
+}
+
+static void node_plug(uint8_t i, bool plug)
+{
+	struct node *node = &nodes[i];
+
+	node->plugged = plug;
+	if (!plug) {
+		usbh_sim_disconnect(node->dev);
+	} else if (node->parent < 0) {
+		usbh_sim_connect(0, 0, node->dev);
+	} else {
+		usbh_sim_connect(nodes[node->parent].dev, node->port, node->dev);
+	}
+}
+
+static bool node_expected(uint8_t i)
+{
+	const struct node *node = &nodes[i];
+	return node->plugged && (node->parent < 0 || node_expected(node->parent));
+}
+
+static bool node_enumerated(uint8_t i)
+{
+	const usbh_sim_device_t *dev = nodes[i].dev;
+
+	// hubs and gamepads are configured by their drivers
+	if (dev->hub_model || nodes[i].gamepad >= 0) {
+		return usbh_sim_configured(dev);
+	}
+	return dev->address != 0;
+}
+
+static uint32_t host_attached(void)
+{
+	const usbh_generic_data_t *lld_data = ((const usbh_low_level_driver_t *)usbh_sim_lld)->driver_data;
+	const usbh_device_t *dev;
+	uint32_t count = 0;
+
+	for (dev = lld_data->active_first; dev; dev = dev->active_next) {
+		count++;
+	}
+	return count;
+}
+
+/**
+ * After the tree settled, the host sees exactly the reachable devices
+ * @returns false on the first difference
+ */
+static bool tree_check(uint32_t action)
+{
+	uint32_t expected = 0;
+	uint32_t gamepads_expected = 0;
+	uint32_t gamepads_connected = 0;
+	uint32_t reports[GAMEPADS];
+	uint8_t i;
+
+	for (i = 0; i < GAMEPADS; i++) {
+		reports[i] = gamepads[i].reports;
+		gamepads_connected += connected[i];
+	}
+	for (i = 0; i < sizeof(nodes) / sizeof(nodes[0]); i++) {
+		if (!node_expected(i)) {
+			continue;
+		}
+		expected++;
+		if (nodes[i].gamepad >= 0) {
+			gamepads_expected++;
+		}
+		if (!node_enumerated(i)) {
+			printf("action %d: device %d not enumerated\n", action, i);
+			return false;
+		}
+	}
+	if (host_attached() != expected || gamepads_connected != gamepads_expected) {
+		printf("action %d: %d devices attached, %d gamepads connected, expected %d and %d\n",
+			action, host_attached(), gamepads_connected, expected, gamepads_expected);
+		return false;
+	}
+
+	// gamepads keep streaming
+	usbh_sim_run(50000);
+	for (i = 0; i < GAMEPADS; i++) {
+		const int8_t node = i == 0 ? 2 : 4;
+		if (node_expected(node) && gamepads[i].reports == reports[i]) {
+			printf("action %d: gamepad %d stopped\n", action, i);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Random unplug and plug of the devices of the tree,
+ * the tree settles after every few of them
+ *
+ *   root - hub 0 - 1: hub 1 - 1: gamepad 1
+ *                |          - 2: other 1
+ *                |          - 3: other 2
+ *                - 2: gamepad 0
+ *                - 3: other 0
+ *                - 4: other 3
+ */
+static bool hotplug_stress(enum USBH_SPEED hub_speed, uint32_t actions, uint32_t seed)
+{
+	uint32_t random = seed;
+	uint32_t action;
+	uint8_t i;
+
+	setup(true);
+	usbh_sim_hub_init(&hubs[0], hub_speed, 4);
+	usbh_sim_hub_init(&hubs[1], hub_speed, 4);
+	gamepad_init(&gamepads[0], hub_speed, 4);
+	gamepad_init(&gamepads[1], hub_speed, 4);
+	for (i = 0; i < sizeof(others) / sizeof(others[0]); i++) {
+		other_init(&others[i]);
+	}
+	node_set(0, &hubs[0].device, -1, 0, -1);
+	node_set(1, &hubs[1].device, 0, 1, -1);
+	node_set(2, &gamepads[0].sim, 0, 2, 0);
+	node_set(3, &others[0].sim, 0, 3, -1);
+	node_set(4, &gamepads[1].sim, 1, 1, 1);
+	node_set(5, &others[1].sim, 1, 2, -1);
+	node_set(6, &others[2].sim, 1, 3, -1);
+	node_set(7, &others[3].sim, 0, 4, -1);
+
+	// children first, they appear when their hub is plugged
+	for (i = sizeof(nodes) / sizeof(nodes[0]); i-- > 0;) {
+		node_plug(i, true);
+	}
+	usbh_sim_run(3000000);
+	if (!tree_check(0)) {
+		return false;
+	}
+
+	for (action = 1; action <= actions; action++) {
+		i = random_next(&random) % (sizeof(nodes) / sizeof(nodes[0]));
+		node_plug(i, !nodes[i].plugged);
+
+		// often in the middle of debounce, reset or enumeration
+		if (random_next(&random) % 2) {
+			usbh_sim_run(random_next(&random) % 20000);
+		} else {
+			usbh_sim_run(random_next(&random) % 300000);
+		}
+
+		if (action % 4 == 0) {
+			usbh_sim_run(3000000);
+			if (!tree_check(action)) {
+				return false;
+			}
+		}
+	}
+
+	// unplugged devices come back
+	for (i = 0; i < sizeof(nodes) / sizeof(nodes[0]); i++) {
+		if (!nodes[i].plugged) {
+			node_plug(i, true);
+		}
+	}
+	usbh_sim_run(3000000);
+	if (!tree_check(actions + 1)) {
+		return false;
+	}
+
+	node_plug(0, false);
+	usbh_sim_run(10000);
+	return host_attached() == 0 && !connected[0] && !connected[1];
+}
+
+static void test_hotplug_stress(enum USBH_SPEED hub_speed, uint32_t seed)
+{
+	CHECK(hotplug_stress(hub_speed, 200, seed));
+	CHECK_EQ(usbh_sim_stats()->address_conflicts, 0);
+	CHECK_EQ(usbh_sim_stats()->channels_exhausted, 0);
+}
+
+/*
+ * Contact bounce: debounce starts over with every connection change
+ */
+static uint32_t reset_us;
+
+static void other_reset(usbh_sim_device_t *sim)
+{
+	(void)sim;
+	if (!reset_us) {
+		reset_us = usbh_sim_time_us();
+	}
+}
+
+static void test_debounce_restart(void)
+{
+	setup(true);
+	usbh_sim_hub_init(&hubs[0], USBH_SPEED_HIGH, 4);
+	other_init(&others[0]);
+	others[0].sim.reset = other_reset;
+	reset_us = 0;
+
+	usbh_sim_connect(0, 0, &hubs[0].device);
+	usbh_sim_run(1000000);
+	CHECK(usbh_sim_configured(&hubs[0].device));
+
+	// the hub sees the first connection, then the device bounces
+	usbh_sim_connect(&hubs[0].device, 1, &others[0].sim);
+	usbh_sim_run(60000);
+	usbh_sim_disconnect(&others[0].sim);
+	usbh_sim_run(1000);
+	usbh_sim_connect(&hubs[0].device, 1, &others[0].sim);
+	const uint32_t stable_us = usbh_sim_time_us();
+
+	usbh_sim_run(1000000);
+	CHECK(reset_us);
+	CHECK(reset_us - stable_us >= usbh_timing()->debounce_us);
+	CHECK(others[0].sim.address != 0);
+	CHECK_EQ(host_attached(), 2);
+}
+
+static usbh_device_t *host_device(uint8_t address)
+{
+	const usbh_generic_data_t *lld_data = ((const usbh_low_level_driver_t *)usbh_sim_lld)->driver_data;
+	usbh_device_t *dev;
+
+	for (dev = lld_data->active_first; dev; dev = dev->active_next) {
+		if (dev->address == address) {
+			return dev;
+		}
+	}
+	return 0;
+}
+
+static usbh_packet_callback_data_t refused;
+
+static void refused_callback(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	(void)dev;
+	refused = cb_data;
+}
+
+/*
+ * Idle gamepad is suspended by its hub port, the streaming one next to it
+ * is not. Suspended gamepad is not polled, transfer to it is refused and
+ * resumes it. Suspended gamepad can be unplugged.
+ */
+static void test_suspend(void)
+{
+	uint8_t buffer[REPORT_LENGTH];
+	uint8_t toggle = 0;
+	usbh_packet_t packet;
+
+	setup(true);
+	usbh_suspend_timeout_set(20);
+	usbh_sim_hub_init(&hubs[0], USBH_SPEED_HIGH, 4);
+	gamepad_init(&gamepads[0], USBH_SPEED_HIGH, 4);
+	gamepad_init(&gamepads[1], USBH_SPEED_HIGH, 4);
+
+	usbh_sim_connect(0, 0, &hubs[0].device);
+	usbh_sim_connect(&hubs[0].device, 1, &gamepads[0].sim);
+	usbh_sim_connect(&hubs[0].device, 2, &gamepads[1].sim);
+	CHECK(usbh_sim_run_until(&connected[0], 3000000));
+	CHECK(usbh_sim_run_until(&connected[1], 3000000));
+
+	gamepads[0].idle = true;
+	usbh_sim_run(100000);
+	CHECK(hubs[0].port[1].status & PORT_SUSPEND);
+	CHECK(!(hubs[0].port[2].status & PORT_SUSPEND));
+
+	const uint32_t polls = gamepads[0].polls;
+	const uint32_t reports = gamepads[1].reports;
+	usbh_sim_run(100000);
+	CHECK_EQ(gamepads[0].polls, polls);
+	CHECK(gamepads[1].reports - reports >= 100000 / 4000 - 1);
+	CHECK(connected[0]);
+
+	usbh_device_t *dev = host_device(gamepads[0].sim.address);
+	CHECK(dev != 0);
+	if (dev) {
+		memset(&packet, 0, sizeof(packet));
+		packet.address = dev->address;
+		packet.data = buffer;
+		packet.datalen = REPORT_LENGTH;
+		packet.endpoint_address = 1;
+		packet.endpoint_size_max = 32;
+		packet.endpoint_type = USBH_ENDPOINT_TYPE_INTERRUPT;
+		packet.speed = dev->speed;
+		packet.callback = refused_callback;
+		packet.callback_arg = dev;
+		packet.toggle = &toggle;
+		refused.status = USBH_PACKET_CALLBACK_STATUS_OK;
+		usbh_read(dev, &packet);
+		CHECK_EQ(refused.status, USBH_PACKET_CALLBACK_STATUS_EAGAIN);
+		CHECK_EQ(gamepads[0].polls, polls);
+
+		// resume signaling and recovery, then the driver reads again
+		usbh_sim_run(40000);
+		CHECK(gamepads[0].polls > polls);
+	}
+
+	usbh_sim_disconnect(&gamepads[0].sim);
+	usbh_sim_run(100000);
+	CHECK(!connected[0]);
+	CHECK(connected[1]);
+	CHECK_EQ(host_attached(), 2);
+
+	usbh_suspend_timeout_set(0);
+	usbh_sim_disconnect(&hubs[0].device);
+	usbh_sim_run(10000);
+}
+
+/*
+ * Periodic split transactions are not scheduled, so full speed gamepad
+ * behind high speed hub is enumerated by control transfers, but its
+ * interrupt endpoint is not admitted and the driver does not take it.
+ * Interrupt transfer to it is refused, the gamepad is never polled.
+ */
+static void test_tt_periodic(void)
+{
+	uint8_t buffer[REPORT_LENGTH];
+	uint8_t toggle = 0;
+	usbh_packet_t packet;
+
+	setup(true);
+	usbh_sim_hub_init(&hubs[0], USBH_SPEED_HIGH, 4);
+	gamepad_init(&gamepads[0], USBH_SPEED_FULL, 4);
+	gamepad_init(&gamepads[1], USBH_SPEED_HIGH, 4);
+
+	usbh_sim_connect(0, 0, &hubs[0].device);
+	usbh_sim_connect(&hubs[0].device, 1, &gamepads[0].sim);
+	usbh_sim_connect(&hubs[0].device, 2, &gamepads[1].sim);
+	usbh_sim_run(3000000);
+	CHECK(connected[1]);
+	CHECK(!connected[0]);
+	CHECK(gamepads[0].sim.address != 0);
+	CHECK_EQ(host_attached(), 3);
+	CHECK_EQ(gamepads[0].polls, 0);
+
+	usbh_device_t *dev = host_device(gamepads[0].sim.address);
+	CHECK(dev != 0);
+	if (dev) {
+		CHECK(dev->tt_hub != 0);
+		memset(&packet, 0, sizeof(packet));
+		packet.address = dev->address;
+		packet.data = buffer;
+		packet.datalen = REPORT_LENGTH;
+		packet.endpoint_address = 1;
+		packet.endpoint_size_max = 32;
+		packet.endpoint_type = USBH_ENDPOINT_TYPE_INTERRUPT;
+		packet.speed = dev->speed;
+		packet.callback = refused_callback;
+		packet.callback_arg = dev;
+		packet.toggle = &toggle;
+		refused.status = USBH_PACKET_CALLBACK_STATUS_OK;
+		usbh_read(dev, &packet);
+		CHECK_EQ(refused.status, USBH_PACKET_CALLBACK_STATUS_EFATAL);
+		usbh_sim_run(10000);
+		CHECK_EQ(gamepads[0].polls, 0);
+	}
+
+	usbh_sim_disconnect(&hubs[0].device);
+	usbh_sim_run(10000);
+	CHECK_EQ(host_attached(), 0);
+}
+
+/*
+ * Benchmark
+ */
+static void bench_hub(void)
+{
+	static const uint8_t intervals[] = { 1, 4, 8 };
+	uint32_t s, n, i;
+
+	printf("gamepad behind hub, another device plugged in, simulated time, usbh_poll() every %d us\n",
+		USBH_SIM_STEP_US);
+	for (s = 0; s < 2; s++) {
+		const enum USBH_SPEED speed = s ? USBH_SPEED_HIGH : USBH_SPEED_FULL;
+		for (n = 0; n < 2; n++) {
+			for (i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++) {
+				struct plug_result result;
+
+				CHECK(plug_while_streaming(speed, intervals[i], n, &result));
+				printf("  %s hub, %-13s bInterval %d ms: enumeration %4.0f ms, "
+					"largest gap %5.2f ms, %4d reports\n",
+					s ? "high speed" : "full speed", n ? "hub+gamepad," : "gamepad,",
+					intervals[i], result.enumeration_us / 1e3, result.gap_max_us / 1e3, result.updates);
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_bench_requested(argc, argv)) {
+		bench_hub();
+	} else {
+		test_plug_while_streaming(USBH_SPEED_FULL, false);
+		test_plug_while_streaming(USBH_SPEED_HIGH, false);
+		test_plug_while_streaming(USBH_SPEED_FULL, true);
+		test_plug_while_streaming(USBH_SPEED_HIGH, true);
+		test_hotplug_stress(USBH_SPEED_FULL, 1);
+		test_hotplug_stress(USBH_SPEED_HIGH, 2);
+		test_debounce_restart();
+		test_suspend();
+		test_tt_periodic();
+	}
+	return test_exit("hub");
+}
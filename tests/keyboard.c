@@ -0,0 +1,306 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Keyboard report diffing: events of parse_data() against the difference
+ * of the key sets computed key by key, for boot protocol (6KRO) and
+ * bitmap (NKRO) reports, and the cost of one report.
+ */
+
+#include "test.h"
+
+// static functions of the driver are tested directly,
+// its remove() would clash with remove() of stdio.h
+#define remove keyboard_remove
+#include "usbh_driver_hid_keyboard.c"
+#undef remove
+
+// modifiers and bitmap of usages 0x00 - 0xDF, 29 bytes report
+static const uint8_t nkro_report_descriptor[] = {
+	0x05, 0x01, 0x09, 0x06, 0xA1, 0x01,
+	0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01,
+	0x75, 0x01, 0x95, 0x08, 0x81, 0x02,
+	0x05, 0x07, 0x19, 0x00, 0x29, 0xDF, 0x15, 0x00, 0x25, 0x01,
+	0x75, 0x01, 0x95, 0xE0, 0x81, 0x02,
+	0xC0
+};
+#define NKRO_REPORT_LENGTH	(1 + 0xE0 / 8)
+
+// key events reported by the driver, indexed by usage
+static uint8_t event_count[256];
+static uint8_t event_last[256];
+static uint32_t events;
+
+static void key(uint8_t device_id, uint8_t usage, uint8_t event, uint8_t modifiers)
+{
+	(void)device_id;
+	(void)modifiers;
+	event_count[usage]++;
+	event_last[usage] = event;
+	events++;
+}
+
+static const hid_keyboard_config_t config = {
+	.key = key
+};
+
+static usbh_device_t device;
+
+static hid_keyboard_device_t *keyboard_setup(bool nkro)
+{
+	hid_keyboard_device_t *keyboard;
+
+	hid_keyboard_driver_init(&config);
+	keyboard = init(&device);
+	keyboard->state_next = STATE_READING_REQUEST;
+	memset(keyboard->keys, 0, sizeof(keyboard->keys));
+	keyboard->repeat_usage = 0;
+	if (nkro) {
+		memcpy(keyboard->report_descriptor, nkro_report_descriptor, sizeof(nkro_report_descriptor));
+		report_layout_setup(keyboard, sizeof(nkro_report_descriptor));
+	}
+	return keyboard;
+}
+
+static uint32_t random_next(uint32_t *state)
+{
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+static bool key_in(const uint32_t *keys, uint32_t usage)
+{
+	return (keys[usage / 32] >> (usage % 32)) & 1;
+}
+
+/*
+ * Random key set in the form of the report, with modifiers, and
+ * as the set of usages expected to be pressed
+ */
+static uint16_t report_random(bool nkro, uint32_t *random, uint8_t *report, uint32_t *keys)
+{
+	uint32_t i;
+
+	memset(keys, 0, KEY_WORDS * sizeof(uint32_t));
+	report[0] = random_next(random);
+	keys[KEY_MODIFIER_FIRST / 32] = (uint32_t)report[0] << (KEY_MODIFIER_FIRST % 32);
+
+	if (nkro) {
+		const uint32_t count = random_next(random) % 40;
+
+		memset(&report[1], 0, NKRO_REPORT_LENGTH - 1);
+		for (i = 0; i < count; i++) {
+			const uint32_t usage = KEY_FIRST + random_next(random) % (0xE0 - KEY_FIRST);
+			report[1 + usage / 8] |= 1 << (usage % 8);
+			keys_set(keys, usage);
+		}
+		return NKRO_REPORT_LENGTH;
+	}
+
+	report[1] = 0;
+	for (i = 2; i < 8; i++) {
+		// about half of the slots are empty
+		if (random_next(random) & 1) {
+			report[i] = 0;
+		} else {
+			report[i] = KEY_FIRST + random_next(random) % (0xE0 - KEY_FIRST);
+			keys_set(keys, report[i]);
+		}
+	}
+	return 8;
+}
+
+static void test_diff(bool nkro)
+{
+	hid_keyboard_device_t *keyboard = keyboard_setup(nkro);
+	uint32_t previous[KEY_WORDS] = {0};
+	uint32_t random = nkro ? 11 : 5;
+	uint32_t mismatches = 0;
+	uint32_t i;
+
+	CHECK_EQ(keyboard->report_layout, nkro);
+	for (i = 0; i < 20000; i++) {
+		uint32_t keys[KEY_WORDS];
+		uint32_t usage;
+		const uint16_t length = report_random(nkro, &random, keyboard->buffer, keys);
+
+		memset(event_count, 0, sizeof(event_count));
+		parse_data(keyboard, length);
+
+		// exactly one event for every changed key, none for the others
+		for (usage = 0; usage < 256; usage++) {
+			const bool pressed = key_in(keys, usage);
+			const bool changed = pressed != key_in(previous, usage);
+
+			if (event_count[usage] != changed ||
+				(changed && event_last[usage] != (pressed ? HID_KEYBOARD_EVENT_PRESSED : HID_KEYBOARD_EVENT_RELEASED)) ||
+				usbh_hid_keyboard_key_pressed(0, usage) != pressed) {
+				mismatches++;
+			}
+		}
+		memcpy(previous, keys, sizeof(previous));
+	}
+	CHECK_EQ(mismatches, 0);
+}
+
+static void test_roll_over(void)
+{
+	hid_keyboard_device_t *keyboard = keyboard_setup(false);
+	const uint8_t press[8] = { 0, 0, 0x04, 0x05 };
+	const uint8_t phantom[8] = { 0, 0, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01 };
+
+	memcpy(keyboard->buffer, press, sizeof(press));
+	parse_data(keyboard, sizeof(press));
+	CHECK(usbh_hid_keyboard_key_pressed(0, 0x04));
+
+	// error roll over keeps the previous state
+	events = 0;
+	memcpy(keyboard->buffer, phantom, sizeof(phantom));
+	parse_data(keyboard, sizeof(phantom));
+	CHECK_EQ(events, 0);
+	CHECK(usbh_hid_keyboard_key_pressed(0, 0x04));
+	CHECK(usbh_hid_keyboard_key_pressed(0, 0x05));
+}
+
+/*
+ * Key by key comparison of the old and new key set, the cost
+ * the word-wise diff is compared with
+ */
+static void keys_update_reference(hid_keyboard_device_t *keyboard, const uint32_t *keys)
+{
+	uint32_t usage;
+
+	for (usage = 0; usage < 256; usage++) {
+		const bool pressed = key_in(keys, usage);
+		if (pressed != key_in(keyboard->keys, usage)) {
+			if (pressed) {
+				keyboard->keys[usage / 32] |= 1UL << (usage % 32);
+			} else {
+				keyboard->keys[usage / 32] &= ~(1UL << (usage % 32));
+			}
+			keyboard_config->key(keyboard->device_id, usage,
+				pressed ? HID_KEYBOARD_EVENT_PRESSED : HID_KEYBOARD_EVENT_RELEASED, 0);
+		}
+	}
+}
+
+#define BENCH_REPORTS	(256)
+
+struct bench_case {
+	const char *name;
+	bool nkro;
+	// keys held in every report
+	uint8_t held;
+	// keys changed between reports
+	uint8_t changing;
+};
+
+static void bench_case(const struct bench_case *bc)
+{
+	static uint8_t reports[BENCH_REPORTS][NKRO_REPORT_LENGTH];
+	hid_keyboard_device_t *keyboard = keyboard_setup(bc->nkro);
+	const uint16_t length = bc->nkro ? NKRO_REPORT_LENGTH : 8;
+	const uint32_t rounds = 2000;
+	uint32_t i, r;
+
+	// held keys 0x04.., changing keys alternate between two usages each
+	memset(reports, 0, sizeof(reports));
+	for (i = 0; i < BENCH_REPORTS; i++) {
+		uint8_t k;
+
+		for (k = 0; k < bc->held + bc->changing; k++) {
+			uint8_t usage = KEY_FIRST + k;
+			if (k >= bc->held) {
+				usage += (i & 1) ? 0x40 : 0;
+			}
+			if (bc->nkro) {
+				reports[i][1 + usage / 8] |= 1 << (usage % 8);
+			} else {
+				reports[i][2 + k] = usage;
+			}
+		}
+	}
+
+	events = 0;
+	uint64_t start = test_wall_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < BENCH_REPORTS; i++) {
+			memcpy(keyboard->buffer, reports[i], length);
+			parse_data(keyboard, length);
+		}
+	}
+	const uint64_t driver_ns = test_wall_ns() - start;
+	const uint32_t driver_events = events;
+
+	// same parsing, key by key diff
+	memset(keyboard->keys, 0, sizeof(keyboard->keys));
+	events = 0;
+	start = test_wall_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < BENCH_REPORTS; i++) {
+			uint32_t keys[KEY_WORDS] = {0};
+
+			if (bc->nkro) {
+				parse_report(keyboard, reports[i], length, keys);
+			} else {
+				parse_boot(reports[i], length, keys);
+			}
+			keys_update_reference(keyboard, keys);
+		}
+	}
+	const uint64_t reference_ns = test_wall_ns() - start;
+	CHECK_EQ(events, driver_events);
+
+	const double count = (double)rounds * BENCH_REPORTS;
+	printf("  %-28s %7.1f ns/report (key by key %7.1f ns), %5.2f events/report\n",
+		bc->name, driver_ns / count, reference_ns / count, driver_events / count);
+}
+
+static void bench_diff(void)
+{
+	static const struct bench_case cases[] = {
+		{ "6KRO, 2 keys held",		false, 2, 0 },
+		{ "6KRO, 1 key changes",	false, 2, 1 },
+		{ "6KRO, 6 keys change",	false, 0, 6 },
+		{ "NKRO, 2 keys held",		true, 2, 0 },
+		{ "NKRO, 20 held, 1 changes",	true, 20, 1 },
+		{ "NKRO, 40 keys change",	true, 0, 40 },
+	};
+	uint32_t i;
+
+	printf("keyboard report parsing and diff\n");
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		bench_case(&cases[i]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_bench_requested(argc, argv)) {
+		bench_diff();
+	} else {
+		test_diff(false);
+		test_diff(true);
+		test_roll_over();
+	}
+	return test_exit("keyboard");
+}
@@ -0,0 +1,354 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Channel interrupt handling of the STM32F4 low-level driver against
+ * registers of the OTG_HS core mapped into plain memory: split
+ * transactions of full speed bulk endpoint behind high speed hub (start
+ * split, complete split, NYET and NAK of the complete split, one start
+ * split per packet) and NYET of high speed bulk OUT followed by PING.
+ *
+ * The test plays the role of the core: it halts the channel with
+ * the channel interrupt bits, runs the interrupt handler and checks
+ * what the driver programmed for the next transaction.
+ */
+
+#include "test.h"
+
+#include <sys/mman.h>
+
+// static functions of the driver are tested directly, OTG_HS is used,
+// both cores are enabled, so the driver takes registers from its data
+// data dump of write_fifo() leaves unused variables, when debug output is compiled out
+#define USE_STM32F4_USBH_DRIVER_HS
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#include "usbh_lld_stm32f4.c"
+#pragma GCC diagnostic pop
+
+#define OTG_SIZE		(0x40000)
+#define REG(reg)		MMIO32(USB_OTG_HS_BASE + (reg))
+#define REG_CH(reg, x)		MMIO32(USB_OTG_HS_BASE + reg(x))
+
+#define HUB_ADDRESS		(5)
+#define HUB_PORT		(3)
+
+static usbh_lld_stm32f4_driver_data_t *const otg = &driver_data_hs;
+
+static uint32_t callbacks;
+static usbh_packet_callback_data_t callback_data;
+
+static void packet_callback(usbh_device_t *usbh_dev, usbh_packet_callback_data_t cb_data)
+{
+	(void)usbh_dev;
+	callbacks++;
+	callback_data = cb_data;
+}
+
+static bool registers_map(void)
+{
+	void *base = (void *)(uintptr_t)USB_OTG_HS_BASE;
+	void *regs = mmap(base, OTG_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (regs != base) {
+		printf("registers of OTG_HS cannot be mapped at %p\n", base);
+		if (regs != MAP_FAILED) {
+			munmap(regs, OTG_SIZE);
+		}
+		return false;
+	}
+	return true;
+}
+
+static void setup(void)
+{
+	memset((void *)(uintptr_t)USB_OTG_HS_BASE, 0, OTG_SIZE);
+	memset(channels_hs, 0, sizeof(channels_hs));
+	otg->dpstate = DEVICE_POLL_STATE_RUN;
+	otg->state = DEVICE_STATE_RUN;
+	callbacks = 0;
+}
+
+static void packet_init(usbh_packet_t *packet, uint8_t *toggle, void *data, uint16_t datalen,
+	uint16_t endpoint_size_max, enum USBH_SPEED speed)
+{
+	memset(packet, 0, sizeof(*packet));
+	packet->address = 7;
+	packet->data = data;
+	packet->datalen = datalen;
+	packet->endpoint_address = 1;
+	packet->endpoint_size_max = endpoint_size_max;
+	packet->endpoint_type = USBH_ENDPOINT_TYPE_BULK;
+	packet->speed = speed;
+	packet->toggle = toggle;
+	packet->callback = packet_callback;
+	if (speed != USBH_SPEED_HIGH) {
+		packet->split_hub_address = HUB_ADDRESS;
+		packet->split_port = HUB_PORT;
+	}
+}
+
+/**
+ * Core halts the channel with the interrupt bits, driver handles them
+ * @returns true when the driver enabled the channel again
+ */
+static bool channel_halt(uint8_t channel, uint32_t hcint)
+{
+	REG_CH(OTG_HCCHAR, channel) &= ~OTG_HCCHAR_CHENA;
+	REG_CH(OTG_HCINT, channel) = hcint | OTG_HCINT_CHH;
+	REG(OTG_HAINT) = 1 << channel;
+	REG(OTG_GINTSTS) = OTG_GINTSTS_HCINT;
+	poll_run(otg);
+	REG(OTG_HAINT) = 0;
+	REG(OTG_GINTSTS) = 0;
+	return REG_CH(OTG_HCCHAR, channel) & OTG_HCCHAR_CHENA;
+}
+
+/**
+ * Core receives IN packet into the receive FIFO
+ */
+static void channel_receive(uint8_t channel, const uint8_t *data, uint16_t length)
+{
+	memcpy((void *)&REG_CH(OTG_FIFO, channel), data, length);
+	REG(OTG_GRXSTSP) = OTG_GRXSTSP_PKTSTS_IN | (length << 4) | channel;
+	rxflvl_handle(otg);
+}
+
+static bool fifo_check(uint8_t channel, const uint8_t *data, uint16_t length)
+{
+	const void *fifo = (const void *)(&REG_CH(OTG_FIFO, channel) + RX_FIFO_SIZE);
+	return !memcmp(fifo, data, length);
+}
+
+static void fifo_clear(uint8_t channel)
+{
+	memset((void *)(&REG_CH(OTG_FIFO, channel) + RX_FIFO_SIZE), 0, 0x1000 - 4 * RX_FIFO_SIZE);
+}
+
+static bool complete_split(uint8_t channel)
+{
+	return REG_CH(OTG_HCSPLT, channel) & OTG_HCSPLT_COMPLSPLT;
+}
+
+static uint32_t transfer_size(uint8_t channel)
+{
+	return REG_CH(OTG_HCTSIZ, channel) & 0x7ffff;
+}
+
+static uint32_t dpid(uint8_t channel)
+{
+	return REG_CH(OTG_HCTSIZ, channel) & OTG_HCTSIZ_DPID_MDATA;
+}
+
+/*
+ * Bulk OUT of 100 bytes, 64 bytes packets, to full speed device behind
+ * high speed hub: start split of each packet carries its data,
+ * complete split has none. NYET repeats the complete split, NAK sends
+ * the packet again from start split.
+ */
+static void test_split_out(void)
+{
+	uint32_t buffer[25];
+	uint8_t *data = (uint8_t *)buffer;
+	uint8_t toggle = 0;
+	usbh_packet_t packet;
+	uint32_t i;
+
+	setup();
+	for (i = 0; i < sizeof(buffer); i++) {
+		data[i] = i;
+	}
+	packet_init(&packet, &toggle, data, 100, 64, USBH_SPEED_FULL);
+	write(otg, &packet);
+
+	// start split of the first packet
+	const uint32_t hcsplt = REG_CH(OTG_HCSPLT, 0);
+	CHECK(hcsplt & OTG_HCSPLT_SPLITEN);
+	CHECK(!(hcsplt & OTG_HCSPLT_COMPLSPLT));
+	CHECK_EQ(hcsplt & OTG_HCSPLT_XACTPOS_ALL, OTG_HCSPLT_XACTPOS_ALL);
+	CHECK_EQ((hcsplt & OTG_HCSPLT_HUBADDR_MASK) >> 7, HUB_ADDRESS);
+	CHECK_EQ(hcsplt & OTG_HCSPLT_PORTADDR_MASK, HUB_PORT);
+	CHECK(REG_CH(OTG_HCCHAR, 0) & OTG_HCCHAR_CHENA);
+	CHECK_EQ(transfer_size(0), 64);
+	CHECK_EQ(dpid(0), OTG_HCTSIZ_DPID_DATA0);
+	CHECK(fifo_check(0, data, 64));
+
+	// TT accepted the start split, complete split without data follows
+	CHECK(channel_halt(0, OTG_HCINT_ACK));
+	CHECK(complete_split(0));
+	CHECK_EQ(transfer_size(0), 0);
+	CHECK_EQ(dpid(0), OTG_HCTSIZ_DPID_DATA0);
+
+	// TT has no result yet
+	CHECK(channel_halt(0, OTG_HCINT_NYET));
+	CHECK(complete_split(0));
+	CHECK_EQ(toggle, 0);
+
+	// device NAKed the packet, start split with the same data again
+	fifo_clear(0);
+	CHECK(channel_halt(0, OTG_HCINT_NAK));
+	CHECK(!complete_split(0));
+	CHECK_EQ(transfer_size(0), 64);
+	CHECK_EQ(dpid(0), OTG_HCTSIZ_DPID_DATA0);
+	CHECK(fifo_check(0, data, 64));
+
+	CHECK(channel_halt(0, OTG_HCINT_ACK));
+	CHECK(complete_split(0));
+
+	// first packet acknowledged, start split of the second one
+	fifo_clear(0);
+	CHECK(channel_halt(0, OTG_HCINT_ACK));
+	CHECK(!complete_split(0));
+	CHECK_EQ(transfer_size(0), 36);
+	CHECK_EQ(dpid(0), OTG_HCTSIZ_DPID_DATA1);
+	CHECK(fifo_check(0, &data[64], 36));
+	CHECK_EQ(callbacks, 0);
+
+	CHECK(channel_halt(0, OTG_HCINT_ACK));
+	CHECK(complete_split(0));
+	CHECK_EQ(transfer_size(0), 0);
+	CHECK_EQ(dpid(0), OTG_HCTSIZ_DPID_DATA1);
+
+	// last packet acknowledged, transfer is complete
+	CHECK(!channel_halt(0, OTG_HCINT_ACK | OTG_HCINT_XFRC));
+	CHECK_EQ(callbacks, 1);
+	CHECK_EQ(callback_data.status, USBH_PACKET_CALLBACK_STATUS_OK);
+	CHECK_EQ(callback_data.transferred_length, 100);
+	CHECK_EQ(toggle, 0);
+	CHECK_EQ(channels_hs[0].state, CHANNEL_STATE_FREE);
+}
+
+/*
+ * Bulk IN of 100 bytes from full speed device behind high speed hub:
+ * data of each packet comes with its complete split, then the next
+ * packet starts with start split
+ */
+static void test_split_in(void)
+{
+	uint32_t buffer[25];
+	uint8_t *data = (uint8_t *)buffer;
+	uint8_t expected[100];
+	uint8_t toggle = 1;
+	usbh_packet_t packet;
+	uint32_t i;
+
+	setup();
+	for (i = 0; i < sizeof(expected); i++) {
+		expected[i] = 0xff - i;
+	}
+	memset(buffer, 0, sizeof(buffer));
+	packet_init(&packet, &toggle, data, 100, 64, USBH_SPEED_FULL);
+	read(otg, &packet);
+
+	CHECK(REG_CH(OTG_HCSPLT, 0) & OTG_HCSPLT_SPLITEN);
+	CHECK(!complete_split(0));
+	CHECK(REG_CH(OTG_HCCHAR, 0) & OTG_HCCHAR_EPDIR_IN);
+	CHECK_EQ(dpid(0), OTG_HCTSIZ_DPID_DATA1);
+
+	CHECK(channel_halt(0, OTG_HCINT_ACK));
+	CHECK(complete_split(0));
+	CHECK(channel_halt(0, OTG_HCINT_NYET));
+	CHECK(complete_split(0));
+
+	// device has no data, read is retried from start split
+	CHECK(channel_halt(0, OTG_HCINT_NAK));
+	CHECK(!complete_split(0));
+	CHECK_EQ(toggle, 1);
+
+	CHECK(channel_halt(0, OTG_HCINT_ACK));
+	CHECK(complete_split(0));
+
+	// first packet, the channel is not enabled by the receive handler
+	REG_CH(OTG_HCCHAR, 0) &= ~OTG_HCCHAR_CHENA;
+	channel_receive(0, expected, 64);
+	CHECK(!(REG_CH(OTG_HCCHAR, 0) & OTG_HCCHAR_CHENA));
+	CHECK(channel_halt(0, OTG_HCINT_ACK));
+	CHECK(!complete_split(0));
+	CHECK_EQ(toggle, 0);
+
+	CHECK(channel_halt(0, OTG_HCINT_ACK));
+	CHECK(complete_split(0));
+
+	// last packet, core has the next data PID in the transfer size register
+	channel_receive(0, &expected[64], 36);
+	REG_CH(OTG_HCTSIZ, 0) = OTG_HCTSIZ_DPID_DATA1;
+	CHECK(!channel_halt(0, OTG_HCINT_ACK | OTG_HCINT_XFRC));
+	CHECK_EQ(callbacks, 1);
+	CHECK_EQ(callback_data.status, USBH_PACKET_CALLBACK_STATUS_OK);
+	CHECK_EQ(callback_data.transferred_length, 100);
+	CHECK(!memcmp(data, expected, 100));
+	CHECK_EQ(toggle, 1);
+	CHECK_EQ(channels_hs[0].state, CHANNEL_STATE_FREE);
+}
+
+/*
+ * High speed bulk OUT of two 512 bytes packets: device answers the first
+ * one with NYET, the data toggle advances and the rest is sent with PING
+ */
+static void test_nyet_ping(void)
+{
+	static uint32_t buffer[256];
+	uint8_t toggle = 0;
+	usbh_packet_t packet;
+
+	setup();
+	packet_init(&packet, &toggle, buffer, 1024, 512, USBH_SPEED_HIGH);
+	write(otg, &packet);
+
+	CHECK(!(REG_CH(OTG_HCSPLT, 0) & OTG_HCSPLT_SPLITEN));
+	CHECK_EQ(transfer_size(0), 1024);
+	CHECK_EQ((REG_CH(OTG_HCTSIZ, 0) >> 19) & 0x3ff, 2);
+	CHECK(!(REG_CH(OTG_HCTSIZ, 0) & OTG_HCTSIZ_DOPING));
+
+	CHECK(channel_halt(0, OTG_HCINT_ACK | OTG_HCINT_NYET));
+	CHECK(REG_CH(OTG_HCTSIZ, 0) & OTG_HCTSIZ_DOPING);
+	CHECK_EQ(toggle, 1);
+	CHECK_EQ(callbacks, 0);
+
+	CHECK(!channel_halt(0, OTG_HCINT_ACK | OTG_HCINT_XFRC));
+	CHECK_EQ(callbacks, 1);
+	CHECK_EQ(callback_data.status, USBH_PACKET_CALLBACK_STATUS_OK);
+	CHECK_EQ(callback_data.transferred_length, 1024);
+	CHECK_EQ(toggle, 0);
+
+	// NYET of the last packet completes the transfer
+	setup();
+	packet_init(&packet, &toggle, buffer, 512, 512, USBH_SPEED_HIGH);
+	write(otg, &packet);
+	CHECK(!channel_halt(0, OTG_HCINT_NYET | OTG_HCINT_XFRC));
+	CHECK_EQ(callbacks, 1);
+	CHECK_EQ(callback_data.status, USBH_PACKET_CALLBACK_STATUS_OK);
+	CHECK_EQ(toggle, 1);
+}
+
+int main(int argc, char *argv[])
+{
+	if (!registers_map()) {
+		return 1;
+	}
+	if (!test_bench_requested(argc, argv)) {
+		test_split_out();
+		test_split_in();
+		test_nyet_ping();
+	}
+	return test_exit("lld");
+}
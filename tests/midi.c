@@ -0,0 +1,624 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * USB-MIDI driver against a simulated MIDI interface with one input and
+ * one output port: jacks of the cables, write callback of a write that
+ * fills the whole output queue, events in order in both directions,
+ * SysEx dumps reassembled in a small buffer, suspend of the idle device behind a hub and its resume by a queued
+ * event, and events per second sent and received.
+ */
+
+#include "test.h"
+#include "usbh_sim.h"
+#include "usbh_driver_ac_midi.h"
+#include "usbh_driver_hub.h"
+
+#include <string.h>
+
+#define MAXPACKETSIZE		(64)
+
+// note on, 14 bits of the sequence number in the note and velocity
+#define EVENT_CIN_NOTE_ON	(0x09)
+#define SEQUENCE_MASK		(0x3fff)
+
+// wPortStatus of the hub port
+#define PORT_SUSPEND		(1 << 2)
+
+struct midi_device {
+	usbh_sim_device_t sim;
+	uint8_t device_descriptor[USB_DT_DEVICE_SIZE];
+	uint8_t config_descriptor[101];
+
+	// host to device
+	uint32_t out_events;
+	uint32_t out_bad;
+	uint32_t out_sequence;
+
+	// device to host, raw packets first, then in_limit events in total,
+	// up to in_per_packet in a packet
+	const uint8_t *in_raw;
+	uint32_t in_raw_count;
+	uint32_t in_requests;
+	uint32_t in_events;
+	uint32_t in_limit;
+	uint8_t in_per_packet;
+};
+
+static void event_fill(uint8_t *packet, uint32_t sequence)
+{
+	packet[0] = EVENT_CIN_NOTE_ON;
+	packet[1] = 0x90;
+	packet[2] = sequence & 0x7f;
+	packet[3] = (sequence >> 7) & 0x7f;
+}
+
+static bool event_check(const uint8_t *packet, uint32_t sequence)
+{
+	uint8_t expected[4];
+
+	event_fill(expected, sequence);
+	return !memcmp(packet, expected, sizeof(expected));
+}
+
+static int midi_in(usbh_sim_device_t *sim, uint8_t endpoint, uint8_t *data, uint16_t length)
+{
+	struct midi_device *midi = sim->priv;
+	uint16_t count = 0;
+	(void)endpoint;
+
+	midi->in_requests++;
+	while (count < midi->in_per_packet && (count + 1) * 4 <= length && midi->in_raw_count) {
+		memcpy(&data[count * 4], midi->in_raw, 4);
+		midi->in_raw += 4;
+		midi->in_raw_count--;
+		count++;
+	}
+	while (count < midi->in_per_packet && (count + 1) * 4 <= length && midi->in_events < midi->in_limit) {
+		event_fill(&data[count * 4], midi->in_events++);
+		count++;
+	}
+	return count ? count * 4 : USBH_SIM_NAK;
+}
+
+static int midi_out(usbh_sim_device_t *sim, uint8_t endpoint, const uint8_t *data, uint16_t length)
+{
+	struct midi_device *midi = sim->priv;
+	uint16_t i;
+	(void)endpoint;
+
+	if (length % 4) {
+		midi->out_bad++;
+	}
+	for (i = 0; i + 4 <= length; i += 4) {
+		if (!event_check(&data[i], midi->out_sequence)) {
+			midi->out_bad++;
+		}
+		midi->out_sequence = (midi->out_sequence + 1) & SEQUENCE_MASK;
+		midi->out_events++;
+	}
+	return 0;
+}
+
+static void midi_device_init(struct midi_device *midi)
+{
+	const uint8_t device_descriptor[USB_DT_DEVICE_SIZE] = {
+		USB_DT_DEVICE_SIZE, USB_DT_DEVICE, 0x10, 0x01, 0, 0, 0, 64,
+		0x83, 0x04, 0x61, 0x57, 0x00, 0x01, 0, 0, 0, 1
+	};
+	const uint8_t config_descriptor[101] = {
+		9, USB_DT_CONFIGURATION, 101, 0, 2, 1, 0, 0x80, 50,
+		// audio control
+		9, USB_DT_INTERFACE, 0, 0, 0, 0x01, 0x01, 0, 0,
+		9, 0x24, 0x01, 0x00, 0x01, 9, 0, 1, 1,
+		// MIDI streaming: embedded IN jack 1 fed by host, external OUT jack 4,
+		// external IN jack 2 feeding embedded OUT jack 3 read by host
+		9, USB_DT_INTERFACE, 1, 0, 2, 0x01, 0x03, 0, 0,
+		7, 0x24, 0x01, 0x00, 0x01, 65, 0,
+		6, 0x24, 0x02, 0x01, 1, 0,
+		6, 0x24, 0x02, 0x02, 2, 0,
+		9, 0x24, 0x03, 0x01, 3, 1, 2, 1, 0,
+		9, 0x24, 0x03, 0x02, 4, 1, 1, 1, 0,
+		9, USB_DT_ENDPOINT, 0x02, USB_ENDPOINT_ATTR_BULK, MAXPACKETSIZE, 0, 0, 0, 0,
+		5, 0x25, 0x01, 1, 1,
+		9, USB_DT_ENDPOINT, 0x81, USB_ENDPOINT_ATTR_BULK, MAXPACKETSIZE, 0, 0, 0, 0,
+		5, 0x25, 0x01, 1, 3
+	};
+
+	memset(midi, 0, sizeof(*midi));
+	memcpy(midi->device_descriptor, device_descriptor, sizeof(device_descriptor));
+	memcpy(midi->config_descriptor, config_descriptor, sizeof(config_descriptor));
+	midi->in_per_packet = MAXPACKETSIZE / 4;
+	midi->sim.speed = USBH_SPEED_FULL;
+	midi->sim.device_descriptor = midi->device_descriptor;
+	midi->sim.config_descriptor = midi->config_descriptor;
+	midi->sim.in = midi_in;
+	midi->sim.out = midi_out;
+	midi->sim.priv = midi;
+}
+
+/*
+ * Host side
+ */
+static volatile bool connected;
+
+static uint32_t read_events;
+static uint32_t read_bad;
+
+static uint32_t write_callbacks;
+static uint32_t write_length;
+// events the device had received when the write callback was called
+static uint32_t write_received;
+
+static struct midi_device midi;
+
+static void notify_connected(int device_id)
+{
+	(void)device_id;
+	connected = true;
+}
+
+static void notify_disconnected(int device_id)
+{
+	(void)device_id;
+	connected = false;
+}
+
+static void read_callback(int device_id, uint8_t *data)
+{
+	(void)device_id;
+	if (!event_check(data, read_events & SEQUENCE_MASK)) {
+		read_bad++;
+	}
+	read_events++;
+}
+
+static void write_callback(uint32_t bytes_written)
+{
+	write_callbacks++;
+	write_length = bytes_written;
+	write_received = midi.out_events;
+}
+
+// SysEx chunks delivered by the driver, their bytes one after another
+struct sysex_chunk {
+	uint16_t length;
+	uint8_t flags;
+};
+
+static struct sysex_chunk sysex_chunks[8];
+static uint32_t sysex_chunk_count;
+static uint8_t sysex_data[64];
+static uint32_t sysex_length;
+
+static void sysex_callback(int device_id, uint8_t cable, const uint8_t *data, uint16_t length, uint8_t flags)
+{
+	(void)device_id;
+	(void)cable;
+	if (sysex_chunk_count < sizeof(sysex_chunks) / sizeof(sysex_chunks[0])) {
+		sysex_chunks[sysex_chunk_count].length = length;
+		sysex_chunks[sysex_chunk_count].flags = flags;
+	}
+	sysex_chunk_count++;
+	if (sysex_length + length <= sizeof(sysex_data)) {
+		memcpy(&sysex_data[sysex_length], data, length);
+	}
+	sysex_length += length;
+}
+
+static const midi_config_t midi_config = {
+	.read_callback = read_callback,
+	.notify_connected = notify_connected,
+	.notify_disconnected = notify_disconnected,
+	.sysex = sysex_callback
+};
+
+static const usbh_dev_driver_t *device_drivers[] = {
+	&usbh_hub_driver,
+	&usbh_midi_driver,
+	0
+};
+
+// kept by usbh_init()
+static const void *lld_drivers[] = {
+	0,
+	0
+};
+
+static bool setup_device(bool streaming)
+{
+	lld_drivers[0] = usbh_sim_lld;
+	usbh_sim_reset(false, 8);
+	usbh_init(lld_drivers, device_drivers);
+	hub_driver_init();
+	midi_driver_init(&midi_config);
+	connected = false;
+	read_events = 0;
+	read_bad = 0;
+	write_callbacks = 0;
+	write_length = 0;
+
+	midi_device_init(&midi);
+	if (streaming) {
+		midi.in_limit = UINT32_MAX;
+	}
+	usbh_sim_connect(0, 0, &midi.sim);
+	if (!usbh_sim_run_until(&connected, 2000000)) {
+		return false;
+	}
+	// events are read after initial delay of the driver
+	usbh_sim_run(200000);
+	return true;
+}
+
+static bool setup(void)
+{
+	return setup_device(false);
+}
+
+static void teardown(void)
+{
+	usbh_sim_disconnect(&midi.sim);
+	usbh_sim_run(10000);
+}
+
+static void test_cables(void)
+{
+	midi_cable_t cables[2];
+
+	CHECK(setup());
+	CHECK_EQ(usbh_midi_cables(0, true, cables, 2), 1);
+	CHECK_EQ(cables[0].jack_id, 3);
+	CHECK_EQ(cables[0].external_jack_id, 2);
+	CHECK_EQ(usbh_midi_cables(0, false, cables, 2), 1);
+	CHECK_EQ(cables[0].jack_id, 1);
+	CHECK_EQ(cables[0].external_jack_id, 4);
+	teardown();
+	CHECK(!connected);
+}
+
+/*
+ * Write of 256 bytes fills the whole output queue, callback gets its
+ * length after all of it left
+ */
+static void test_write_callback(void)
+{
+	uint8_t data[256];
+	uint32_t i;
+
+	CHECK(setup());
+	for (i = 0; i < sizeof(data) / 4; i++) {
+		event_fill(&data[i * 4], i);
+	}
+
+	usbh_midi_write(0, data, sizeof(data), write_callback);
+	usbh_sim_run(10000);
+	CHECK_EQ(write_callbacks, 1);
+	CHECK_EQ(write_length, sizeof(data));
+	CHECK_EQ(write_received, sizeof(data) / 4);
+	CHECK_EQ(midi.out_events, sizeof(data) / 4);
+	CHECK_EQ(midi.out_bad, 0);
+
+	// next write is reported on its own
+	event_fill(&data[0], 64);
+	event_fill(&data[4], 65);
+	usbh_midi_write(0, data, 8, write_callback);
+	usbh_sim_run(10000);
+	CHECK_EQ(write_callbacks, 2);
+	CHECK_EQ(write_length, 8);
+	CHECK_EQ(midi.out_events, 66);
+	CHECK_EQ(midi.out_bad, 0);
+	teardown();
+}
+
+/*
+ * Events enqueued faster than they are sent arrive in order
+ */
+static void test_write_order(void)
+{
+	const uint32_t events = 20000;
+	uint32_t sequence = 0;
+	uint32_t i;
+
+	CHECK(setup());
+	for (i = 0; i < 100000 && sequence < events; i++) {
+		uint8_t packet[4];
+
+		while (sequence < events && usbh_midi_out_free(0)) {
+			event_fill(packet, sequence & SEQUENCE_MASK);
+			CHECK_EQ(usbh_midi_enqueue(0, packet, 1), 1);
+			sequence++;
+		}
+		usbh_sim_step();
+	}
+	usbh_sim_run(10000);
+	CHECK_EQ(midi.out_events, events);
+	CHECK_EQ(midi.out_bad, 0);
+	teardown();
+}
+
+static void test_read_order(void)
+{
+	const uint32_t events = 20000;
+
+	CHECK(setup());
+	midi.in_limit = events;
+	midi.in_per_packet = 5;
+	usbh_sim_run(1000000);
+	CHECK_EQ(read_events, events);
+	CHECK_EQ(read_bad, 0);
+	teardown();
+}
+
+/*
+ * Events sent by the device during the initial delay are dropped,
+ * but they do not hold the driver in the delay
+ */
+static void test_read_streaming(void)
+{
+	CHECK(setup_device(true));
+	CHECK(read_events > 0);
+	teardown();
+}
+
+/**
+ * Device sends the packets, driver reassembles the SysEx messages in them
+ */
+static void sysex_receive(const uint8_t *packets, uint32_t count)
+{
+	sysex_chunk_count = 0;
+	sysex_length = 0;
+	midi.in_raw = packets;
+	midi.in_raw_count = count;
+	usbh_sim_run(10000);
+}
+
+/*
+ * SysEx dumps reassembled in a buffer of 8 bytes: dump delivered in
+ * chunks, dump filling the buffer exactly, dump aborted by a new one,
+ * end by CIN 0x5, and continuation without a start
+ */
+static void test_sysex(void)
+{
+	static const uint8_t dump[] = {
+		0x04, 0xf0, 0x01, 0x02,
+		0x04, 0x03, 0x04, 0x05,
+		0x04, 0x06, 0x07, 0x08,
+		0x04, 0x09, 0x0a, 0x0b,
+		0x04, 0x0c, 0x0d, 0x0e,
+		0x04, 0x0f, 0x10, 0x11,
+		0x06, 0x12, 0xf7, 0x00
+	};
+	static const uint8_t full[] = {
+		0x04, 0xf0, 0x01, 0x02,
+		0x04, 0x03, 0x04, 0x05,
+		0x06, 0x06, 0xf7, 0x00
+	};
+	static const uint8_t aborted[] = {
+		0x04, 0xf0, 0x01, 0x02,
+		0x04, 0xf0, 0x11, 0x12,
+		0x07, 0x13, 0x14, 0xf7
+	};
+	static const uint8_t single_byte_end[] = {
+		0x04, 0xf0, 0x01, 0x02,
+		0x04, 0x03, 0x04, 0x05,
+		0x05, 0xf7, 0x00, 0x00
+	};
+	static const uint8_t continuation[] = {
+		0x04, 0x01, 0x02, 0x03,
+		0x06, 0x04, 0xf7, 0x00
+	};
+	uint8_t buffer[8];
+	uint8_t expected[20];
+	uint8_t i;
+
+	CHECK(setup());
+	CHECK(usbh_midi_sysex_buffer(0, 0, buffer, sizeof(buffer)));
+	midi.in_per_packet = 2;
+
+	// 20 bytes in chunks of 8, 8 and 4
+	sysex_receive(dump, sizeof(dump) / 4);
+	expected[0] = 0xf0;
+	for (i = 1; i < 19; i++) {
+		expected[i] = i;
+	}
+	expected[19] = 0xf7;
+	CHECK_EQ(sysex_chunk_count, 3);
+	CHECK_EQ(sysex_chunks[0].length, 8);
+	CHECK_EQ(sysex_chunks[0].flags, MIDI_SYSEX_START);
+	CHECK_EQ(sysex_chunks[1].length, 8);
+	CHECK_EQ(sysex_chunks[1].flags, 0);
+	CHECK_EQ(sysex_chunks[2].length, 4);
+	CHECK_EQ(sysex_chunks[2].flags, MIDI_SYSEX_END);
+	CHECK_EQ(sysex_length, 20);
+	CHECK(!memcmp(sysex_data, expected, 20));
+
+	// buffer exactly full at the end, delivered at once
+	sysex_receive(full, sizeof(full) / 4);
+	CHECK_EQ(sysex_chunk_count, 1);
+	CHECK_EQ(sysex_chunks[0].length, 8);
+	CHECK_EQ(sysex_chunks[0].flags, MIDI_SYSEX_START | MIDI_SYSEX_END);
+	expected[7] = 0xf7;
+	CHECK(!memcmp(sysex_data, expected, 8));
+
+	// new 0xF0 aborts the running dump
+	sysex_receive(aborted, sizeof(aborted) / 4);
+	CHECK_EQ(sysex_chunk_count, 2);
+	CHECK_EQ(sysex_chunks[0].length, 3);
+	CHECK_EQ(sysex_chunks[0].flags, MIDI_SYSEX_START | MIDI_SYSEX_END | MIDI_SYSEX_ABORTED);
+	CHECK_EQ(sysex_chunks[1].length, 6);
+	CHECK_EQ(sysex_chunks[1].flags, MIDI_SYSEX_START | MIDI_SYSEX_END);
+	CHECK_EQ(sysex_length, 9);
+	CHECK(!memcmp(sysex_data, "\xf0\x01\x02\xf0\x11\x12\x13\x14\xf7", 9));
+
+	// single 0xF7 ends the dump
+	sysex_receive(single_byte_end, sizeof(single_byte_end) / 4);
+	CHECK_EQ(sysex_chunk_count, 1);
+	CHECK_EQ(sysex_chunks[0].length, 7);
+	CHECK_EQ(sysex_chunks[0].flags, MIDI_SYSEX_START | MIDI_SYSEX_END);
+	CHECK(!memcmp(sysex_data, "\xf0\x01\x02\x03\x04\x05\xf7", 7));
+
+	// continuation without a start is dropped, not passed as events
+	sysex_receive(continuation, sizeof(continuation) / 4);
+	CHECK_EQ(sysex_chunk_count, 0);
+	CHECK_EQ(read_events, 0);
+
+	// notes are not affected
+	midi.in_limit = 10;
+	usbh_sim_run(10000);
+	CHECK_EQ(read_events, 10);
+	CHECK_EQ(read_bad, 0);
+	CHECK_EQ(sysex_chunk_count, 0);
+	teardown();
+}
+
+/*
+ * Idle device behind a hub is suspended by its port and not polled,
+ * queued event resumes it and is sent after the resume. Device sending
+ * events is not suspended.
+ */
+static void test_suspend(void)
+{
+	static usbh_sim_hub_t hub;
+	uint8_t packet[4];
+
+	lld_drivers[0] = usbh_sim_lld;
+	usbh_sim_reset(false, 8);
+	usbh_init(lld_drivers, device_drivers);
+	hub_driver_init();
+	midi_driver_init(&midi_config);
+	usbh_suspend_timeout_set(20);
+	connected = false;
+	read_events = 0;
+	read_bad = 0;
+
+	midi_device_init(&midi);
+	usbh_sim_hub_init(&hub, USBH_SPEED_FULL, 2);
+	usbh_sim_connect(0, 0, &hub.device);
+	usbh_sim_connect(&hub.device, 1, &midi.sim);
+	CHECK(usbh_sim_run_until(&connected, 2000000));
+
+	// initial delay of the driver, then idle
+	usbh_sim_run(300000);
+	CHECK(hub.port[1].status & PORT_SUSPEND);
+	const uint32_t in_requests = midi.in_requests;
+	usbh_sim_run(100000);
+	CHECK_EQ(midi.in_requests, in_requests);
+
+	// events from the device keep it active
+	event_fill(packet, 0);
+	CHECK_EQ(usbh_midi_enqueue(0, packet, 1), 1);
+	midi.in_limit = UINT32_MAX;
+	midi.in_per_packet = 1;
+	usbh_sim_run(100000);
+	CHECK_EQ(midi.out_events, 1);
+	CHECK_EQ(midi.out_bad, 0);
+	CHECK(!(hub.port[1].status & PORT_SUSPEND));
+	CHECK(read_events > 0);
+	CHECK_EQ(read_bad, 0);
+	CHECK(connected);
+
+	// idle again
+	midi.in_limit = midi.in_events;
+	usbh_sim_run(100000);
+	CHECK(hub.port[1].status & PORT_SUSPEND);
+
+	usbh_suspend_timeout_set(0);
+	usbh_sim_disconnect(&hub.device);
+	usbh_sim_run(10000);
+	CHECK(!connected);
+}
+
+/*
+ * Benchmark
+ */
+static void bench_write(uint32_t step_us)
+{
+	const uint32_t duration_us = 500000;
+	uint8_t packets[64 * 4];
+	uint32_t sequence = 0;
+
+	CHECK(setup());
+	usbh_sim_step_set(step_us);
+	const uint32_t start = usbh_sim_time_us();
+	const uint32_t events_start = midi.out_events;
+	while (usbh_sim_time_us() - start < duration_us) {
+		uint32_t count = usbh_midi_out_free(0);
+		uint32_t i;
+
+		for (i = 0; i < count; i++) {
+			event_fill(&packets[i * 4], (sequence + i) & SEQUENCE_MASK);
+		}
+		sequence += usbh_midi_enqueue(0, packets, count);
+		usbh_sim_step();
+	}
+	CHECK_EQ(midi.out_bad, 0);
+	printf("  send,    usbh_poll() every %3d us: %7.0f events/s\n", step_us,
+		(midi.out_events - events_start) * 1e6 / duration_us);
+	teardown();
+}
+
+static void bench_read(uint32_t step_us)
+{
+	const uint32_t duration_us = 500000;
+
+	CHECK(setup());
+	midi.in_limit = UINT32_MAX;
+	usbh_sim_step_set(step_us);
+	const uint32_t events_start = read_events;
+	usbh_sim_run(duration_us);
+	CHECK_EQ(read_bad, 0);
+	printf("  receive, usbh_poll() every %3d us: %7.0f events/s\n", step_us,
+		(read_events - events_start) * 1e6 / duration_us);
+	teardown();
+}
+
+static void bench_midi(void)
+{
+	static const uint32_t steps[] = { 1000, 125, 20 };
+	uint32_t i;
+
+	// 16 events in a full speed bulk packet of 64 bytes, which takes
+	// 52.13 us on the simulated bus
+	printf("USB-MIDI, full speed, simulated time, bus limit %.0f events/s\n",
+		16 * 1e6 / 52.13);
+	for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+		bench_write(steps[i]);
+		bench_read(steps[i]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_bench_requested(argc, argv)) {
+		bench_midi();
+	} else {
+		test_cables();
+		test_write_callback();
+		test_write_order();
+		test_read_order();
+		test_read_streaming();
+		test_sysex();
+		test_suspend();
+	}
+	return test_exit("midi");
+}
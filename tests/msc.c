@@ -0,0 +1,676 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Mass storage driver against a simulated Bulk-Only Transport device:
+ * data integrity through the cache, the last sectors of a medium whose
+ * size is not a multiple of the cache line, removal during a request,
+ * and MB/s of sequential and random 512 B / 4 KB requests in simulated time.
+ */
+
+#include "test.h"
+#include "usbh_sim.h"
+#include "usbh_driver_msc.h"
+
+#include <string.h>
+
+#define CBW_LENGTH		(31)
+#define CSW_LENGTH		(13)
+
+#define SCSI_TEST_UNIT_READY	(0x00)
+#define SCSI_REQUEST_SENSE	(0x03)
+#define SCSI_INQUIRY		(0x12)
+#define SCSI_READ_CAPACITY	(0x25)
+#define SCSI_READ_10		(0x28)
+#define SCSI_WRITE_10		(0x2a)
+
+#define SENSE_ILLEGAL_REQUEST	(0x05)
+#define ASC_INVALID_COMMAND	(0x20)
+#define ASC_LBA_OUT_OF_RANGE	(0x21)
+
+// not a multiple of the cache line
+#define MEDIUM_SECTORS		(2051)
+
+enum BOT_PHASE {
+	PHASE_CBW,
+	PHASE_DATA_IN,
+	PHASE_DATA_OUT,
+	PHASE_CSW
+};
+
+/*
+ * Bulk-Only Transport device with one LUN, medium in memory
+ */
+struct bot_device {
+	usbh_sim_device_t sim;
+	uint8_t device_descriptor[USB_DT_DEVICE_SIZE];
+	uint8_t config_descriptor[32];
+
+	enum BOT_PHASE phase;
+	bool in_halted;
+	bool out_halted;
+	uint32_t tag;
+	uint32_t expected;
+	uint32_t transferred;
+	uint8_t status;
+
+	// data phase, from the response or the medium
+	uint8_t *data;
+	uint32_t length;
+	uint8_t response[36];
+
+	uint8_t sense_key;
+	uint8_t asc;
+
+	uint32_t commands;
+	uint32_t out_of_range;
+};
+
+static uint8_t medium[MEDIUM_SECTORS * USBH_MSC_SECTOR_SIZE];
+
+static inline uint32_t load_be32(const uint8_t *buf)
+{
+	return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+static inline uint32_t load_le32(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static inline void store_le32(uint8_t *buf, uint32_t value)
+{
+	buf[0] = value;
+	buf[1] = value >> 8;
+	buf[2] = value >> 16;
+	buf[3] = value >> 24;
+}
+
+static void bot_fail(struct bot_device *bot, uint8_t key, uint8_t asc)
+{
+	bot->status = 1;
+	bot->sense_key = key;
+	bot->asc = asc;
+	bot->length = 0;
+	// expected data are not delivered, the endpoint is halted (case Hi > Dn, Ho > Dn)
+	if (bot->expected) {
+		if (bot->phase == PHASE_DATA_IN) {
+			bot->in_halted = true;
+		} else {
+			bot->out_halted = true;
+		}
+	}
+	bot->phase = PHASE_CSW;
+}
+
+static void bot_command(struct bot_device *bot, const uint8_t *cbw)
+{
+	const uint8_t *cdb = &cbw[15];
+
+	bot->commands++;
+	bot->tag = load_le32(&cbw[4]);
+	bot->expected = load_le32(&cbw[8]);
+	bot->transferred = 0;
+	bot->status = 0;
+	bot->data = bot->response;
+	bot->length = 0;
+	if (!bot->expected) {
+		bot->phase = PHASE_CSW;
+	} else {
+		bot->phase = (cbw[12] & 0x80) ? PHASE_DATA_IN : PHASE_DATA_OUT;
+	}
+
+	switch (cdb[0]) {
+	case SCSI_TEST_UNIT_READY:
+		break;
+
+	case SCSI_INQUIRY:
+		memset(bot->response, 0, sizeof(bot->response));
+		bot->response[1] = 0x80;
+		bot->response[3] = 2;
+		bot->response[4] = 31;
+		memcpy(&bot->response[8], "libusbh simulated BOT   ", 24);
+		bot->length = 36;
+		break;
+
+	case SCSI_REQUEST_SENSE:
+		memset(bot->response, 0, 18);
+		bot->response[0] = 0x70;
+		bot->response[2] = bot->sense_key;
+		bot->response[7] = 10;
+		bot->response[12] = bot->asc;
+		bot->length = 18;
+		bot->sense_key = 0;
+		bot->asc = 0;
+		break;
+
+	case SCSI_READ_CAPACITY:
+		bot->response[0] = (MEDIUM_SECTORS - 1) >> 24;
+		bot->response[1] = (MEDIUM_SECTORS - 1) >> 16;
+		bot->response[2] = (MEDIUM_SECTORS - 1) >> 8;
+		bot->response[3] = (MEDIUM_SECTORS - 1) & 0xff;
+		bot->response[4] = 0;
+		bot->response[5] = 0;
+		bot->response[6] = USBH_MSC_SECTOR_SIZE >> 8;
+		bot->response[7] = USBH_MSC_SECTOR_SIZE & 0xff;
+		bot->length = 8;
+		break;
+
+	case SCSI_READ_10:
+	case SCSI_WRITE_10:
+		{
+			const uint32_t lba = load_be32(&cdb[2]);
+			const uint32_t count = (cdb[7] << 8) | cdb[8];
+
+			if (lba >= MEDIUM_SECTORS || count > MEDIUM_SECTORS - lba) {
+				bot->out_of_range++;
+				bot_fail(bot, SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+				return;
+			}
+			bot->data = &medium[lba * USBH_MSC_SECTOR_SIZE];
+			bot->length = count * USBH_MSC_SECTOR_SIZE;
+		}
+		break;
+
+	default:
+		bot_fail(bot, SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+		return;
+	}
+
+	if (bot->length > bot->expected) {
+		bot->length = bot->expected;
+	}
+}
+
+static int bot_in(usbh_sim_device_t *sim, uint8_t endpoint, uint8_t *data, uint16_t length)
+{
+	struct bot_device *bot = sim->priv;
+	(void)endpoint;
+
+	if (bot->in_halted) {
+		return USBH_SIM_STALL;
+	}
+
+	switch (bot->phase) {
+	case PHASE_DATA_IN:
+		{
+			uint32_t left = bot->length - bot->transferred;
+			if (length > left) {
+				length = left;
+			}
+			memcpy(data, &bot->data[bot->transferred], length);
+			bot->transferred += length;
+			if (bot->transferred == bot->length) {
+				bot->phase = PHASE_CSW;
+			}
+			return length;
+		}
+
+	case PHASE_CSW:
+		store_le32(&data[0], 0x53425355);
+		store_le32(&data[4], bot->tag);
+		store_le32(&data[8], bot->expected - bot->transferred);
+		data[12] = bot->status;
+		bot->phase = PHASE_CBW;
+		return CSW_LENGTH;
+
+	default:
+		return USBH_SIM_NAK;
+	}
+}
+
+static int bot_out(usbh_sim_device_t *sim, uint8_t endpoint, const uint8_t *data, uint16_t length)
+{
+	struct bot_device *bot = sim->priv;
+	(void)endpoint;
+
+	if (bot->out_halted) {
+		return USBH_SIM_STALL;
+	}
+
+	switch (bot->phase) {
+	case PHASE_CBW:
+		if (length != CBW_LENGTH || load_le32(data) != 0x43425355) {
+			bot->in_halted = true;
+			bot->out_halted = true;
+			return USBH_SIM_STALL;
+		}
+		bot_command(bot, data);
+		return 0;
+
+	case PHASE_DATA_OUT:
+		if (length > bot->length - bot->transferred) {
+			length = bot->length - bot->transferred;
+		}
+		memcpy(&bot->data[bot->transferred], data, length);
+		bot->transferred += length;
+		if (bot->transferred == bot->length) {
+			bot->phase = PHASE_CSW;
+		}
+		return 0;
+
+	default:
+		return USBH_SIM_NAK;
+	}
+}
+
+static int bot_control(usbh_sim_device_t *sim, const struct usb_setup_data *setup, uint8_t *data)
+{
+	struct bot_device *bot = sim->priv;
+
+	// CLEAR_FEATURE(ENDPOINT_HALT)
+	if (setup->bmRequestType == 0x02 && setup->bRequest == USB_REQ_CLEAR_FEATURE) {
+		if (setup->wIndex & 0x80) {
+			bot->in_halted = false;
+		} else {
+			bot->out_halted = false;
+		}
+		return 0;
+	}
+
+	// Bulk-Only Mass Storage Reset, Get Max LUN
+	if (setup->bmRequestType == 0x21 && setup->bRequest == 0xff) {
+		bot->phase = PHASE_CBW;
+		return 0;
+	}
+	if (setup->bmRequestType == 0xa1 && setup->bRequest == 0xfe) {
+		data[0] = 0;
+		return 1;
+	}
+	return USBH_SIM_UNHANDLED;
+}
+
+static void bot_reset(usbh_sim_device_t *sim)
+{
+	struct bot_device *bot = sim->priv;
+
+	bot->phase = PHASE_CBW;
+	bot->in_halted = false;
+	bot->out_halted = false;
+}
+
+static void bot_init(struct bot_device *bot, enum USBH_SPEED speed)
+{
+	const uint16_t mps = speed == USBH_SPEED_HIGH ? 512 : 64;
+	const uint8_t device_descriptor[USB_DT_DEVICE_SIZE] = {
+		USB_DT_DEVICE_SIZE, USB_DT_DEVICE, 0x00, 0x02, 0, 0, 0, 64,
+		0x83, 0x04, 0x20, 0x57, 0x00, 0x01, 0, 0, 0, 1
+	};
+	const uint8_t config_descriptor[32] = {
+		9, USB_DT_CONFIGURATION, 32, 0, 1, 1, 0, 0x80, 50,
+		9, USB_DT_INTERFACE, 0, 0, 2, 0x08, 0x06, 0x50, 0,
+		7, USB_DT_ENDPOINT, 0x81, USB_ENDPOINT_ATTR_BULK, mps & 0xff, mps >> 8, 0,
+		7, USB_DT_ENDPOINT, 0x02, USB_ENDPOINT_ATTR_BULK, mps & 0xff, mps >> 8, 0
+	};
+
+	memset(bot, 0, sizeof(*bot));
+	memcpy(bot->device_descriptor, device_descriptor, sizeof(device_descriptor));
+	memcpy(bot->config_descriptor, config_descriptor, sizeof(config_descriptor));
+	bot->sim.speed = speed;
+	bot->sim.device_descriptor = bot->device_descriptor;
+	bot->sim.config_descriptor = bot->config_descriptor;
+	bot->sim.control = bot_control;
+	bot->sim.in = bot_in;
+	bot->sim.out = bot_out;
+	bot->sim.reset = bot_reset;
+	bot->sim.priv = bot;
+}
+
+/*
+ * Host side
+ */
+static volatile bool connected;
+static uint32_t sector_count;
+static volatile bool done;
+static bool success;
+static uint32_t callbacks;
+
+static void notify_connected(uint8_t device_id, uint32_t count)
+{
+	(void)device_id;
+	connected = true;
+	sector_count = count;
+}
+
+static void notify_disconnected(uint8_t device_id)
+{
+	(void)device_id;
+	connected = false;
+}
+
+static const msc_config_t msc_config = {
+	.notify_connected = notify_connected,
+	.notify_disconnected = notify_disconnected
+};
+
+static void request_callback(uint8_t device_id, bool result)
+{
+	(void)device_id;
+	success = result;
+	done = true;
+	callbacks++;
+}
+
+static const usbh_dev_driver_t *device_drivers[] = {
+	&usbh_msc_driver,
+	0
+};
+
+// kept by usbh_init()
+static const void *lld_drivers[] = {
+	0,
+	0
+};
+
+static struct bot_device bot;
+
+static bool setup(bool high_speed)
+{
+	lld_drivers[0] = usbh_sim_lld;
+	usbh_sim_reset(high_speed, 8);
+	usbh_init(lld_drivers, device_drivers);
+	msc_driver_init(&msc_config);
+	connected = false;
+
+	bot_init(&bot, high_speed ? USBH_SPEED_HIGH : USBH_SPEED_FULL);
+	usbh_sim_connect(0, 0, &bot.sim);
+	return usbh_sim_run_until(&connected, 2000000);
+}
+
+static void teardown(void)
+{
+	usbh_sim_disconnect(&bot.sim);
+	usbh_sim_run(10000);
+}
+
+static void medium_fill(uint32_t seed)
+{
+	uint32_t i;
+
+	for (i = 0; i < sizeof(medium); i += 4) {
+		store_le32(&medium[i], seed ^ (i * 2654435761u));
+	}
+}
+
+static bool read(uint32_t sector, uint32_t count, uint8_t *data)
+{
+	done = false;
+	if (!usbh_msc_read(0, sector, count, data, request_callback)) {
+		return false;
+	}
+	return usbh_sim_run_until(&done, 5000000) && success;
+}
+
+static bool write(uint32_t sector, uint32_t count, const uint8_t *data)
+{
+	done = false;
+	if (!usbh_msc_write(0, sector, count, data, request_callback)) {
+		return false;
+	}
+	return usbh_sim_run_until(&done, 5000000) && success;
+}
+
+static bool flush(void)
+{
+	done = false;
+	if (!usbh_msc_flush(0, request_callback)) {
+		return false;
+	}
+	return usbh_sim_run_until(&done, 5000000) && success;
+}
+
+static bool medium_equal(uint32_t sector, uint32_t count, const uint8_t *data)
+{
+	return !memcmp(&medium[sector * USBH_MSC_SECTOR_SIZE], data, count * USBH_MSC_SECTOR_SIZE);
+}
+
+static void test_enumeration(void)
+{
+	CHECK(setup(false));
+	CHECK_EQ(sector_count, MEDIUM_SECTORS);
+	CHECK_EQ(bot.out_of_range, 0);
+	teardown();
+	CHECK(!connected);
+}
+
+/*
+ * Cache lines at the end of the medium are partial, reads must not go past it
+ */
+static void test_last_sectors(void)
+{
+	static uint8_t buffer[8 * USBH_MSC_SECTOR_SIZE];
+	uint32_t sector;
+
+	medium_fill(1);
+	CHECK(setup(false));
+
+	CHECK(read(MEDIUM_SECTORS - 1, 1, buffer));
+	CHECK(medium_equal(MEDIUM_SECTORS - 1, 1, buffer));
+	CHECK_EQ(bot.out_of_range, 0);
+
+	// the request may not reach past the end
+	CHECK(!usbh_msc_read(0, MEDIUM_SECTORS - 1, 2, buffer, request_callback));
+	CHECK(!usbh_msc_read(0, MEDIUM_SECTORS, 1, buffer, request_callback));
+
+	// sequential reading up to the end, with read-ahead
+	for (sector = MEDIUM_SECTORS - 11; sector < MEDIUM_SECTORS; sector++) {
+		CHECK(read(sector, 1, buffer));
+		CHECK(medium_equal(sector, 1, buffer));
+	}
+	usbh_sim_run(100000);
+	CHECK_EQ(bot.out_of_range, 0);
+
+	// write of the last sectors through the cache
+	memset(buffer, 0xa5, sizeof(buffer));
+	CHECK(write(MEDIUM_SECTORS - 3, 3, buffer));
+	CHECK(flush());
+	CHECK(medium_equal(MEDIUM_SECTORS - 3, 3, buffer));
+	CHECK_EQ(bot.out_of_range, 0);
+	teardown();
+}
+
+static uint32_t random_next(uint32_t *state)
+{
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+/*
+ * Random reads and writes of random lengths against a copy of the medium
+ */
+static void test_random_access(void)
+{
+	static uint8_t expected[MEDIUM_SECTORS * USBH_MSC_SECTOR_SIZE];
+	static uint8_t buffer[32 * USBH_MSC_SECTOR_SIZE];
+	uint32_t random = 3;
+	uint32_t mismatches = 0;
+	uint32_t failures = 0;
+	uint32_t i;
+
+	medium_fill(2);
+	memcpy(expected, medium, sizeof(medium));
+	CHECK(setup(false));
+
+	for (i = 0; i < 400; i++) {
+		const uint32_t count = 1 + random_next(&random) % 32;
+		const uint32_t sector = random_next(&random) % (MEDIUM_SECTORS - count + 1);
+		uint8_t *data = &expected[sector * USBH_MSC_SECTOR_SIZE];
+
+		if (random_next(&random) & 1) {
+			uint32_t j;
+
+			for (j = 0; j < count * USBH_MSC_SECTOR_SIZE; j++) {
+				buffer[j] = random_next(&random);
+			}
+			memcpy(data, buffer, count * USBH_MSC_SECTOR_SIZE);
+			failures += !write(sector, count, buffer);
+		} else {
+			failures += !read(sector, count, buffer);
+			mismatches += memcmp(buffer, data, count * USBH_MSC_SECTOR_SIZE) != 0;
+		}
+	}
+	CHECK(flush());
+	CHECK_EQ(failures, 0);
+	CHECK_EQ(mismatches, 0);
+	CHECK(!memcmp(expected, medium, sizeof(medium)));
+	CHECK_EQ(bot.out_of_range, 0);
+	teardown();
+}
+
+static void test_removal(void)
+{
+	static uint8_t buffer[64 * USBH_MSC_SECTOR_SIZE];
+
+	CHECK(setup(false));
+	callbacks = 0;
+	done = false;
+	CHECK(usbh_msc_read(0, 0, 64, buffer, request_callback));
+	usbh_sim_run(5000);
+	CHECK(!done);
+
+	// pending request is finished, unsuccessfully
+	usbh_sim_disconnect(&bot.sim);
+	usbh_sim_run(10000);
+	CHECK(done);
+	CHECK(!success);
+	CHECK_EQ(callbacks, 1);
+	CHECK(!connected);
+	CHECK(!usbh_msc_read(0, 0, 1, buffer, request_callback));
+}
+
+/*
+ * Benchmark: requests are chained from the callback, as fast as the driver
+ * and the simulated bus allow
+ */
+struct bench_state {
+	bool write;
+	bool random;
+	uint32_t count;
+	uint32_t requests;
+	uint32_t random_state;
+	uint32_t next;
+	bool failed;
+};
+
+static struct bench_state bench;
+static uint8_t bench_buffer[8 * USBH_MSC_SECTOR_SIZE];
+
+static void bench_callback(uint8_t device_id, bool result);
+
+static void bench_issue(void)
+{
+	uint32_t sector;
+	bool started;
+
+	if (bench.random) {
+		sector = random_next(&bench.random_state) % (MEDIUM_SECTORS - bench.count + 1);
+	} else {
+		if (bench.next + bench.count > MEDIUM_SECTORS) {
+			bench.next = 0;
+		}
+		sector = bench.next;
+		bench.next += bench.count;
+	}
+
+	if (bench.write) {
+		started = usbh_msc_write(0, sector, bench.count, bench_buffer, bench_callback);
+	} else {
+		started = usbh_msc_read(0, sector, bench.count, bench_buffer, bench_callback);
+	}
+	bench.failed |= !started;
+}
+
+static void bench_callback(uint8_t device_id, bool result)
+{
+	(void)device_id;
+	bench.failed |= !result;
+	if (--bench.requests) {
+		bench_issue();
+	} else {
+		done = true;
+	}
+}
+
+static void bench_case(const char *name, bool write_requests, bool random_requests, uint32_t bytes)
+{
+	const uint32_t total = 512 * 1024;
+	const uint64_t transactions = usbh_sim_stats()->transactions;
+
+	bench.write = write_requests;
+	bench.random = random_requests;
+	bench.count = bytes / USBH_MSC_SECTOR_SIZE;
+	bench.requests = total / bytes;
+	bench.random_state = 17;
+	bench.next = 0;
+	bench.failed = false;
+
+	done = false;
+	const uint32_t start = usbh_sim_time_us();
+	bench_issue();
+	usbh_sim_run_until(&done, 60000000);
+	if (write_requests) {
+		CHECK(flush());
+	}
+	const uint32_t elapsed = usbh_sim_time_us() - start;
+
+	CHECK(done);
+	CHECK(!bench.failed);
+	printf("  %-28s %6.2f MB/s, %6.1f transactions/request\n", name,
+		(double)total / elapsed, (double)(usbh_sim_stats()->transactions - transactions) / (total / bytes));
+}
+
+static void bench_msc(void)
+{
+	uint32_t s;
+
+	for (s = 0; s < 2; s++) {
+		const bool high_speed = s;
+
+		medium_fill(5);
+		CHECK(setup(high_speed));
+		printf("mass storage, %s speed, simulated time, usbh_poll() every %d us\n",
+			high_speed ? "high" : "full", USBH_SIM_STEP_US);
+		bench_case("sequential read 512 B", false, false, 512);
+		bench_case("sequential read 4 KB", false, false, 4096);
+		bench_case("random read 512 B", false, true, 512);
+		bench_case("random read 4 KB", false, true, 4096);
+		bench_case("sequential write 512 B", true, false, 512);
+		bench_case("sequential write 4 KB", true, false, 4096);
+		bench_case("random write 512 B", true, true, 512);
+		bench_case("random write 4 KB", true, true, 4096);
+		CHECK_EQ(bot.out_of_range, 0);
+		teardown();
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_bench_requested(argc, argv)) {
+		bench_msc();
+	} else {
+		test_enumeration();
+		test_last_sectors();
+		test_random_access();
+		test_removal();
+	}
+	return test_exit("msc");
+}
@@ -0,0 +1,645 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * CDC-NCM driver against a simulated NCM device: configuration and MAC
+ * address, frames sent and received through NTBs, the receive endpoint
+ * not re-armed after it stalls, and packets per second with and without
+ * aggregation of frames into NTBs.
+ */
+
+#include "test.h"
+#include "usbh_sim.h"
+#include "usbh_driver_cdc_ncm.h"
+
+#include <string.h>
+
+#define NCM_REQ_GET_NTB_PARAMETERS	(0x80)
+#define NCM_REQ_SET_NTB_INPUT_SIZE	(0x86)
+
+#define NTH16_SIGNATURE		(0x484d434e)
+#define NDP16_SIGNATURE		(0x304d434e)
+#define NTH16_LENGTH		(12)
+#define NDP16_HEADER_LENGTH	(8)
+
+// NTBs of the device
+#define DEVICE_NTB_MAX		(8192)
+#define FRAME_MAX		(1514)
+
+/*
+ * NCM device: checks NTBs sent by the host and generates NTBs of frames
+ */
+struct ncm_device {
+	usbh_sim_device_t sim;
+	uint8_t device_descriptor[USB_DT_DEVICE_SIZE];
+	uint8_t config_descriptor[86];
+	uint16_t maxpacketsize;
+
+	uint8_t alternate;
+	uint32_t ntb_in_max;
+
+	// host to device
+	uint8_t out[DEVICE_NTB_MAX];
+	uint32_t out_length;
+	uint32_t out_ntbs;
+	uint32_t out_frames;
+	uint32_t out_bad;
+	uint32_t out_sequence;
+
+	// device to host, frames of rx_length, rx_per_ntb of them in every NTB
+	uint8_t in[DEVICE_NTB_MAX];
+	uint32_t in_length;
+	uint32_t in_index;
+	bool in_zlp;
+	uint16_t rx_length;
+	uint8_t rx_per_ntb;
+	uint32_t rx_limit;
+	uint32_t in_frames;
+	uint32_t in_sequence;
+
+	bool in_stall;
+	uint32_t in_calls;
+};
+
+static inline void store_le16(uint8_t *buf, uint16_t value)
+{
+	buf[0] = value;
+	buf[1] = value >> 8;
+}
+
+static inline void store_le32(uint8_t *buf, uint32_t value)
+{
+	buf[0] = value;
+	buf[1] = value >> 8;
+	buf[2] = value >> 16;
+	buf[3] = value >> 24;
+}
+
+static inline uint16_t load_le16(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8);
+}
+
+static inline uint32_t load_le32(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/*
+ * Frame content follows from its sequence number and length
+ */
+static void frame_fill(uint8_t *frame, uint16_t length, uint32_t sequence)
+{
+	uint16_t i;
+
+	store_le32(frame, sequence);
+	for (i = 4; i < length; i++) {
+		frame[i] = sequence + i;
+	}
+}
+
+static bool frame_check(const uint8_t *frame, uint16_t length, uint32_t sequence)
+{
+	uint16_t i;
+
+	if (length < 4 || load_le32(frame) != sequence) {
+		return false;
+	}
+	for (i = 4; i < length; i++) {
+		if (frame[i] != (uint8_t)(sequence + i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void ncm_out_parse(struct ncm_device *ncm)
+{
+	const uint8_t *data = ncm->out;
+	const uint32_t length = ncm->out_length;
+
+	ncm->out_ntbs++;
+	if (length < NTH16_LENGTH || load_le32(data) != NTH16_SIGNATURE || load_le16(&data[8]) != length) {
+		ncm->out_bad++;
+		return;
+	}
+
+	const uint16_t ndp = load_le16(&data[10]);
+	if (ndp % 4 || (uint32_t)ndp + NDP16_HEADER_LENGTH > length || load_le32(&data[ndp]) != NDP16_SIGNATURE) {
+		ncm->out_bad++;
+		return;
+	}
+
+	uint32_t entry = ndp + NDP16_HEADER_LENGTH;
+	const uint32_t end = ndp + load_le16(&data[ndp + 4]);
+	while (entry + 4 <= end && end <= length) {
+		const uint16_t index = load_le16(&data[entry]);
+		const uint16_t datagram_length = load_le16(&data[entry + 2]);
+
+		entry += 4;
+		if (!index) {
+			return;
+		}
+		if (index % 4 || index + datagram_length > length ||
+			!frame_check(&data[index], datagram_length, ncm->out_sequence)) {
+			ncm->out_bad++;
+		}
+		ncm->out_sequence++;
+		ncm->out_frames++;
+	}
+	// table has to end with zero entry
+	ncm->out_bad++;
+}
+
+/*
+ * Next NTB of the device, frames behind NTH, NDP at the end
+ */
+static void ncm_in_build(struct ncm_device *ncm)
+{
+	uint8_t *data = ncm->in;
+	uint32_t offset = NTH16_LENGTH;
+	uint16_t index[32];
+	uint8_t count = 0;
+	uint8_t i;
+
+	while (count < ncm->rx_per_ntb && count < 32 && ncm->in_frames + count < ncm->rx_limit) {
+		const uint32_t start = (offset + 3) & ~3u;
+		const uint32_t ndp = (start + ncm->rx_length + 3) & ~3u;
+
+		if (ndp + NDP16_HEADER_LENGTH + 4 * (count + 2) > ncm->ntb_in_max) {
+			break;
+		}
+		frame_fill(&data[start], ncm->rx_length, ncm->in_sequence + count);
+		index[count++] = start;
+		offset = start + ncm->rx_length;
+	}
+
+	ncm->in_length = 0;
+	if (!count) {
+		return;
+	}
+
+	const uint32_t ndp = (offset + 3) & ~3u;
+	const uint16_t ndp_length = NDP16_HEADER_LENGTH + 4 * (count + 1);
+
+	store_le32(&data[0], NTH16_SIGNATURE);
+	store_le16(&data[4], NTH16_LENGTH);
+	store_le16(&data[6], ncm->in_sequence);
+	store_le16(&data[10], ndp);
+	store_le32(&data[ndp], NDP16_SIGNATURE);
+	store_le16(&data[ndp + 4], ndp_length);
+	store_le16(&data[ndp + 6], 0);
+	for (i = 0; i < count; i++) {
+		store_le16(&data[ndp + 8 + 4 * i], index[i]);
+		store_le16(&data[ndp + 10 + 4 * i], ncm->rx_length);
+	}
+	store_le32(&data[ndp + 8 + 4 * count], 0);
+
+	ncm->in_length = ndp + ndp_length;
+	store_le16(&data[8], ncm->in_length);
+	ncm->in_index = 0;
+	ncm->in_zlp = !(ncm->in_length % ncm->maxpacketsize) && ncm->in_length < ncm->ntb_in_max;
+	ncm->in_sequence += count;
+	ncm->in_frames += count;
+}
+
+static int ncm_in(usbh_sim_device_t *sim, uint8_t endpoint, uint8_t *data, uint16_t length)
+{
+	struct ncm_device *ncm = sim->priv;
+	(void)endpoint;
+
+	ncm->in_calls++;
+	if (ncm->in_stall) {
+		return USBH_SIM_STALL;
+	}
+	if (ncm->in_index == ncm->in_length && !ncm->in_zlp) {
+		ncm_in_build(ncm);
+		if (!ncm->in_length) {
+			return USBH_SIM_NAK;
+		}
+	}
+
+	if (ncm->in_index == ncm->in_length) {
+		ncm->in_zlp = false;
+		return 0;
+	}
+	if (length > ncm->in_length - ncm->in_index) {
+		length = ncm->in_length - ncm->in_index;
+	}
+	memcpy(data, &ncm->in[ncm->in_index], length);
+	ncm->in_index += length;
+	return length;
+}
+
+static int ncm_out(usbh_sim_device_t *sim, uint8_t endpoint, const uint8_t *data, uint16_t length)
+{
+	struct ncm_device *ncm = sim->priv;
+	(void)endpoint;
+
+	if (ncm->out_length + length > sizeof(ncm->out)) {
+		ncm->out_bad++;
+		ncm->out_length = 0;
+		return USBH_SIM_STALL;
+	}
+	memcpy(&ncm->out[ncm->out_length], data, length);
+	ncm->out_length += length;
+
+	// short packet or dwNtbOutMaxSize ends the NTB
+	if (length < ncm->maxpacketsize || ncm->out_length == DEVICE_NTB_MAX) {
+		if (ncm->out_length) {
+			ncm_out_parse(ncm);
+		}
+		ncm->out_length = 0;
+	}
+	return 0;
+}
+
+static int ncm_control(usbh_sim_device_t *sim, const struct usb_setup_data *setup, uint8_t *data)
+{
+	struct ncm_device *ncm = sim->priv;
+	static const char mac[] = "020000000001";
+	uint8_t i;
+
+	switch (setup->bmRequestType) {
+	case 0xa1:
+		if (setup->bRequest != NCM_REQ_GET_NTB_PARAMETERS) {
+			return USBH_SIM_STALL;
+		}
+		memset(data, 0, 28);
+		store_le16(&data[0], 28);
+		store_le16(&data[2], 1);
+		store_le32(&data[4], DEVICE_NTB_MAX);
+		store_le16(&data[8], 4);
+		store_le16(&data[12], 4);
+		store_le32(&data[16], DEVICE_NTB_MAX);
+		store_le16(&data[20], 4);
+		store_le16(&data[24], 4);
+		return 28;
+
+	case 0x21:
+		if (setup->bRequest != NCM_REQ_SET_NTB_INPUT_SIZE || setup->wLength != 4) {
+			return USBH_SIM_STALL;
+		}
+		ncm->ntb_in_max = load_le32(data);
+		return 0;
+
+	case 0x80:
+		if (setup->bRequest != USB_REQ_GET_DESCRIPTOR || (setup->wValue >> 8) != USB_DT_STRING) {
+			return USBH_SIM_UNHANDLED;
+		}
+		data[0] = 2 + 2 * 12;
+		data[1] = USB_DT_STRING;
+		for (i = 0; i < 12; i++) {
+			data[2 + 2 * i] = mac[i];
+			data[3 + 2 * i] = 0;
+		}
+		return data[0];
+
+	case 0x01:
+		if (setup->bRequest == USB_REQ_SET_INTERFACE && setup->wIndex == 1) {
+			ncm->alternate = setup->wValue;
+			return 0;
+		}
+		return USBH_SIM_UNHANDLED;
+
+	default:
+		return USBH_SIM_UNHANDLED;
+	}
+}
+
+static void ncm_init(struct ncm_device *ncm, enum USBH_SPEED speed)
+{
+	const uint16_t mps = speed == USBH_SPEED_HIGH ? 512 : 64;
+	const uint8_t device_descriptor[USB_DT_DEVICE_SIZE] = {
+		USB_DT_DEVICE_SIZE, USB_DT_DEVICE, 0x00, 0x02, 0x02, 0, 0, 64,
+		0x83, 0x04, 0x60, 0x57, 0x00, 0x01, 0, 0, 0, 1
+	};
+	const uint8_t config_descriptor[86] = {
+		9, USB_DT_CONFIGURATION, 86, 0, 2, 1, 0, 0x80, 50,
+		// communication interface: header, union, ethernet networking (MAC in string 1), NCM
+		9, USB_DT_INTERFACE, 0, 0, 1, 0x02, 0x0d, 0x00, 0,
+		5, 0x24, 0x00, 0x10, 0x01,
+		5, 0x24, 0x06, 0x00, 0x01,
+		13, 0x24, 0x0f, 1, 0, 0, 0, 0, 0xea, 0x05, 0, 0, 0,
+		6, 0x24, 0x1a, 0x00, 0x01, 0x00,
+		7, USB_DT_ENDPOINT, 0x83, USB_ENDPOINT_ATTR_INTERRUPT, 16, 0, 32,
+		// data interface, endpoints in alternate setting 1
+		9, USB_DT_INTERFACE, 1, 0, 0, 0x0a, 0, 0x01, 0,
+		9, USB_DT_INTERFACE, 1, 1, 2, 0x0a, 0, 0x01, 0,
+		7, USB_DT_ENDPOINT, 0x81, USB_ENDPOINT_ATTR_BULK, mps & 0xff, mps >> 8, 0,
+		7, USB_DT_ENDPOINT, 0x02, USB_ENDPOINT_ATTR_BULK, mps & 0xff, mps >> 8, 0
+	};
+
+	memset(ncm, 0, sizeof(*ncm));
+	memcpy(ncm->device_descriptor, device_descriptor, sizeof(device_descriptor));
+	memcpy(ncm->config_descriptor, config_descriptor, sizeof(config_descriptor));
+	ncm->maxpacketsize = mps;
+	ncm->ntb_in_max = DEVICE_NTB_MAX;
+	ncm->rx_length = 64;
+	ncm->rx_per_ntb = 32;
+	ncm->sim.speed = speed;
+	ncm->sim.device_descriptor = ncm->device_descriptor;
+	ncm->sim.config_descriptor = ncm->config_descriptor;
+	ncm->sim.control = ncm_control;
+	ncm->sim.in = ncm_in;
+	ncm->sim.out = ncm_out;
+	ncm->sim.priv = ncm;
+}
+
+/*
+ * Host side
+ */
+static volatile bool connected;
+static uint8_t connected_mac[6];
+static uint32_t disconnects;
+
+static uint32_t rx_frames;
+static uint32_t rx_bad;
+static uint32_t rx_sequence;
+// frames kept by the application, released later
+static const uint8_t *rx_held[16];
+static uint8_t rx_held_count;
+static bool rx_hold;
+
+static void notify_connected(uint8_t device_id, const uint8_t *mac)
+{
+	(void)device_id;
+	memcpy(connected_mac, mac, sizeof(connected_mac));
+	connected = true;
+}
+
+static void notify_disconnected(uint8_t device_id)
+{
+	(void)device_id;
+	connected = false;
+	disconnects++;
+}
+
+static void rx_frame(uint8_t device_id, const uint8_t *frame, uint16_t length)
+{
+	if (!frame_check(frame, length, rx_sequence)) {
+		rx_bad++;
+	}
+	rx_sequence++;
+	rx_frames++;
+
+	if (rx_hold && rx_held_count < sizeof(rx_held) / sizeof(rx_held[0])) {
+		rx_held[rx_held_count++] = frame;
+	} else {
+		usbh_cdc_ncm_rx_release(device_id, frame);
+	}
+}
+
+static void rx_held_release(void)
+{
+	while (rx_held_count) {
+		usbh_cdc_ncm_rx_release(0, rx_held[--rx_held_count]);
+	}
+}
+
+static const cdc_ncm_config_t ncm_config = {
+	.notify_connected = notify_connected,
+	.notify_disconnected = notify_disconnected,
+	.rx_frame = rx_frame
+};
+
+static const usbh_dev_driver_t *device_drivers[] = {
+	&usbh_cdc_ncm_driver,
+	0
+};
+
+// kept by usbh_init()
+static const void *lld_drivers[] = {
+	0,
+	0
+};
+
+static struct ncm_device ncm;
+
+static bool setup(bool high_speed, uint32_t rx_limit)
+{
+	lld_drivers[0] = usbh_sim_lld;
+	usbh_sim_reset(high_speed, 8);
+	usbh_init(lld_drivers, device_drivers);
+	cdc_ncm_driver_init(&ncm_config);
+	connected = false;
+	disconnects = 0;
+	rx_frames = 0;
+	rx_bad = 0;
+	rx_sequence = 0;
+	rx_held_count = 0;
+	rx_hold = false;
+
+	ncm_init(&ncm, high_speed ? USBH_SPEED_HIGH : USBH_SPEED_FULL);
+	ncm.rx_limit = rx_limit;
+	usbh_sim_connect(0, 0, &ncm.sim);
+	return usbh_sim_run_until(&connected, 2000000);
+}
+
+static void teardown(void)
+{
+	usbh_sim_disconnect(&ncm.sim);
+	usbh_sim_run(10000);
+}
+
+static void test_configuration(void)
+{
+	const uint8_t mac[6] = { 0x02, 0, 0, 0, 0, 0x01 };
+
+	CHECK(setup(false, 0));
+	CHECK(!memcmp(connected_mac, mac, sizeof(mac)));
+	CHECK_EQ(ncm.alternate, 1);
+	CHECK_EQ(ncm.ntb_in_max, USBH_CDC_NCM_NTB_SIZE);
+	teardown();
+	CHECK(!connected);
+	CHECK_EQ(disconnects, 1);
+}
+
+static uint32_t random_next(uint32_t *state)
+{
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+/*
+ * Frames of random lengths, several per poll, arrive in order
+ */
+static void test_tx(bool high_speed)
+{
+	const uint32_t frames = 2000;
+	uint32_t random = 21;
+	uint32_t sent = 0;
+	uint32_t i;
+
+	CHECK(setup(high_speed, 0));
+	for (i = 0; i < 100000 && ncm.out_frames < frames; i++) {
+		uint32_t burst = random_next(&random) % 6;
+
+		while (burst-- && sent < frames) {
+			const uint16_t length = 60 + random_next(&random) % (FRAME_MAX - 60 + 1);
+			uint8_t *frame = usbh_cdc_ncm_tx_frame(0, length);
+			if (!frame) {
+				break;
+			}
+			frame_fill(frame, length, sent++);
+		}
+		usbh_sim_step();
+	}
+	usbh_sim_run(10000);
+	CHECK_EQ(sent, frames);
+	CHECK_EQ(ncm.out_frames, frames);
+	CHECK_EQ(ncm.out_bad, 0);
+	// frames reserved in the same poll share NTB
+	CHECK(ncm.out_ntbs < frames);
+	teardown();
+}
+
+/*
+ * Frames held by the application keep their NTB, the others are reused
+ */
+static void test_rx(bool high_speed)
+{
+	const uint32_t frames = 3000;
+	uint32_t i;
+
+	CHECK(setup(high_speed, frames));
+	ncm.rx_length = 200;
+	ncm.rx_per_ntb = 7;
+	for (i = 0; i < 100000 && rx_frames < frames; i++) {
+		rx_hold = (i % 64) < 8;
+		if (!rx_hold) {
+			rx_held_release();
+		}
+		usbh_sim_step();
+	}
+	rx_held_release();
+	CHECK_EQ(rx_frames, frames);
+	CHECK_EQ(rx_bad, 0);
+	CHECK(connected);
+	teardown();
+}
+
+/*
+ * Stalled receive endpoint is not read again, device is reported gone
+ */
+static void test_rx_stall(void)
+{
+	CHECK(setup(false, 0));
+	usbh_sim_run(10000);
+	// receive read is pending and NAKed
+	CHECK(ncm.in_calls > 0);
+
+	ncm.in_stall = true;
+	usbh_sim_run(10000);
+	const uint32_t calls = ncm.in_calls;
+	CHECK(!connected);
+	CHECK_EQ(disconnects, 1);
+
+	usbh_sim_run(200000);
+	CHECK_EQ(ncm.in_calls, calls);
+	CHECK(usbh_cdc_ncm_tx_frame(0, 64) == 0);
+
+	// removal does not report the device again
+	teardown();
+	CHECK_EQ(disconnects, 1);
+}
+
+/*
+ * Benchmark
+ */
+static void bench_tx(bool high_speed, uint16_t length, uint32_t per_poll)
+{
+	const uint32_t duration_us = 500000;
+	uint32_t sequence = 0;
+
+	CHECK(setup(high_speed, 0));
+	const uint32_t start = usbh_sim_time_us();
+	const uint32_t ntbs = ncm.out_ntbs;
+	while (usbh_sim_time_us() - start < duration_us) {
+		uint32_t n;
+
+		for (n = 0; n < per_poll; n++) {
+			uint8_t *frame = usbh_cdc_ncm_tx_frame(0, length);
+			if (!frame) {
+				break;
+			}
+			frame_fill(frame, length, sequence++);
+		}
+		usbh_sim_step();
+	}
+	CHECK_EQ(ncm.out_bad, 0);
+	const double frames = ncm.out_frames;
+	printf("  transmit %4d B, %2d frames/poll: %8.0f frames/s, %5.2f frames/NTB\n",
+		length, per_poll, frames * 1e6 / duration_us, frames / (ncm.out_ntbs - ntbs));
+	teardown();
+}
+
+static void bench_rx(bool high_speed, uint16_t length, uint8_t per_ntb)
+{
+	const uint32_t duration_us = 500000;
+
+	CHECK(setup(high_speed, 0));
+	ncm.rx_length = length;
+	ncm.rx_per_ntb = per_ntb;
+	ncm.rx_limit = UINT32_MAX;
+	const uint32_t frames_start = rx_frames;
+	usbh_sim_run(duration_us);
+	CHECK_EQ(rx_bad, 0);
+	printf("  receive  %4d B, %2d frames/NTB:  %8.0f frames/s\n",
+		length, per_ntb, (rx_frames - frames_start) * 1e6 / duration_us);
+	teardown();
+}
+
+static void bench_ncm(void)
+{
+	static const uint16_t lengths[] = { 64, 512, 1514 };
+	uint32_t s, i;
+
+	for (s = 0; s < 2; s++) {
+		printf("CDC-NCM, %s speed, simulated time, usbh_poll() every %d us\n",
+			s ? "high" : "full", USBH_SIM_STEP_US);
+		for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+			bench_tx(s, lengths[i], 1);
+			bench_tx(s, lengths[i], 4);
+			bench_tx(s, lengths[i], 32);
+		}
+		for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+			bench_rx(s, lengths[i], 1);
+			bench_rx(s, lengths[i], 32);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_bench_requested(argc, argv)) {
+		bench_ncm();
+	} else {
+		test_configuration();
+		test_tx(false);
+		test_tx(true);
+		test_rx(false);
+		test_rx(true);
+		test_rx_stall();
+	}
+	return test_exit("ncm");
+}
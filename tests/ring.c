@@ -0,0 +1,283 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * SPSC byte ring (usbh_ring.h) used by the DMA log sink, the trace
+ * and the serial driver: wrap-around of the buffer and of the free
+ * running indices, peek/consume as done by the DMA consumer, and
+ * a producer/consumer pair in two threads.
+ */
+
+#include "test.h"
+#include "usbh_ring.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+static void test_wrap(void)
+{
+	uint8_t data[16];
+	uint8_t in[32];
+	uint8_t out[32];
+	usbh_ring_t ring;
+	uint8_t next_in = 0;
+	uint8_t next_out = 0;
+	uint32_t i;
+
+	usbh_ring_init(&ring, data, sizeof(data));
+	CHECK_EQ(usbh_ring_used(&ring), 0);
+	CHECK_EQ(usbh_ring_free(&ring), 16);
+
+	// lengths not dividing the size move the wrap point through the whole buffer
+	for (i = 0; i < 1000; i++) {
+		const uint32_t length = 1 + i % 17;
+		const uint32_t used = usbh_ring_used(&ring);
+		uint32_t j;
+
+		for (j = 0; j < length; j++) {
+			in[j] = next_in + j;
+		}
+		const uint32_t written = usbh_ring_write(&ring, in, length);
+		CHECK_EQ(written, length < 16 - used ? length : 16 - used);
+		next_in += written;
+		CHECK_EQ(usbh_ring_used(&ring), used + written);
+
+		const uint32_t read = usbh_ring_read(&ring, out, 1 + i % 13);
+		for (j = 0; j < read; j++) {
+			CHECK_EQ(out[j], (uint8_t)(next_out + j));
+		}
+		next_out += read;
+	}
+
+	// drain
+	const uint32_t rest = usbh_ring_read(&ring, out, sizeof(out));
+	for (i = 0; i < rest; i++) {
+		CHECK_EQ(out[i], (uint8_t)(next_out + i));
+	}
+	next_out += rest;
+	CHECK_EQ(next_in, next_out);
+	CHECK_EQ(usbh_ring_used(&ring), 0);
+}
+
+static void test_index_overflow(void)
+{
+	uint8_t data[8];
+	uint8_t out[8];
+	usbh_ring_t ring;
+	const uint8_t in[6] = { 1, 2, 3, 4, 5, 6 };
+
+	// indices are free running, check the uint32_t wrap
+	usbh_ring_init(&ring, data, sizeof(data));
+	ring.head = 0xfffffffd;
+	ring.tail = 0xfffffffd;
+
+	CHECK_EQ(usbh_ring_write(&ring, in, sizeof(in)), 6);
+	CHECK_EQ(ring.head, 3);
+	CHECK_EQ(usbh_ring_used(&ring), 6);
+	CHECK_EQ(usbh_ring_free(&ring), 2);
+	CHECK_EQ(usbh_ring_write(&ring, in, sizeof(in)), 2);
+	CHECK_EQ(usbh_ring_free(&ring), 0);
+
+	CHECK_EQ(usbh_ring_read(&ring, out, sizeof(out)), 8);
+	CHECK(!memcmp(out, in, 6));
+	CHECK_EQ(out[6], 1);
+	CHECK_EQ(out[7], 2);
+	CHECK_EQ(usbh_ring_used(&ring), 0);
+}
+
+static void test_peek(void)
+{
+	uint8_t data[8];
+	usbh_ring_t ring;
+	const uint8_t *p;
+	const uint8_t in[6] = { 1, 2, 3, 4, 5, 6 };
+
+	usbh_ring_init(&ring, data, sizeof(data));
+	CHECK_EQ(usbh_ring_peek(&ring, &p), 0);
+
+	// 5 bytes at index 5: 3 to the end of the buffer, 2 at the start
+	ring.head = 5;
+	ring.tail = 5;
+	usbh_ring_write(&ring, in, 5);
+	CHECK_EQ(usbh_ring_peek(&ring, &p), 3);
+	CHECK(p == &data[5]);
+	CHECK(!memcmp(p, in, 3));
+
+	// producer may continue while the consumer holds the peeked data
+	CHECK_EQ(usbh_ring_write(&ring, in, 6), 3);
+
+	usbh_ring_consume(&ring, 3);
+	CHECK_EQ(usbh_ring_peek(&ring, &p), 5);
+	CHECK(p == &data[0]);
+	CHECK(!memcmp(p, &in[3], 2));
+	CHECK(!memcmp(p + 2, in, 3));
+
+	usbh_ring_consume(&ring, 1);
+	CHECK_EQ(usbh_ring_used(&ring), 4);
+	usbh_ring_flush(&ring);
+	CHECK_EQ(usbh_ring_used(&ring), 0);
+	CHECK_EQ(usbh_ring_free(&ring), 8);
+}
+
+/*
+ * Producer writes a byte counter in chunks of varying length, consumer
+ * takes contiguous blocks by peek/consume (as the DMA sink does) and
+ * checks the sequence.
+ */
+struct spsc {
+	usbh_ring_t ring;
+	uint64_t total;
+	uint32_t chunk;
+	uint64_t errors;
+};
+
+static void *spsc_consumer(void *arg)
+{
+	struct spsc *s = arg;
+	uint64_t got = 0;
+	uint8_t expect = 0;
+
+	while (got < s->total) {
+		const uint8_t *p;
+		const uint32_t n = usbh_ring_peek(&s->ring, &p);
+		uint32_t i;
+
+		if (!n) {
+			sched_yield();
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			if (p[i] != expect) {
+				s->errors++;
+				expect = p[i];
+			}
+			expect++;
+		}
+		usbh_ring_consume(&s->ring, n);
+		got += n;
+	}
+	return 0;
+}
+
+static uint64_t spsc_run(uint32_t ring_size, uint32_t chunk, uint64_t total, uint64_t *errors)
+{
+	static uint8_t data[1 << 16];
+	uint8_t msg[256];
+	struct spsc s;
+	pthread_t consumer;
+	uint64_t sent = 0;
+	uint8_t value = 0;
+
+	usbh_ring_init(&s.ring, data, ring_size);
+	s.total = total;
+	s.chunk = chunk;
+	s.errors = 0;
+
+	const uint64_t start = test_wall_ns();
+	pthread_create(&consumer, 0, spsc_consumer, &s);
+	while (sent < total) {
+		// odd lengths, so the chunks do not line up with the end of the buffer
+		uint32_t length = chunk - (uint32_t)(sent % 3);
+		uint32_t i;
+
+		if (length > total - sent) {
+			length = total - sent;
+		}
+		for (i = 0; i < length; i++) {
+			msg[i] = value + i;
+		}
+		if (usbh_ring_free(&s.ring) < length) {
+			sched_yield();
+			continue;
+		}
+		usbh_ring_write(&s.ring, msg, length);
+		value += length;
+		sent += length;
+	}
+	pthread_join(consumer, 0);
+
+	*errors = s.errors;
+	return test_wall_ns() - start;
+}
+
+static void test_spsc(void)
+{
+	uint64_t errors;
+
+	spsc_run(64, 13, 1 << 20, &errors);
+	CHECK_EQ(errors, 0);
+	spsc_run(4096, 200, 8 << 20, &errors);
+	CHECK_EQ(errors, 0);
+}
+
+static void bench_spsc(void)
+{
+	static const uint32_t chunks[] = { 16, 48, 128, 256 };
+	const uint64_t total = 64 << 20;
+	uint32_t i;
+
+	printf("ring SPSC throughput, two threads, %u MB\n", (unsigned)(total >> 20));
+	for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+		uint64_t errors;
+		const uint64_t ns = spsc_run(4096, chunks[i], total, &errors);
+		printf("  ring 4096 B, writes of %3u B: %8.1f MB/s%s\n", chunks[i],
+			total * 1e3 / ns, errors ? " (DATA ERRORS)" : "");
+		CHECK_EQ(errors, 0);
+	}
+}
+
+static void bench_single(void)
+{
+	static uint8_t data[4096];
+	uint8_t msg[48];
+	usbh_ring_t ring;
+	const uint32_t rounds = 4 << 20;
+	uint32_t i;
+
+	// cost of one log record: write into the ring and hand out by peek/consume
+	memset(msg, 'x', sizeof(msg));
+	usbh_ring_init(&ring, data, sizeof(data));
+	const uint64_t start = test_wall_ns();
+	for (i = 0; i < rounds; i++) {
+		const uint8_t *p;
+
+		usbh_ring_write(&ring, msg, sizeof(msg));
+		usbh_ring_consume(&ring, usbh_ring_peek(&ring, &p));
+	}
+	const uint64_t ns = test_wall_ns() - start;
+	printf("ring write+peek+consume of %u B, one thread: %.1f ns per record, %.1f MB/s\n",
+		(unsigned)sizeof(msg), (double)ns / rounds, (double)rounds * sizeof(msg) * 1e3 / ns);
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_bench_requested(argc, argv)) {
+		bench_single();
+		bench_spsc();
+	} else {
+		test_wrap();
+		test_index_overflow();
+		test_peek();
+		test_spsc();
+	}
+	return test_exit("ring");
+}
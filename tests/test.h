@@ -0,0 +1,88 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Minimal host test support
+ *
+ * Each test program runs its checks when started without arguments
+ * and its benchmarks when started with -b. CHECK() failures are counted,
+ * test_exit() returns non zero exit code when any check failed.
+ */
+
+static int test_failures;
+static int test_checks;
+
+#define CHECK(cond) \
+	do { \
+		test_checks++; \
+		if (!(cond)) { \
+			test_failures++; \
+			printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+		} \
+	} while (0)
+
+#define CHECK_EQ(a, b) \
+	do { \
+		const long long check_a = (long long)(a); \
+		const long long check_b = (long long)(b); \
+		test_checks++; \
+		if (check_a != check_b) { \
+			test_failures++; \
+			printf("%s:%d: CHECK failed: %s == %s (%lld != %lld)\n", \
+				__FILE__, __LINE__, #a, #b, check_a, check_b); \
+		} \
+	} while (0)
+
+static inline int test_bench_requested(int argc, char *argv[])
+{
+	return argc > 1 && !strcmp(argv[1], "-b");
+}
+
+/**
+ * @brief test_wall_ns monotonic wall clock for CPU benchmarks
+ */
+static inline uint64_t test_wall_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int test_exit(const char *name)
+{
+	if (test_failures) {
+		printf("%s: %d of %d checks FAILED\n", name, test_failures, test_checks);
+		return 1;
+	}
+	printf("%s: %d checks passed\n", name, test_checks);
+	return 0;
+}
+
+#endif
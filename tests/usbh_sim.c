@@ -0,0 +1,1054 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "usbh_sim.h"
+
+#include <string.h>
+
+enum CONTROL_STAGE {
+	STAGE_IDLE,
+	STAGE_DATA_IN,
+	STAGE_DATA_OUT,
+	STAGE_STATUS_IN,
+	STAGE_STALLED
+};
+
+enum ROOT_STATE {
+	ROOT_EMPTY,
+	// connected, reported after debounce and port reset
+	ROOT_ATTACHING,
+	ROOT_ENABLED,
+	// disconnected, not reported yet
+	ROOT_DETACHED
+};
+
+// hub port status and feature selectors (USB 2.0, 11.24.2)
+#define PORT_CONNECTION		(1 << 0)
+#define PORT_ENABLE		(1 << 1)
+#define PORT_SUSPEND		(1 << 2)
+#define PORT_RESET		(1 << 4)
+#define PORT_POWER		(1 << 8)
+#define PORT_LOW_SPEED		(1 << 9)
+#define PORT_HIGH_SPEED		(1 << 10)
+
+#define FEATURE_PORT_ENABLE	(1)
+#define FEATURE_PORT_SUSPEND	(2)
+#define FEATURE_PORT_RESET	(4)
+#define FEATURE_PORT_POWER	(8)
+#define FEATURE_C_PORT_CONNECTION	(16)
+#define FEATURE_C_PORT_RESET	(20)
+
+// port reset (TDRST) and resume signaling (TDRSMDN) driven by the hub
+#define HUB_RESET_US		(10000)
+#define HUB_RESUME_US		(20000)
+
+#define CLASS_HUB		(0x09)
+
+#define CHANNELS_MAX		(16)
+
+// bus time left unused is not carried over more than one frame
+#define CREDIT_MAX_NS		(1000000)
+
+struct channel {
+	bool active;
+	bool in;
+	// NAKed or periodic transaction done in this (micro)frame, retried in the next poll
+	bool waiting;
+	uint32_t index;
+	uint32_t frame;
+	usbh_packet_t packet;
+	// first packet is taken at the time of the request, as the OTG core does
+	uint8_t first[1024];
+};
+
+struct completion {
+	usbh_packet_callback_t callback;
+	void *callback_arg;
+	usbh_packet_callback_data_t data;
+};
+
+static usbh_generic_data_t driver_data;
+
+static struct {
+	bool high_speed;
+	uint8_t channels_num;
+	struct channel channel[CHANNELS_MAX];
+	uint8_t round_robin;
+
+	uint32_t time_us;
+	uint32_t step_us;
+	uint32_t poll_last_us;
+	uint64_t credit_ns;
+	// transaction did not fit into the bus time of the poll
+	bool starved;
+
+	// connected devices, including devices behind unreachable hubs
+	usbh_sim_device_t *device[USBH_SIM_MAX_DEVICES];
+	usbh_sim_device_t *root;
+	enum ROOT_STATE root_state;
+	uint32_t root_timer_us;
+	bool root_suspended;
+	bool root_resuming;
+	uint32_t root_resume_end_us;
+
+	uint32_t reset_sequence;
+	usbh_sim_stats_t stats;
+
+	struct completion done[CHANNELS_MAX];
+	uint8_t done_num;
+} sim;
+
+/*
+ * Bus time of one transaction (USB 2.0, 5.11.3), bit stuffing is not counted
+ */
+static uint32_t transaction_ns(enum USBH_SPEED speed, uint32_t length)
+{
+	const uint32_t bits = 8 * length + 3;
+
+	switch (speed) {
+	case USBH_SPEED_HIGH:
+		return 917 + bits * 2083 / 1000;
+	case USBH_SPEED_LOW:
+		return 64060 + 2 * 333 + bits * 676670 / 1000;
+	case USBH_SPEED_FULL:
+	default:
+		return 9107 + bits * 83540 / 1000;
+	}
+}
+
+static enum USBH_SPEED bus_speed(const usbh_sim_device_t *dev)
+{
+	const usbh_sim_device_t *hub = dev->hub;
+
+	if (dev->speed != USBH_SPEED_HIGH) {
+		return dev->speed;
+	}
+	if (hub) {
+		return hub->speed == USBH_SPEED_HIGH && bus_speed(hub) == USBH_SPEED_HIGH ?
+			USBH_SPEED_HIGH : USBH_SPEED_FULL;
+	}
+	return sim.high_speed ? USBH_SPEED_HIGH : USBH_SPEED_FULL;
+}
+
+static void registry_add(usbh_sim_device_t *dev)
+{
+	uint32_t i;
+
+	for (i = 0; i < USBH_SIM_MAX_DEVICES; i++) {
+		if (!sim.device[i] || sim.device[i] == dev) {
+			sim.device[i] = dev;
+			return;
+		}
+	}
+}
+
+static void registry_remove(usbh_sim_device_t *dev)
+{
+	uint32_t i;
+
+	for (i = 0; i < USBH_SIM_MAX_DEVICES; i++) {
+		if (sim.device[i] == dev) {
+			sim.device[i] = 0;
+		}
+	}
+}
+
+/*
+ * Device lost power: no address, not configured, does not answer until reset,
+ * ports of the hub are powered off
+ */
+static void device_power_off(usbh_sim_device_t *dev)
+{
+	dev->address = 0;
+	dev->address_pending = -1;
+	dev->configuration = 0;
+	dev->control_stage = STAGE_IDLE;
+	dev->reset_sequence = 0;
+
+	if (dev->hub_model) {
+		usbh_sim_hub_t *hub = dev->hub_model;
+		uint8_t i;
+
+		for (i = 1; i <= hub->ports_num; i++) {
+			hub->port[i].status = 0;
+			hub->port[i].change = 0;
+			hub->port[i].timer = false;
+			if (hub->port[i].device) {
+				device_power_off(hub->port[i].device);
+			}
+		}
+	}
+}
+
+static void device_reset(usbh_sim_device_t *dev)
+{
+	device_power_off(dev);
+	dev->reset_sequence = ++sim.reset_sequence;
+	if (dev->reset) {
+		dev->reset(dev);
+	}
+}
+
+static bool reachable(const usbh_sim_device_t *dev)
+{
+	while (dev) {
+		if (!dev->connected) {
+			return false;
+		}
+		if (!dev->hub) {
+			return sim.root == dev && sim.root_state == ROOT_ENABLED && !sim.root_suspended;
+		}
+
+		const struct _usbh_sim_port *port = &dev->hub->hub_model->port[dev->port];
+		if (port->device != dev || (port->status & (PORT_ENABLE | PORT_SUSPEND | PORT_RESET)) != PORT_ENABLE) {
+			return false;
+		}
+		if (!dev->hub->configuration) {
+			return false;
+		}
+		dev = dev->hub;
+	}
+	return false;
+}
+
+/*
+ * Device answering the address, address 0 is answered by the device
+ * reset last
+ */
+static usbh_sim_device_t *route(uint8_t address)
+{
+	usbh_sim_device_t *found = 0;
+	uint32_t matches = 0;
+	uint32_t i;
+
+	for (i = 0; i < USBH_SIM_MAX_DEVICES; i++) {
+		usbh_sim_device_t *dev = sim.device[i];
+		if (!dev || dev->address != address || !dev->reset_sequence || !reachable(dev)) {
+			continue;
+		}
+		matches++;
+		if (!found || dev->reset_sequence > found->reset_sequence) {
+			found = dev;
+		}
+	}
+	if (matches > 1) {
+		sim.stats.address_conflicts++;
+	}
+	return found;
+}
+
+/*
+ * Control endpoint of the device model
+ */
+static int standard_request(usbh_sim_device_t *dev, const struct usb_setup_data *setup, uint8_t *data)
+{
+	if (setup->bmRequestType & USB_REQ_TYPE_TYPE) {
+		return USBH_SIM_STALL;
+	}
+
+	switch (setup->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		switch (setup->wValue >> 8) {
+		case USB_DT_DEVICE:
+			memcpy(data, dev->device_descriptor, USB_DT_DEVICE_SIZE);
+			return USB_DT_DEVICE_SIZE;
+
+		case USB_DT_CONFIGURATION:
+			{
+				const uint16_t total = dev->config_descriptor[2] | (dev->config_descriptor[3] << 8);
+				memcpy(data, dev->config_descriptor, total);
+				return total;
+			}
+
+		default:
+			return USBH_SIM_STALL;
+		}
+
+	case USB_REQ_GET_CONFIGURATION:
+		data[0] = dev->configuration;
+		return 1;
+
+	case USB_REQ_GET_STATUS:
+		data[0] = 0;
+		data[1] = 0;
+		return 2;
+
+	case USB_REQ_SET_CONFIGURATION:
+	case USB_REQ_SET_INTERFACE:
+	case USB_REQ_CLEAR_FEATURE:
+	case USB_REQ_SET_FEATURE:
+		return 0;
+
+	default:
+		return USBH_SIM_STALL;
+	}
+}
+
+static int request(usbh_sim_device_t *dev, uint8_t *data)
+{
+	const struct usb_setup_data *setup = &dev->setup;
+	const bool standard = !(setup->bmRequestType & USB_REQ_TYPE_TYPE);
+	int result;
+
+	if (standard && setup->bRequest == USB_REQ_SET_ADDRESS) {
+		// new address is used after the status stage
+		dev->address_pending = setup->wValue & 0x7f;
+		return 0;
+	}
+
+	result = dev->control ? dev->control(dev, setup, data) : USBH_SIM_UNHANDLED;
+	if (result == USBH_SIM_UNHANDLED) {
+		result = standard_request(dev, setup, data);
+	}
+	if (standard && setup->bRequest == USB_REQ_SET_CONFIGURATION && result != USBH_SIM_STALL) {
+		dev->configuration = setup->wValue;
+	}
+	return result;
+}
+
+static void ep0_setup(usbh_sim_device_t *dev, const uint8_t *data)
+{
+	memcpy(&dev->setup, data, sizeof(dev->setup));
+	dev->control_index = 0;
+	dev->control_length = 0;
+
+	if (dev->setup.bmRequestType & USB_REQ_TYPE_IN) {
+		const int result = request(dev, dev->control_data);
+		if (result < 0) {
+			dev->control_stage = STAGE_STALLED;
+			return;
+		}
+		dev->control_length = result < dev->setup.wLength ? result : dev->setup.wLength;
+		dev->control_stage = STAGE_DATA_IN;
+	} else if (dev->setup.wLength) {
+		dev->control_stage = STAGE_DATA_OUT;
+	} else {
+		dev->control_stage = STAGE_STATUS_IN;
+	}
+}
+
+static int ep0_in(usbh_sim_device_t *dev, uint8_t *data, uint16_t length)
+{
+	switch (dev->control_stage) {
+	case STAGE_DATA_IN:
+		{
+			uint16_t left = dev->control_length - dev->control_index;
+			if (length > left) {
+				length = left;
+			}
+			memcpy(data, &dev->control_data[dev->control_index], length);
+			dev->control_index += length;
+			return length;
+		}
+
+	case STAGE_DATA_OUT:
+	case STAGE_STATUS_IN:
+		// status stage of the request without data or with OUT data
+		if (request(dev, dev->control_data) < 0) {
+			dev->control_stage = STAGE_STALLED;
+			return USBH_SIM_STALL;
+		}
+		dev->control_stage = STAGE_IDLE;
+		if (dev->address_pending >= 0) {
+			dev->address = dev->address_pending;
+			dev->address_pending = -1;
+		}
+		return 0;
+
+	default:
+		return USBH_SIM_STALL;
+	}
+}
+
+static int ep0_out(usbh_sim_device_t *dev, const uint8_t *data, uint16_t length)
+{
+	switch (dev->control_stage) {
+	case STAGE_DATA_OUT:
+		if (dev->control_length + length > dev->setup.wLength) {
+			dev->control_stage = STAGE_STALLED;
+			return USBH_SIM_STALL;
+		}
+		memcpy(&dev->control_data[dev->control_length], data, length);
+		dev->control_length += length;
+		return 0;
+
+	case STAGE_DATA_IN:
+		// status stage of IN request
+		dev->control_stage = STAGE_IDLE;
+		return 0;
+
+	default:
+		return USBH_SIM_STALL;
+	}
+}
+
+/*
+ * Hub model
+ */
+static uint8_t hub_bitmap_size(const usbh_sim_hub_t *hub)
+{
+	return (hub->ports_num + 1 + 7) / 8;
+}
+
+static void hub_port_connect(usbh_sim_hub_t *hub, uint8_t port)
+{
+	struct _usbh_sim_port *p = &hub->port[port];
+	usbh_sim_device_t *dev = p->device;
+
+	if (!(p->status & PORT_POWER) || !dev) {
+		return;
+	}
+	p->status |= PORT_CONNECTION;
+	p->status &= ~(PORT_LOW_SPEED | PORT_HIGH_SPEED);
+	if (dev->speed == USBH_SPEED_LOW) {
+		p->status |= PORT_LOW_SPEED;
+	} else if (bus_speed(dev) == USBH_SPEED_HIGH) {
+		p->status |= PORT_HIGH_SPEED;
+	}
+	p->change |= PORT_CONNECTION;
+}
+
+static int hub_control(usbh_sim_device_t *sim_dev, const struct usb_setup_data *setup, uint8_t *data)
+{
+	usbh_sim_hub_t *hub = sim_dev->hub_model;
+	const uint8_t port = setup->wIndex;
+	struct _usbh_sim_port *p = &hub->port[port];
+	const bool port_request = (setup->bmRequestType & USB_REQ_TYPE_RECIPIENT) == USB_REQ_TYPE_OTHER;
+
+	if ((setup->bmRequestType & USB_REQ_TYPE_TYPE) != USB_REQ_TYPE_CLASS) {
+		return USBH_SIM_UNHANDLED;
+	}
+	if (port_request && (!port || port > hub->ports_num)) {
+		return USBH_SIM_STALL;
+	}
+
+	switch (setup->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		memcpy(data, hub->hub_descriptor, hub->hub_descriptor[0]);
+		return hub->hub_descriptor[0];
+
+	case USB_REQ_GET_STATUS:
+		if (port_request) {
+			data[0] = p->status;
+			data[1] = p->status >> 8;
+			data[2] = p->change;
+			data[3] = p->change >> 8;
+		} else {
+			memset(data, 0, 4);
+		}
+		return 4;
+
+	case USB_REQ_SET_FEATURE:
+		if (!port_request) {
+			return 0;
+		}
+		switch (setup->wValue) {
+		case FEATURE_PORT_POWER:
+			if (!(p->status & PORT_POWER)) {
+				p->status |= PORT_POWER;
+				hub_port_connect(hub, port);
+			}
+			break;
+
+		case FEATURE_PORT_RESET:
+			if (p->status & PORT_CONNECTION) {
+				p->status |= PORT_RESET;
+				p->status &= ~(PORT_ENABLE | PORT_SUSPEND);
+				p->timer = true;
+				p->timer_end_us = sim.time_us + HUB_RESET_US;
+			}
+			break;
+
+		case FEATURE_PORT_SUSPEND:
+			if (p->status & PORT_ENABLE) {
+				p->status |= PORT_SUSPEND;
+			}
+			break;
+
+		default:
+			break;
+		}
+		return 0;
+
+	case USB_REQ_CLEAR_FEATURE:
+		if (!port_request) {
+			return 0;
+		}
+		switch (setup->wValue) {
+		case FEATURE_PORT_ENABLE:
+			p->status &= ~PORT_ENABLE;
+			break;
+
+		case FEATURE_PORT_SUSPEND:
+			if ((p->status & PORT_SUSPEND) && !p->timer) {
+				p->timer = true;
+				p->timer_end_us = sim.time_us + HUB_RESUME_US;
+			}
+			break;
+
+		case FEATURE_PORT_POWER:
+			p->status = 0;
+			p->timer = false;
+			if (p->device) {
+				device_power_off(p->device);
+			}
+			break;
+
+		default:
+			if (setup->wValue >= FEATURE_C_PORT_CONNECTION && setup->wValue <= FEATURE_C_PORT_RESET) {
+				p->change &= ~(1 << (setup->wValue - FEATURE_C_PORT_CONNECTION));
+			}
+			break;
+		}
+		return 0;
+
+	default:
+		return USBH_SIM_STALL;
+	}
+}
+
+static int hub_in(usbh_sim_device_t *sim_dev, uint8_t endpoint, uint8_t *data, uint16_t length)
+{
+	usbh_sim_hub_t *hub = sim_dev->hub_model;
+	uint8_t bitmap[(USBH_SIM_HUB_PORTS + 1 + 7) / 8] = {0};
+	bool changed = false;
+	uint8_t i;
+
+	if (endpoint != 1) {
+		return USBH_SIM_STALL;
+	}
+	for (i = 1; i <= hub->ports_num; i++) {
+		if (hub->port[i].change) {
+			bitmap[i / 8] |= 1 << (i % 8);
+			changed = true;
+		}
+	}
+	if (!changed) {
+		return USBH_SIM_NAK;
+	}
+	if (length > hub_bitmap_size(hub)) {
+		length = hub_bitmap_size(hub);
+	}
+	memcpy(data, bitmap, length);
+	return length;
+}
+
+static void hub_timers(usbh_sim_hub_t *hub)
+{
+	uint8_t i;
+
+	for (i = 1; i <= hub->ports_num; i++) {
+		struct _usbh_sim_port *p = &hub->port[i];
+		if (!p->timer || (int32_t)(sim.time_us - p->timer_end_us) < 0) {
+			continue;
+		}
+		p->timer = false;
+		if (p->status & PORT_RESET) {
+			p->status &= ~PORT_RESET;
+			if (p->device) {
+				p->status |= PORT_ENABLE;
+				device_reset(p->device);
+			}
+			p->change |= PORT_RESET;
+		} else if (p->status & PORT_SUSPEND) {
+			p->status &= ~PORT_SUSPEND;
+			p->change |= PORT_SUSPEND;
+		}
+	}
+}
+
+void usbh_sim_hub_init(usbh_sim_hub_t *hub, enum USBH_SPEED speed, uint8_t ports)
+{
+	const uint8_t bitmap_size = (ports + 1 + 7) / 8;
+	const uint8_t device_descriptor[USB_DT_DEVICE_SIZE] = {
+		USB_DT_DEVICE_SIZE, USB_DT_DEVICE, 0x00, 0x02,
+		CLASS_HUB, 0, speed == USBH_SPEED_HIGH ? 1 : 0, 64,
+		0x34, 0x12, 0x01, 0x00, 0x00, 0x01, 0, 0, 0, 1
+	};
+	const uint8_t config_descriptor[25] = {
+		9, USB_DT_CONFIGURATION, 25, 0, 1, 1, 0, 0xe0, 0,
+		9, USB_DT_INTERFACE, 0, 0, 1, CLASS_HUB, 0, 0, 0,
+		// status change endpoint, 16 ms
+		7, USB_DT_ENDPOINT, 0x81, USB_ENDPOINT_ATTR_INTERRUPT, bitmap_size, 0,
+		speed == USBH_SPEED_HIGH ? 8 : 16
+	};
+
+	memset(hub, 0, sizeof(*hub));
+	if (ports > USBH_SIM_HUB_PORTS) {
+		ports = USBH_SIM_HUB_PORTS;
+	}
+	hub->ports_num = ports;
+	memcpy(hub->device_descriptor, device_descriptor, sizeof(device_descriptor));
+	memcpy(hub->config_descriptor, config_descriptor, sizeof(config_descriptor));
+
+	// per port power switching, 2 ms power on to power good
+	hub->hub_descriptor[0] = 7 + 2 * bitmap_size;
+	hub->hub_descriptor[1] = 0x29;
+	hub->hub_descriptor[2] = ports;
+	hub->hub_descriptor[3] = 0x01;
+	hub->hub_descriptor[4] = 0x00;
+	hub->hub_descriptor[5] = 1;
+	hub->hub_descriptor[6] = 0;
+	memset(&hub->hub_descriptor[7], 0, bitmap_size);
+	memset(&hub->hub_descriptor[7 + bitmap_size], 0xff, bitmap_size);
+
+	hub->device.speed = speed;
+	hub->device.device_descriptor = hub->device_descriptor;
+	hub->device.config_descriptor = hub->config_descriptor;
+	hub->device.control = hub_control;
+	hub->device.in = hub_in;
+	hub->device.hub_model = hub;
+}
+
+/*
+ * Topology
+ */
+void usbh_sim_connect(usbh_sim_device_t *hub, uint8_t port, usbh_sim_device_t *dev)
+{
+	dev->hub = hub;
+	dev->port = hub ? port : 0;
+	dev->connected = true;
+	device_power_off(dev);
+	registry_add(dev);
+
+	if (!hub) {
+		sim.root = dev;
+		sim.root_state = ROOT_ATTACHING;
+		sim.root_suspended = false;
+		sim.root_timer_us = sim.time_us + usbh_timing()->debounce_us + usbh_timing()->reset_us;
+		return;
+	}
+
+	hub->hub_model->port[port].device = dev;
+	hub_port_connect(hub->hub_model, port);
+}
+
+void usbh_sim_disconnect(usbh_sim_device_t *dev)
+{
+	if (!dev->connected) {
+		return;
+	}
+	dev->connected = false;
+	registry_remove(dev);
+	device_power_off(dev);
+
+	if (!dev->hub) {
+		if (sim.root == dev) {
+			sim.root = 0;
+			sim.root_state = sim.root_state == ROOT_ATTACHING ? ROOT_EMPTY : ROOT_DETACHED;
+		}
+		return;
+	}
+
+	struct _usbh_sim_port *p = &dev->hub->hub_model->port[dev->port];
+	p->device = 0;
+	p->timer = false;
+	if (p->status & PORT_POWER) {
+		p->status &= PORT_POWER;
+		p->change |= PORT_CONNECTION;
+	}
+}
+
+/*
+ * Transfers
+ */
+static void complete(struct channel *c, enum USBH_PACKET_CALLBACK_STATUS status, uint32_t length)
+{
+	struct completion *done = &sim.done[sim.done_num++];
+
+	done->callback = c->packet.callback;
+	done->callback_arg = c->packet.callback_arg;
+	done->data.status = status;
+	done->data.transferred_length = length;
+	c->active = false;
+}
+
+static uint16_t transaction_length(const struct channel *c)
+{
+	const uint32_t left = c->packet.datalen - c->index;
+	return left < c->packet.endpoint_size_max ? left : c->packet.endpoint_size_max;
+}
+
+static bool periodic(const struct channel *c)
+{
+	return c->packet.endpoint_type == USBH_ENDPOINT_TYPE_INTERRUPT ||
+		c->packet.endpoint_type == USBH_ENDPOINT_TYPE_ISOCHRONOUS;
+}
+
+/*
+ * (Micro)frame of periodic transactions
+ */
+static uint32_t frame_of(enum USBH_SPEED speed)
+{
+	if (speed == USBH_SPEED_HIGH) {
+		return sim.time_us / 125;
+	}
+	return sim.time_us / 1000;
+}
+
+/**
+ * One transaction of the channel
+ * @returns bus time taken
+ */
+static uint32_t transaction(struct channel *c)
+{
+	static uint8_t buffer[1024];
+	usbh_packet_t *packet = &c->packet;
+	usbh_sim_device_t *dev = route(packet->address);
+	const uint16_t length = transaction_length(c);
+	const bool isochronous = packet->endpoint_type == USBH_ENDPOINT_TYPE_ISOCHRONOUS;
+	int result;
+
+	sim.stats.transactions++;
+	if (!dev || (packet->endpoint_address && !dev->configuration)) {
+		// no answer, OTG core reports transaction error after three attempts
+		sim.stats.errors++;
+		complete(c, c->in ? USBH_PACKET_CALLBACK_STATUS_EFATAL : USBH_PACKET_CALLBACK_STATUS_EAGAIN, 0);
+		return 3 * transaction_ns(USBH_SPEED_FULL, 0);
+	}
+
+	const enum USBH_SPEED speed = bus_speed(dev);
+	if (periodic(c)) {
+		c->frame = frame_of(packet->speed);
+	}
+
+	if (c->in) {
+		if (packet->endpoint_address) {
+			result = dev->in ? dev->in(dev, packet->endpoint_address, buffer, length) : USBH_SIM_STALL;
+		} else {
+			result = ep0_in(dev, buffer, length);
+		}
+		if (isochronous && result == USBH_SIM_NAK) {
+			result = 0;
+		}
+
+		if (result == USBH_SIM_NAK) {
+			sim.stats.naks++;
+			if (packet->nak_eagain) {
+				complete(c, USBH_PACKET_CALLBACK_STATUS_EAGAIN, 0);
+			} else {
+				c->waiting = true;
+			}
+			return transaction_ns(speed, 0);
+		}
+		if (result == USBH_SIM_STALL || result > length) {
+			complete(c, USBH_PACKET_CALLBACK_STATUS_EFATAL, 0);
+			return transaction_ns(speed, 0);
+		}
+
+		if (result) {
+			memcpy((uint8_t *)packet->data + c->index, buffer, result);
+		}
+		c->index += result;
+		sim.stats.bytes_in += result;
+		if (result < length || c->index == packet->datalen) {
+			complete(c, c->index == packet->datalen ?
+				USBH_PACKET_CALLBACK_STATUS_OK : USBH_PACKET_CALLBACK_STATUS_ERRSIZ, c->index);
+		}
+		return transaction_ns(speed, result);
+	}
+
+	const uint8_t *data = c->index ? (const uint8_t *)packet->data + c->index : c->first;
+	if (!packet->endpoint_address) {
+		if (packet->control_type == USBH_CONTROL_TYPE_SETUP) {
+			ep0_setup(dev, data);
+			result = 0;
+		} else {
+			result = ep0_out(dev, data, length);
+		}
+	} else {
+		result = dev->out ? dev->out(dev, packet->endpoint_address, data, length) : USBH_SIM_STALL;
+	}
+	if (isochronous) {
+		result = 0;
+	}
+
+	if (result == USBH_SIM_NAK) {
+		sim.stats.naks++;
+		c->waiting = true;
+		return transaction_ns(speed, length);
+	}
+	if (result == USBH_SIM_STALL) {
+		complete(c, USBH_PACKET_CALLBACK_STATUS_EFATAL, 0);
+		return transaction_ns(speed, length);
+	}
+
+	c->index += length;
+	sim.stats.bytes_out += length;
+	if (c->index == packet->datalen) {
+		complete(c, USBH_PACKET_CALLBACK_STATUS_OK, packet->datalen);
+	}
+	return transaction_ns(speed, length);
+}
+
+/*
+ * Run transactions of all channels in the bus time given, channels take
+ * turns packet by packet
+ * @returns bus time left
+ */
+static uint64_t bus_run(uint64_t budget)
+{
+	bool progress = true;
+	uint8_t k;
+
+	sim.round_robin = (sim.round_robin + 1) % sim.channels_num;
+	while (progress) {
+		progress = false;
+		for (k = 0; k < sim.channels_num; k++) {
+			struct channel *c = &sim.channel[(sim.round_robin + k) % sim.channels_num];
+			if (!c->active || c->waiting) {
+				continue;
+			}
+			if (periodic(c) && c->frame == frame_of(c->packet.speed)) {
+				c->waiting = true;
+				continue;
+			}
+
+			// transaction has to fit whole, the rest is used in the next poll
+			if (transaction_ns(c->packet.speed, transaction_length(c)) > budget) {
+				sim.starved = true;
+				return budget;
+			}
+
+			const uint32_t ns = transaction(c);
+			sim.stats.busy_ns += ns;
+			budget = budget > ns ? budget - ns : 0;
+			progress = true;
+		}
+	}
+	return budget;
+}
+
+static void channels_drop(void)
+{
+	uint8_t k;
+
+	for (k = 0; k < CHANNELS_MAX; k++) {
+		sim.channel[k].active = false;
+	}
+}
+
+static void transfer_start(const usbh_packet_t *packet, bool in)
+{
+	uint8_t k;
+
+	for (k = 0; k < sim.channels_num; k++) {
+		struct channel *c = &sim.channel[k];
+		if (c->active) {
+			continue;
+		}
+		c->active = true;
+		c->in = in;
+		c->waiting = false;
+		c->index = 0;
+		c->frame = UINT32_MAX;
+		c->packet = *packet;
+		if (!in && packet->datalen) {
+			const uint16_t first = packet->datalen < packet->endpoint_size_max ?
+				packet->datalen : packet->endpoint_size_max;
+			memcpy(c->first, packet->data, first);
+		}
+		return;
+	}
+
+	// OTG core without free channel
+	sim.stats.channels_exhausted++;
+	usbh_packet_callback_data_t cb_data;
+	cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
+	cb_data.transferred_length = 0;
+	packet->callback(packet->callback_arg, cb_data);
+}
+
+/*
+ * Low-level driver
+ */
+static void lld_init(void *drvdata)
+{
+	(void)drvdata;
+}
+
+static void lld_write(void *drvdata, const usbh_packet_t *packet)
+{
+	(void)drvdata;
+	transfer_start(packet, false);
+}
+
+static void lld_read(void *drvdata, usbh_packet_t *packet)
+{
+	(void)drvdata;
+	transfer_start(packet, true);
+}
+
+/*
+ * Transfers started from callbacks continue in the bus time left,
+ * as the OTG core starts them right after the interrupt
+ */
+static enum USBH_POLL_STATUS lld_poll(void *drvdata, uint32_t time_curr_us)
+{
+	uint64_t budget = sim.credit_ns + (uint64_t)(sim.time_us - sim.poll_last_us) * 1000;
+	uint32_t i;
+	(void)drvdata;
+	(void)time_curr_us;
+
+	sim.poll_last_us = sim.time_us;
+	if (sim.root_state == ROOT_DETACHED) {
+		// OTG core drops all channels on disconnect
+		channels_drop();
+		sim.credit_ns = 0;
+		sim.root_state = ROOT_EMPTY;
+		return USBH_POLL_STATUS_DEVICE_DISCONNECTED;
+	}
+
+	for (i = 0; i < USBH_SIM_MAX_DEVICES; i++) {
+		if (sim.device[i] && sim.device[i]->hub_model) {
+			hub_timers(sim.device[i]->hub_model);
+		}
+	}
+
+	for (i = 0; i < sim.channels_num; i++) {
+		sim.channel[i].waiting = false;
+	}
+	do {
+		sim.done_num = 0;
+		budget = bus_run(budget);
+		for (i = 0; i < sim.done_num; i++) {
+			const struct completion *done = &sim.done[i];
+			done->callback(done->callback_arg, done->data);
+		}
+	} while (sim.done_num && budget);
+	sim.done_num = 0;
+
+	// unused bus time is kept only for transaction, that did not fit into it,
+	// idle bus (e.g. pending reads answered by NAK) does not save time for later
+	if (!sim.starved) {
+		budget = 0;
+	}
+	sim.starved = false;
+	sim.credit_ns = budget < CREDIT_MAX_NS ? budget : CREDIT_MAX_NS;
+
+	if (sim.root_state == ROOT_ATTACHING && (int32_t)(sim.time_us - sim.root_timer_us) >= 0) {
+		sim.root_state = ROOT_ENABLED;
+		device_reset(sim.root);
+		return USBH_POLL_STATUS_DEVICE_CONNECTED;
+	}
+
+	if (sim.root_resuming && (int32_t)(sim.time_us - sim.root_resume_end_us) >= 0) {
+		sim.root_resuming = false;
+		sim.root_suspended = false;
+		return USBH_POLL_STATUS_DEVICE_RESUMED;
+	}
+	return USBH_POLL_STATUS_NONE;
+}
+
+static enum USBH_SPEED lld_root_speed(void *drvdata)
+{
+	(void)drvdata;
+	return sim.root ? bus_speed(sim.root) : USBH_SPEED_FULL;
+}
+
+static uint16_t lld_frame_number(void *drvdata)
+{
+	(void)drvdata;
+	return sim.time_us / 1000;
+}
+
+static void lld_root_suspend(void *drvdata, bool suspend)
+{
+	(void)drvdata;
+	if (suspend) {
+		sim.root_suspended = true;
+	} else if (sim.root_suspended && !sim.root_resuming) {
+		sim.root_resuming = true;
+		sim.root_resume_end_us = sim.time_us + HUB_RESUME_US;
+	}
+}
+
+static const usbh_low_level_driver_t sim_lld = {
+	.init = lld_init,
+	.write = lld_write,
+	.read = lld_read,
+	.poll = lld_poll,
+	.root_speed = lld_root_speed,
+	.frame_number = lld_frame_number,
+	.root_suspend = lld_root_suspend,
+	.driver_data = &driver_data
+};
+const void *usbh_sim_lld = &sim_lld;
+
+void usbh_sim_reset(bool high_speed, uint8_t channels)
+{
+	memset(&sim, 0, sizeof(sim));
+	sim.high_speed = high_speed;
+	sim.channels_num = channels < CHANNELS_MAX ? channels : CHANNELS_MAX;
+	// time does not start at 0, so wrap of timestamps is not hidden
+	sim.time_us = 1000000;
+	sim.step_us = USBH_SIM_STEP_US;
+	sim.poll_last_us = sim.time_us;
+}
+
+void usbh_sim_step(void)
+{
+	sim.time_us += sim.step_us;
+	usbh_poll(sim.time_us);
+}
+
+void usbh_sim_step_set(uint32_t step_us)
+{
+	sim.step_us = step_us;
+}
+
+void usbh_sim_run(uint32_t duration_us)
+{
+	const uint32_t start = sim.time_us;
+
+	while (sim.time_us - start < duration_us) {
+		usbh_sim_step();
+	}
+}
+
+bool usbh_sim_run_until(const volatile bool *flag, uint32_t timeout_us)
+{
+	const uint32_t start = sim.time_us;
+
+	while (!*flag) {
+		if (sim.time_us - start >= timeout_us) {
+			return false;
+		}
+		usbh_sim_step();
+	}
+	return true;
+}
+
+uint32_t usbh_sim_time_us(void)
+{
+	return sim.time_us;
+}
+
+bool usbh_sim_configured(const usbh_sim_device_t *dev)
+{
+	return dev->configuration && reachable(dev);
+}
+
+const usbh_sim_stats_t *usbh_sim_stats(void)
+{
+	return &sim.stats;
+}
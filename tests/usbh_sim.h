@@ -0,0 +1,254 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_SIM_H
+#define USBH_SIM_H
+
+#include "usbh_core.h"
+#include "driver/usbh_device_driver.h"
+
+#include <libopencm3/usb/usbstd.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Simulated bus for host tests
+ *
+ * usbh_sim_lld is a low-level driver, which executes the transfers
+ * against device models in simulated time instead of the OTG core.
+ * Each transaction takes bus time given by the speed of the device and
+ * the length of the data (USB 2.0 bus time formulas without bit stuffing),
+ * so transfer rates measured in simulated time are close to real bus
+ * limits. Packets are exchanged with the device models one transaction
+ * at a time: NAK, STALL and short packets behave as on the bus.
+ *
+ * Hubs are simulated by usbh_sim_hub_t: port power, reset, enable,
+ * suspend and status change endpoint, so the hub driver of the library
+ * is used unchanged.
+ *
+ * Time advances only by usbh_sim_step(), which calls usbh_poll().
+ */
+
+/// return values of the device model callbacks
+#define USBH_SIM_NAK		(-1)
+#define USBH_SIM_STALL		(-2)
+/// control request is left to the standard request handling of the simulator
+#define USBH_SIM_UNHANDLED	(-3)
+
+/// Max length of the data stage of control transfer
+#define USBH_SIM_CONTROL_BUFFER	(1024)
+
+/// Max devices on the simulated bus, including hubs
+#define USBH_SIM_MAX_DEVICES	(32)
+
+/// Max ports of simulated hub
+#define USBH_SIM_HUB_PORTS	(8)
+
+/// Default time between usbh_poll() calls of usbh_sim_step()
+#define USBH_SIM_STEP_US	(125)
+
+typedef struct _usbh_sim_device usbh_sim_device_t;
+
+/**
+ * @brief Device model
+ *
+ * The test fills the descriptors and callbacks, the rest is state
+ * of the simulator.
+ */
+struct _usbh_sim_device {
+	/// speed of the device, high speed device falls back to full speed behind full speed hub
+	enum USBH_SPEED speed;
+
+	/// device descriptor (18 bytes)
+	const uint8_t *device_descriptor;
+
+	/// whole configuration (wTotalLength bytes)
+	const uint8_t *config_descriptor;
+
+	/**
+	 * @brief optional, control request of the device
+	 * @param data IN requests: buffer for the response (up to USBH_SIM_CONTROL_BUFFER)
+	 *	OUT requests: data received in the data stage
+	 * @returns length of the response of IN request, 0 for OUT request,
+	 * USBH_SIM_STALL or USBH_SIM_UNHANDLED
+	 *
+	 * Called for every request, requests returning USBH_SIM_UNHANDLED
+	 * are handled as standard requests (descriptors, address, configuration).
+	 */
+	int (*control)(usbh_sim_device_t *sim, const struct usb_setup_data *setup, uint8_t *data);
+
+	/**
+	 * @brief optional, IN transaction of non-control endpoint
+	 * @param endpoint endpoint number (without direction bit)
+	 * @param length max length of the packet
+	 * @returns length of the packet, USBH_SIM_NAK or USBH_SIM_STALL
+	 */
+	int (*in)(usbh_sim_device_t *sim, uint8_t endpoint, uint8_t *data, uint16_t length);
+
+	/**
+	 * @brief optional, OUT transaction of non-control endpoint
+	 * @returns 0 when accepted, USBH_SIM_NAK or USBH_SIM_STALL
+	 */
+	int (*out)(usbh_sim_device_t *sim, uint8_t endpoint, const uint8_t *data, uint16_t length);
+
+	/// optional, called when the device is reset by its port
+	void (*reset)(usbh_sim_device_t *sim);
+
+	/// test's data
+	void *priv;
+
+	/* Simulator state */
+
+	/// hub the device is connected to, 0 for the root port
+	usbh_sim_device_t *hub;
+	uint8_t port;
+	bool connected;
+
+	uint8_t address;
+	uint8_t configuration;
+	int16_t address_pending;
+
+	/// order of port resets, newest device in default state answers address 0
+	uint32_t reset_sequence;
+
+	/// control transfer in progress
+	struct usb_setup_data setup;
+	uint8_t control_stage;
+	uint16_t control_length;
+	uint16_t control_index;
+	uint8_t control_data[USBH_SIM_CONTROL_BUFFER];
+
+	/// hub model, when the device is a hub @see usbh_sim_hub_init()
+	struct _usbh_sim_hub *hub_model;
+};
+
+struct _usbh_sim_port {
+	usbh_sim_device_t *device;
+	uint16_t status;
+	uint16_t change;
+	/// end of the reset or resume in progress
+	uint32_t timer_end_us;
+	bool timer;
+};
+
+typedef struct _usbh_sim_hub usbh_sim_hub_t;
+
+/**
+ * @brief Hub model
+ */
+struct _usbh_sim_hub {
+	usbh_sim_device_t device;
+	uint8_t ports_num;
+	struct _usbh_sim_port port[USBH_SIM_HUB_PORTS + 1];
+	uint8_t device_descriptor[18];
+	uint8_t config_descriptor[25];
+	uint8_t hub_descriptor[7 + 2 * ((USBH_SIM_HUB_PORTS + 1 + 7) / 8)];
+};
+
+/**
+ * @brief Statistics of the simulated bus
+ */
+struct _usbh_sim_stats {
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t transactions;
+	uint64_t naks;
+	/// transactions to devices that are not reachable
+	uint64_t errors;
+	/// transactions answered by more than one device with the same address
+	uint64_t address_conflicts;
+	/// read or write refused because all channels were busy
+	uint64_t channels_exhausted;
+	/// bus time of all transactions
+	uint64_t busy_ns;
+};
+typedef struct _usbh_sim_stats usbh_sim_stats_t;
+
+/// low-level driver for usbh_init()
+extern const void *usbh_sim_lld;
+
+/**
+ * @brief usbh_sim_reset start new simulation
+ * @param high_speed root port supports high speed devices
+ * @param channels count of host channels (transfers in progress), up to 16
+ *
+ * Has to be called before usbh_init(), all devices are disconnected
+ */
+void usbh_sim_reset(bool high_speed, uint8_t channels);
+
+/**
+ * @brief usbh_sim_connect plug the device in
+ * @param hub hub device, 0 for the root port
+ * @param port port of the hub, ignored for the root port
+ */
+void usbh_sim_connect(usbh_sim_device_t *hub, uint8_t port, usbh_sim_device_t *dev);
+
+/**
+ * @brief usbh_sim_disconnect unplug the device together with devices connected to it
+ */
+void usbh_sim_disconnect(usbh_sim_device_t *dev);
+
+/**
+ * @brief usbh_sim_hub_init set up the hub model
+ * @param speed full or high speed hub
+ * @param ports count of ports, up to USBH_SIM_HUB_PORTS
+ */
+void usbh_sim_hub_init(usbh_sim_hub_t *hub, enum USBH_SPEED speed, uint8_t ports);
+
+/**
+ * @brief usbh_sim_step advance simulated time by the step and call usbh_poll()
+ */
+void usbh_sim_step(void);
+
+/**
+ * @brief usbh_sim_step_set change time between usbh_poll() calls
+ *
+ * Drivers, which start transfers from their poll, depend on how often
+ * the application polls. USBH_SIM_STEP_US after usbh_sim_reset()
+ */
+void usbh_sim_step_set(uint32_t step_us);
+
+/**
+ * @brief usbh_sim_run step the simulation for the time
+ */
+void usbh_sim_run(uint32_t duration_us);
+
+/**
+ * @brief usbh_sim_run_until step the simulation until the flag is set or timeout passes
+ * @returns true when the flag was set
+ */
+bool usbh_sim_run_until(const volatile bool *flag, uint32_t timeout_us);
+
+/**
+ * @brief usbh_sim_time_us current simulated time
+ */
+uint32_t usbh_sim_time_us(void);
+
+/**
+ * @brief usbh_sim_configured device is configured by the host
+ */
+bool usbh_sim_configured(const usbh_sim_device_t *dev);
+
+const usbh_sim_stats_t *usbh_sim_stats(void);
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2016 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * XBox report decoding: lookup tables against the bit by bit decoding
+ * of the original driver for all 65536 values of the two button bytes,
+ * and decoded reports per second.
+ */
+
+#include "test.h"
+
+// static functions of the driver are tested directly,
+// its remove() would clash with remove() of stdio.h
+#define remove xbox_remove
+#include "usbh_driver_gp_xbox.c"
+#undef remove
+
+/*
+ * Decoding of the original driver, kept as the reference
+ */
+static void reference_parse(const uint8_t *packet, gp_xbox_packet_t *gp_xbox_packet)
+{
+	gp_xbox_packet->buttons = 0;
+
+	// DPAD
+	const uint8_t data1 = packet[2];
+	const uint8_t data2 = packet[3];
+	if (data1 & (1 << 0)) {
+		gp_xbox_packet->buttons |= GP_XBOX_DPAD_TOP;
+	}
+
+	if (data1 & (1 << 1)) {
+		gp_xbox_packet->buttons |= GP_XBOX_DPAD_BOTTOM;
+	}
+
+	if (data1 & (1 << 2)) {
+		gp_xbox_packet->buttons |= GP_XBOX_DPAD_LEFT;
+	}
+
+	if (data1 & (1 << 3)) {
+		gp_xbox_packet->buttons |= GP_XBOX_DPAD_RIGHT;
+	}
+
+	// Start + select
+
+	if (data1 & (1 << 4)) {
+		gp_xbox_packet->buttons |= GP_XBOX_BUTTON_START;
+	}
+
+	if (data1 & (1 << 5)) {
+		gp_xbox_packet->buttons |= GP_XBOX_BUTTON_SELECT;
+	}
+
+	// axis buttons
+
+	if (data1 & (1 << 6)) {
+		gp_xbox_packet->buttons |= GP_XBOX_BUTTON_AXIS_LEFT;
+	}
+
+	if (data1 & (1 << 7)) {
+		gp_xbox_packet->buttons |= GP_XBOX_BUTTON_AXIS_RIGHT;
+	}
+
+	// buttons ABXY
+
+	if (data2 & (1 << 4)) {
+		gp_xbox_packet->buttons |= GP_XBOX_BUTTON_A;
+	}
+
+	if (data2 & (1 << 5)) {
+		gp_xbox_packet->buttons |= GP_XBOX_BUTTON_B;
+	}
+
+	if (data2 & (1 << 6)) {
+		gp_xbox_packet->buttons |= GP_XBOX_BUTTON_X;
+	}
+
+	if (data2 & (1 << 7)) {
+		gp_xbox_packet->buttons |= GP_XBOX_BUTTON_Y;
+	}
+
+	// buttons rear
+
+	if (data2 & (1 << 0)) {
+		gp_xbox_packet->buttons |= GP_XBOX_BUTTON_LT;
+	}
+
+	if (data2 & (1 << 1)) {
+		gp_xbox_packet->buttons |= GP_XBOX_BUTTON_RT;
+	}
+
+	if (data2 & (1 << 2)) {
+		gp_xbox_packet->buttons |= GP_XBOX_BUTTON_XBOX;
+	}
+
+	// rear levers
+
+	gp_xbox_packet->axis_rear_left = packet[4];
+	gp_xbox_packet->axis_rear_right = packet[5];
+	gp_xbox_packet->axis_left_x = packet[7]*256 + packet[6];
+	gp_xbox_packet->axis_left_y = packet[9]*256 + packet[8];
+	gp_xbox_packet->axis_right_x = packet[11]*256 + packet[10];
+	gp_xbox_packet->axis_right_y = packet[13]*256 + packet[12];
+}
+
+static gp_xbox_packet_t update_packet;
+static uint32_t update_count;
+
+static void update(uint8_t device_id, const gp_xbox_packet_t *data)
+{
+	(void)device_id;
+	update_packet = *data;
+	update_count++;
+}
+
+static const gp_xbox_config_t config = {
+	.update = update
+};
+
+static usbh_device_t device;
+
+static gp_xbox_device_t *device_setup(void)
+{
+	gp_xbox_device_t *gp_xbox;
+
+	gp_xbox_driver_init(&config);
+	gp_xbox = init(&device);
+	device.drvdata = gp_xbox;
+	gp_xbox->report_valid = false;
+	memset(&gp_xbox->packet_last, 0, sizeof(gp_xbox->packet_last));
+	return gp_xbox;
+}
+
+static uint32_t random_next(uint32_t *state)
+{
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+static void test_buttons_exhaustive(void)
+{
+	gp_xbox_device_t *gp_xbox = device_setup();
+	uint32_t random = 1;
+	uint32_t mismatches = 0;
+	uint32_t i;
+
+	for (i = 0; i < 0x10000; i++) {
+		uint8_t *packet = gp_xbox->buffer;
+		gp_xbox_packet_t expected;
+		uint32_t j;
+
+		packet[0] = 0x00;
+		packet[1] = GP_XBOX_CORRECT_TRANSFERRED_LENGTH;
+		packet[2] = i & 0xff;
+		packet[3] = i >> 8;
+		for (j = 4; j < GP_XBOX_CORRECT_TRANSFERRED_LENGTH; j++) {
+			packet[j] = random_next(&random);
+		}
+		reference_parse(packet, &expected);
+
+		// without filtering every change is reported, force one
+		gp_xbox->packet_last.buttons = ~expected.buttons;
+		update_count = 0;
+		parse_data(&device);
+
+		if (update_count != 1 ||
+			update_packet.buttons != expected.buttons ||
+			update_packet.axis_left_x != expected.axis_left_x ||
+			update_packet.axis_left_y != expected.axis_left_y ||
+			update_packet.axis_right_x != expected.axis_right_x ||
+			update_packet.axis_right_y != expected.axis_right_y ||
+			update_packet.axis_rear_left != expected.axis_rear_left ||
+			update_packet.axis_rear_right != expected.axis_rear_right) {
+			if (!mismatches) {
+				printf("first mismatch: data %02X %02X, buttons %04X expected %04X\n",
+					packet[2], packet[3], update_packet.buttons, expected.buttons);
+			}
+			mismatches++;
+		}
+	}
+	CHECK_EQ(mismatches, 0);
+
+	// all 15 buttons are reachable, reserved bit 3 of data2 is ignored
+	gp_xbox_packet_t all;
+	uint8_t packet[GP_XBOX_CORRECT_TRANSFERRED_LENGTH] = { 0, 0, 0xff, 0xf7 };
+	reference_parse(packet, &all);
+	CHECK_EQ(all.buttons, 0x7fff);
+	CHECK_EQ(buttons_data2_low[8], 0);
+}
+
+static void test_repeated_report(void)
+{
+	gp_xbox_device_t *gp_xbox = device_setup();
+
+	memset(gp_xbox->buffer, 0, GP_XBOX_CORRECT_TRANSFERRED_LENGTH);
+	gp_xbox->buffer[2] = 0x01;
+	update_count = 0;
+	parse_data(&device);
+	CHECK_EQ(update_count, 1);
+	CHECK_EQ(update_packet.buttons, GP_XBOX_DPAD_TOP);
+
+	// same report is not decoded again
+	parse_data(&device);
+	CHECK_EQ(update_count, 1);
+
+	// release is reported
+	gp_xbox->buffer[2] = 0x00;
+	parse_data(&device);
+	CHECK_EQ(update_count, 2);
+	CHECK_EQ(update_packet.buttons, 0);
+}
+
+#define BENCH_REPORTS	(1 << 16)
+
+static uint8_t bench_reports[BENCH_REPORTS][GP_XBOX_CORRECT_TRANSFERRED_LENGTH];
+
+static void bench_parse(void)
+{
+	gp_xbox_device_t *gp_xbox = device_setup();
+	const uint32_t rounds = 64;
+	uint32_t random = 7;
+	uint32_t checksum = 0;
+	uint32_t i, r;
+
+	// every report differs in buttons and axes
+	for (i = 0; i < BENCH_REPORTS; i++) {
+		uint32_t j;
+
+		bench_reports[i][1] = GP_XBOX_CORRECT_TRANSFERRED_LENGTH;
+		bench_reports[i][2] = i & 0xff;
+		bench_reports[i][3] = i >> 8;
+		for (j = 4; j < 14; j++) {
+			bench_reports[i][j] = random_next(&random);
+		}
+	}
+
+	uint64_t start = test_wall_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < BENCH_REPORTS; i++) {
+			gp_xbox_packet_t packet;
+
+			reference_parse(bench_reports[i], &packet);
+			checksum += packet.buttons + packet.axis_left_x;
+		}
+	}
+	const uint64_t reference_ns = test_wall_ns() - start;
+
+	start = test_wall_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < BENCH_REPORTS; i++) {
+			const uint8_t *p = bench_reports[i];
+
+			checksum += buttons_data1_low[p[2] & 0x0f] | buttons_data1_high[p[2] >> 4] |
+				buttons_data2_low[p[3] & 0x0f] | buttons_data2_high[p[3] >> 4];
+			checksum += load_le16(&p[6]);
+		}
+	}
+	const uint64_t table_ns = test_wall_ns() - start;
+
+	// whole path of the driver: change detection, decoding, report
+	update_count = 0;
+	start = test_wall_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < BENCH_REPORTS; i++) {
+			memcpy(gp_xbox->buffer, bench_reports[i], GP_XBOX_CORRECT_TRANSFERRED_LENGTH);
+			parse_data(&device);
+		}
+	}
+	const uint64_t changed_ns = test_wall_ns() - start;
+	CHECK(update_count > 0);
+
+	// controller repeating the same report
+	start = test_wall_ns();
+	for (r = 0; r < rounds * BENCH_REPORTS; r++) {
+		parse_data(&device);
+	}
+	const uint64_t repeated_ns = test_wall_ns() - start;
+
+	const double reports = (double)rounds * BENCH_REPORTS;
+	printf("xbox reports/s (checksum %08X)\n", checksum);
+	printf("  buttons+axis, bit by bit (original): %8.2f M/s\n", reports * 1e3 / reference_ns);
+	printf("  buttons+axis, tables:                %8.2f M/s\n", reports * 1e3 / table_ns);
+	printf("  parse_data, every report changes:    %8.2f M/s\n", reports * 1e3 / changed_ns);
+	printf("  parse_data, repeated report:         %8.2f M/s\n", reports * 1e3 / repeated_ns);
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_bench_requested(argc, argv)) {
+		bench_parse();
+	} else {
+		test_buttons_exhaustive();
+		test_repeated_report();
+	}
+	return test_exit("xbox");
+}